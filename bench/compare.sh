@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# compare.sh BEFORE AFTER
+#
+# Put side by side the rows/s and p95 latencies of two outputs of
+# run.sh -o, with the ratio of AFTER to BEFORE.
+
+set -e
+
+before=${1:?usage: compare.sh BEFORE AFTER}
+after=${2:?usage: compare.sh BEFORE AFTER}
+
+printf '%-20s %12s %12s %7s %9s %9s %7s\n' name 'rows/s' 'rows/s' ratio \
+       'p95 ms' 'p95 ms' ratio
+awk 'NR == FNR { rows[$1] = $3; p95[$1] = $5; next }
+     ($1 in rows) {
+         printf "%-20s %12.0f %12.0f %7.2f %9.3f %9.3f %7.2f\n", $1,
+                rows[$1], $3, rows[$1] > 0 ? $3 / rows[$1] : 0,
+                p95[$1], $5, p95[$1] > 0 ? $5 / p95[$1] : 0
+     }' "$before" "$after"
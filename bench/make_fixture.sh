@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# make_fixture.sh FILE [ROWS]
+#
+# Write a sqlite database of benchmark tables to FILE, ROWS rows each
+# (default 100000):
+#
+#   narrow        id INTEGER PRIMARY KEY, k, v; indexed on k
+#   narrow_noidx  the same rows without the index
+#   wide          id and 16 more columns of mixed types
+#   texts         id and a 200 character text
+#   blobs         id and a 1 KiB blob
+#
+# k holds about ten rows per value.  The tables are analyzed, so that
+# sqlite and use_remote_estimate have sqlite_stat1 to go by.
+
+set -e
+
+file=${1:?usage: make_fixture.sh FILE [ROWS]}
+rows=${2:-100000}
+keys=$(( rows / 10 > 0 ? rows / 10 : 1 ))
+
+rm -f "$file"
+sqlite3 "$file" >/dev/null <<SQL
+PRAGMA journal_mode = off;
+PRAGMA synchronous = off;
+BEGIN;
+
+CREATE TABLE narrow (id INTEGER PRIMARY KEY, k INTEGER NOT NULL, v REAL);
+WITH RECURSIVE s(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM s WHERE i < $rows)
+INSERT INTO narrow SELECT i, abs(random()) % $keys + 1, random() / 1e12 FROM s;
+CREATE INDEX narrow_k ON narrow (k);
+
+CREATE TABLE narrow_noidx (id INTEGER PRIMARY KEY, k INTEGER NOT NULL, v REAL);
+INSERT INTO narrow_noidx SELECT * FROM narrow;
+
+CREATE TABLE wide (id INTEGER PRIMARY KEY,
+    i1 INTEGER, i2 INTEGER, i3 INTEGER, i4 INTEGER,
+    f1 REAL, f2 REAL, f3 REAL, f4 REAL,
+    t1 TEXT, t2 TEXT, t3 TEXT, t4 TEXT,
+    d1 TEXT, d2 TEXT, n1 NUMERIC, b1 INTEGER);
+WITH RECURSIVE s(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM s WHERE i < $rows)
+INSERT INTO wide SELECT i,
+    i, i * 7, abs(random()) % 1000, random(),
+    i / 3.0, random() / 1e12, i * 0.5, abs(random()) / 1e15,
+    'name ' || i, lower(hex(randomblob(8))), 'category ' || (i % 50),
+    substr('lorem ipsum dolor sit amet', 1 + i % 20),
+    date('2020-01-01', '+' || (i % 2000) || ' days'),
+    datetime('2020-01-01 00:00:00', '+' || i || ' seconds'),
+    (i % 10000) / 100.0, i % 2
+    FROM s;
+
+CREATE TABLE texts (id INTEGER PRIMARY KEY, t TEXT NOT NULL);
+WITH RECURSIVE s(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM s WHERE i < $rows)
+INSERT INTO texts SELECT i, lower(hex(randomblob(100))) FROM s;
+
+CREATE TABLE blobs (id INTEGER PRIMARY KEY, b BLOB NOT NULL);
+WITH RECURSIVE s(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM s WHERE i < $rows)
+INSERT INTO blobs SELECT i, randomblob(1024) FROM s;
+
+COMMIT;
+ANALYZE;
+SQL
@@ -0,0 +1,116 @@
+#!/bin/sh
+#
+# run.sh [-o FILE] [BENCHMARK ...]
+#
+# Build a fixture with make_fixture.sh, set up the foreign tables of
+# setup.sql, and run the pgbench scripts of scripts/ against them, all or
+# only the named BENCHMARKs.  Prints one line per benchmark:
+#
+#   name  tps  rows/s  p50 ms  p95 ms  p99 ms
+#
+# rows/s is the transactions per second times the rows of the sqlite
+# tables each transaction has to look at (see the list below), so that
+# benchmarks of different sizes compare.  The latency percentiles are
+# those of pgbench's per-transaction log.  With -o the lines are written
+# to FILE too, for compare.sh.
+#
+# Settings come from the environment:
+#
+#   BENCH_ROWS     rows per fixture table (100000)
+#   BENCH_TIME     seconds per benchmark (10)
+#   BENCH_CLIENTS  concurrent pgbench clients (1)
+#   BENCH_FIXTURE  the sqlite file, which the server must be able to read
+#                  (bench/fixture.db); rebuilt when BENCH_ROWS changes
+#
+# and the database to run in from the usual PGDATABASE, PGHOST, ...
+# sqlite_fdw must be installed there, and sqlite3 and pgbench in the PATH.
+
+set -e
+
+cd "$(dirname "$0")"
+here=$(pwd)
+rows=${BENCH_ROWS:-100000}
+duration=${BENCH_TIME:-10}
+clients=${BENCH_CLIENTS:-1}
+fixture=${BENCH_FIXTURE:-$here/fixture.db}
+output=
+
+if [ "$1" = "-o" ]; then
+    output=${2:?-o needs a file name}
+    shift 2
+    : > "$output"
+fi
+
+if [ ! -f "$fixture" ] || [ "$(cat "$fixture.rows" 2>/dev/null)" != "$rows" ]
+then
+    echo "making a fixture of $rows rows per table in $fixture" >&2
+    ./make_fixture.sh "$fixture" "$rows"
+    echo "$rows" > "$fixture.rows"
+fi
+psql -X -q -v ON_ERROR_STOP=1 -v fixture="$fixture" -f setup.sql
+
+logs=$(mktemp -d)
+trap 'rm -rf "$logs"' EXIT
+
+printf '%-20s %10s %12s %9s %9s %9s\n' \
+       name tps rows/s 'p50 ms' 'p95 ms' 'p99 ms'
+
+# name|script|pgbench variables|query mode|settings|rows per transaction
+while IFS='|' read -r name script vars mode settings rows_sql
+do
+    case "$name" in ''|'#'*) continue ;; esac
+    if [ $# -gt 0 ]; then
+        case " $* " in *" $name "*) ;; *) continue ;; esac
+    fi
+
+    export PGOPTIONS="-c search_path=sqlite_bench $settings"
+    txn_rows=$(psql -X -A -t -v ON_ERROR_STOP=1 -c "$rows_sql" </dev/null)
+    defines=
+    for v in $vars rows=$rows; do
+        defines="$defines -D $v"
+    done
+
+    rm -f "$logs"/*
+    tps=$(pgbench -n -f "scripts/$script" -T "$duration" -c "$clients" \
+                  -j "$clients" -M "$mode" $defines \
+                  -l --log-prefix="$logs/log" </dev/null 2>"$logs/stderr" |
+          sed -n 's/^tps = \([0-9.]*\).*/\1/p' | tail -n 1)
+    if [ -z "$tps" ]; then
+        cat "$logs/stderr" >&2
+        exit 1
+    fi
+
+    # field 3 of pgbench's log is the transaction's latency in us
+    cat "$logs"/log.* | awk '{ print $3 }' | sort -n |
+    awk -v name="$name" -v tps="$tps" -v rows="$txn_rows" '
+        { lat[NR] = $1 }
+        function pct(p,    i) {
+            i = int(NR * p + 0.999999)
+            if (i < 1) i = 1
+            return lat[i] / 1000.0
+        }
+        END {
+            printf "%-20s %10.2f %12.0f %9.3f %9.3f %9.3f\n", name, tps,
+                   tps * rows, pct(0.50), pct(0.95), pct(0.99)
+        }' | tee -a ${output:-/dev/null}
+done <<'LIST'
+# full scans, narrow to wide rows
+scan_narrow|scan.sql|table=narrow|simple||SELECT count(*) FROM narrow
+scan_wide|scan.sql|table=wide|simple||SELECT count(*) FROM wide
+scan_texts|scan.sql|table=texts|simple||SELECT count(*) FROM texts
+scan_blobs|scan.sql|table=blobs|simple||SELECT count(*) FROM blobs
+# primary key lookups through a prepared statement's parameter
+lookup|lookup.sql||prepared||SELECT 1
+# a parameterized inner scan, rescanned for each of the 100 outer rows
+nestloop_index|nestloop.sql|table=narrow|simple|-c enable_hashjoin=off -c enable_mergejoin=off|SELECT count(*) FROM bench_keys b JOIN narrow n ON n.k = b.k
+nestloop_noidx|nestloop.sql|table=narrow_noidx|simple|-c enable_hashjoin=off -c enable_mergejoin=off|SELECT count(*) * 100 FROM narrow_noidx
+# aggregation pushed down to sqlite
+group_by|group_by.sql|table=narrow|simple||SELECT count(*) FROM narrow
+# ORDER BY ... LIMIT, served by an index or by sorting
+order_limit_index|order_limit.sql|table=narrow|simple||SELECT 10
+order_limit_noidx|order_limit.sql|table=narrow_noidx|simple||SELECT count(*) FROM narrow_noidx
+# pattern matching evaluated by sqlite
+like|like.sql||simple||SELECT count(*) FROM texts
+regexp|regexp.sql||simple||SELECT count(*) FROM texts
+analyze|analyze.sql|table=narrow|simple||SELECT count(*) FROM narrow
+LIST
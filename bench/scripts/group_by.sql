@@ -0,0 +1 @@
+SELECT k, count(*), sum(v) FROM :table GROUP BY k;
@@ -0,0 +1 @@
+SELECT count(*) FROM texts WHERE t LIKE '%abc%';
@@ -0,0 +1,2 @@
+\set id random(1, :rows)
+SELECT * FROM narrow WHERE id = :id;
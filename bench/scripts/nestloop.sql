@@ -0,0 +1 @@
+SELECT count(n.v) FROM bench_keys b JOIN :table n ON n.k = b.k;
@@ -0,0 +1 @@
+SELECT * FROM :table ORDER BY k DESC LIMIT 10;
@@ -0,0 +1 @@
+SELECT count(*) FROM texts WHERE t ~ 'a[0-9]b';
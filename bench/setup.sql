@@ -0,0 +1,45 @@
+--
+-- Foreign tables over a fixture of make_fixture.sh, in schema sqlite_bench.
+-- Run with psql -v fixture=FILE.
+--
+
+CREATE EXTENSION IF NOT EXISTS sqlite_fdw;
+
+DROP SCHEMA IF EXISTS sqlite_bench CASCADE;
+DROP SERVER IF EXISTS sqlite_bench_server CASCADE;
+
+CREATE SCHEMA sqlite_bench;
+SET search_path = sqlite_bench;
+
+CREATE SERVER sqlite_bench_server
+FOREIGN DATA WRAPPER sqlite_fdw
+OPTIONS (database :'fixture');
+
+CREATE FOREIGN TABLE narrow (id bigint, k bigint NOT NULL, v float8)
+SERVER sqlite_bench_server;
+
+CREATE FOREIGN TABLE narrow_noidx (id bigint, k bigint NOT NULL, v float8)
+SERVER sqlite_bench_server;
+
+CREATE FOREIGN TABLE wide (id bigint,
+    i1 bigint, i2 bigint, i3 integer, i4 bigint,
+    f1 float8, f2 float8, f3 float8, f4 float8,
+    t1 text, t2 text, t3 text, t4 text,
+    d1 date, d2 timestamp, n1 numeric, b1 integer)
+SERVER sqlite_bench_server;
+
+CREATE FOREIGN TABLE texts (id bigint, t text NOT NULL)
+SERVER sqlite_bench_server;
+
+CREATE FOREIGN TABLE blobs (id bigint, b bytea NOT NULL)
+SERVER sqlite_bench_server;
+
+-- the outer side of the nested-loop joins
+CREATE TABLE bench_keys AS SELECT g::bigint AS k FROM generate_series(1, 100) g;
+
+ANALYZE bench_keys;
+ANALYZE narrow;
+ANALYZE narrow_noidx;
+ANALYZE wide;
+ANALYZE texts;
+ANALYZE blobs;
@@ -27,3 +27,65 @@ LANGUAGE C STRICT;
 CREATE FOREIGN DATA WRAPPER sqlite_fdw
   HANDLER sqlite_fdw_handler
   VALIDATOR sqlite_fdw_validator;
+
+CREATE FUNCTION sqlite_fdw_get_connections(OUT server_name text,
+    OUT database text, OUT valid boolean, OUT in_use boolean,
+    OUT opens bigint, OUT cached_statements integer,
+    OUT statement_hits bigint, OUT statement_misses bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sqlite_fdw_disconnect(text)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sqlite_fdw_disconnect_all()
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sqlite_fdw_memory_usage(reset_highwater boolean DEFAULT false,
+    OUT used bigint, OUT highwater bigint,
+    OUT soft_heap_limit bigint, OUT hard_heap_limit bigint)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sqlite_fdw_stat_tables(OUT dbid oid, OUT relid oid,
+    OUT database text, OUT scans bigint, OUT rows bigint,
+    OUT rows_checked_locally bigint, OUT step_time double precision,
+    OUT prepares bigint, OUT cached_statements bigint,
+    OUT connection_opens bigint, OUT analyzes bigint,
+    OUT analyze_time double precision,
+    OUT joins_pushed bigint, OUT joins_local bigint,
+    OUT aggregates_pushed bigint, OUT aggregates_local bigint,
+    OUT sorts_pushed bigint, OUT sorts_local bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+-- the tables of other databases have no name here
+CREATE VIEW sqlite_fdw_stat_tables AS
+  SELECT s.dbid, s.relid, n.nspname AS schemaname, c.relname, s.database,
+         s.scans, s.rows, s.rows_checked_locally, s.step_time,
+         s.prepares, s.cached_statements, s.connection_opens,
+         s.analyzes, s.analyze_time,
+         s.joins_pushed, s.joins_local,
+         s.aggregates_pushed, s.aggregates_local,
+         s.sorts_pushed, s.sorts_local
+    FROM sqlite_fdw_stat_tables() s
+    LEFT JOIN pg_database d ON d.oid = s.dbid
+    LEFT JOIN pg_class c
+           ON c.oid = s.relid AND d.datname = current_database()
+    LEFT JOIN pg_namespace n ON n.oid = c.relnamespace;
+
+GRANT SELECT ON sqlite_fdw_stat_tables TO PUBLIC;
+
+CREATE FUNCTION sqlite_fdw_stat_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C PARALLEL RESTRICTED;
+
+REVOKE ALL ON FUNCTION sqlite_fdw_stat_reset() FROM PUBLIC;
@@ -3,9 +3,17 @@
 #include <unistd.h>
 
 #include <postgres.h>
+#include <access/heapam.h>
 #include <access/htup_details.h>
+#include <access/sysattr.h>
+#include <catalog/pg_type.h>
+#include <executor/executor.h>
 #include <foreign/fdwapi.h>
+#include <miscadmin.h>
+#include <nodes/makefuncs.h>
+#include <nodes/nodeFuncs.h>
 #include <nodes/relation.h>
+#include <optimizer/clauses.h>
 #include <optimizer/cost.h>
 #include <optimizer/paths.h>
 #include <optimizer/pathnode.h>
@@ -13,9 +21,14 @@
 #include <optimizer/tlist.h>
 #include <optimizer/restrictinfo.h>
 #include <optimizer/var.h>
+#include <parser/parsetree.h>
 #include <utils/builtins.h>
+#include <utils/datum.h>
 #include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
 #include <utils/relcache.h>
+#include <utils/typcache.h>
 #include <foreign/foreign.h>
 #include <commands/defrem.h>
 #include <commands/explain.h>
@@ -26,7 +39,66 @@
 #include "callbacks.h"
 
 
-static int8 SQLITE_ANALYZE_NUM_ROWS = 0;
+/*
+ * True if clause, in a scan of the copy of baserel (see tablecache.c), can
+ * look rows up by a column: col = expr, where expr does not involve
+ * baserel and cannot change during the scan, and = is the equality of the
+ * column's type that goes with its hash function.  Sets *attnum to the
+ * column and *other to expr.
+ */
+static bool
+is_cacheProbe__(RelOptInfo *baserel, Expr *clause, AttrNumber *attnum,
+                Expr **other)
+{
+    OpExpr *op = (OpExpr *) clause;
+    int i;
+
+    if (!IsA(clause, OpExpr) || list_length(op->args) != 2)
+        return false;
+
+    for (i = 0; i < 2; i++)
+    {
+        Node *var = (Node *) list_nth(op->args, i);
+        Node *expr = (Node *) list_nth(op->args, 1 - i);
+        TypeCacheEntry *tce;
+
+        while (IsA(var, RelabelType))
+            var = (Node *) ((RelabelType *) var)->arg;
+        if (!IsA(var, Var) || ((Var *) var)->varno != baserel->relid ||
+            ((Var *) var)->varlevelsup != 0 || ((Var *) var)->varattno <= 0)
+            continue;
+        if (bms_is_member(baserel->relid, pull_varnos(expr)) ||
+            contain_volatile_functions(expr))
+            continue;
+
+        tce = lookup_type_cache(((Var *) var)->vartype,
+                                TYPECACHE_EQ_OPR | TYPECACHE_HASH_PROC);
+        if (op->opno != tce->eq_opr || !OidIsValid(tce->hash_proc))
+            continue;
+
+        *attnum = ((Var *) var)->varattno;
+        *other = (Expr *) expr;
+        return true;
+    }
+    return false;
+}
+
+
+/*
+ * True if a scan of baserel parameterized by the outer rels of rinfo can
+ * make use of it: by sending it to sqlite, or by looking rows of the copy
+ * of the table up with it.
+ */
+static bool
+is_paramClause__(PlannerInfo *root, RelOptInfo *baserel, RestrictInfo *rinfo)
+{
+    AttrNumber attnum;
+    Expr *other;
+
+    if (FDW_RELINFO(baserel->fdw_private)->cached)
+        return is_cacheProbe__(baserel, rinfo->clause, &attnum, &other);
+    return is_foreign_expr(root, baserel, rinfo->clause);
+}
 
 
 void
@@ -49,8 +121,15 @@ get_foreignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
 									 NULL,		/* no extra plan */
 									 NIL));		/* no fdw_private data */
 	
-    /* Add paths with pathkeys */
-	add_pathsWithPathKeysForRel(root, baserel, NULL);
+    /*
+     * Add paths with pathkeys, which cannot span many files, and a path for
+     * parallel workers to share.  The copy of a table is in no order, and
+     * is not read by parts either.
+     */
+    if (!fpinfo->src.shard_pattern && !fpinfo->cached)
+        add_pathsWithPathKeysForRel(root, baserel, NULL);
+    if (!fpinfo->cached)
+        add_partialPathForRel(root, baserel);
 	
     /*
 	 * Thumb through all join clauses for the rel to identify which outer
@@ -77,8 +156,8 @@ get_foreignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
 		if (!join_clause_is_movable_to(rinfo, baserel))
 			continue;
 
-		/* See if it is safe to send to remote */
-		if (!is_foreign_expr(root, baserel, rinfo->clause))
+		/* See if the scan can make use of it */
+		if (!is_paramClause__(root, baserel, rinfo))
 			continue;
 
 		/* Calculate required outer rels for the resulting path */
@@ -153,8 +232,8 @@ get_foreignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
 				if (!join_clause_is_movable_to(rinfo, baserel))
 					continue;
 
-				/* See if it is safe to send to remote */
-				if (!is_foreign_expr(root, baserel, rinfo->clause))
+				/* See if the scan can make use of it */
+				if (!is_paramClause__(root, baserel, rinfo))
 					continue;
 
 				/* Calculate required outer rels for the resulting path */
@@ -184,19 +263,23 @@ get_foreignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
 	foreach(lc, ppi_list)
 	{
 		ParamPathInfo *param_info = (ParamPathInfo *) lfirst(lc);
+		SqliteRelationCostSize costs;
+
+		/* Each execution of the path is one probe for the outer values */
+		estimate_param_path_cost(root, baserel, param_info, &costs);
 
 		/*
 		 * ppi_rows currently won't get looked at by anything, but still we
 		 * may as well ensure that it matches our idea of the rowcount.
 		 */
-		param_info->ppi_rows = fpinfo->costsize.rows;
+		param_info->ppi_rows = costs.rows;
 
 		/* Make the path */
 		path = create_foreignscan_path(root, baserel,
 									   NULL,	/* default pathtarget */
-									   fpinfo->costsize.rows,
-									   fpinfo->costsize.startup_cost,
-									   fpinfo->costsize.total_cost,
+									   costs.rows,
+									   costs.startup_cost,
+									   costs.total_cost,
 									   NIL,		/* no pathkeys */
 									   param_info->ppi_req_outer,
 									   NULL,
@@ -242,6 +325,38 @@ get_foreignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
     //  classify the condition as local or remote
     classifyConditions(root, baserel, baserel->baserestrictinfo, 
                        &fpinfo->remote_conds, &fpinfo->local_conds);
+
+    /*
+     * A table spread over many files is scanned file by file, so joins,
+     * aggregates and limits cannot be left to sqlite.  Only the files the
+     * conditions leave in play are read; those found now are only for
+     * costing, the scan lists them again when it starts.
+     */
+    if (fpinfo->src.shard_pattern)
+    {
+        fpinfo->pushdown_safe = false;
+        fpinfo->shard_bounds = get_sqliteShardBounds(root, baserel);
+        fpinfo->shards = prune_sqliteShards(
+                            planner_rt_fetch(baserel->relid, root)->relid,
+                            fpinfo->src.shard_pattern,
+                            fpinfo->src.shard_column,
+                            get_sqliteShards(fpinfo->src.shard_pattern),
+                            fpinfo->shard_bounds, NULL);
+    }
+
+    /*
+     * A table with the cache option is read from the backend's copy of its
+     * rows, on which all the conditions are checked; see tablecache.c.  The
+     * target of an UPDATE or DELETE is always read from sqlite.
+     */
+    if (fpinfo->src.cache &&
+        root->parse->resultRelation != (int) baserel->relid)
+    {
+        fpinfo->cached = true;
+        fpinfo->pushdown_safe = false;
+        fpinfo->remote_conds = NIL;
+        fpinfo->local_conds = list_copy(baserel->baserestrictinfo);
+    }
 	
     // fetch the attributes that are needed locally by postgres
 	foreach(lc, fpinfo->local_conds)
@@ -268,9 +383,8 @@ get_foreignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
                    fpinfo->local_conds, root);
 	
     /*
-     * We are going to assume that postgres is responsible for keeping 
-     * the statistics for the foreign tables.  This saves us the major
-     * headache of extracting/translating sqlite3 information
+     * By default we assume that postgres is responsible for keeping the
+     * statistics for the foreign tables; see use_remote_estimate below.
      */
     
     /* 
@@ -279,10 +393,138 @@ get_foreignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
      * and baserel->baserestrictcost
      */
     set_baserel_size_estimates(root, baserel);
+
+    /* unless sqlite's own metadata is preferred */
+    fpinfo->index_rows = -1;
+    if (fpinfo->src.use_remote_estimate)
+        apply_remoteEstimates(root, baserel);
+
     estimate_path_cost_size(root, baserel);
 }
 
 
+/*
+ * True if rel includes the target of an UPDATE, whose scan must then read
+ * its whole result before the first row is updated (see fetch_batch).
+ */
+static bool
+is_updateSource__(PlannerInfo *root, RelOptInfo *rel)
+{
+    return root->parse->commandType == CMD_UPDATE &&
+           bms_is_member(root->parse->resultRelation, rel->relids);
+}
+
+
+/*
+ * Paths that apply the query's final ORDER BY or its LIMIT on top of the
+ * scan of their parent rel say so in their fdw_private; see
+ * get_foreignUpperPaths.
+ */
+static bool
+has_finalSort__(ForeignPath *path)
+{
+    return path->fdw_private && intVal(linitial(path->fdw_private));
+}
+
+
+static bool
+has_limit__(ForeignPath *path)
+{
+    return path->fdw_private && intVal(lsecond(path->fdw_private));
+}
+
+
+/*
+ * The fdw_private list of a scan's plan node, see FdwScanPrivateIndex.
+ * table and chunk_sql may be NULL, and cache is NIL unless the scan reads
+ * the copy of the table.
+ */
+static List *
+make_scanPrivate__(char *sql, List *retrieved_attrs,
+                   SqliteFdwRelationInfo *fpinfo, bool fetch_all,
+                   char *table, char *chunk_sql, List *cache)
+{
+    List *fdw_private = NIL;
+    List *shards = NIL;
+
+    if (fpinfo->src.shard_pattern)
+        shards = list_make3(makeString(fpinfo->src.shard_pattern),
+                            fpinfo->src.shard_column ?
+                            makeString(fpinfo->src.shard_column) : NULL,
+                            fpinfo->shard_bounds);
+
+    fdw_private = lappend(fdw_private, makeString(sql));
+    fdw_private = lappend(fdw_private, retrieved_attrs);
+    fdw_private = lappend(fdw_private, makeInteger(fetch_all));
+    fdw_private = lappend(fdw_private, makeInteger(fpinfo->src.serverid));
+    fdw_private = lappend(fdw_private, fpinfo->src.database ?
+                                       makeString(fpinfo->src.database) :
+                                       NULL);
+    fdw_private = lappend(fdw_private, makeInteger(fpinfo->src.fetch_size));
+    fdw_private = lappend(fdw_private, table ? makeString(table) : NULL);
+    fdw_private = lappend(fdw_private, table && fpinfo->src.schema ?
+                                       makeString(fpinfo->src.schema) : NULL);
+    fdw_private = lappend(fdw_private,
+                          chunk_sql ? makeString(chunk_sql) : NULL);
+    fdw_private = lappend(fdw_private, shards);
+    fdw_private = lappend(fdw_private, cache);
+    return fdw_private;
+}
+
+
+/*
+ * A scan of the copy of a table, see tablecache.c.  The conditions are all
+ * checked locally, and the first that can look rows up by a column also
+ * does that, with the value to look up as the scan's parameter.  The query
+ * is the one that reads the whole table into the copy.
+ */
+static ForeignScan *
+get_foreignPlanCached__(PlannerInfo *root,
+                        RelOptInfo *baserel,
+                        Oid foreigntableid,
+                        List *tlist,
+                        List *scan_clauses,
+                        Plan *outer_plan)
+{
+	SqliteFdwRelationInfo *fpinfo = FDW_RELINFO(baserel->fdw_private);
+    List           *fdw_exprs = NIL;
+    List           *cache = list_make2_int(0, InvalidOid);
+    List           *retrieved_attrs;
+    StringInfoData  sql;
+    Relation        rel;
+    ListCell       *lc;
+
+    foreach(lc, scan_clauses)
+    {
+        RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+        AttrNumber attnum;
+        Expr *other;
+
+        if (fdw_exprs == NIL && !rinfo->pseudoconstant &&
+            is_cacheProbe__(baserel, rinfo->clause, &attnum, &other))
+        {
+            fdw_exprs = list_make1(other);
+            cache = list_make2_int(attnum,
+                                   ((OpExpr *) rinfo->clause)->inputcollid);
+        }
+    }
+
+    /* the planner holds a lock on the table already */
+    rel = heap_open(foreigntableid, NoLock);
+    initStringInfo(&sql);
+    deparseAnalyzeSql(&sql, rel, &retrieved_attrs);
+    heap_close(rel, NoLock);
+
+    return make_foreignscan(tlist, extract_actual_clauses(scan_clauses, false),
+                            baserel->relid, fdw_exprs,
+                            make_scanPrivate__(sql.data, retrieved_attrs,
+                                               fpinfo, false,
+                                               fpinfo->src.table, NULL,
+                                               cache),
+                            NIL, NIL, outer_plan);
+}
+
+
 static ForeignScan *
 get_foreignPlanSimple__(PlannerInfo *root,
 					    RelOptInfo *baserel,
@@ -299,6 +541,7 @@ get_foreignPlanSimple__(PlannerInfo *root,
 	List        *remote_exprs = NULL;
 	List        *params_list = NULL;
 	StringInfoData sql;
+	StringInfoData chunk_sql;
 	List           *retrieved_attrs;
 	ListCell       *lc;
 	List	       *fdw_scan_tlist = NULL;
@@ -339,15 +582,37 @@ get_foreignPlanSimple__(PlannerInfo *root,
 			local_exprs = lappend(local_exprs, rinfo->clause);
 	}
 	
+	/* Remember remote_exprs for possible use by plan_directModify */
+	fpinfo->final_remote_exprs = remote_exprs;
+
     /* Build the query */
     fdw_scan_tlist = build_tlist_to_deparse(baserel);
 	initStringInfo(&sql);
 	deparseSelectStmtForRel(&sql, root, baserel, fdw_scan_tlist,
 							remote_exprs, best_path->path.pathkeys,
+							false, has_limit__(best_path),
 							false, &retrieved_attrs, &params_list);
 
+    /*
+     * A parallel scan runs the query once per chunk of rowids, unless the
+     * table is spread over many files, which are handed out whole.
+     */
+    if (best_path->path.parallel_aware && !fpinfo->src.shard_pattern)
+    {
+        Assert(!best_path->path.pathkeys && !has_limit__(best_path));
+        initStringInfo(&chunk_sql);
+        appendStringInfoString(&chunk_sql, sql.data);
+        appendRowidRangeCondition(&chunk_sql, remote_exprs != NIL,
+                                  list_length(params_list) + 1);
+    }
+
     /* goodies for begin_foreignScan */
-	fdw_private = list_make3(makeString(sql.data), retrieved_attrs, fpinfo);
+	fdw_private = make_scanPrivate__(sql.data, retrieved_attrs, fpinfo,
+                                     is_updateSource__(root, baserel),
+                                     fpinfo->src.table,
+                                     best_path->path.parallel_aware &&
+                                     !fpinfo->src.shard_pattern ?
+                                     chunk_sql.data : NULL, NIL);
 
 	/*
      * params_list -> fdw_exprs
@@ -448,13 +713,16 @@ get_foreignPlanJoinUpper__(PlannerInfo *root,
     initStringInfo(&sql);
 	deparseSelectStmtForRel(&sql, root, foreignrel, fdw_scan_tlist,
 							remote_exprs, best_path->path.pathkeys,
+							has_finalSort__(best_path), has_limit__(best_path),
 							false, &retrieved_attrs, &params_list);
 
-	/* Remember remote_exprs for possible use by postgresPlanDirectModify */
-	// fpinfo->final_remote_exprs = remote_exprs;
+	/* Remember remote_exprs for possible use by plan_directModify */
+	fpinfo->final_remote_exprs = remote_exprs;
 
     /* goodies for begin_foreignScan */
-	fdw_private = list_make3(makeString(sql.data), retrieved_attrs, fpinfo);
+	fdw_private = make_scanPrivate__(sql.data, retrieved_attrs, fpinfo,
+                                     is_updateSource__(root, foreignrel),
+                                     NULL, NULL, NIL);
 	
     /*
      * scanrelid -> 0 for join and upper
@@ -472,7 +740,10 @@ get_foreignPlan(PlannerInfo *root, RelOptInfo *baserel,
                 Oid foreigntableoid, ForeignPath *best_path,
                 List *tlist, List *scan_clauses, Plan *outer_plan)
 {
-	if (IS_SIMPLE_REL(baserel))
+	if (IS_SIMPLE_REL(baserel) && FDW_RELINFO(baserel->fdw_private)->cached)
+        return get_foreignPlanCached__(root, baserel, foreigntableoid,
+                                       tlist, scan_clauses, outer_plan);
+	else if (IS_SIMPLE_REL(baserel))
         return get_foreignPlanSimple__(root, baserel, foreigntableoid,
                                        best_path, tlist, scan_clauses,
                                        outer_plan);
@@ -536,6 +807,8 @@ get_foreignJoinPaths(PlannerInfo *root, RelOptInfo *joinrel,
 		{
 			elog(DEBUG3, "could not push down foreign join because "
                          "a local path suitable for EPQ checks was not found");
+			count_sqlitePushdown(root, joinrel->relids, SQLITE_PUSHDOWN_JOIN,
+								 false);
 			return;
 		}
 	}
@@ -547,8 +820,11 @@ get_foreignJoinPaths(PlannerInfo *root, RelOptInfo *joinrel,
 		/* Free path required for EPQ if we copied one; we don't need it now */
 		if (epq_path)
 			pfree(epq_path);
+		count_sqlitePushdown(root, joinrel->relids, SQLITE_PUSHDOWN_JOIN,
+							 false);
 		return;
 	}
+	count_sqlitePushdown(root, joinrel->relids, SQLITE_PUSHDOWN_JOIN, true);
     
 	/*
 	 * Compute the selectivity and cost of the local_conds, so we don't have
@@ -604,6 +880,63 @@ get_foreignJoinPaths(PlannerInfo *root, RelOptInfo *joinrel,
 }
 
     
+/*
+ * Add the sqlite3_stmt_status counters of stmt to stats, unless stats is
+ * NULL, and with reset set them back to zero: when a statement is taken,
+ * to forget what earlier scans counted, and when it is given back.
+ */
+static void
+add_stmtStatus__(SqliteScanStats *stats, sqlite3_stmt *stmt, bool reset)
+{
+    int64 fullscan_steps =
+        sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, reset);
+    int64 sorts = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, reset);
+    int64 autoindexes =
+        sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, reset);
+    int64 vm_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, reset);
+
+    if (!stats)
+        return;
+    stats->fullscan_steps += fullscan_steps;
+    stats->sorts += sorts;
+    stats->autoindexes += autoindexes;
+    stats->vm_steps += vm_steps;
+}
+
+
+/*
+ * Get the connection to database and the scan's statement, cached with
+ * it, keeping count of what that took if the scan is instrumented.
+ */
+static void
+open_scanStatement__(SqliteFdwExecutionState *festate, char const *database)
+{
+    SqliteScanStats *stats = festate->stats;
+    instr_time start;
+    instr_time end;
+    bool db_hit;
+    bool stmt_hit;
+
+    if (festate->timing)
+        INSTR_TIME_SET_CURRENT(start);
+    festate->db = get_sqliteDbHandle(festate->serverid, database);
+    festate->stmt = acquire_sqliteStatement(festate->db, festate->query);
+    if (!stats)
+        return;
+
+    if (festate->timing)
+    {
+        INSTR_TIME_SET_CURRENT(end);
+        INSTR_TIME_ACCUM_DIFF(stats->prepare_time, end, start);
+    }
+    get_sqliteCacheHits(festate->db, &db_hit, &stmt_hit);
+    stats->opens++;
+    stats->db_hits += db_hit;
+    stats->stmt_hits += stmt_hit;
+    add_stmtStatus__(NULL, festate->stmt, true);
+}
+
+
 void
 begin_foreignScan(ForeignScanState *node, int eflags)
 {
@@ -628,23 +961,120 @@ begin_foreignScan(ForeignScanState *node, int eflags)
 	SqliteFdwExecutionState  *festate = (SqliteFdwExecutionState *)
                     palloc0(sizeof(SqliteFdwExecutionState));
 	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
-    SqliteFdwRelationInfo *fpinfo = FDW_RELINFO(
-                                    list_nth(fsplan->fdw_private, 2));
+    List        *fdw_private = fsplan->fdw_private;
+    List        *cache = list_nth(fdw_private, FdwScanPrivateCache);
+    List        *shards = list_nth(fdw_private, FdwScanPrivateShards);
 
     /* will be accessed in iterate_foreignScan */
 	node->fdw_state = (void *) festate;
 	
-	festate->db = get_sqliteDbHandle(fpinfo->src.database);
-    festate->query = strVal(list_nth(fsplan->fdw_private, 0));
-    festate->retrieved_attrs = list_nth(fsplan->fdw_private, 1);
+    festate->serverid = (Oid) intVal(list_nth(fdw_private,
+                                              FdwScanPrivateServerId));
+    festate->sharded = shards != NIL;
+    festate->query = strVal(list_nth(fdw_private, FdwScanPrivateSelectSql));
+    festate->retrieved_attrs = list_nth(fdw_private,
+                                        FdwScanPrivateRetrievedAttrs);
     festate->param_exprs = ExecInitExprList(fsplan->fdw_exprs, 
                                             (PlanState *)node);
     festate->traits = get_pgTypeInputTraits(
             node->ss.ss_ScanTupleSlot->tts_tupleDescriptor);
+    init_fetchBuffer(festate,
+            intVal(list_nth(fdw_private, FdwScanPrivateFetchSize)),
+            node->ss.ps.state->es_query_cxt);
+    festate->fetch_all = intVal(list_nth(fdw_private,
+                                         FdwScanPrivateFetchAll));
+
+    /*
+     * EXPLAIN ANALYZE shows what the scan cost, see explain_scanStats__,
+     * and the shared statistics of its tables add it up, see stats.c.
+     */
+    if (is_sqliteStatsEnabled() && !(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+    {
+        int rti = -1;
+
+        while ((rti = bms_next_member(fsplan->fs_relids, rti)) >= 0)
+        {
+            RangeTblEntry *rte = rt_fetch(rti,
+                                          node->ss.ps.state->es_range_table);
+
+            if (rte->rtekind == RTE_RELATION)
+                festate->stat_relids = lappend_oid(festate->stat_relids,
+                                                   rte->relid);
+        }
+        festate->checked_locally = fsplan->scan.plan.qual != NIL;
+    }
+    if (node->ss.ps.instrument || festate->stat_relids)
+    {
+        festate->stats = palloc0(sizeof(SqliteScanStats));
+        festate->timing = festate->stat_relids ||
+                          node->ss.ps.instrument->need_timer;
+    }
+
+    /* The copy of a table is read without asking sqlite for its rows */
+    if (cache)
+    {
+        festate->cached = true;
+        festate->cache_attnum = (AttrNumber) linitial_int(cache);
+        festate->cache_collation = (Oid) lsecond_int(cache);
+        festate->cache_row = -1;
+        if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+            return;
+        festate->cache = acquire_sqliteTableCache(
+                node->ss.ss_currentRelation, festate->serverid,
+                strVal(list_nth(fdw_private, FdwScanPrivateDatabase)),
+                festate->query, festate->retrieved_attrs);
+        if (festate->cache)
+            return;
+
+        /*
+         * Too large to copy: read the whole table from sqlite instead,
+         * with all the conditions, a looked up value included, checked
+         * locally as before.
+         */
+        festate->cached = false;
+        festate->param_exprs = NIL;
+    }
+
+    /*
+     * A parallel-aware scan has not claimed its first chunk of rowids yet,
+     * see claim_rowidChunk.  Until shared state is attached each process
+     * scans all rowids, which is what serial execution of the plan needs.
+     * A sharded one claims files in open_nextShard__.
+     */
+    if (fsplan->scan.plan.parallel_aware && !festate->sharded)
+    {
+        festate->query = strVal(list_nth(fdw_private,
+                                         FdwScanPrivateChunkSql));
+        festate->parallel = true;
+        festate->chunk_param = list_length(fsplan->fdw_exprs) + 1;
+        festate->eof = true;
+    }
+
+    /*
+     * The files of a sharded table are listed now, as the plan may be
+     * older than some of them, and opened one by one as we go.
+     */
+    if (festate->sharded)
+    {
+        char *pattern = strVal(linitial(shards));
+        ListCell *lc;
+
+        foreach(lc, prune_sqliteShards(
+                        RelationGetRelid(node->ss.ss_currentRelation),
+                        pattern,
+                        lsecond(shards) ? strVal(lsecond(shards)) : NULL,
+                        get_sqliteShards(pattern), lthird(shards),
+                        (PlanState *) node))
+            festate->shards = lappend(festate->shards,
+                                      makeString((char *) lfirst(lc)));
+        festate->eof = true;
+        return;
+    }
     
     PG_TRY();
     {
-        festate->stmt = prepare_sqliteQuery(festate->db, festate->query, NULL);
+        open_scanStatement__(festate,
+                strVal(list_nth(fdw_private, FdwScanPrivateDatabase)));
     }
     PG_CATCH();
     {
@@ -659,18 +1089,37 @@ List *
 import_foreignSchema(ImportForeignSchemaStmt *stmt, Oid serverOid)
 {
 	sqlite3		   *db = NULL;
-	sqlite3_stmt   *volatile tbls = NULL;
 	char		   *filename = NULL;
 	List		   *commands = NIL;
     ListCell       *lc;
+    bool            attached = false;
     SqliteTableImportOptions importOptions = 
             get_sqliteTableImportOptions(stmt);
 
+	/* get the db filename, and the aliases of the attached files */
+	foreach(lc, GetForeignServer(serverOid)->options)
+	{
+		DefElem *def = (DefElem *) lfirst(lc);
+		if (strcmp(def->defname, "database") == 0)
+			filename = defGetString(def);
+		else if (strcmp(def->defname, "attach") == 0)
+		{
+			ListCell *alc;
+
+			foreach(alc, parse_sqliteAttachOption(defGetString(def)))
+			{
+				if (strcmp(((DefElem *) lfirst(alc))->defname,
+						   stmt->remote_schema) == 0)
+					attached = true;
+			}
+		}
+	}
+
 	/*
-	 * The only legit sqlite schema are temp and main, 
-     * We want only "main"
+	 * The tables of main, or those of a file attached to the server; temp
+	 * only has what the connection itself made.
 	 */
-	if ( strcmp(stmt->remote_schema, "main") != 0)
+	if ( strcmp(stmt->remote_schema, "main") != 0 && !attached )
 	{
 		ereport(ERROR,
 			(errcode(ERRCODE_FDW_SCHEMA_NOT_FOUND),
@@ -679,58 +1128,98 @@ import_foreignSchema(ImportForeignSchemaStmt *stmt, Oid serverOid)
 			));
 	}
 
-	/* get the db filename */
-	foreach(lc, GetForeignServer(serverOid)->options)
-	{
-		DefElem *def = (DefElem *) lfirst(lc);
-		if (strcmp(def->defname, "database") == 0)
-		{
-			filename = defGetString(def);
-			break;
-		}
-	}
-
     if ( !filename )
 		ereport(ERROR,
 			(errcode(ERRCODE_FDW_ERROR),
 			errmsg("Need database option for server %s", 
                     stmt->server_name)
 			));
+
+    /* All the files of a pattern have the same tables; ask the first */
+    if ( has_sqliteShards(GetForeignServer(serverOid)->options) )
+    {
+        List *shards = get_sqliteShards(filename);
+
+        if ( !shards )
+            ereport(ERROR,
+                (errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+                errmsg("no sqlite file matches \"%s\"", filename)
+                ));
+        filename = (char *) linitial(shards);
+    }
     
 	/* Connect to the server */
-	db = get_sqliteDbHandle(filename);
+	db = get_sqliteDbHandle(serverOid, filename);
 
 	PG_TRY();
 	{
-		/* You want all tables, except system tables */
-        char tablenames_q[256] = "select name from sqlite_master "
-                                  "where type = 'table' "
-                                  "and name not like 'sqlite_%'";
-		
-        /* Iterate to all matching tables, and get their definition */
-		tbls = prepare_sqliteQuery(db, tablenames_q, NULL);
-		while (sqlite3_step(tbls) == SQLITE_ROW)
-		{
-            char *tablename = (char *) sqlite3_column_text(tbls, 0);
-            char *cftsql = get_foreignTableCreationSql(
-                            stmt, db, tablename, importOptions);
-            if ( cftsql ) {
-                commands = lappend(commands, cftsql);
-            }
-		}
+		commands = get_foreignTableCreationSql(stmt, db, importOptions);
 	}
 	PG_CATCH();
 	{
-        dispose_sqlite(&db, (sqlite3_stmt **)&tbls);
+        release_sqliteDbHandle(db);
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
     
-    dispose_sqlite(&db, (sqlite3_stmt **)&tbls);
+    release_sqliteDbHandle(db);
 	return commands;
 }
 
     
+/*
+ * How a line of EXPLAIN QUERY PLAN reads its table: 1 for a SEARCH through
+ * an index, 2 for a SCAN of a whole index, 3 for a SCAN of the table itself
+ * and 0 for anything else (subqueries, virtual tables, temp b-trees).
+ */
+static int
+get_planAccess__(char const *detail)
+{
+    if (!detail)
+        return 0;
+    if (strncmp(detail, "SEARCH ", 7) == 0)
+        return 1;
+    if (strncmp(detail, "SCAN ", 5) != 0 ||
+        strstr(detail, "VIRTUAL TABLE") || strstr(detail, "CONSTANT ROW") ||
+        strstr(detail, "SUBQUERY") || strstr(detail, "subquery"))
+        return 0;
+    return strstr(detail, " USING ") ? 2 : 3;
+}
+
+
+/*
+ * The EXPLAIN ANALYZE figures of a scan.  The rows that local conditions
+ * reject are counted by the executor, as "Rows Removed by Filter".
+ */
+static void
+explain_scanStats__(SqliteFdwExecutionState *festate, ExplainState *es)
+{
+    SqliteScanStats stats = *festate->stats;
+
+    if (festate->stmt)
+        add_stmtStatus__(&stats, festate->stmt, false);
+
+    if (festate->timing && es->timing)
+    {
+        ExplainPropertyFloat("sqlite prepare time",
+                             INSTR_TIME_GET_MILLISEC(stats.prepare_time), 3, es);
+        ExplainPropertyFloat("sqlite step time",
+                             INSTR_TIME_GET_MILLISEC(stats.step_time), 3, es);
+    }
+    ExplainPropertyLong("sqlite rows", (long) stats.rows, es);
+    ExplainPropertyLong("sqlite bytes", (long) stats.bytes, es);
+    ExplainPropertyInteger("sqlite statements", stats.opens, es);
+    ExplainPropertyInteger("sqlite cached connections", stats.db_hits, es);
+    ExplainPropertyInteger("sqlite cached statements", stats.stmt_hits, es);
+    ExplainPropertyLong("sqlite full scan steps", (long) stats.fullscan_steps,
+                        es);
+    ExplainPropertyLong("sqlite sorts", (long) stats.sorts, es);
+    ExplainPropertyLong("sqlite automatic indexes", (long) stats.autoindexes,
+                        es);
+    ExplainPropertyLong("sqlite VM steps", (long) stats.vm_steps, es);
+}
+
+
 void
 explain_foreignScan(ForeignScanState *node, ExplainState *es)
 {
@@ -750,12 +1239,48 @@ explain_foreignScan(ForeignScanState *node, ExplainState *es)
 	const char				   *pzTail;
 	SqliteFdwExecutionState	   *festate = (SqliteFdwExecutionState *) 
                                           node->fdw_state;
+	sqlite3                    *db = festate->db;
+	bool                        own_db = false;
+	int                         access = 0;
+	static char const *const    access_names[] =
+		{ NULL, "index search", "index scan", "full scan" };
 
 	/* Show the query (only if VERBOSE) */
 	if (es->verbose)
 		/* show query */
 		ExplainPropertyText("sqlite query", festate->query, es);
 
+	/* The copy of a table is read without running the query */
+	if (festate->cached)
+	{
+		Relation	rel = node->ss.ss_currentRelation;
+
+		ExplainPropertyText("sqlite cache", festate->cache_attnum == 0 ?
+			"all rows" :
+			psprintf("lookup by %s", quote_identifier(NameStr(
+				RelationGetDescr(rel)->attrs[festate->cache_attnum - 1]->attname))),
+			es);
+		if (es->analyze && festate->cache)
+			ExplainPropertyInteger("sqlite cached rows", festate->cache->nrows,
+								   es);
+		return;
+	}
+
+	/*
+	 * A sharded table has no file open before the scan starts.  The plan
+	 * sqlite makes on its first file stands for all of them.
+	 */
+	if (festate->sharded || !db)
+	{
+		ExplainPropertyInteger("sqlite files", list_length(festate->shards),
+							   es);
+		if (!festate->shards)
+			return;
+		db = get_sqliteDbHandle(festate->serverid,
+								strVal(linitial(festate->shards)));
+		own_db = true;
+	}
+
 	/* Build the query */
 	len = strlen(festate->query) + 32;
 	query = (char *)palloc(len);
@@ -764,21 +1289,33 @@ explain_foreignScan(ForeignScanState *node, ExplainState *es)
     /* Execute the query */
     PG_TRY();
     {
-	    stmt = prepare_sqliteQuery(festate->db, query, &pzTail);
+	    stmt = prepare_sqliteQuery(db, query, &pzTail);
         while (sqlite3_step(stmt) == SQLITE_ROW)
-            ExplainPropertyText(
-                    "sqlite plan", 
-                    (char*)sqlite3_column_text(stmt, 3), 
-                    es);
+        {
+            char const *detail = (char const *) sqlite3_column_text(stmt, 3);
+
+            ExplainPropertyText("sqlite plan", detail, es);
+            access = Max(access, get_planAccess__(detail));
+        }
     }
     PG_CATCH();
     {
         dispose_sqlite(NULL, (sqlite3_stmt **)&stmt);
+        if (own_db)
+            close_sqliteDbHandle(db);
         PG_RE_THROW();
     }
     PG_END_TRY();
 
     dispose_sqlite(NULL, (sqlite3_stmt **)&stmt);
+    if (own_db)
+        close_sqliteDbHandle(db);
+
+    /* the worst way any table is read, for a quick look in the logs */
+    if (access > 0)
+        ExplainPropertyText("sqlite access", access_names[access], es);
+    if (es->analyze && festate->stats)
+        explain_scanStats__(festate, es);
 }
 
 
@@ -792,7 +1329,10 @@ acquire_foreignSamples(Relation relation, int elevel,
 	StringInfoData sql;
 	ForeignTable *table = GetForeignTable(RelationGetRelid(relation));
     TupleDesc desc = relation->rd_att;
+    instr_time start;
+    instr_time duration;
     
+    INSTR_TIME_SET_CURRENT(start);
     state.relation = relation;
     state.rows = rows;
     state.targrows = targrows;
@@ -802,19 +1342,17 @@ acquire_foreignSamples(Relation relation, int elevel,
     state.slot->tts_tupleDescriptor = desc;
     state.slot->tts_values = palloc(desc->natts * sizeof(Datum));
     state.slot->tts_isnull = palloc(desc->natts * sizeof(bool));
-    
-    if (targrows > 0)
-        state.toskip = SQLITE_ANALYZE_NUM_ROWS / targrows - 1;
-    else
-        state.toskip = SQLITE_ANALYZE_NUM_ROWS;
-    if (state.toskip <= 0)
-        state.toskip = 1;
 
     sql = construct_foreignSamplesQuery(&state);
     collect_foreignSamples(&state, sql);
     
     *totalrows = state.count;
     *totaldeadrows = 0;
+
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+    count_sqliteAnalyze(RelationGetRelid(relation),
+                        INSTR_TIME_GET_MILLISEC(duration));
 	ereport(elevel,
 			(errmsg("\"%s\": table contains %.0f rows, %d rows in sample",
 					RelationGetRelationName(relation),
@@ -856,15 +1394,104 @@ analyze_foreignTable(Relation relation, AcquireSampleRowsFunc *func,
 	ForeignTable *table = GetForeignTable(RelationGetRelid(relation));
     SqliteTableSource src = get_tableSource(table->relid);
     double rowsize = get_rowSize(relation);
-    SQLITE_ANALYZE_NUM_ROWS = get_rowCount(src.database, src.table);
+    double rowcount = get_rowCount(&src);
 
-    *totalpages = (BlockNumber) ((rowsize * SQLITE_ANALYZE_NUM_ROWS) / BLCKSZ);
+    *totalpages = (BlockNumber) ((rowsize * rowcount) / BLCKSZ);
     *func = acquire_foreignSamples;
     
     return true;
 }
 
 
+/*
+ * Move a scan of a sharded table on to its next file: give back the
+ * statement of the current one and close its connection, and get the query's
+ * statement, cached with the next file's connection, ready to run.  In a
+ * parallel scan the next file is the next one no other participant has
+ * claimed, so that the files are read side by side.  Returns false after
+ * the last file.
+ */
+static bool
+open_nextShard__(SqliteFdwExecutionState *festate)
+{
+    uint64 shard;
+    char *database;
+
+    if (festate->pstate)
+        shard = pg_atomic_fetch_add_u64(&festate->pstate->next_chunk, 1);
+    else
+        shard = festate->next_shard++;
+    if (shard >= (uint64) list_length(festate->shards))
+        return false;
+    database = strVal(list_nth(festate->shards, (int) shard));
+
+    if (festate->stmt && festate->stats)
+        add_stmtStatus__(festate->stats, festate->stmt, true);
+    release_sqliteStatement(festate->db, festate->stmt);
+    festate->stmt = NULL;
+    close_sqliteDbHandle(festate->db);
+    festate->db = NULL;
+
+    open_scanStatement__(festate, database);
+    festate->params_bound = false;
+    festate->nrows = 0;
+    festate->next_row = 0;
+    festate->eof = false;
+    return true;
+}
+
+
+/*
+ * The next row of the copy of the table a scan reads, looked up by the
+ * value of the scan's parameter if it has one.  The rows stay in the copy,
+ * which the scan holds on to until it ends.
+ */
+static TupleTableSlot *
+iterate_cache__(ForeignScanState *node)
+{
+	SqliteFdwExecutionState   *festate = (SqliteFdwExecutionState *) 
+                                          node->fdw_state;
+	TupleTableSlot  *slot = node->ss.ss_ScanTupleSlot;
+    SqliteTableCache *cache = festate->cache;
+
+    ExecClearTuple(slot);
+    if (festate->eof)
+        return slot;
+
+    if (festate->cache_attnum == 0)
+        festate->cache_row = festate->cache_row + 1 < cache->nrows ?
+                             festate->cache_row + 1 : -1;
+    else
+    {
+        if (!festate->params_bound)
+        {
+            MemoryContext oldcontext;
+
+            /* the value is kept, uncopied, until the next rescan */
+            MemoryContextReset(festate->param_cxt);
+            oldcontext = MemoryContextSwitchTo(festate->param_cxt);
+            festate->cache_value = ExecEvalExpr(
+                    (ExprState *) linitial(festate->param_exprs),
+                    node->ss.ps.ps_ExprContext, &festate->cache_isnull);
+            MemoryContextSwitchTo(oldcontext);
+            festate->params_bound = true;
+        }
+        festate->cache_row = festate->cache_isnull ? -1 :
+            next_sqliteCachedRow(cache, festate->cache_attnum,
+                                 festate->cache_collation,
+                                 festate->cache_value, festate->cache_row);
+    }
+
+    if (festate->cache_row < 0)
+    {
+        festate->eof = true;
+        return slot;
+    }
+    return ExecStoreTuple(cache->rows[festate->cache_row], slot,
+                          InvalidBuffer, false);
+}
+
+
 TupleTableSlot *
 iterate_foreignScan(ForeignScanState *node)
 {
@@ -895,13 +1522,27 @@ iterate_foreignScan(ForeignScanState *node)
                                           node->fdw_state;
 	TupleTableSlot  *slot = node->ss.ss_ScanTupleSlot;
 
-    if ( ! festate->params_bound )
-        sqlite_bind_param_values(node);
-	
+    if (festate->cached)
+        return iterate_cache__(node);
+
     ExecClearTuple(slot);
-    if (sqlite3_step(festate->stmt) == SQLITE_ROW)
-        populate_tupleTableSlot(festate->stmt, slot,
-                                festate->retrieved_attrs, festate->traits);
+    while (festate->next_row >= festate->nrows)
+    {
+        if (!festate->eof)
+        {
+            if ( ! festate->params_bound )
+                sqlite_bind_param_values(node);
+            fetch_batch(festate);
+        }
+        else if (festate->parallel)
+        {
+            if (!claim_rowidChunk(festate))
+                return slot;
+        }
+        else if (!open_nextShard__(festate))
+            return slot;
+    }
+    store_bufferedRow(festate, slot);
     return slot;
 }
 
@@ -911,7 +1552,12 @@ end_foreignScan(ForeignScanState *node)
 {
     SqliteFdwExecutionState *festate = (SqliteFdwExecutionState *)
                                             node->fdw_state;
-    printf("%s", "");
+
+    if (festate->stat_relids)
+        count_sqliteScan(festate->stat_relids, festate->stats,
+                         festate->checked_locally);
+    release_sqliteTableCache(festate->cache);
+    festate->cache = NULL;
 	cleanup_(festate);
 }
 
@@ -924,36 +1570,188 @@ rescan_foreignScan(ForeignScanState *node)
 	 * depends on may have changed value, so the new scan does not necessarily
 	 * return exactly the same rows.
 	 */
-}
+	SqliteFdwExecutionState   *festate = (SqliteFdwExecutionState *) 
+                                          node->fdw_state;
 
+    /* the copy of a table is looked up again, by the new value if any */
+    if (festate->cached)
+    {
+        if (node->ss.ps.chgParam != NULL)
+            festate->params_bound = false;
+        festate->cache_row = -1;
+        festate->eof = false;
+        return;
+    }
 
-/*
- * Assess whether the aggregation, grouping and having operations can be pushed
- * down to the foreign server.  As a side effect, save information we obtain in
- * this function to PgFdwRelationInfo of the input relation.
- */
-static bool
-foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouping_rel)
-{
-	Query	   *query = root->parse;
-	PathTarget *grouping_target;
-	SqliteFdwRelationInfo *fpinfo = (SqliteFdwRelationInfo *) 
-                                     grouping_rel->fdw_private;
-	SqliteFdwRelationInfo *grouped_fpinfo;
-	List	   *aggvars;
-	ListCell   *lc;
-	int			i;
-	List	   *tlist = NIL;
+    /*
+     * Rewinding the statement is enough when none of our parameters
+     * changed; otherwise iterate_foreignScan binds the new values before
+     * stepping again.
+     */
+    sqlite3_reset(festate->stmt);
+    if (node->ss.ps.chgParam != NULL)
+        festate->params_bound = false;
 
-	/* Grouping Sets are not pushable */
-	if (query->groupingSets)
-		return false;
+    /* the spooled result of a fetch_all scan will do again if so */
+    reset_fetchSpool(festate, node->ss.ps.chgParam == NULL);
 
-	/* Get the fpinfo of the underlying scan relation. */
-	grouped_fpinfo = (SqliteFdwRelationInfo *) fpinfo->grouped_rel->fdw_private;
+    /* Drop whatever was left of the last batch */
+    festate->nrows = 0;
+    festate->next_row = 0;
+    festate->eof = false;
 
-	/*
-	 * If underneath input relation has any local conditions, those conditions
+    /*
+     * A parallel scan starts over from its first chunk; the leader resets
+     * the shared counter in reinitialize_foreignScanDSM.  A sharded one
+     * goes back to its first file.
+     */
+    if (festate->parallel)
+    {
+        festate->eof = true;
+        festate->chunk_done = false;
+    }
+    if (festate->sharded)
+    {
+        festate->eof = true;
+        festate->next_shard = 0;
+    }
+}
+
+
+bool
+is_foreignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel,
+                           RangeTblEntry *rte)
+{
+    /*
+     * Every worker opens the database file on its own connection, and a
+     * scan only reads from it, so nothing is shared but the chunk counter.
+     */
+    return true;
+}
+
+
+Size
+estimate_foreignScanDSM(ForeignScanState *node, ParallelContext *pcxt)
+{
+    SqliteFdwExecutionState *festate = (SqliteFdwExecutionState *)
+                                            node->fdw_state;
+    Size size = offsetof(SqliteParallelScanState, shards);
+    ListCell *lc;
+
+    foreach(lc, festate->shards)
+        size = add_size(size, strlen(strVal(lfirst(lc))) + 1);
+    return size;
+}
+
+
+void
+initialize_foreignScanDSM(ForeignScanState *node, ParallelContext *pcxt,
+                          void *coordinate)
+{
+    SqliteFdwExecutionState *festate = (SqliteFdwExecutionState *)
+                                            node->fdw_state;
+    SqliteParallelScanState *pstate = (SqliteParallelScanState *) coordinate;
+    ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+    char *table = strVal(list_nth(fsplan->fdw_private, FdwScanPrivateTable));
+    Value *schema = list_nth(fsplan->fdw_private, FdwScanPrivateSchema);
+
+    /*
+     * The files of a sharded table are counted off by next_chunk alone,
+     * in the list the workers take from here.
+     */
+    pg_atomic_init_u64(&pstate->next_chunk, 0);
+    festate->pstate = pstate;
+    if (festate->sharded)
+    {
+        char *name = pstate->shards;
+        ListCell *lc;
+
+        pstate->nshards = list_length(festate->shards);
+        foreach(lc, festate->shards)
+        {
+            strcpy(name, strVal(lfirst(lc)));
+            name += strlen(name) + 1;
+        }
+        return;
+    }
+
+    /* the rows inserted after this by other connections are not seen */
+    if (!get_sqliteRowidRange(festate->db, schema ? strVal(schema) : NULL,
+                              table, &pstate->min_rowid, &pstate->max_rowid))
+        ereport(ERROR,
+            (errcode(ERRCODE_FDW_ERROR),
+            errmsg("Failed to read the rowid range of sqlite table %s: %s",
+                   table, sqlite3_errmsg(festate->db))
+            ));
+    pstate->chunk_size = SQLITE_PARALLEL_CHUNK_SIZE;
+}
+
+
+void
+reinitialize_foreignScanDSM(ForeignScanState *node, ParallelContext *pcxt,
+                            void *coordinate)
+{
+    SqliteParallelScanState *pstate = (SqliteParallelScanState *) coordinate;
+
+    pg_atomic_write_u64(&pstate->next_chunk, 0);
+}
+
+
+void
+initialize_foreignScanWorker(ForeignScanState *node, shm_toc *toc,
+                             void *coordinate)
+{
+    SqliteFdwExecutionState *festate = (SqliteFdwExecutionState *)
+                                            node->fdw_state;
+    SqliteParallelScanState *pstate = (SqliteParallelScanState *) coordinate;
+
+    festate->pstate = pstate;
+    if (festate->sharded)
+    {
+        MemoryContext oldcontext =
+            MemoryContextSwitchTo(node->ss.ps.state->es_query_cxt);
+        char *name = pstate->shards;
+        int i;
+
+        festate->shards = NIL;
+        for (i = 0; i < pstate->nshards; i++)
+        {
+            festate->shards = lappend(festate->shards,
+                                      makeString(pstrdup(name)));
+            name += strlen(name) + 1;
+        }
+        MemoryContextSwitchTo(oldcontext);
+    }
+}
+
+
+/*
+ * Assess whether the aggregation, grouping and having operations can be pushed
+ * down to the foreign server.  As a side effect, save information we obtain in
+ * this function to PgFdwRelationInfo of the input relation.
+ */
+static bool
+foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouping_rel)
+{
+	Query	   *query = root->parse;
+	PathTarget *grouping_target;
+	SqliteFdwRelationInfo *fpinfo = (SqliteFdwRelationInfo *) 
+                                     grouping_rel->fdw_private;
+	SqliteFdwRelationInfo *grouped_fpinfo;
+	List	   *aggvars;
+	ListCell   *lc;
+	int			i;
+	List	   *tlist = NIL;
+
+	/* Grouping Sets are not pushable */
+	if (query->groupingSets)
+		return false;
+
+	/* Get the fpinfo of the underlying scan relation. */
+	grouped_fpinfo = (SqliteFdwRelationInfo *) fpinfo->grouped_rel->fdw_private;
+
+	/*
+	 * If underneath input relation has any local conditions, those conditions
 	 * are required to be applied before performing aggregation.  Hence the
 	 * aggregate cannot be pushed down.
 	 */
@@ -1164,11 +1962,17 @@ add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
 
 	/* save the input_rel as grouped_rel in fpinfo */
 	fpinfo->grouped_rel = input_rel;
-    fpinfo->src.database = ifpinfo->src.database;
+    fpinfo->src = ifpinfo->src;
     
 	/* Assess if it is safe to push down aggregation and grouping. */
 	if (!foreign_grouping_ok(root, grouping_rel))
+	{
+		count_sqlitePushdown(root, input_rel->relids,
+							 SQLITE_PUSHDOWN_AGGREGATE, false);
 		return;
+	}
+	count_sqlitePushdown(root, input_rel->relids, SQLITE_PUSHDOWN_AGGREGATE,
+						 true);
 
 	/* Estimate the cost of push down */
 	estimate_path_cost_size(root, grouping_rel);
@@ -1189,10 +1993,192 @@ add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
 	add_path(grouping_rel, (Path *) grouppath);
 }
 
-    
+
+/*
+ * add_foreignOrderedPaths
+ *		Add a foreign path that sorts the output of an aggregation.
+ *
+ * Scans and joins get their sorted paths along with the others (see
+ * add_pathsWithPathKeysForRel), since the query's pathkeys are the final
+ * ORDER BY there; only a grouping rel below the sort needs one here.  Like
+ * the paths of get_foreignUpperPaths the new one belongs to input_rel, so
+ * it is planned as that rel's query with the ORDER BY added, and is put
+ * into ordered_rel.
+ */
+static void
+add_foreignOrderedPaths(PlannerInfo *root, RelOptInfo *input_rel,
+                        RelOptInfo *ordered_rel)
+{
+	SqliteFdwRelationInfo *ifpinfo = FDW_RELINFO(input_rel->fdw_private);
+	PathTarget *grouping_target = root->upper_targets[UPPERREL_GROUP_AGG];
+	double		retrieved_rows = ifpinfo->costsize.rows;
+	Path		sort_path;
+	ListCell   *lc;
+
+	if (input_rel->reloptkind != RELOPT_UPPER_REL ||
+		root->parse->hasTargetSRFs)
+		return;
+
+	/* The sort keys have to be among the aggregation's output */
+	foreach(lc, root->sort_pathkeys)
+	{
+		PathKey    *pathkey = (PathKey *) lfirst(lc);
+		Expr	   *sort_expr;
+
+		if (pathkey->pk_eclass->ec_has_volatile ||
+			(OidIsValid(pathkey->pk_eclass->ec_collation) &&
+			 is_sqliteTextByteOrdered(input_rel)))
+			return;
+		sort_expr = find_em_expr_for_input_target(root, pathkey->pk_eclass,
+												  grouping_target);
+		if (!sort_expr || !is_foreign_expr(root, input_rel, sort_expr))
+			return;
+	}
+
+	cost_sort(&sort_path, root, root->sort_pathkeys,
+			  ifpinfo->costsize.total_cost, retrieved_rows,
+			  ifpinfo->costsize.width, 0.0, work_mem, -1.0);
+
+	add_path(ordered_rel, (Path *)
+			 create_foreignscan_path(root, input_rel,
+									 root->upper_targets[UPPERREL_ORDERED],
+									 ifpinfo->costsize.rows,
+									 sort_path.startup_cost,
+									 sort_path.total_cost,
+									 root->sort_pathkeys,
+									 NULL,		/* no required_outer */
+									 NULL,		/* no extra plan */
+									 list_make2(makeInteger(true),
+												makeInteger(false))));
+}
+
+
+/*
+ * Estimated number of rows a LIMIT/OFFSET lets through, given the input
+ * rows; -1 if the query's LIMIT or OFFSET cannot be sent to sqlite.  We
+ * only send constants: a parameter could turn out to be negative, which
+ * sqlite takes as no limit where PostgreSQL raises an error.
+ */
+static double
+get_limitedRows__(PlannerInfo *root, double rows)
+{
+	Const	   *count = (Const *) root->parse->limitCount;
+	Const	   *offset = (Const *) root->parse->limitOffset;
+	double		skip = 0;
+
+	if ((count && !IsA(count, Const)) || (offset && !IsA(offset, Const)))
+		return -1;
+	if (count && !count->constisnull && DatumGetInt64(count->constvalue) < 0)
+		return -1;
+	if (offset && !offset->constisnull)
+	{
+		if (DatumGetInt64(offset->constvalue) < 0)
+			return -1;
+		skip = (double) DatumGetInt64(offset->constvalue);
+	}
+
+	rows = Max(rows - skip, 0);
+	if (count && !count->constisnull)
+		rows = Min(rows, (double) DatumGetInt64(count->constvalue));
+	return clamp_row_est(rows);
+}
+
+
+/*
+ * add_foreignFinalPaths
+ *		Add a foreign path that applies the query's LIMIT/OFFSET in sqlite.
+ *
+ * The cheapest unparameterized foreign path of input_rel that is already
+ * in the query's final order (or any, if there is no ORDER BY) is copied
+ * with the LIMIT added, as long as nothing is left to check locally that
+ * could remove rows before the limit.  FOR UPDATE/SHARE needs the local
+ * LockRows node, and set-returning functions change the row count, so
+ * neither is pushed down.
+ */
+static void
+add_foreignFinalPaths(PlannerInfo *root, RelOptInfo *input_rel,
+                      RelOptInfo *final_rel)
+{
+	Query	   *parse = root->parse;
+	ForeignPath *best = NULL;
+	Cost		run_cost;
+	double		rows;
+	ListCell   *lc;
+
+	if (parse->commandType != CMD_SELECT || parse->rowMarks ||
+		parse->hasTargetSRFs ||
+		(!parse->limitCount && !parse->limitOffset))
+		return;
+
+	foreach(lc, input_rel->pathlist)
+	{
+		Path	   *path = (Path *) lfirst(lc);
+
+		if (!IsA(path, ForeignPath) || path->param_info ||
+			!pathkeys_contained_in(root->sort_pathkeys, path->pathkeys))
+			continue;
+		if (!path->parent->fdw_private ||
+			FDW_RELINFO(path->parent->fdw_private)->local_conds)
+			continue;
+		if (!best || path->total_cost < best->path.total_cost)
+			best = (ForeignPath *) path;
+	}
+	if (!best)
+		return;
+
+	rows = get_limitedRows__(root, best->path.rows);
+	if (rows < 0)
+		return;
+
+	/* sqlite stops once it has produced the rows we want */
+	run_cost = best->path.total_cost - best->path.startup_cost;
+	if (best->path.rows > 0)
+		run_cost *= Min(rows / best->path.rows, 1.0);
+
+	add_path(final_rel, (Path *)
+			 create_foreignscan_path(root, best->path.parent,
+									 root->upper_targets[UPPERREL_FINAL],
+									 rows,
+									 best->path.startup_cost,
+									 best->path.startup_cost + run_cost,
+									 best->path.pathkeys,
+									 NULL,		/* no required_outer */
+									 NULL,		/* no extra plan */
+									 list_make2(makeInteger(
+													has_finalSort__(best)),
+												makeInteger(true))));
+}
+
+
+/*
+ * True if one of rel's paths scans in sqlite and returns the rows in the
+ * order the query wants.
+ */
+static bool
+has_sortedForeignPath__(PlannerInfo *root, RelOptInfo *rel)
+{
+	ListCell   *lc;
+
+	foreach(lc, rel->pathlist)
+	{
+		Path	   *path = (Path *) lfirst(lc);
+
+		if (IsA(path, ForeignPath) &&
+			pathkeys_contained_in(root->sort_pathkeys, path->pathkeys))
+			return true;
+	}
+	return false;
+}
+
+
+/*
+ * get_foreignUpperPaths
+ *		Add paths for post-join operations like aggregation, grouping, the
+ *		final sort and LIMIT/OFFSET.
+ */
 void
 get_foreignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
-                      RelOptInfo *input_rel, RelOptInfo *grouping_rel)
+                      RelOptInfo *input_rel, RelOptInfo *output_rel)
 {
 	SqliteFdwRelationInfo *fpinfo;
 
@@ -1205,12 +2191,913 @@ get_foreignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
 		return;
 
 	/* Ignore stages we don't support; and skip any duplicate calls. */
-	if (stage != UPPERREL_GROUP_AGG || grouping_rel->fdw_private)
+	if ((stage != UPPERREL_GROUP_AGG && stage != UPPERREL_ORDERED &&
+		 stage != UPPERREL_FINAL) ||
+		output_rel->fdw_private)
 		return;
 
 	fpinfo = (SqliteFdwRelationInfo *) palloc0(sizeof(SqliteFdwRelationInfo));
 	fpinfo->pushdown_safe = false;
-	grouping_rel->fdw_private = fpinfo;
+	output_rel->fdw_private = fpinfo;
+
+	switch (stage)
+	{
+		case UPPERREL_GROUP_AGG:
+			add_foreign_grouping_paths(root, input_rel, output_rel);
+			break;
+		case UPPERREL_ORDERED:
+			/* the sorted paths of input_rel are ordered_rel's own */
+			fpinfo->pushdown_safe = true;
+			fpinfo->src = FDW_RELINFO(input_rel->fdw_private)->src;
+			add_foreignOrderedPaths(root, input_rel, output_rel);
+			count_sqlitePushdown(root,
+				input_rel->reloptkind == RELOPT_UPPER_REL ?
+					FDW_RELINFO(input_rel->fdw_private)->grouped_rel->relids :
+					input_rel->relids,
+				SQLITE_PUSHDOWN_SORT,
+				has_sortedForeignPath__(root, input_rel) ||
+				has_sortedForeignPath__(root, output_rel));
+			break;
+		case UPPERREL_FINAL:
+			add_foreignFinalPaths(root, input_rel, output_rel);
+			break;
+		default:
+			break;
+	}
+}
+
+
+/*
+ * Name of the junk column carrying key column attno of the row to modify.
+ */
+static char *
+key_junkName__(AttrNumber attno)
+{
+    return psprintf("sqlite_key%d", attno);
+}
+
+
+static void
+add_junkTarget__(Query *parsetree, Var *var, char *name)
+{
+	TargetEntry *tle = makeTargetEntry((Expr *) var,
+									   list_length(parsetree->targetList) + 1,
+									   name,
+									   true);
+
+	parsetree->targetList = lappend(parsetree->targetList, tle);
+}
+
+
+void
+add_foreignUpdateTargets(Query *parsetree, RangeTblEntry *target_rte,
+                         Relation target_relation)
+{
+	/*
+	 * UPDATE and DELETE need to know which sqlite row to change.  That is
+	 * the value of the columns declared with the key option if there are
+	 * any, and otherwise the rowid, which the scan hands us as the ctid.
+	 */
+    List       *keyAttrs = get_keyAttrs(target_relation);
+    ListCell   *lc;
+
+    if (keyAttrs == NIL)
+    {
+        add_junkTarget__(parsetree,
+                         makeVar(parsetree->resultRelation,
+                                 SelfItemPointerAttributeNumber,
+                                 TIDOID, -1, InvalidOid, 0),
+                         pstrdup("ctid"));
+        return;
+    }
+
+    foreach(lc, keyAttrs)
+    {
+        AttrNumber attno = lfirst_int(lc);
+        Form_pg_attribute attr = 
+            RelationGetDescr(target_relation)->attrs[attno - 1];
+
+        add_junkTarget__(parsetree,
+                         makeVar(parsetree->resultRelation, attno,
+                                 attr->atttypid, attr->atttypmod,
+                                 attr->attcollation, 0),
+                         key_junkName__(attno));
+    }
+}
+
+
+List *
+plan_foreignModify(PlannerInfo *root, ModifyTable *plan,
+                   Index resultRelation, int subplan_index)
+{
+	/*
+	 * Deparse the statement run for every row.  fdw_private holds
+	 *   0: the statement text
+	 *   1: the attribute numbers bound from the new tuple, in order
+	 *   2: the key attributes identifying the row, NIL for rowid
+	 *   3: the rows to insert at a time, 1 but for a plain INSERT
+	 */
+	CmdType		operation = plan->operation;
+	RangeTblEntry *rte = planner_rt_fetch(resultRelation, root);
+	Relation	rel;
+	StringInfoData sql;
+	List	   *targetAttrs = NIL;
+	List	   *keyAttrs = NIL;
+	bool		doNothing = false;
+	int			batch_size = 1;
+
+	if (plan->returningLists)
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			errmsg("RETURNING is not supported by sqlite_fdw")
+			));
+
+	if (get_tableSource(rte->relid).shard_pattern)
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			errmsg("cannot modify foreign table \"%s\", which is spread "
+				   "over many sqlite files", get_rel_name(rte->relid))
+			));
+
+	if (plan->onConflictAction == ONCONFLICT_NOTHING)
+		doNothing = true;
+	else if (plan->onConflictAction != ONCONFLICT_NONE)
+		elog(ERROR, "unexpected ON CONFLICT specification: %d",
+			 (int) plan->onConflictAction);
+
+	/*
+	 * Core code already has some lock on each rel being planned, so we can
+	 * use NoLock here.
+	 */
+	rel = heap_open(rte->relid, NoLock);
+
+	if (operation == CMD_INSERT)
+	{
+		TupleDesc	tupdesc = RelationGetDescr(rel);
+		int			attnum;
+
+		/* send every column, so that sqlite never fills in its defaults */
+		for (attnum = 1; attnum <= tupdesc->natts; attnum++)
+		{
+			if (!tupdesc->attrs[attnum - 1]->attisdropped)
+				targetAttrs = lappend_int(targetAttrs, attnum);
+		}
+	}
+	else if (operation == CMD_UPDATE)
+	{
+		Bitmapset  *tmpset = bms_copy(rte->updatedCols);
+		int			col;
+
+		while ((col = bms_first_member(tmpset)) >= 0)
+		{
+			col += FirstLowInvalidHeapAttributeNumber;
+			if (col <= InvalidAttrNumber)	/* shouldn't happen */
+				elog(ERROR, "system-column update is not supported");
+			targetAttrs = lappend_int(targetAttrs, col);
+		}
+	}
+
+	if (operation != CMD_INSERT)
+		keyAttrs = get_keyAttrs(rel);
+
+	/*
+	 * Rows are inserted in batches unless each one has to be in before the
+	 * next: for its AFTER ROW triggers, or to tell whether ON CONFLICT DO
+	 * NOTHING skipped it.  AFTER STATEMENT triggers fire before
+	 * end_foreignModify writes the last batch, so they rule it out too.
+	 */
+	if (operation == CMD_INSERT && targetAttrs != NIL && !doNothing &&
+		!(rel->trigdesc && (rel->trigdesc->trig_insert_after_row ||
+							rel->trigdesc->trig_insert_after_statement)))
+		batch_size = get_tableSource(rte->relid).batch_size;
+
+	initStringInfo(&sql);
+	switch (operation)
+	{
+		case CMD_INSERT:
+			deparseInsertSql(&sql, root, resultRelation, rel, targetAttrs,
+							 doNothing);
+			break;
+		case CMD_UPDATE:
+			deparseUpdateSql(&sql, root, resultRelation, rel, targetAttrs,
+							 keyAttrs);
+			break;
+		case CMD_DELETE:
+			deparseDeleteSql(&sql, root, resultRelation, rel, keyAttrs);
+			break;
+		default:
+			elog(ERROR, "unexpected operation: %d", (int) operation);
+			break;
+	}
+
+	heap_close(rel, NoLock);
+
+	return list_make4(makeString(sql.data), targetAttrs, keyAttrs,
+					  makeInteger(batch_size));
+}
+
+
+/*
+ * Set up the buffer of rows for an INSERT of batch_size rows at a time,
+ * as many as sqlite takes parameters for, and prepare that INSERT.
+ */
+static void
+begin_insertBatch__(SqliteFdwModifyState *fmstate, int batch_size,
+                    MemoryContext cxt)
+{
+    int nattrs = list_length(fmstate->target_attrs);
+    int max_rows = sqlite3_limit(fmstate->db, SQLITE_LIMIT_VARIABLE_NUMBER,
+                                 -1) / nattrs;
+    StringInfoData sql;
+
+    fmstate->batch_rows = Min(batch_size, max_rows);
+    if (fmstate->batch_rows <= 1)
+    {
+        fmstate->batch_rows = 1;
+        return;
+    }
 
-	add_foreign_grouping_paths(root, input_rel, grouping_rel);
+    fmstate->values = MemoryContextAlloc(cxt, fmstate->batch_rows * nattrs *
+                                              sizeof(Datum));
+    fmstate->nulls = MemoryContextAlloc(cxt, fmstate->batch_rows * nattrs *
+                                             sizeof(bool));
+    fmstate->batch_cxt = AllocSetContextCreate(cxt,
+                                               "sqlite_fdw batched rows",
+                                               ALLOCSET_DEFAULT_SIZES);
+
+    initStringInfo(&sql);
+    deparseInsertBatchSql(&sql, fmstate->query, nattrs, fmstate->batch_rows);
+    fmstate->batch_stmt = acquire_sqliteStatement(fmstate->db, sql.data);
+    pfree(sql.data);
+}
+
+
+void
+begin_foreignModify(ModifyTableState *mtstate, ResultRelInfo *rinfo,
+                    List *fdw_private, int subplan_index, int eflags)
+{
+	/*
+	 * Prepare the statement once for all rows and open the sqlite
+	 * transaction the whole PostgreSQL statement runs in.  Nothing to do
+	 * for EXPLAIN without ANALYZE; explain_foreignModify and
+	 * end_foreignModify look at fdw_private and a NULL ri_FdwState.
+	 */
+	SqliteFdwModifyState *fmstate;
+	Relation	rel = rinfo->ri_RelationDesc;
+	SqliteTableSource src;
+	Plan	   *subplan;
+	int			batch_size = intVal(list_nth(fdw_private, 3));
+
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	fmstate = (SqliteFdwModifyState *) palloc0(sizeof(SqliteFdwModifyState));
+	fmstate->query = strVal(list_nth(fdw_private, 0));
+	fmstate->target_attrs = (List *) list_nth(fdw_private, 1);
+	fmstate->key_attrs = (List *) list_nth(fdw_private, 2);
+	fmstate->temp_cxt = AllocSetContextCreate(mtstate->ps.state->es_query_cxt,
+											  "sqlite_fdw temporary data",
+											  ALLOCSET_SMALL_SIZES);
+
+	/* Find the junk columns identifying the row in the subplan's output */
+	subplan = mtstate->mt_plans[subplan_index]->plan;
+	if (mtstate->operation != CMD_INSERT)
+	{
+		if (fmstate->key_attrs == NIL)
+		{
+			fmstate->ctid_attno =
+				ExecFindJunkAttributeInTlist(subplan->targetlist, "ctid");
+			if (!AttributeNumberIsValid(fmstate->ctid_attno))
+				elog(ERROR, "could not find junk ctid column");
+		}
+		else
+		{
+			ListCell   *lc;
+			int			i = 0;
+
+			fmstate->key_attnos = (AttrNumber *)
+				palloc(list_length(fmstate->key_attrs) * sizeof(AttrNumber));
+			foreach(lc, fmstate->key_attrs)
+			{
+				char	   *name = key_junkName__(lfirst_int(lc));
+
+				fmstate->key_attnos[i] =
+					ExecFindJunkAttributeInTlist(subplan->targetlist, name);
+				if (!AttributeNumberIsValid(fmstate->key_attnos[i]))
+					elog(ERROR, "could not find junk %s column", name);
+				i++;
+			}
+		}
+	}
+
+	src = get_tableSource(RelationGetRelid(rel));
+	fmstate->desc = RelationGetDescr(rel);
+	fmstate->batch_rows = 1;
+	if (mtstate->operation == CMD_INSERT)
+		fmstate->commit_size = src.commit_size;
+	fmstate->db = get_sqliteDbHandle(src.serverid, src.database);
+	PG_TRY();
+	{
+		begin_sqliteTransaction(fmstate->db);
+		fmstate->stmt = acquire_sqliteStatement(fmstate->db, fmstate->query);
+		if (batch_size > 1)
+			begin_insertBatch__(fmstate, batch_size,
+								mtstate->ps.state->es_query_cxt);
+	}
+	PG_CATCH();
+	{
+		/* the transaction goes away with ours */
+		release_sqliteDbHandle(fmstate->db);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	rinfo->ri_FdwState = fmstate;
+}
+
+
+/*
+ * SQLSTATE for a failed sqlite statement, so that constraint violations
+ * can be told apart from other errors.
+ */
+static int
+sqlstate_for__(int rc)
+{
+    switch (rc)
+    {
+        case SQLITE_CONSTRAINT_UNIQUE:
+        case SQLITE_CONSTRAINT_PRIMARYKEY:
+            return ERRCODE_UNIQUE_VIOLATION;
+        case SQLITE_CONSTRAINT_NOTNULL:
+            return ERRCODE_NOT_NULL_VIOLATION;
+        case SQLITE_CONSTRAINT_FOREIGNKEY:
+            return ERRCODE_FOREIGN_KEY_VIOLATION;
+        case SQLITE_CONSTRAINT_CHECK:
+            return ERRCODE_CHECK_VIOLATION;
+        default:
+            if ((rc & 0xff) == SQLITE_CONSTRAINT)
+                return ERRCODE_INTEGRITY_CONSTRAINT_VIOLATION;
+            return ERRCODE_FDW_ERROR;
+    }
+}
+
+
+/*
+ * Bind the given columns of slot as parameters first, first+1, ...
+ * Returns the next parameter number.
+ */
+static int
+bind_slotAttrs__(SqliteFdwModifyState *fmstate, TupleTableSlot *slot,
+                 List *attrs, int first)
+{
+    TupleDesc   desc = slot->tts_tupleDescriptor;
+    ListCell   *lc;
+    int         pindex = first;
+
+    foreach(lc, attrs)
+    {
+        AttrNumber  attnum = lfirst_int(lc);
+        bool        isnull;
+        Datum       value = slot_getattr(slot, attnum, &isnull);
+
+        sqlite_bind_param_value(fmstate->stmt, pindex++,
+                                desc->attrs[attnum - 1]->atttypid,
+                                value, isnull);
+    }
+    return pindex;
+}
+
+
+/*
+ * Bind buffered row number row to parameters first, first+1, ... of stmt.
+ * Returns the next parameter number.
+ */
+static int
+bind_bufferedRow__(SqliteFdwModifyState *fmstate, sqlite3_stmt *stmt,
+                   int row, int first)
+{
+    int         nattrs = list_length(fmstate->target_attrs);
+    Datum      *values = fmstate->values + row * nattrs;
+    bool       *nulls = fmstate->nulls + row * nattrs;
+    ListCell   *lc;
+    int         i = 0;
+
+    foreach(lc, fmstate->target_attrs)
+    {
+        AttrNumber  attnum = lfirst_int(lc);
+
+        sqlite_bind_param_value(stmt, first + i,
+                                fmstate->desc->attrs[attnum - 1]->atttypid,
+                                values[i], nulls[i]);
+        i++;
+    }
+    return first + i;
+}
+
+
+/*
+ * Bind the identity of the row to change, taken from the junk columns of
+ * the subplan's output, starting at parameter first.
+ */
+static void
+bind_rowIdentity__(SqliteFdwModifyState *fmstate, TupleTableSlot *planSlot,
+                   int first)
+{
+    TupleDesc   desc = planSlot->tts_tupleDescriptor;
+    bool        isnull;
+    Datum       value;
+    int         i;
+
+    if (fmstate->key_attrs == NIL)
+    {
+        value = ExecGetJunkAttribute(planSlot, fmstate->ctid_attno, &isnull);
+        if (isnull)
+            elog(ERROR, "ctid is NULL");
+        sqlite_bind_param_value(
+            fmstate->stmt, first, INT8OID,
+            Int64GetDatum(itemPointer_to_rowid(
+                              (ItemPointer) DatumGetPointer(value))),
+            false);
+        return;
+    }
+
+    for (i = 0; i < list_length(fmstate->key_attrs); i++)
+    {
+        AttrNumber attno = fmstate->key_attnos[i];
+
+        value = ExecGetJunkAttribute(planSlot, attno, &isnull);
+        sqlite_bind_param_value(fmstate->stmt, first + i,
+                                desc->attrs[attno - 1]->atttypid,
+                                value, isnull);
+    }
+}
+
+
+/*
+ * Run the bound statement, which is fmstate's own or its batch INSERT, and
+ * rewind it for the next row.  Returns the number of rows changed.
+ */
+static int
+execute_modify__(SqliteFdwModifyState *fmstate, sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+    int changes;
+
+    if (rc != SQLITE_DONE)
+    {
+        int code = sqlite3_extended_errcode(fmstate->db);
+        char *msg = pstrdup(sqlite3_errmsg(fmstate->db));
+
+        sqlite3_reset(stmt);
+        check_sqliteInterrupt(code);
+		ereport(ERROR,
+			(errcode(sqlstate_for__(code)),
+			errmsg("sqlite failed to execute \"%s\": %s",
+                   sqlite3_sql(stmt), msg)
+			));
+    }
+
+    changes = sqlite3_changes(fmstate->db);
+    sqlite3_reset(stmt);
+    return changes;
+}
+
+
+/*
+ * Commit the rows inserted so far once there are commit_size of them, and
+ * go on in a new transaction.
+ */
+static void
+count_inserted__(SqliteFdwModifyState *fmstate, int nrows)
+{
+    if (fmstate->commit_size == 0)
+        return;
+
+    fmstate->uncommitted += nrows;
+    if (fmstate->uncommitted < fmstate->commit_size)
+        return;
+
+    commit_sqliteTransaction(fmstate->db);
+    begin_sqliteTransaction(fmstate->db);
+    fmstate->uncommitted = 0;
+}
+
+
+/*
+ * Insert the buffered rows: in one statement when the batch is full, one
+ * at a time for the rest at the end.
+ */
+static void
+flush_insertBatch__(SqliteFdwModifyState *fmstate)
+{
+    MemoryContext oldcontext;
+    int row;
+
+    if (fmstate->nbuffered == 0)
+        return;
+
+    /* the parameters are bound without a copy, see sqlite_bind_param_value */
+    oldcontext = MemoryContextSwitchTo(fmstate->batch_cxt);
+    if (fmstate->nbuffered == fmstate->batch_rows)
+    {
+        int pindex = 1;
+
+        for (row = 0; row < fmstate->nbuffered; row++)
+            pindex = bind_bufferedRow__(fmstate, fmstate->batch_stmt, row,
+                                        pindex);
+        execute_modify__(fmstate, fmstate->batch_stmt);
+    }
+    else
+    {
+        for (row = 0; row < fmstate->nbuffered; row++)
+        {
+            bind_bufferedRow__(fmstate, fmstate->stmt, row, 1);
+            execute_modify__(fmstate, fmstate->stmt);
+        }
+    }
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextReset(fmstate->batch_cxt);
+
+    count_inserted__(fmstate, fmstate->nbuffered);
+    fmstate->nbuffered = 0;
+}
+
+
+/*
+ * Keep a copy of the new row in the batch, and insert the batch once it
+ * is full.
+ */
+static void
+buffer_insertedRow__(SqliteFdwModifyState *fmstate, TupleTableSlot *slot)
+{
+    int         nattrs = list_length(fmstate->target_attrs);
+    Datum      *values = fmstate->values + fmstate->nbuffered * nattrs;
+    bool       *nulls = fmstate->nulls + fmstate->nbuffered * nattrs;
+    MemoryContext oldcontext = MemoryContextSwitchTo(fmstate->batch_cxt);
+    ListCell   *lc;
+    int         i = 0;
+
+    foreach(lc, fmstate->target_attrs)
+    {
+        Form_pg_attribute attr = fmstate->desc->attrs[lfirst_int(lc) - 1];
+
+        values[i] = slot_getattr(slot, attr->attnum, &nulls[i]);
+        if (!nulls[i] && !attr->attbyval)
+            values[i] = datumCopy(values[i], false, attr->attlen);
+        i++;
+    }
+    MemoryContextSwitchTo(oldcontext);
+
+    if (++fmstate->nbuffered == fmstate->batch_rows)
+        flush_insertBatch__(fmstate);
+}
+
+
+TupleTableSlot *
+exec_foreignInsert(EState *estate, ResultRelInfo *rinfo,
+                   TupleTableSlot *slot, TupleTableSlot *planSlot)
+{
+	SqliteFdwModifyState *fmstate = (SqliteFdwModifyState *) rinfo->ri_FdwState;
+	MemoryContext oldcontext;
+	int			changes;
+
+	/* taken to be inserted; a failure comes later, and fails the statement */
+	if (fmstate->batch_rows > 1)
+	{
+		buffer_insertedRow__(fmstate, slot);
+		return slot;
+	}
+
+	oldcontext = MemoryContextSwitchTo(fmstate->temp_cxt);
+	bind_slotAttrs__(fmstate, slot, fmstate->target_attrs, 1);
+	changes = execute_modify__(fmstate, fmstate->stmt);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(fmstate->temp_cxt);
+	count_inserted__(fmstate, changes);
+
+	/* a row skipped by ON CONFLICT DO NOTHING is not inserted */
+	return changes > 0 ? slot : NULL;
+}
+
+
+TupleTableSlot *
+exec_foreignUpdate(EState *estate, ResultRelInfo *rinfo,
+                   TupleTableSlot *slot, TupleTableSlot *planSlot)
+{
+	SqliteFdwModifyState *fmstate = (SqliteFdwModifyState *) rinfo->ri_FdwState;
+	MemoryContext oldcontext = MemoryContextSwitchTo(fmstate->temp_cxt);
+	int			pindex;
+	int			changes;
+
+	pindex = bind_slotAttrs__(fmstate, slot, fmstate->target_attrs, 1);
+	bind_rowIdentity__(fmstate, planSlot, pindex);
+	changes = execute_modify__(fmstate, fmstate->stmt);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(fmstate->temp_cxt);
+
+	/* no row updated means nothing for the executor to count */
+	return changes > 0 ? slot : NULL;
+}
+
+
+TupleTableSlot *
+exec_foreignDelete(EState *estate, ResultRelInfo *rinfo,
+                   TupleTableSlot *slot, TupleTableSlot *planSlot)
+{
+	SqliteFdwModifyState *fmstate = (SqliteFdwModifyState *) rinfo->ri_FdwState;
+	MemoryContext oldcontext = MemoryContextSwitchTo(fmstate->temp_cxt);
+	int			changes;
+
+	bind_rowIdentity__(fmstate, planSlot, 1);
+	changes = execute_modify__(fmstate, fmstate->stmt);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(fmstate->temp_cxt);
+	return changes > 0 ? slot : NULL;
+}
+
+
+void
+end_foreignModify(EState *estate, ResultRelInfo *rinfo)
+{
+	/*
+	 * All rows are in; commit them in one go.  If anything failed before
+	 * we got here, the abort callbacks in connection.c roll back instead.
+	 */
+	SqliteFdwModifyState *fmstate = (SqliteFdwModifyState *) rinfo->ri_FdwState;
+
+	if (fmstate == NULL)
+		return;
+
+	flush_insertBatch__(fmstate);
+	if (fmstate->batch_stmt)
+		release_sqliteStatement(fmstate->db, fmstate->batch_stmt);
+	fmstate->batch_stmt = NULL;
+	release_sqliteStatement(fmstate->db, fmstate->stmt);
+	fmstate->stmt = NULL;
+	commit_sqliteTransaction(fmstate->db);
+	release_sqliteDbHandle(fmstate->db);
+	fmstate->db = NULL;
+}
+
+
+void
+explain_foreignModify(ModifyTableState *mtstate, ResultRelInfo *rinfo,
+                      List *fdw_private, int subplan_index,
+                      struct ExplainState *es)
+{
+	if (es->verbose)
+	{
+		int			batch_size = intVal(list_nth(fdw_private, 3));
+
+		ExplainPropertyText("sqlite query", strVal(list_nth(fdw_private, 0)),
+							es);
+		if (batch_size > 1)
+			ExplainPropertyInteger("sqlite batch size", batch_size, es);
+	}
+}
+
+
+bool
+plan_directModify(PlannerInfo *root, ModifyTable *plan,
+                  Index resultRelation, int subplan_index)
+{
+	/*
+	 * Decide whether the UPDATE or DELETE can be run as one sqlite
+	 * statement.  That takes a plain scan of the target table with every
+	 * condition shipped, and, for UPDATE, new values sqlite can compute.
+	 * If so, the scan is turned into the modification, and fdw_private
+	 * becomes
+	 *   0: the statement text
+	 *   1: whether to count the changed rows in es_processed
+	 */
+	CmdType		operation = plan->operation;
+	Plan	   *subplan;
+	RelOptInfo *foreignrel;
+	RangeTblEntry *rte;
+	SqliteFdwRelationInfo *fpinfo;
+	Relation	rel;
+	StringInfoData sql;
+	ForeignScan *fscan;
+	List	   *targetAttrs = NIL;
+	List	   *params_list = NIL;
+
+	if (operation != CMD_UPDATE && operation != CMD_DELETE)
+		return false;
+
+	/* RETURNING is refused by plan_foreignModify */
+	if (plan->returningLists)
+		return false;
+
+	/*
+	 * It's unsafe to modify a foreign table directly if there are any local
+	 * joins needed, or any quals that could not be shipped.
+	 */
+	subplan = (Plan *) list_nth(plan->plans, subplan_index);
+	if (!IsA(subplan, ForeignScan))
+		return false;
+	fscan = (ForeignScan *) subplan;
+	if (subplan->qual != NIL)
+		return false;
+	if (fscan->scan.scanrelid == 0)
+		return false;
+
+	foreignrel = root->simple_rel_array[resultRelation];
+	rte = root->simple_rte_array[resultRelation];
+	fpinfo = (SqliteFdwRelationInfo *) foreignrel->fdw_private;
+
+	/* plan_foreignModify refuses tables spread over many files */
+	if (fpinfo->src.shard_pattern)
+		return false;
+
+	/* Every new value has to be computable by sqlite */
+	if (operation == CMD_UPDATE)
+	{
+		int			col = -1;
+
+		while ((col = bms_next_member(rte->updatedCols, col)) >= 0)
+		{
+			AttrNumber	attno = col + FirstLowInvalidHeapAttributeNumber;
+			TargetEntry *tle;
+
+			if (attno <= InvalidAttrNumber)	/* shouldn't happen */
+				elog(ERROR, "system-column update is not supported");
+
+			tle = get_tle_by_resno(subplan->targetlist, attno);
+			if (!tle)
+				elog(ERROR, "attribute number %d not found in subplan targetlist",
+					 attno);
+
+			if (!is_foreign_expr(root, foreignrel, (Expr *) tle->expr))
+				return false;
+
+			targetAttrs = lappend_int(targetAttrs, attno);
+		}
+	}
+
+	/*
+	 * Core code already has some lock on each rel being planned, so we can
+	 * use NoLock here.
+	 */
+	rel = heap_open(rte->relid, NoLock);
+
+	initStringInfo(&sql);
+	if (operation == CMD_UPDATE)
+		deparseDirectUpdateSql(&sql, root, resultRelation, rel,
+							   subplan->targetlist, targetAttrs,
+							   fpinfo->final_remote_exprs, &params_list);
+	else
+		deparseDirectDeleteSql(&sql, root, resultRelation, rel,
+							   fpinfo->final_remote_exprs, &params_list);
+
+	heap_close(rel, NoLock);
+
+	/* Turn the scan into the modification */
+	fscan->operation = operation;
+	fscan->fdw_exprs = params_list;
+	fscan->fdw_private = list_make2(makeString(sql.data),
+									makeInteger(plan->canSetTag));
+
+	return true;
+}
+
+
+void
+begin_directModify(ForeignScanState *node, int eflags)
+{
+	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+	SqliteFdwDirectModifyState *dmstate;
+	SqliteTableSource src;
+
+	/* Do nothing in EXPLAIN (no ANALYZE) case; node->fdw_state stays NULL */
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	dmstate = (SqliteFdwDirectModifyState *)
+		palloc0(sizeof(SqliteFdwDirectModifyState));
+	dmstate->query = strVal(list_nth(fsplan->fdw_private, 0));
+	dmstate->set_processed = intVal(list_nth(fsplan->fdw_private, 1));
+	dmstate->param_exprs = ExecInitExprList(fsplan->fdw_exprs,
+											(PlanState *) node);
+	dmstate->num_changed = -1;
+
+	src = get_tableSource(RelationGetRelid(node->ss.ss_currentRelation));
+	dmstate->db = get_sqliteDbHandle(src.serverid, src.database);
+	PG_TRY();
+	{
+		begin_sqliteTransaction(dmstate->db);
+		dmstate->stmt = acquire_sqliteStatement(dmstate->db, dmstate->query);
+	}
+	PG_CATCH();
+	{
+		release_sqliteDbHandle(dmstate->db);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	node->fdw_state = dmstate;
+}
+
+
+/*
+ * Bind the parameters and run the statement.
+ */
+static void
+execute_directModify__(ForeignScanState *node)
+{
+	SqliteFdwDirectModifyState *dmstate =
+		(SqliteFdwDirectModifyState *) node->fdw_state;
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	List	   *fdw_exprs = ((ForeignScan *) node->ss.ps.plan)->fdw_exprs;
+	MemoryContext oldcontext =
+		MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+	ListCell   *lc;
+	ListCell   *lcf;
+	int			i = 1;
+	int			rc;
+
+	forboth(lc, dmstate->param_exprs, lcf, fdw_exprs)
+	{
+		ExprState  *expr_state = (ExprState *) lfirst(lc);
+		bool		isNull;
+		Datum		value = ExecEvalExpr(expr_state, econtext, &isNull);
+
+		sqlite_bind_param_value(dmstate->stmt, i++,
+								exprType((Node *) lfirst(lcf)),
+								value, isNull);
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	rc = sqlite3_step(dmstate->stmt);
+	if (rc != SQLITE_DONE)
+	{
+		int			code = sqlite3_extended_errcode(dmstate->db);
+		char	   *msg = pstrdup(sqlite3_errmsg(dmstate->db));
+
+		sqlite3_reset(dmstate->stmt);
+		check_sqliteInterrupt(code);
+		ereport(ERROR,
+			(errcode(sqlstate_for__(code)),
+			errmsg("sqlite failed to execute \"%s\": %s",
+                   dmstate->query, msg)
+			));
+	}
+	dmstate->num_changed = sqlite3_changes(dmstate->db);
+	sqlite3_reset(dmstate->stmt);
+}
+
+
+TupleTableSlot *
+iterate_directModify(ForeignScanState *node)
+{
+	/*
+	 * The statement runs on the first call, and there is never a row to
+	 * return since RETURNING is not supported.
+	 */
+	SqliteFdwDirectModifyState *dmstate =
+		(SqliteFdwDirectModifyState *) node->fdw_state;
+	EState	   *estate = node->ss.ps.state;
+	Instrumentation *instr = node->ss.ps.instrument;
+
+	if (dmstate->num_changed == -1)
+	{
+		execute_directModify__(node);
+
+		if (dmstate->set_processed)
+			estate->es_processed += dmstate->num_changed;
+		if (instr)
+			instr->tuplecount += dmstate->num_changed;
+	}
+
+	return ExecClearTuple(node->ss.ss_ScanTupleSlot);
+}
+
+
+void
+end_directModify(ForeignScanState *node)
+{
+	SqliteFdwDirectModifyState *dmstate =
+		(SqliteFdwDirectModifyState *) node->fdw_state;
+
+	if (dmstate == NULL)
+		return;
+
+	release_sqliteStatement(dmstate->db, dmstate->stmt);
+	dmstate->stmt = NULL;
+	commit_sqliteTransaction(dmstate->db);
+	release_sqliteDbHandle(dmstate->db);
+	dmstate->db = NULL;
+}
+
+
+void
+explain_directModify(ForeignScanState *node, struct ExplainState *es)
+{
+	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+
+	if (es->verbose)
+		ExplainPropertyText("sqlite query",
+							strVal(list_nth(fsplan->fdw_private, 0)), es);
 }
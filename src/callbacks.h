@@ -22,6 +22,46 @@ void end_foreignScan(ForeignScanState *node);
 void rescan_foreignScan(ForeignScanState *node);
 void explain_foreignScan(ForeignScanState *node, struct ExplainState *es);
 
+bool is_foreignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel,
+                                RangeTblEntry *rte);
+Size estimate_foreignScanDSM(ForeignScanState *node,
+                             struct ParallelContext *pcxt);
+void initialize_foreignScanDSM(ForeignScanState *node,
+                               struct ParallelContext *pcxt,
+                               void *coordinate);
+void reinitialize_foreignScanDSM(ForeignScanState *node,
+                                 struct ParallelContext *pcxt,
+                                 void *coordinate);
+void initialize_foreignScanWorker(ForeignScanState *node,
+                                  struct shm_toc *toc, void *coordinate);
+
+void add_foreignUpdateTargets(Query *parsetree, RangeTblEntry *target_rte,
+                              Relation target_relation);
+List * plan_foreignModify(PlannerInfo *root, ModifyTable *plan,
+                          Index resultRelation, int subplan_index);
+void begin_foreignModify(ModifyTableState *mtstate, ResultRelInfo *rinfo,
+                         List *fdw_private, int subplan_index, int eflags);
+TupleTableSlot * exec_foreignInsert(EState *estate, ResultRelInfo *rinfo,
+                                    TupleTableSlot *slot,
+                                    TupleTableSlot *planSlot);
+TupleTableSlot * exec_foreignUpdate(EState *estate, ResultRelInfo *rinfo,
+                                    TupleTableSlot *slot,
+                                    TupleTableSlot *planSlot);
+TupleTableSlot * exec_foreignDelete(EState *estate, ResultRelInfo *rinfo,
+                                    TupleTableSlot *slot,
+                                    TupleTableSlot *planSlot);
+void end_foreignModify(EState *estate, ResultRelInfo *rinfo);
+void explain_foreignModify(ModifyTableState *mtstate, ResultRelInfo *rinfo,
+                           List *fdw_private, int subplan_index,
+                           struct ExplainState *es);
+
+bool plan_directModify(PlannerInfo *root, ModifyTable *plan,
+                       Index resultRelation, int subplan_index);
+void begin_directModify(ForeignScanState *node, int eflags);
+TupleTableSlot * iterate_directModify(ForeignScanState *node);
+void end_directModify(ForeignScanState *node);
+void explain_directModify(ForeignScanState *node, struct ExplainState *es);
+
 List * import_foreignSchema(ImportForeignSchemaStmt *stmt, Oid serverOid);
 bool analyze_foreignTable(Relation relation, AcquireSampleRowsFunc *func,
                           BlockNumber *totalpages);
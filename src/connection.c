@@ -0,0 +1,1131 @@
+/*-------------------------------------------------------------------------
+ *
+ * connection.c
+ *	  Backend-lifespan cache of sqlite database handles.
+ *
+ * Opening a sqlite database is not free: the file has to be opened and
+ * locked, the schema parsed, and our collation and pattern matching
+ * functions registered.  Doing all of that for every scan makes short
+ * queries against foreign tables needlessly expensive, so we keep one
+ * handle per (server, database file) for the life of the backend.
+ *
+ * A cached handle is reopened when the server's options change or when the
+ * file on disk is replaced (different inode or modification time).  A handle
+ * is never reopened or closed while a scan is still using it; the check is
+ * deferred to the next time the handle is acquired.  The handles on the
+ * files of a sharded table are not kept, see close_sqliteDbHandle.
+ *
+ * Each connection also keeps a small LRU list of prepared statements keyed
+ * by query text, so that running the same deparsed query again (from a
+ * prepared statement or a PL/pgSQL loop, say) only costs a sqlite3_reset
+ * instead of a full parse and plan inside sqlite.  Its size is set by the
+ * statement_cache_size server option.
+ *
+ * The open mode (readonly, immutable), the files to attach, and the
+ * cache_size, mmap_size, temp_store, journal_mode and synchronous PRAGMAs
+ * of the server are applied once, when the handle is opened.  Without a
+ * cache_size, the page caches of the main and temp databases are kept
+ * work_mem in size, which also bounds sqlite's sorts (see memory.c).  The
+ * file of an immutable server is taken never to be replaced, so it is not
+ * checked for changes either.
+ *
+ * Writes to a foreign table run inside one sqlite transaction per
+ * PostgreSQL statement (BEGIN IMMEDIATE at the start of the modify node,
+ * COMMIT at its end), so sqlite syncs the file once per statement rather
+ * than once per row.  If the statement fails, or the (sub)transaction it
+ * ran in is aborted before that, the sqlite transaction is rolled back.
+ * Being committed at the end of the statement, the changes are not undone
+ * by a later ROLLBACK of the PostgreSQL transaction.  An INSERT with the
+ * commit_size option commits and begins again every so many rows; a
+ * failure then only rolls back the rows since.
+ *
+ * A progress handler on every connection stops sqlite, between two of its
+ * VM steps, once a cancel or termination of the backend (statement_timeout
+ * among them) is pending, so a long sort or join in sqlite does not hold
+ * up the interrupt until it returns a row.  The caller then sees
+ * SQLITE_INTERRUPT and throws the pending interrupt (check_sqliteInterrupt);
+ * the statements it interrupted are reset when the transaction aborts, and
+ * stay cached.
+ *
+ * The planner metadata of tables (see metadata.c) is cached with the
+ * connection too, and forgotten when the file is reopened or after we
+ * commit a write to it.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <postgres.h>
+#include <access/hash.h>
+#include <access/htup_details.h>
+#include <access/xact.h>
+#include <catalog/pg_foreign_server.h>
+#include <catalog/pg_type.h>
+#include <commands/defrem.h>
+#include <foreign/foreign.h>
+#include <funcapi.h>
+#include <lib/ilist.h>
+#include <miscadmin.h>
+#include <utils/builtins.h>
+#include <utils/hsearch.h>
+#include <utils/inval.h>
+#include <utils/memutils.h>
+#include <utils/syscache.h>
+#include <utils/tuplestore.h>
+
+#include <sys/stat.h>
+#include <sqlite3.h>
+
+#include "sqlite_private.h"
+
+
+/*
+ * Hash key for cached connections: the server together with the path of
+ * the database file it points at.
+ */
+typedef struct
+{
+	/* XXX we assume this struct contains no padding bytes */
+	Oid			serverid;
+	char		database[MAXPGPATH];
+} SqliteConnCacheKey;
+
+/*
+ * A statement prepared on a cached connection.  Statements handed out to a
+ * scan are marked in_use; a statement that is requested again while in use
+ * is prepared a second time.
+ */
+typedef struct
+{
+    dlist_node  node;           /* position in the connection's LRU list */
+    uint32      hash;           /* hash of the query text */
+    char       *query;
+    sqlite3_stmt *stmt;
+    bool        in_use;
+} SqliteStmtCacheEntry;
+
+/*
+ * The server options applied when a connection is opened.
+ */
+typedef struct
+{
+    int         stmt_cache_size;
+    bool        readonly;
+    bool        immutable;
+    bool        binary_collation;
+    List       *attach;         /* files to attach, DefElems alias => path */
+    char       *pragmas;        /* PRAGMAs to run on the new handle, or NULL */
+    bool        cache_size;     /* the cache_size option is set */
+} SqliteServerOptions;
+
+typedef struct
+{
+	SqliteConnCacheKey key;		/* hash key - must be first */
+	sqlite3    *db;				/* open handle, or NULL */
+	MemoryContext stmt_cxt;		/* holds the statement cache entries */
+	dlist_head	stmts;			/* most recently used first */
+	int			nstmts;			/* length of stmts */
+	int			stmt_cache_size;	/* statement_cache_size option */
+	bool		immutable;		/* immutable option: the file never changes */
+	int			cache_kb;		/* work_mem the page caches were sized by,
+								 * -1 if the cache_size option sizes them */
+	int64		stmt_hits;
+	int64		stmt_misses;
+	bool		last_db_hit;	/* latest get_sqliteDbHandle found it open */
+	bool		last_stmt_hit;	/* latest acquire_sqliteStatement was cached */
+	uint32		server_hashvalue;	/* hash of the pg_foreign_server entry */
+	bool		invalidated;	/* server options changed since open */
+	int			nusers;			/* scans currently holding the handle */
+	int64		opens;			/* number of times the file was opened */
+	int64		epoch;			/* changed when the file was opened and when
+								 * we committed a write, see
+								 * get_sqliteDataVersion */
+	dev_t		file_dev;		/* identity of the file when opened */
+	ino_t		file_ino;
+	time_t		file_mtime;
+	int			xact_depth;		/* nested begin_sqliteTransaction calls */
+	bool		xact_write;		/* one of them was for writing */
+	int			xact_level;		/* (sub)transaction nest level at BEGIN */
+	MemoryContext meta_cxt;		/* holds tables, or NULL */
+	List	   *tables;			/* SqliteTableInfo of tables planned for */
+} SqliteConnCacheEntry;
+
+
+static HTAB *ConnectionHash = NULL;
+static int64 last_epoch = 0;
+
+static void close_connection__(SqliteConnCacheEntry *entry);
+static bool is_fileUnchanged__(SqliteConnCacheEntry *entry);
+static void trim_stmtCache__(SqliteConnCacheEntry *entry, int size);
+static void reset_stmtCache__(SqliteConnCacheEntry *entry);
+static void rollback_transaction__(SqliteConnCacheEntry *entry);
+static void remember_fileIdentity__(SqliteConnCacheEntry *entry);
+static void forget_tableInfo__(SqliteConnCacheEntry *entry);
+
+
+/*
+ * Mark connections of an altered (or dropped) server as invalid, so they
+ * get reopened with the new options on next use.
+ */
+static void
+invalidate_connCache__(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS scan;
+	SqliteConnCacheEntry *entry;
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (SqliteConnCacheEntry *) hash_seq_search(&scan)) != NULL)
+	{
+		if (hashvalue == 0 || entry->server_hashvalue == hashvalue)
+			entry->invalidated = true;
+	}
+}
+
+
+/*
+ * Nobody can still be using a handle once the transaction that acquired it
+ * is over; forget about users that errored out before releasing theirs.
+ * The connections of servers that were altered or dropped are closed now
+ * rather than when next used, which for a dropped server would be never.
+ */
+static void
+xact_callback__(XactEvent event, void *arg)
+{
+	HASH_SEQ_STATUS scan;
+	SqliteConnCacheEntry *entry;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			break;
+		default:
+			return;
+	}
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (SqliteConnCacheEntry *) hash_seq_search(&scan)) != NULL)
+	{
+		entry->nusers = 0;
+		if (entry->invalidated)
+		{
+			close_connection__(entry);
+			hash_search(ConnectionHash, &entry->key, HASH_REMOVE, NULL);
+		}
+		else if (entry->db)
+		{
+			reset_stmtCache__(entry);
+			rollback_transaction__(entry);
+		}
+	}
+}
+
+
+/*
+ * A sqlite transaction begun inside a subtransaction that is being rolled
+ * back belongs to a statement that never reached its end.
+ */
+static void
+subxact_callback__(SubXactEvent event, SubTransactionId mySubid,
+				   SubTransactionId parentSubid, void *arg)
+{
+	HASH_SEQ_STATUS scan;
+	SqliteConnCacheEntry *entry;
+	int			level;
+
+	if (event != SUBXACT_EVENT_ABORT_SUB)
+		return;
+
+	level = GetCurrentTransactionNestLevel();
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (SqliteConnCacheEntry *) hash_seq_search(&scan)) != NULL)
+	{
+		if (entry->db && entry->xact_depth > 0 && entry->xact_level >= level)
+			rollback_transaction__(entry);
+	}
+}
+
+
+static void
+initialize_connCache__(void)
+{
+	HASHCTL		ctl;
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(SqliteConnCacheKey);
+	ctl.entrysize = sizeof(SqliteConnCacheEntry);
+	ConnectionHash =
+		hash_create("sqlite_fdw connections", 8, &ctl, HASH_ELEM | HASH_BLOBS);
+
+	CacheRegisterSyscacheCallback(FOREIGNSERVEROID,
+								  invalidate_connCache__,
+								  (Datum) 0);
+	RegisterXactCallback(xact_callback__, NULL);
+	RegisterSubXactCallback(subxact_callback__, NULL);
+}
+
+
+/*
+ * Wait for locks held by other connections for up to
+ * DEFAULT_BUSY_TIMEOUT milliseconds, but give up early when the query is
+ * cancelled.  We must not throw from inside sqlite, so the caller gets
+ * SQLITE_BUSY and checks for interrupts itself.
+ */
+static int
+busy_handler__(void *arg, int count)
+{
+    if (InterruptPending || count * 10 >= DEFAULT_BUSY_TIMEOUT)
+        return 0;
+    pg_usleep(10000L);
+    return 1;
+}
+
+
+/*
+ * Called by sqlite every SQLITE_PROGRESS_OPS VM steps; stops the statement
+ * when an interrupt is pending that CHECK_FOR_INTERRUPTS would act on.
+ * Like busy_handler__ it does not throw itself.
+ */
+static int
+progress_handler__(void *arg)
+{
+    if (InterruptHoldoffCount != 0 || CritSectionCount != 0)
+        return 0;
+    return ProcDiePending || (QueryCancelPending &&
+                              QueryCancelHoldoffCount == 0);
+}
+
+
+/*
+ * Throw the interrupt that progress_handler__ stopped a statement for, if
+ * rc, a result code of sqlite, says that it did.
+ */
+void
+check_sqliteInterrupt(int rc)
+{
+    if ((rc & 0xff) != SQLITE_INTERRUPT)
+        return;
+
+    CHECK_FOR_INTERRUPTS();
+    /* the interrupt was dealt with in the meantime, but we still stopped */
+	ereport(ERROR,
+		(errcode(ERRCODE_QUERY_CANCELED),
+		errmsg("canceling statement due to user request")
+		));
+}
+
+
+/*
+ * Run a statement that returns no rows, such as BEGIN or COMMIT.
+ */
+static void
+exec_sqliteCommand__(sqlite3 *db, char const *sql)
+{
+    char *err = NULL;
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK)
+    {
+        char *msg = pstrdup(err ? err : sqlite3_errmsg(db));
+
+        sqlite3_free(err);
+        CHECK_FOR_INTERRUPTS();
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			errmsg("sqlite \"%s\" failed: %s", sql, msg)
+			));
+    }
+}
+
+
+static void
+rollback_transaction__(SqliteConnCacheEntry *entry)
+{
+    if (entry->xact_depth > 0 && !sqlite3_get_autocommit(entry->db))
+    {
+        elog(DEBUG3, "sqlite_fdw: rolling back on %s", entry->key.database);
+        sqlite3_exec(entry->db, "ROLLBACK", NULL, NULL, NULL);
+    }
+    entry->xact_depth = 0;
+    entry->xact_write = false;
+}
+
+
+static void
+remember_fileIdentity__(SqliteConnCacheEntry *entry)
+{
+    struct stat st;
+
+    if (stat(entry->key.database, &st) == 0)
+    {
+        entry->file_dev = st.st_dev;
+        entry->file_ino = st.st_ino;
+        entry->file_mtime = st.st_mtime;
+    }
+}
+
+
+static void
+forget_tableInfo__(SqliteConnCacheEntry *entry)
+{
+    if (entry->meta_cxt)
+    {
+        MemoryContextDelete(entry->meta_cxt);
+        entry->meta_cxt = NULL;
+    }
+    entry->tables = NIL;
+}
+
+
+static void
+close_connection__(SqliteConnCacheEntry *entry)
+{
+    if (entry->db)
+    {
+        elog(DEBUG3, "sqlite_fdw: closing %s", entry->key.database);
+        /*
+         * Only closed once nobody uses it, so the statements still marked
+         * in use were left so by a scan that failed; finalize them all,
+         * or sqlite3_close_v2 would keep the handle open for them.
+         */
+        reset_stmtCache__(entry);
+        trim_stmtCache__(entry, 0);
+        rollback_transaction__(entry);
+        sqlite3_close_v2(entry->db);
+        entry->db = NULL;
+    }
+    if (entry->stmt_cxt)
+    {
+        MemoryContextDelete(entry->stmt_cxt);
+        entry->stmt_cxt = NULL;
+    }
+    forget_tableInfo__(entry);
+}
+
+
+/*
+ * Finalize unused statements, least recently used first, until at most
+ * size of them remain.  Statements that are in use are left alone.
+ */
+static void
+trim_stmtCache__(SqliteConnCacheEntry *entry, int size)
+{
+    dlist_node *cur;
+    dlist_node *prev;
+
+    for (cur = entry->stmts.head.prev;
+         cur != &entry->stmts.head && entry->nstmts > size;
+         cur = prev)
+    {
+        SqliteStmtCacheEntry *cached =
+            dlist_container(SqliteStmtCacheEntry, node, cur);
+
+        prev = cur->prev;
+        if (cached->in_use)
+            continue;
+
+        sqlite3_finalize(cached->stmt);
+        dlist_delete(&cached->node);
+        pfree(cached->query);
+        pfree(cached);
+        entry->nstmts--;
+    }
+}
+
+
+/*
+ * At transaction end every statement is released, whether its scan
+ * finished normally or not.
+ */
+static void
+reset_stmtCache__(SqliteConnCacheEntry *entry)
+{
+    dlist_iter iter;
+
+    dlist_foreach(iter, &entry->stmts)
+    {
+        SqliteStmtCacheEntry *cached =
+            dlist_container(SqliteStmtCacheEntry, node, iter.cur);
+
+        if (cached->in_use)
+        {
+            sqlite3_reset(cached->stmt);
+            sqlite3_clear_bindings(cached->stmt);
+            cached->in_use = false;
+        }
+    }
+    trim_stmtCache__(entry, entry->stmt_cache_size);
+}
+
+
+/*
+ * The server options that shape its connections.  The PRAGMAs are
+ * collected into one string to run on every new connection.
+ */
+static SqliteServerOptions
+get_serverOptions__(Oid serverid)
+{
+    ForeignServer *server = GetForeignServer(serverid);
+    SqliteServerOptions opts = {0};
+    StringInfoData pragmas;
+    ListCell *lc;
+
+    opts.stmt_cache_size = DEFAULT_STATEMENT_CACHE_SIZE;
+    initStringInfo(&pragmas);
+
+    foreach(lc, server->options)
+    {
+        DefElem *def = (DefElem *) lfirst(lc);
+
+        if (strcmp(def->defname, "statement_cache_size") == 0)
+            opts.stmt_cache_size = atoi(defGetString(def));
+        else if (strcmp(def->defname, "readonly") == 0)
+            opts.readonly = defGetBoolean(def);
+        else if (strcmp(def->defname, "immutable") == 0)
+            opts.immutable = defGetBoolean(def);
+        else if (strcmp(def->defname, "binary_collation") == 0)
+            opts.binary_collation = defGetBoolean(def);
+        else if (strcmp(def->defname, "attach") == 0)
+            opts.attach = parse_sqliteAttachOption(defGetString(def));
+        else if (strcmp(def->defname, "cache_size") == 0 ||
+                 strcmp(def->defname, "mmap_size") == 0 ||
+                 strcmp(def->defname, "temp_store") == 0 ||
+                 strcmp(def->defname, "journal_mode") == 0 ||
+                 strcmp(def->defname, "synchronous") == 0)
+        {
+            /* the validator has made sure the value is a plain word */
+            appendStringInfo(&pragmas, "PRAGMA %s = %s; ",
+                             def->defname, defGetString(def));
+            opts.cache_size |= strcmp(def->defname, "cache_size") == 0;
+        }
+    }
+
+    opts.pragmas = pragmas.len > 0 ? pragmas.data : NULL;
+    return opts;
+}
+
+
+/*
+ * Close the handle just opened for entry, which could not be set up as
+ * the server wants, and report why.
+ */
+static void
+abandon_connection__(SqliteConnCacheEntry *entry, char const *detail)
+{
+    char *msg = pstrdup(sqlite3_errmsg(entry->db));
+
+    sqlite3_close(entry->db);
+    entry->db = NULL;
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_ERROR),
+        errmsg("Failed to set up sqlite database %s: %s",
+               entry->key.database, msg),
+        errdetail("%s", detail)
+        ));
+}
+
+
+static SqliteConnCacheEntry *
+find_connection__(sqlite3 *db)
+{
+    HASH_SEQ_STATUS scan;
+    SqliteConnCacheEntry *entry;
+
+    if (!db || !ConnectionHash)
+        return NULL;
+
+    hash_seq_init(&scan, ConnectionHash);
+    while ((entry = (SqliteConnCacheEntry *) hash_seq_search(&scan)) != NULL)
+    {
+        if (entry->db == db)
+        {
+            hash_seq_term(&scan);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * True when the database file is still the one we opened.  A file that
+ * has since disappeared counts as changed; reopening it will then report
+ * a proper error.
+ */
+static bool
+is_fileUnchanged__(SqliteConnCacheEntry *entry)
+{
+    struct stat st;
+
+    /* we have been promised so */
+    if (entry->immutable)
+        return true;
+
+    if (stat(entry->key.database, &st) != 0)
+        return false;
+    return st.st_dev == entry->file_dev &&
+           st.st_ino == entry->file_ino &&
+           st.st_mtime == entry->file_mtime;
+}
+
+
+/*
+ * Return a handle on the given database for the given server, opening it
+ * if there is no usable cached one.  Must be paired with a call to
+ * release_sqliteDbHandle.
+ */
+sqlite3 *
+get_sqliteDbHandle(Oid serverid, char const *database)
+{
+    SqliteConnCacheKey key;
+    SqliteConnCacheEntry *entry;
+    bool found;
+
+    if (strlen(database) >= MAXPGPATH)
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			errmsg("sqlite database path is too long: %s", database)
+			));
+
+    if (!ConnectionHash)
+        initialize_connCache__();
+
+    MemSet(&key, 0, sizeof(key));
+    key.serverid = serverid;
+    strlcpy(key.database, database, MAXPGPATH);
+
+    entry = (SqliteConnCacheEntry *)
+        hash_search(ConnectionHash, &key, HASH_ENTER, &found);
+    if (!found)
+    {
+        entry->db = NULL;
+        entry->stmt_cxt = NULL;
+        entry->meta_cxt = NULL;
+        entry->tables = NIL;
+        entry->nusers = 0;
+        entry->opens = 0;
+        entry->stmt_hits = 0;
+        entry->stmt_misses = 0;
+        entry->last_stmt_hit = false;
+        entry->xact_depth = 0;
+        entry->xact_write = false;
+    }
+
+    if (entry->db && entry->nusers == 0 &&
+        (entry->invalidated || !is_fileUnchanged__(entry)))
+        close_connection__(entry);
+
+    entry->last_db_hit = entry->db != NULL;
+    if (!entry->db)
+    {
+        SqliteServerOptions opts = get_serverOptions__(serverid);
+        ListCell *lc;
+
+        entry->invalidated = false;
+        entry->nusers = 0;
+        entry->server_hashvalue =
+            GetSysCacheHashValue1(FOREIGNSERVEROID,
+                                  ObjectIdGetDatum(serverid));
+        entry->stmt_cache_size = opts.stmt_cache_size;
+        entry->immutable = opts.immutable;
+        entry->db = open_sqliteDb(database, opts.readonly, opts.immutable,
+                                 opts.binary_collation);
+        entry->opens++;
+        entry->epoch = ++last_epoch;
+        entry->xact_depth = 0;
+        sqlite3_busy_handler(entry->db, busy_handler__, NULL);
+        sqlite3_progress_handler(entry->db, SQLITE_PROGRESS_OPS,
+                                 progress_handler__, NULL);
+        /* sqlite must not call our allocator from threads of its own */
+        sqlite3_limit(entry->db, SQLITE_LIMIT_WORKER_THREADS, 0);
+        foreach(lc, opts.attach)
+        {
+            DefElem *def = (DefElem *) lfirst(lc);
+
+            if (!attach_sqliteDb(entry->db, def->defname, defGetString(def),
+                                 opts.immutable))
+                abandon_connection__(entry,
+                    psprintf("Attaching %s as %s.", defGetString(def),
+                             def->defname));
+        }
+        if (opts.pragmas &&
+            sqlite3_exec(entry->db, opts.pragmas, NULL, NULL, NULL) != SQLITE_OK)
+            abandon_connection__(entry,
+                psprintf("The statements were: %s", opts.pragmas));
+
+        entry->stmt_cxt = AllocSetContextCreate(TopMemoryContext,
+                                                "sqlite_fdw statement cache",
+                                                ALLOCSET_SMALL_SIZES);
+        dlist_init(&entry->stmts);
+        entry->nstmts = 0;
+        entry->cache_kb = opts.cache_size ? -1 : 0;
+        remember_fileIdentity__(entry);
+    }
+
+    /* work_mem may have been SET since we last looked */
+    if (entry->cache_kb >= 0 && entry->cache_kb != work_mem)
+    {
+        char *sql = psprintf("PRAGMA main.cache_size = -%d; "
+                             "PRAGMA temp.cache_size = -%d", work_mem,
+                             work_mem);
+
+        exec_sqliteCommand__(entry->db, sql);
+        pfree(sql);
+        entry->cache_kb = work_mem;
+    }
+
+    entry->nusers++;
+    return entry->db;
+}
+
+
+/*
+ * Give back a handle obtained from get_sqliteDbHandle.  The handle stays
+ * open in the cache.
+ */
+void
+release_sqliteDbHandle(sqlite3 *db)
+{
+    SqliteConnCacheEntry *entry = find_connection__(db);
+
+    if (entry && entry->nusers > 0)
+        entry->nusers--;
+}
+
+
+/*
+ * Give back a handle obtained from get_sqliteDbHandle, and close it unless
+ * it is still in use.  The files of a sharded table, which may be far too
+ * many to keep open, are read on handles given back this way.
+ */
+void
+close_sqliteDbHandle(sqlite3 *db)
+{
+    SqliteConnCacheEntry *entry = find_connection__(db);
+
+    if (!entry)
+        return;
+    if (entry->nusers > 0)
+        entry->nusers--;
+    if (entry->nusers == 0 && entry->xact_depth == 0)
+    {
+        close_connection__(entry);
+        hash_search(ConnectionHash, &entry->key, HASH_REMOVE, NULL);
+    }
+}
+
+
+/*
+ * Return a prepared statement for query on a handle obtained from
+ * get_sqliteDbHandle, reusing a cached one when it is not already in use.
+ * Must be paired with a call to release_sqliteStatement.
+ */
+sqlite3_stmt *
+acquire_sqliteStatement(sqlite3 *db, char const *query)
+{
+    SqliteConnCacheEntry *entry = find_connection__(db);
+    SqliteStmtCacheEntry *cached;
+    sqlite3_stmt *stmt;
+    uint32 hash;
+    dlist_iter iter;
+
+    if (!entry)
+        return prepare_sqliteQuery(db, (char *) query, NULL);
+
+    hash = DatumGetUInt32(hash_any((unsigned char const *) query,
+                                   strlen(query)));
+    dlist_foreach(iter, &entry->stmts)
+    {
+        cached = dlist_container(SqliteStmtCacheEntry, node, iter.cur);
+        if (!cached->in_use && cached->hash == hash &&
+            strcmp(cached->query, query) == 0)
+        {
+            dlist_move_head(&entry->stmts, &cached->node);
+            cached->in_use = true;
+            entry->stmt_hits++;
+            entry->last_stmt_hit = true;
+            return cached->stmt;
+        }
+    }
+
+    entry->stmt_misses++;
+    entry->last_stmt_hit = false;
+    stmt = prepare_sqliteQuery(db, (char *) query, NULL);
+    if (entry->stmt_cache_size == 0)
+        return stmt;
+
+    cached = (SqliteStmtCacheEntry *)
+        MemoryContextAlloc(entry->stmt_cxt, sizeof(SqliteStmtCacheEntry));
+    cached->hash = hash;
+    cached->query = MemoryContextStrdup(entry->stmt_cxt, query);
+    cached->stmt = stmt;
+    cached->in_use = true;
+    dlist_push_head(&entry->stmts, &cached->node);
+    entry->nstmts++;
+    trim_stmtCache__(entry, entry->stmt_cache_size);
+
+    return stmt;
+}
+
+
+/*
+ * Whether the latest get_sqliteDbHandle for db found it open already, and
+ * whether the latest acquire_sqliteStatement on it found the statement in
+ * the cache.  For EXPLAIN ANALYZE.
+ */
+void
+get_sqliteCacheHits(sqlite3 *db, bool *db_hit, bool *stmt_hit)
+{
+    SqliteConnCacheEntry *entry = find_connection__(db);
+
+    *db_hit = entry && entry->last_db_hit;
+    *stmt_hit = entry && entry->last_stmt_hit;
+}
+
+
+/*
+ * Hand back a statement obtained from acquire_sqliteStatement.  Cached
+ * statements are reset and kept; anything else is finalized.
+ */
+void
+release_sqliteStatement(sqlite3 *db, sqlite3_stmt *stmt)
+{
+    SqliteConnCacheEntry *entry = find_connection__(db);
+    dlist_iter iter;
+
+    if (!stmt)
+        return;
+
+    if (entry)
+    {
+        dlist_foreach(iter, &entry->stmts)
+        {
+            SqliteStmtCacheEntry *cached =
+                dlist_container(SqliteStmtCacheEntry, node, iter.cur);
+
+            if (cached->stmt == stmt)
+            {
+                sqlite3_reset(stmt);
+                sqlite3_clear_bindings(stmt);
+                cached->in_use = false;
+                trim_stmtCache__(entry, entry->stmt_cache_size);
+                return;
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+
+static void
+begin_transaction__(sqlite3 *db, char const *command)
+{
+    SqliteConnCacheEntry *entry = find_connection__(db);
+
+    if (!entry)
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			errmsg("sqlite handle is not a cached connection")
+			));
+
+    if (entry->xact_depth == 0)
+    {
+        exec_sqliteCommand__(db, command);
+        entry->xact_level = GetCurrentTransactionNestLevel();
+    }
+    entry->xact_depth++;
+}
+
+
+/*
+ * Start a write transaction on a handle obtained from get_sqliteDbHandle.
+ * Calls nest; only the outermost one issues BEGIN IMMEDIATE, which takes
+ * the write lock up front so that a concurrent writer makes us wait here
+ * rather than fail halfway through the statement.  Nested in a read
+ * transaction, the write lock is only taken by the first write.
+ */
+void
+begin_sqliteTransaction(sqlite3 *db)
+{
+    begin_transaction__(db, "BEGIN IMMEDIATE");
+    find_connection__(db)->xact_write = true;
+}
+
+
+/*
+ * Start a read transaction on a handle obtained from get_sqliteDbHandle,
+ * so that all the statements run on it until commit_sqliteTransaction
+ * read the same state of the file, as sqlite otherwise only promises for
+ * the lifetime of each statement.  It nests with begin_sqliteTransaction.
+ * The outermost call issues a plain BEGIN, which takes no lock until the
+ * first read.
+ */
+void
+begin_sqliteReadTransaction(sqlite3 *db)
+{
+    begin_transaction__(db, "BEGIN");
+}
+
+
+/*
+ * Finish a transaction started by begin_sqliteTransaction or
+ * begin_sqliteReadTransaction; the outermost call commits.  A failed
+ * COMMIT (say, readers still holding the file after the busy timeout)
+ * rolls everything back.
+ */
+void
+commit_sqliteTransaction(sqlite3 *db)
+{
+    SqliteConnCacheEntry *entry = find_connection__(db);
+
+    if (!entry || entry->xact_depth == 0)
+        return;
+
+    if (--entry->xact_depth > 0)
+        return;
+
+    PG_TRY();
+    {
+        exec_sqliteCommand__(db, "COMMIT");
+    }
+    PG_CATCH();
+    {
+        entry->xact_depth = 1;
+        rollback_transaction__(entry);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    if (!entry->xact_write)
+        return;
+    entry->xact_write = false;
+
+    /* our own write is no reason to reopen the file */
+    remember_fileIdentity__(entry);
+    entry->epoch = ++last_epoch;
+
+    /* but the row counts may have moved */
+    forget_tableInfo__(entry);
+}
+
+
+/*
+ * Planner metadata of table (in the attached database schema, if not
+ * NULL), as seen through a handle obtained from get_sqliteDbHandle.  It
+ * is loaded on first use and then kept with the connection.
+ */
+SqliteTableInfo *
+get_sqliteTableInfo(sqlite3 *db, char const *schema, char const *table)
+{
+    SqliteConnCacheEntry *entry = find_connection__(db);
+    SqliteTableInfo *info;
+    MemoryContext oldcontext;
+    ListCell *lc;
+
+    if (!entry)
+        return load_sqliteTableInfo(db, schema, table);
+
+    foreach(lc, entry->tables)
+    {
+        info = (SqliteTableInfo *) lfirst(lc);
+        if (strcmp(info->table, table) == 0 &&
+            (info->schema && schema ? strcmp(info->schema, schema) == 0
+                                    : info->schema == schema))
+            return info;
+    }
+
+    if (!entry->meta_cxt)
+        entry->meta_cxt = AllocSetContextCreate(TopMemoryContext,
+                                                "sqlite_fdw table metadata",
+                                                ALLOCSET_SMALL_SIZES);
+    oldcontext = MemoryContextSwitchTo(entry->meta_cxt);
+    info = load_sqliteTableInfo(db, schema, table);
+    entry->tables = lappend(entry->tables, info);
+    MemoryContextSwitchTo(oldcontext);
+
+    return info;
+}
+
+
+/*
+ * Tell when the data seen through a handle obtained from get_sqliteDbHandle
+ * may have changed: *epoch moves when we reopen the file or commit a write
+ * to it, *data_version (PRAGMA data_version) when another connection
+ * commits one.  The file of an immutable server never changes.
+ */
+void
+get_sqliteDataVersion(sqlite3 *db, int64 *epoch, int *data_version)
+{
+    SqliteConnCacheEntry *entry = find_connection__(db);
+    sqlite3_stmt *stmt = NULL;
+
+    *epoch = entry ? entry->epoch : 0;
+    *data_version = 0;
+    if (entry && entry->immutable)
+        return;
+
+    if (sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &stmt,
+                           NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW)
+        *data_version = sqlite3_column_int(stmt, 0);
+    else
+        *epoch = -1;    /* we cannot tell, so take it to have changed */
+    sqlite3_finalize(stmt);
+}
+
+
+/*
+ * Close cached connections of the given server, or of all servers when
+ * serverid is InvalidOid.  Returns true if anything was closed.
+ */
+static bool
+disconnect_cached__(Oid serverid)
+{
+    HASH_SEQ_STATUS scan;
+    SqliteConnCacheEntry *entry;
+    bool result = false;
+
+    if (!ConnectionHash)
+        return false;
+
+    hash_seq_init(&scan, ConnectionHash);
+    while ((entry = (SqliteConnCacheEntry *) hash_seq_search(&scan)) != NULL)
+    {
+        if (OidIsValid(serverid) && entry->key.serverid != serverid)
+            continue;
+
+        if (entry->nusers > 0)
+        {
+            ereport(WARNING,
+                    (errmsg("cannot close sqlite connection to %s because it is still in use",
+                            entry->key.database)));
+            continue;
+        }
+
+        if (entry->db)
+            result = true;
+        close_connection__(entry);
+        if (hash_search(ConnectionHash, &entry->key, HASH_REMOVE, NULL) == NULL)
+            elog(ERROR, "hash table corrupted");
+    }
+    return result;
+}
+
+
+static char *
+get_serverName__(Oid serverid)
+{
+    HeapTuple tup = SearchSysCache1(FOREIGNSERVEROID,
+                                    ObjectIdGetDatum(serverid));
+    char *name = NULL;
+
+    if (HeapTupleIsValid(tup))
+    {
+        name = pstrdup(NameStr(((Form_pg_foreign_server) GETSTRUCT(tup))->srvname));
+        ReleaseSysCache(tup);
+    }
+    return name;
+}
+
+
+/*
+ * SQL functions
+ */
+PG_FUNCTION_INFO_V1(sqlite_fdw_get_connections);
+PG_FUNCTION_INFO_V1(sqlite_fdw_disconnect);
+PG_FUNCTION_INFO_V1(sqlite_fdw_disconnect_all);
+
+#define SQLITE_FDW_GET_CONNECTIONS_COLS 8
+
+/*
+ * List the connections cached by this backend, one row per database file.
+ */
+Datum
+sqlite_fdw_get_connections(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS scan;
+	SqliteConnCacheEntry *entry;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+    if (ConnectionHash)
+    {
+        hash_seq_init(&scan, ConnectionHash);
+        while ((entry = (SqliteConnCacheEntry *) hash_seq_search(&scan)) != NULL)
+        {
+            Datum values[SQLITE_FDW_GET_CONNECTIONS_COLS];
+            bool nulls[SQLITE_FDW_GET_CONNECTIONS_COLS];
+            char *server_name;
+
+            if (!entry->db)
+                continue;
+
+            MemSet(nulls, 0, sizeof(nulls));
+            server_name = get_serverName__(entry->key.serverid);
+            if (server_name)
+                values[0] = CStringGetTextDatum(server_name);
+            else
+                nulls[0] = true;
+            values[1] = CStringGetTextDatum(entry->key.database);
+            values[2] = BoolGetDatum(!entry->invalidated &&
+                                     is_fileUnchanged__(entry));
+            values[3] = BoolGetDatum(entry->nusers > 0);
+            values[4] = Int64GetDatum(entry->opens);
+            values[5] = Int32GetDatum(entry->nstmts);
+            values[6] = Int64GetDatum(entry->stmt_hits);
+            values[7] = Int64GetDatum(entry->stmt_misses);
+
+            tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+        }
+    }
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+
+/*
+ * Close the cached connections of the named server.
+ */
+Datum
+sqlite_fdw_disconnect(PG_FUNCTION_ARGS)
+{
+    ForeignServer *server = GetForeignServerByName(
+                                text_to_cstring(PG_GETARG_TEXT_PP(0)), false);
+
+    PG_RETURN_BOOL(disconnect_cached__(server->serverid));
+}
+
+
+/*
+ * Close all cached connections.
+ */
+Datum
+sqlite_fdw_disconnect_all(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(disconnect_cached__(InvalidOid));
+}
@@ -0,0 +1,686 @@
+/*-------------------------------------------------------------------------
+ *
+ * decode.c
+ *	  Turning sqlite column values into PostgreSQL datums.
+ *
+ * What a sqlite value means depends on two things: its storage class
+ * (integer, real, text or blob, decided per value) and the PostgreSQL type
+ * of the column it lands in (decided once per scan).  Rather than switching
+ * on both for every value, get_pgTypeInputTraits resolves, for every column,
+ * a decoder function per storage class.  make_datum then only has to look
+ * up the value's storage class.
+ *
+ * Types with a cheap native representation get a direct decoder; the rest
+ * fall back to the type's input function, called through an FmgrInfo that
+ * is looked up once.
+ *
+ * Dates and timestamps may be stored in any of the three encodings sqlite's
+ * own date functions understand: ISO-8601 text, an integer count of seconds
+ * since the unix epoch, or a real julian day number.
+ *
+ * A row's ctid is its sqlite rowid, split into the block number (all but
+ * the low 15 bits) and offset (the low 15 bits, plus one) of an item
+ * pointer; see rowid_to_itemPointer.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <postgres.h>
+#include <access/htup_details.h>
+#include <catalog/pg_type.h>
+#include <datatype/timestamp.h>
+#include <storage/itemptr.h>
+#include <utils/builtins.h>
+#include <utils/date.h>
+#include <utils/datetime.h>
+#include <utils/jsonapi.h>
+#include <utils/lsyscache.h>
+#include <utils/syscache.h>
+#include <utils/timestamp.h>
+#include <utils/uuid.h>
+
+#include <limits.h>
+#include <math.h>
+#include <sqlite3.h>
+
+#include "sqlite_private.h"
+
+
+/* decode[] is indexed by sqlite storage class */
+#define DECODER_INDEX(type)   ((type) - SQLITE_INTEGER)
+
+/* unix epoch seconds beyond this are out of range for any of our types */
+#define MAX_EPOCH_SECONDS     INT64CONST(300000000000)
+
+
+static Datum
+decode_viaCString__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    return InputFunctionCall(&traits->input_fn,
+                             (char *) sqlite3_column_text(stmt, col),
+                             traits->typioparam,
+                             traits->typmod);
+}
+
+
+static Datum
+decode_bool__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    return BoolGetDatum(sqlite3_column_int(stmt, col) > 0);
+}
+
+
+static Datum
+decode_int8__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    return Int64GetDatum(sqlite3_column_int64(stmt, col));
+}
+
+
+static Datum
+decode_int4__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    return Int32GetDatum(sqlite3_column_int(stmt, col));
+}
+
+
+static Datum
+decode_int2__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    return Int16GetDatum(sqlite3_column_int(stmt, col));
+}
+
+
+static Datum
+decode_char__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    return CharGetDatum((char) sqlite3_column_int(stmt, col));
+}
+
+
+static Datum
+decode_float4__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    return Float4GetDatum((float) sqlite3_column_double(stmt, col));
+}
+
+
+static Datum
+decode_float8__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    return Float8GetDatum(sqlite3_column_double(stmt, col));
+}
+
+
+static Datum
+apply_numericTypmod__(Datum value, PgTypeInputTraits *traits)
+{
+    if (traits->typmod < 0)
+        return value;
+    return DirectFunctionCall2(numeric, value, Int32GetDatum(traits->typmod));
+}
+
+
+static Datum
+decode_intNumeric__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    Datum value = DirectFunctionCall1(int8_numeric,
+                        Int64GetDatum(sqlite3_column_int64(stmt, col)));
+    return apply_numericTypmod__(value, traits);
+}
+
+
+static Datum
+decode_floatNumeric__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    Datum value = DirectFunctionCall1(float8_numeric,
+                        Float8GetDatum(sqlite3_column_double(stmt, col)));
+    return apply_numericTypmod__(value, traits);
+}
+
+
+/*
+ * text, varchar and bpchar share the varlena layout, so the value can be
+ * built straight from sqlite's buffer.  A length limit still has to go
+ * through the type's length coercion function.
+ */
+static Datum
+decode_text__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    char const *str = (char const *) sqlite3_column_text(stmt, col);
+    Datum value = PointerGetDatum(
+                    cstring_to_text_with_len(str,
+                                             sqlite3_column_bytes(stmt, col)));
+
+    if (traits->typmod < 0)
+        return value;
+    if (traits->pgtyp == BPCHAROID)
+        return DirectFunctionCall3(bpchar, value,
+                                   Int32GetDatum(traits->typmod),
+                                   BoolGetDatum(false));
+    return DirectFunctionCall3(varchar, value,
+                               Int32GetDatum(traits->typmod),
+                               BoolGetDatum(false));
+}
+
+
+static Datum
+decode_bytea__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    int len = sqlite3_column_bytes(stmt, col);
+    bytea *blob = (bytea *) palloc(len + VARHDRSZ);
+
+    memcpy(VARDATA(blob), sqlite3_column_blob(stmt, col), len);
+    SET_VARSIZE(blob, len + VARHDRSZ);
+    return PointerGetDatum(blob);
+}
+
+
+/*
+ * json is stored as its text, so all json_in adds is a validation pass;
+ * run that on sqlite's buffer without the cstring round trip.
+ */
+static Datum
+decode_json__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    char *str = (char *) sqlite3_column_text(stmt, col);
+    int len = sqlite3_column_bytes(stmt, col);
+    JsonSemAction sem;
+    JsonLexContext *lex;
+
+    memset(&sem, 0, sizeof(sem));
+    lex = makeJsonLexContextCstringLen(str, len, false);
+    pg_parse_json(lex, &sem);
+
+    return PointerGetDatum(cstring_to_text_with_len(str, len));
+}
+
+
+static int
+hexValue__(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+
+/*
+ * Canonical xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx text is decoded here;
+ * any other spelling uuid_in accepts is left to it.
+ */
+static Datum
+decode_textUuid__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    char const *str = (char const *) sqlite3_column_text(stmt, col);
+    pg_uuid_t *uuid;
+    int i;
+    int j = 0;
+
+    if (sqlite3_column_bytes(stmt, col) != 36 ||
+        str[8] != '-' || str[13] != '-' || str[18] != '-' || str[23] != '-')
+        return decode_viaCString__(stmt, col, traits);
+
+    uuid = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+    for (i = 0; i < UUID_LEN; i++)
+    {
+        int hi, lo;
+
+        if (j == 8 || j == 13 || j == 18 || j == 23)
+            j++;
+        hi = hexValue__(str[j]);
+        lo = hexValue__(str[j + 1]);
+        if (hi < 0 || lo < 0)
+        {
+            pfree(uuid);
+            return decode_viaCString__(stmt, col, traits);
+        }
+        uuid->data[i] = (unsigned char) (hi << 4 | lo);
+        j += 2;
+    }
+    return UUIDPGetDatum(uuid);
+}
+
+
+static Datum
+decode_blobUuid__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    pg_uuid_t *uuid;
+
+    if (sqlite3_column_bytes(stmt, col) != UUID_LEN)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+			errmsg("sqlite blob of %d bytes is not a uuid",
+                   sqlite3_column_bytes(stmt, col))
+			));
+
+    uuid = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+    memcpy(uuid->data, sqlite3_column_blob(stmt, col), UUID_LEN);
+    return UUIDPGetDatum(uuid);
+}
+
+
+static int
+parse_digits__(char const *s, int n)
+{
+    int value = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (s[i] < '0' || s[i] > '9')
+            return -1;
+        value = value * 10 + (s[i] - '0');
+    }
+    return value;
+}
+
+
+/*
+ * Parse the "YYYY-MM-DD[ HH:MM[:SS[.ffffff]]]" text written by sqlite's
+ * date and time functions (a 'T' separator is allowed as well), into a
+ * day number relative to the PostgreSQL epoch and a time of day.  Return
+ * false for anything else, such as a time zone or BC suffix, and let the
+ * type's input function deal with it.
+ */
+static bool
+parse_isoDatetime__(char const *s, int len, int *date, int64 *tod,
+                    bool *has_time)
+{
+    int year, month, day;
+    int hour = 0, minute = 0, second = 0;
+    int64 fraction = 0;
+    int pos;
+
+    if (len < 10 || s[4] != '-' || s[7] != '-')
+        return false;
+    year = parse_digits__(s, 4);
+    month = parse_digits__(s + 5, 2);
+    day = parse_digits__(s + 8, 2);
+    if (year < 1 || month < 1 || month > 12 || day < 1 ||
+        day > day_tab[isleap(year)][month - 1])
+        return false;
+
+    *has_time = len > 10;
+    if (*has_time)
+    {
+        if (len < 16 || (s[10] != ' ' && s[10] != 'T') || s[13] != ':')
+            return false;
+        hour = parse_digits__(s + 11, 2);
+        minute = parse_digits__(s + 14, 2);
+        pos = 16;
+        if (pos < len && s[pos] == ':')
+        {
+            if (len < pos + 3)
+                return false;
+            second = parse_digits__(s + pos + 1, 2);
+            pos += 3;
+            if (pos < len && s[pos] == '.')
+            {
+                int ndigits = 0;
+                int64 scale = USECS_PER_SEC;
+
+                for (pos++; pos < len && s[pos] >= '0' && s[pos] <= '9'; pos++)
+                {
+                    if (++ndigits > 6)
+                        return false;
+                    scale /= 10;
+                    fraction += (s[pos] - '0') * scale;
+                }
+                if (ndigits == 0)
+                    return false;
+            }
+        }
+        if (pos != len || hour < 0 || hour > 23 ||
+            minute < 0 || minute > 59 || second < 0 || second > 59)
+            return false;
+    }
+
+    *date = date2j(year, month, day) - POSTGRES_EPOCH_JDATE;
+    *tod = ((hour * MINS_PER_HOUR + minute) * SECS_PER_MINUTE + second) *
+            USECS_PER_SEC + fraction;
+    return true;
+}
+
+
+static Datum
+make_timestampDatum__(Timestamp ts, PgTypeInputTraits *traits)
+{
+    if (!IS_VALID_TIMESTAMP(ts))
+		ereport(ERROR,
+			(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+			errmsg("timestamp out of range")
+			));
+
+    if (traits->typmod < 0)
+        return TimestampGetDatum(ts);
+    if (traits->pgtyp == TIMESTAMPTZOID)
+        return DirectFunctionCall2(timestamptz_scale, TimestampTzGetDatum(ts),
+                                   Int32GetDatum(traits->typmod));
+    return DirectFunctionCall2(timestamp_scale, TimestampGetDatum(ts),
+                               Int32GetDatum(traits->typmod));
+}
+
+
+static Datum
+make_dateDatum__(int64 julian)
+{
+    int year, month, day;
+
+    if (julian < 0 || julian > INT_MAX)
+		ereport(ERROR,
+			(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+			errmsg("date out of range")
+			));
+    j2date((int) julian, &year, &month, &day);
+    if (!IS_VALID_JULIAN(year, month, day))
+		ereport(ERROR,
+			(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+			errmsg("date out of range")
+			));
+    return DateADTGetDatum((DateADT) (julian - POSTGRES_EPOCH_JDATE));
+}
+
+
+/* Text timestamps carry no zone, so this is for timestamp without one */
+static Datum
+decode_isoTimestamp__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    int date;
+    int64 tod;
+    bool has_time;
+
+    if (!parse_isoDatetime__((char const *) sqlite3_column_text(stmt, col),
+                             sqlite3_column_bytes(stmt, col),
+                             &date, &tod, &has_time))
+        return decode_viaCString__(stmt, col, traits);
+
+    return make_timestampDatum__(date * USECS_PER_DAY + tod, traits);
+}
+
+
+static Datum
+decode_isoDate__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    int date;
+    int64 tod;
+    bool has_time;
+
+    if (!parse_isoDatetime__((char const *) sqlite3_column_text(stmt, col),
+                             sqlite3_column_bytes(stmt, col),
+                             &date, &tod, &has_time) || has_time)
+        return decode_viaCString__(stmt, col, traits);
+
+    return DateADTGetDatum(date);
+}
+
+
+static Datum
+decode_unixepochTimestamp__(sqlite3_stmt *stmt, int col,
+                            PgTypeInputTraits *traits)
+{
+    int64 secs = sqlite3_column_int64(stmt, col);
+
+    if (secs < -MAX_EPOCH_SECONDS || secs > MAX_EPOCH_SECONDS)
+		ereport(ERROR,
+			(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+			errmsg("timestamp out of range")
+			));
+
+    secs -= (int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY;
+    return make_timestampDatum__(secs * USECS_PER_SEC, traits);
+}
+
+
+static Datum
+decode_unixepochDate__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    int64 secs = sqlite3_column_int64(stmt, col);
+    int64 days = secs / SECS_PER_DAY;
+
+    /* round towards minus infinity, like sqlite's date(x, 'unixepoch') */
+    if (secs % SECS_PER_DAY < 0)
+        days--;
+    return make_dateDatum__(days + UNIX_EPOCH_JDATE);
+}
+
+
+/*
+ * Julian day numbers start at noon, hence the half day.
+ */
+static Datum
+decode_julianTimestamp__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    double days = sqlite3_column_double(stmt, col) -
+                  (POSTGRES_EPOCH_JDATE - 0.5);
+    double usecs = rint(days * USECS_PER_DAY);
+
+    if (isnan(usecs) || usecs < (double) MIN_TIMESTAMP ||
+        usecs >= (double) END_TIMESTAMP)
+		ereport(ERROR,
+			(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+			errmsg("timestamp out of range")
+			));
+    return make_timestampDatum__((Timestamp) usecs, traits);
+}
+
+
+static Datum
+decode_julianDate__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    double julian = floor(sqlite3_column_double(stmt, col) + 0.5);
+
+    if (isnan(julian) || julian < 0 || julian > INT_MAX)
+		ereport(ERROR,
+			(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+			errmsg("date out of range")
+			));
+    return make_dateDatum__((int64) julian);
+}
+
+
+/*
+ * Encode a rowid as an item pointer: the low 15 bits, plus one, as the
+ * offset, which must not be 0, and the rest as the block number, which
+ * must not be InvalidBlockNumber.  Negative rowids and those beyond 2^47
+ * or so cannot be represented; that would make the row impossible to
+ * update or delete.
+ */
+void
+rowid_to_itemPointer(int64 rowid, ItemPointer tid)
+{
+    if (rowid < 0 || (rowid >> 15) >= (int64) InvalidBlockNumber)
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			errmsg("sqlite rowid " INT64_FORMAT " cannot be represented as a ctid",
+                   rowid)
+			));
+    ItemPointerSet(tid, (BlockNumber) (rowid >> 15),
+                   (OffsetNumber) ((rowid & 0x7FFF) + 1));
+}
+
+
+int64
+itemPointer_to_rowid(ItemPointer tid)
+{
+    return ((int64) ItemPointerGetBlockNumberNoCheck(tid) << 15) |
+           (ItemPointerGetOffsetNumberNoCheck(tid) - 1);
+}
+
+
+static Datum
+decode_rowidTid__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+{
+    ItemPointer tid = (ItemPointer) palloc(sizeof(ItemPointerData));
+
+    rowid_to_itemPointer(sqlite3_column_int64(stmt, col), tid);
+    return PointerGetDatum(tid);
+}
+
+
+/*
+ * Pick the decoder for every storage class a value of this type may
+ * arrive in.  Anything not listed goes through the input function.
+ */
+static void
+resolve_decoders__(PgTypeInputTraits *traits)
+{
+    SqliteDecodeFunc *decode = traits->decode;
+    int i;
+
+    for (i = 0; i < SQLITE_NUM_STORAGE_CLASSES; i++)
+        decode[i] = decode_viaCString__;
+
+#define SET_DECODER(type, func)   (decode[DECODER_INDEX(type)] = (func))
+
+    switch (traits->pgtyp)
+    {
+        case BOOLOID:
+            SET_DECODER(SQLITE_INTEGER, decode_bool__);
+            break;
+
+        case INT8OID:
+            SET_DECODER(SQLITE_INTEGER, decode_int8__);
+            break;
+
+        case INT4OID:
+            SET_DECODER(SQLITE_INTEGER, decode_int4__);
+            break;
+
+        case INT2OID:
+            SET_DECODER(SQLITE_INTEGER, decode_int2__);
+            break;
+
+        case CHAROID:
+            SET_DECODER(SQLITE_INTEGER, decode_char__);
+            break;
+
+        case FLOAT4OID:
+            SET_DECODER(SQLITE_INTEGER, decode_float4__);
+            SET_DECODER(SQLITE_FLOAT, decode_float4__);
+            break;
+
+        case FLOAT8OID:
+            SET_DECODER(SQLITE_INTEGER, decode_float8__);
+            SET_DECODER(SQLITE_FLOAT, decode_float8__);
+            break;
+
+        case NUMERICOID:
+            SET_DECODER(SQLITE_INTEGER, decode_intNumeric__);
+            SET_DECODER(SQLITE_FLOAT, decode_floatNumeric__);
+            break;
+
+        case TEXTOID:
+        case VARCHAROID:
+        case BPCHAROID:
+            for (i = 0; i < SQLITE_NUM_STORAGE_CLASSES; i++)
+                decode[i] = decode_text__;
+            break;
+
+        case BYTEAOID:
+            SET_DECODER(SQLITE_BLOB, decode_bytea__);
+            break;
+
+        case DATEOID:
+            SET_DECODER(SQLITE_INTEGER, decode_unixepochDate__);
+            SET_DECODER(SQLITE_FLOAT, decode_julianDate__);
+            SET_DECODER(SQLITE_TEXT, decode_isoDate__);
+            break;
+
+        case TIMESTAMPOID:
+            SET_DECODER(SQLITE_INTEGER, decode_unixepochTimestamp__);
+            SET_DECODER(SQLITE_FLOAT, decode_julianTimestamp__);
+            SET_DECODER(SQLITE_TEXT, decode_isoTimestamp__);
+            break;
+
+        case TIMESTAMPTZOID:
+            /* zoneless text is in the session time zone: leave it to input */
+            SET_DECODER(SQLITE_INTEGER, decode_unixepochTimestamp__);
+            SET_DECODER(SQLITE_FLOAT, decode_julianTimestamp__);
+            break;
+
+        case UUIDOID:
+            SET_DECODER(SQLITE_TEXT, decode_textUuid__);
+            SET_DECODER(SQLITE_BLOB, decode_blobUuid__);
+            break;
+
+        case JSONOID:
+            SET_DECODER(SQLITE_TEXT, decode_json__);
+            break;
+
+        case TIDOID:
+            /* a ctid pulled up through a pushed down join */
+            SET_DECODER(SQLITE_INTEGER, decode_rowidTid__);
+            break;
+
+        default:
+            break;
+    }
+
+#undef SET_DECODER
+}
+
+
+Datum
+make_datum(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits, bool *isnull)
+{
+    int type;
+
+    if (!traits->valid)
+        return (Datum) 0;
+
+    type = sqlite3_column_type(stmt, col);
+    if (type == SQLITE_NULL)
+    {
+        *isnull = true;
+        return (Datum) 0;
+    }
+
+    *isnull = false;
+    return traits->decode[DECODER_INDEX(type)](stmt, col, traits);
+}
+
+
+static PgTypeInputTraits
+get_pgTypeInputTraits__(Oid pgtyp, int32 typmod)
+{
+    PgTypeInputTraits traits;
+	HeapTuple tuple;
+    Form_pg_type typeform;
+
+    memset(&traits, 0, sizeof(traits));
+    traits.pgtyp = pgtyp;
+    traits.typmod = typmod;
+    tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(pgtyp));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for type %u", pgtyp);
+
+    typeform = ((Form_pg_type)GETSTRUCT(tuple));
+    traits.typeinput = typeform->typinput;
+    traits.typioparam = getTypeIOParam(tuple);
+    traits.valid = true;
+	ReleaseSysCache(tuple);
+
+    fmgr_info(traits.typeinput, &traits.input_fn);
+    resolve_decoders__(&traits);
+    return traits;
+}
+
+
+PgTypeInputTraits *
+get_pgTypeInputTraits(TupleDesc desc)
+{
+    PgTypeInputTraits *vec = palloc0(desc->natts * sizeof(PgTypeInputTraits));
+    int i;
+    for ( i = 0; i < desc->natts; i++)
+    {
+        if (desc->attrs[i]->attisdropped)
+            continue;
+        vec[i] = get_pgTypeInputTraits__(desc->attrs[i]->atttypid,
+                                         desc->attrs[i]->atttypmod);
+    }
+    return vec;
+}
@@ -54,8 +54,11 @@
 #include "optimizer/tlist.h"
 #include "optimizer/var.h"
 #include "parser/parsetree.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/fmgroids.h"
 #include "utils/lsyscache.h"
+#include "utils/pg_locale.h"
 #include "utils/rel.h"
 #include "utils/syscache.h"
 #include "utils/typcache.h"
@@ -84,6 +87,9 @@ typedef struct deparse_expr_cxt
 #define SUBQUERY_REL_ALIAS_PREFIX	"s"
 #define SUBQUERY_COL_ALIAS_PREFIX	"c"
 
+/* Constant arrays longer than this are sent as one parameter, not a list */
+#define INLINE_ARRAY_MAX	32
+
 /*
  * Functions to determine whether an expression can be evaluated safely on
  * remote server.
@@ -113,8 +119,10 @@ static void deparseConst(Const *node, deparse_expr_cxt *context, int showtype);
 static void deparseParam(Param *node, deparse_expr_cxt *context);
 static void deparseArrayRef(ArrayRef *node, deparse_expr_cxt *context);
 static void deparseFuncExpr(FuncExpr *node, deparse_expr_cxt *context);
+static void deparseCoalesceExpr(CoalesceExpr *node, deparse_expr_cxt *context);
 static void deparseOpExpr(OpExpr *node, deparse_expr_cxt *context);
-static void deparseOperatorName(StringInfo buf, Form_pg_operator opform);
+static void deparseOperatorName(StringInfo buf, Oid opno,
+								Form_pg_operator opform);
 static void deparseDistinctExpr(DistinctExpr *node, deparse_expr_cxt *context);
 static void deparseScalarArrayOpExpr(ScalarArrayOpExpr *node,
 						 deparse_expr_cxt *context);
@@ -122,13 +130,18 @@ static void deparseRelabelType(RelabelType *node, deparse_expr_cxt *context);
 static void deparseBoolExpr(BoolExpr *node, deparse_expr_cxt *context);
 static void deparseNullTest(NullTest *node, deparse_expr_cxt *context);
 static void deparseArrayExpr(ArrayExpr *node, deparse_expr_cxt *context);
+static bool is_locallyEvaluable__(Node *node);
+static bool is_jsonArrayParam__(Node *arraynode);
+static void deparseAsParam__(Expr *node, deparse_expr_cxt *context);
 static void printRemoteParam(int paramindex, Oid paramtype, int32 paramtypmod,
 				 deparse_expr_cxt *context);
 static void printRemotePlaceholder(Oid paramtype, int32 paramtypmod,
 					   deparse_expr_cxt *context);
 static void deparseSelectSql(List *tlist, bool is_subquery, List **retrieved_attrs,
 				 deparse_expr_cxt *context);
-static void appendOrderByClause(List *pathkeys, deparse_expr_cxt *context);
+static void appendOrderByClause(List *pathkeys, bool has_final_sort,
+					deparse_expr_cxt *context);
+static void appendLimitClause(deparse_expr_cxt *context);
 static void appendConditions(List *exprs, deparse_expr_cxt *context);
 static void deparseFromExprForRel(StringInfo buf, PlannerInfo *root,
 					RelOptInfo *joinrel, bool use_alias, List **params_list);
@@ -178,6 +191,13 @@ foreign_expr_walker(Node *node, Oid *expr_collid, Oid *expected_collid)
              *expected_collid != InvalidOid )
             return false;
     
+    /*
+     * Column-free subexpressions become parameters, whatever sqlite would
+     * make of them.
+     */
+    if (is_locallyEvaluable__(node))
+        collation = exprCollation(node);
+    else
 	switch (nodeTag(node))
 	{
 		case T_Var:
@@ -199,14 +219,16 @@ foreign_expr_walker(Node *node, Oid *expr_collid, Oid *expected_collid)
                 if (!is_builtin(oe->opno))
                     return false;
 
+                /* a mutable operator could give a different answer there */
+                if (op_volatile(oe->opno) != PROVOLATILE_IMMUTABLE)
+                    return false;
+
                 /*
-                 * the semantics of like in sqlite are different than
-                 * postgres.  So we will ship over the textlike function
-                 * to sqlite. 
-                 * Also sqlite does not have an ilike operator
+                 * nor could one sqlite has not got, or computes otherwise
+                 * for these operands (see shippable.c).  like and regexp
+                 * are ours, see open_sqliteDb.
                  */
-                if (oe->opno >= OID_NAME_ICLIKE_OP &&
-                    oe->opno <= OID_BPCHAR_ICLIKE_OP)
+                if (!get_sqliteOpExprTranslation(oe))
                     return false;
 
 				/*
@@ -284,7 +306,8 @@ foreign_expr_walker(Node *node, Oid *expr_collid, Oid *expected_collid)
 					return false;
 
 				/* As usual, it must be shippable. */
-				if (!is_shippable_agg(agg->aggfnoid))
+				if (!is_shippable_agg(agg->aggfnoid) ||
+				    func_volatile(agg->aggfnoid) != PROVOLATILE_IMMUTABLE)
 					return false;
 				
                 /*
@@ -323,24 +346,46 @@ foreign_expr_walker(Node *node, Oid *expr_collid, Oid *expected_collid)
 		case T_FuncExpr:
             {
 				FuncExpr   *fe = (FuncExpr *) node;
+				ListCell   *lc;
 
 				/*
-				 * If function used by the expression is not shippable, it
-				 * can't be sent to remote because it might have incompatible
-				 * semantics on remote side.
+				 * Only the functions with a sqlite translation can be sent,
+				 * see shippable.c; any other might have incompatible
+				 * semantics on the remote side, or not exist there.
 				 */
-				if (!is_shippable_func(fe->funcid))
+				if (func_volatile(fe->funcid) != PROVOLATILE_IMMUTABLE ||
+				    !get_sqliteFuncTranslation(fe))
+					return false;
+
+				/* sqlite only knows of the default collation, see above */
+				if (OidIsValid(fe->inputcollid) &&
+					fe->inputcollid != DEFAULT_COLLATION_OID)
 					return false;
 
 				/*
-				 * Recurse to input subexpressions.
+				 * Recurse to input subexpressions, one by one: a field
+				 * name like that of date_trunc is text where the other
+				 * arguments need not be.
 				 */
-				if (!foreign_expr_walker((Node *) fe->args, NULL,
-                                         &fe->inputcollid))
-					return false;
+				foreach(lc, fe->args)
+				{
+					if (!foreign_expr_walker((Node *) lfirst(lc), NULL, NULL))
+						return false;
+				}
 
                 collation = fe->funccollid;
 			}
+			break;
+		case T_CoalesceExpr:
+			{
+				CoalesceExpr *ce = (CoalesceExpr *) node;
+
+				if (!foreign_expr_walker((Node *) ce->args, NULL, NULL))
+					return false;
+
+				collation = ce->coalescecollid;
+			}
+			break;
 		case T_ScalarArrayOpExpr: 
             {
                 /*
@@ -352,10 +397,17 @@ foreign_expr_walker(Node *node, Oid *expr_collid, Oid *expected_collid)
 				ScalarArrayOpExpr *oe = (ScalarArrayOpExpr *) node;
                 Node *arraynode = (Node *) lsecond(oe->args); 
                 
+                char *opname = get_opname(oe->opno);
+
+                /* it is deparsed as IN, so only = will do */
                 if ( (!oe->useOr) || 
+                     op_volatile(oe->opno) != PROVOLATILE_IMMUTABLE ||
+                     (!opname) || strcmp(opname, "=") != 0 ||
                      (!arraynode) ||
-                     (!IsA(arraynode, Const)) ||
-                     ( ((Const *)arraynode)->constisnull ) 
+                     (!IsA(arraynode, Const) &&
+                      !is_jsonArrayParam__(arraynode)) ||
+                     ( IsA(arraynode, Const) &&
+                       ((Const *)arraynode)->constisnull )
                    )
                     return false;
                 
@@ -464,6 +516,10 @@ build_tlist_to_deparse(RelOptInfo *foreignrel)
  *
  * pathkeys is the list of pathkeys to order the result by.
  *
+ * has_final_sort is true when the pathkeys are the query's final ORDER BY
+ * applied to the output of an upper relation, and has_limit when the
+ * query's LIMIT and OFFSET are to be added as well.
+ *
  * is_subquery is the flag to indicate whether to deparse the specified
  * relation as a subquery.
  *
@@ -472,6 +528,7 @@ build_tlist_to_deparse(RelOptInfo *foreignrel)
 extern void
 deparseSelectStmtForRel(StringInfo buf, PlannerInfo *root, RelOptInfo *rel,
 						List *tlist, List *remote_conds, List *pathkeys,
+						bool has_final_sort, bool has_limit,
 						bool is_subquery, List **retrieved_attrs,
 						List **params_list)
 {
@@ -527,7 +584,24 @@ deparseSelectStmtForRel(StringInfo buf, PlannerInfo *root, RelOptInfo *rel,
 
 	/* Add ORDER BY clause if we found any useful pathkeys */
 	if (pathkeys)
-		appendOrderByClause(pathkeys, &context);
+		appendOrderByClause(pathkeys, has_final_sort, &context);
+
+	/* Add LIMIT clause if necessary */
+	if (has_limit)
+		appendLimitClause(&context);
+}
+
+/*
+ * Restrict a base relation's SELECT, as built by deparseSelectStmtForRel
+ * without ORDER BY or LIMIT, to the rowids between parameters ?first and
+ * ?first+1.  has_where says whether the statement has a WHERE clause yet.
+ * A parallel scan runs this once for every chunk of rowids it claims.
+ */
+extern void
+appendRowidRangeCondition(StringInfo buf, bool has_where, int first)
+{
+	appendStringInfo(buf, "%s rowid BETWEEN ?%d AND ?%d",
+	                 has_where ? " AND" : " WHERE", first, first + 1);
 }
 
 /*
@@ -682,7 +756,7 @@ deparseTargetList(StringInfo buf,
 
 	/*
 	 * Add ctid and oid if needed.  We currently don't support retrieving any
-	 * other system columns.
+	 * other system columns.  The ctid of a sqlite row is its rowid.
 	 */
 	if (bms_is_member(SelfItemPointerAttributeNumber - FirstLowInvalidHeapAttributeNumber,
 					  attrs_used))
@@ -695,7 +769,7 @@ deparseTargetList(StringInfo buf,
 
 		if (qualify_col)
 			ADD_REL_QUALIFIER(buf, rtindex);
-		appendStringInfoString(buf, "ctid");
+		appendStringInfoString(buf, "rowid");
 
 		*retrieved_attrs = lappend_int(*retrieved_attrs,
 									   SelfItemPointerAttributeNumber);
@@ -964,8 +1038,8 @@ deparseRangeTblRef(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
 		/* Deparse the subquery representing the relation. */
 		appendStringInfoChar(buf, '(');
 		deparseSelectStmtForRel(buf, root, foreignrel, NIL,
-								fpinfo->remote_conds, NIL, true,
-								&retrieved_attrs, params_list);
+								fpinfo->remote_conds, NIL, false, false,
+								true, &retrieved_attrs, params_list);
 		appendStringInfoChar(buf, ')');
 
 		/* Append the relation alias. */
@@ -1081,6 +1155,230 @@ deparseAnalyzeSql(StringInfo buf, Relation rel, List **retrieved_attrs)
 	deparseRelation(buf, rel);
 }
 
+/*
+ * Append the WHERE clause identifying a single row to buf: the rowid, or
+ * each of the key columns, compared with parameters ?first, ?first+1, ...
+ */
+static void
+appendRowIdentity__(StringInfo buf, PlannerInfo *root, Index rtindex,
+                    List *keyAttrs, int first)
+{
+	ListCell   *lc;
+	int			pindex = first;
+
+	appendStringInfoString(buf, " WHERE ");
+	if (keyAttrs == NIL)
+	{
+		appendStringInfo(buf, "rowid = ?%d", pindex);
+		return;
+	}
+
+	foreach(lc, keyAttrs)
+	{
+		if (pindex > first)
+			appendStringInfoString(buf, " AND ");
+		deparseColumnRef(buf, rtindex, lfirst_int(lc), root, false);
+		appendStringInfo(buf, " = ?%d", pindex++);
+	}
+}
+
+/*
+ * deparse remote INSERT statement
+ *
+ * The statement text is appended to buf.  targetAttrs lists the columns
+ * bound, in parameter order.  doNothing is true for ON CONFLICT DO NOTHING,
+ * which sqlite spells INSERT OR IGNORE.
+ */
+void
+deparseInsertSql(StringInfo buf, PlannerInfo *root, Index rtindex,
+				 Relation rel, List *targetAttrs, bool doNothing)
+{
+	ListCell   *lc;
+	bool		first;
+	int			pindex;
+
+	appendStringInfoString(buf, doNothing ? "INSERT OR IGNORE INTO "
+										  : "INSERT INTO ");
+	deparseRelation(buf, rel);
+
+	if (targetAttrs == NIL)
+	{
+		appendStringInfoString(buf, " DEFAULT VALUES");
+		return;
+	}
+
+	appendStringInfoChar(buf, '(');
+	first = true;
+	foreach(lc, targetAttrs)
+	{
+		if (!first)
+			appendStringInfoString(buf, ", ");
+		first = false;
+		deparseColumnRef(buf, rtindex, lfirst_int(lc), root, false);
+	}
+
+	appendStringInfoString(buf, ") VALUES (");
+	for (pindex = 1; pindex <= list_length(targetAttrs); pindex++)
+	{
+		if (pindex > 1)
+			appendStringInfoString(buf, ", ");
+		appendStringInfo(buf, "?%d", pindex);
+	}
+	appendStringInfoChar(buf, ')');
+}
+
+/*
+ * The INSERT query, as made by deparseInsertSql, for nrows rows: another
+ * list of nparams parameters for each row after the first.
+ */
+void
+deparseInsertBatchSql(StringInfo buf, char const *query, int nparams,
+					  int nrows)
+{
+	int			pindex = nparams + 1;
+	int			row;
+	int			i;
+
+	appendStringInfoString(buf, query);
+	for (row = 1; row < nrows; row++)
+	{
+		appendStringInfoString(buf, ", (");
+		for (i = 0; i < nparams; i++)
+		{
+			if (i > 0)
+				appendStringInfoString(buf, ", ");
+			appendStringInfo(buf, "?%d", pindex++);
+		}
+		appendStringInfoChar(buf, ')');
+	}
+}
+
+/*
+ * deparse remote UPDATE statement
+ *
+ * The new values of targetAttrs are parameters 1..n, followed by the row
+ * identity (see appendRowIdentity__).
+ */
+void
+deparseUpdateSql(StringInfo buf, PlannerInfo *root, Index rtindex,
+				 Relation rel, List *targetAttrs, List *keyAttrs)
+{
+	ListCell   *lc;
+	int			pindex = 1;
+
+	appendStringInfoString(buf, "UPDATE ");
+	deparseRelation(buf, rel);
+	appendStringInfoString(buf, " SET ");
+
+	foreach(lc, targetAttrs)
+	{
+		if (pindex > 1)
+			appendStringInfoString(buf, ", ");
+		deparseColumnRef(buf, rtindex, lfirst_int(lc), root, false);
+		appendStringInfo(buf, " = ?%d", pindex++);
+	}
+
+	appendRowIdentity__(buf, root, rtindex, keyAttrs, pindex);
+}
+
+/*
+ * deparse remote DELETE statement
+ */
+void
+deparseDeleteSql(StringInfo buf, PlannerInfo *root, Index rtindex,
+				 Relation rel, List *keyAttrs)
+{
+	appendStringInfoString(buf, "DELETE FROM ");
+	deparseRelation(buf, rel);
+	appendRowIdentity__(buf, root, rtindex, keyAttrs, 1);
+}
+
+/*
+ * deparse remote UPDATE statement that does all the work itself
+ *
+ * The new values are taken from targetlist, the subplan's output, for the
+ * columns in targetAttrs; remote_conds restrict the rows changed.  Any
+ * parameters needed are added to *params_list.
+ */
+void
+deparseDirectUpdateSql(StringInfo buf, PlannerInfo *root, Index rtindex,
+					   Relation rel, List *targetlist, List *targetAttrs,
+					   List *remote_conds, List **params_list)
+{
+	RelOptInfo *baserel = root->simple_rel_array[rtindex];
+	deparse_expr_cxt context;
+	int			nestlevel;
+	bool		first;
+	ListCell   *lc;
+
+	/* Set up context struct for recursion */
+	context.root = root;
+	context.foreignrel = baserel;
+	context.scanrel = baserel;
+	context.buf = buf;
+	context.params_list = params_list;
+
+	appendStringInfoString(buf, "UPDATE ");
+	deparseRelation(buf, rel);
+	appendStringInfoString(buf, " SET ");
+
+	nestlevel = set_transmission_modes();
+
+	first = true;
+	foreach(lc, targetAttrs)
+	{
+		int			attnum = lfirst_int(lc);
+		TargetEntry *tle = get_tle_by_resno(targetlist, attnum);
+
+		if (!tle)
+			elog(ERROR, "attribute number %d not found in UPDATE targetlist",
+				 attnum);
+
+		if (!first)
+			appendStringInfoString(buf, ", ");
+		first = false;
+
+		deparseColumnRef(buf, rtindex, attnum, root, false);
+		appendStringInfoString(buf, " = ");
+		deparseExpr((Expr *) tle->expr, &context);
+	}
+
+	reset_transmission_modes(nestlevel);
+
+	if (remote_conds)
+	{
+		appendStringInfoString(buf, " WHERE ");
+		appendConditions(remote_conds, &context);
+	}
+}
+
+/*
+ * deparse remote DELETE statement that does all the work itself
+ */
+void
+deparseDirectDeleteSql(StringInfo buf, PlannerInfo *root, Index rtindex,
+					   Relation rel, List *remote_conds, List **params_list)
+{
+	RelOptInfo *baserel = root->simple_rel_array[rtindex];
+	deparse_expr_cxt context;
+
+	/* Set up context struct for recursion */
+	context.root = root;
+	context.foreignrel = baserel;
+	context.scanrel = baserel;
+	context.buf = buf;
+	context.params_list = params_list;
+
+	appendStringInfoString(buf, "DELETE FROM ");
+	deparseRelation(buf, rel);
+
+	if (remote_conds)
+	{
+		appendStringInfoString(buf, " WHERE ");
+		appendConditions(remote_conds, &context);
+	}
+}
+
 /*
  * Construct name to use for given column, and emit it into buf.
  * If it has a column_name FDW option, use that instead of attribute name.
@@ -1093,12 +1391,12 @@ deparseColumnRef(StringInfo buf, int varno, int varattno, PlannerInfo *root,
 {
 	RangeTblEntry *rte;
 
-	/* We support fetching the remote side's CTID and OID. */
+	/* We support fetching the remote side's CTID (its rowid) and OID. */
 	if (varattno == SelfItemPointerAttributeNumber)
 	{
 		if (qualify_col)
 			ADD_REL_QUALIFIER(buf, varno);
-		appendStringInfoString(buf, "ctid");
+		appendStringInfoString(buf, "rowid");
 	}
 	else if (varattno == ObjectIdAttributeNumber)
 	{
@@ -1229,14 +1527,15 @@ deparseColumnRef(StringInfo buf, int varno, int varattno, PlannerInfo *root,
 
 /*
  * Append remote name of specified foreign table to buf.
- * Use value of table_name FDW option (if any) instead of relation's name.
- * Similarly, schema_name FDW option overrides schema name.
+ * Use value of table FDW option (if any) instead of relation's name, in
+ * the database of the schema option (if any).
  */
 static void
 deparseRelation(StringInfo buf, Relation rel)
 {
 	ForeignTable *table;
 	const char *relname = NULL;
+	const char *schema = NULL;
 	ListCell   *lc;
 
 	/* obtain additional catalog information. */
@@ -1248,14 +1547,29 @@ deparseRelation(StringInfo buf, Relation rel)
 	foreach(lc, table->options)
 	{
 		DefElem    *def = (DefElem *) lfirst(lc);
-		if (strcmp(def->defname, "table_name") == 0)
+		if (strcmp(def->defname, "table") == 0)
 			relname = defGetString(def);
+		if (strcmp(def->defname, "schema") == 0)
+			schema = defGetString(def);
 	}
 
 	if (relname == NULL)
 		relname = RelationGetRelationName(rel);
 
-	appendStringInfo(buf, "%s", quote_identifier(relname));
+	appendStringInfoString(buf, quote_sqliteTable(schema, relname));
+}
+
+/*
+ * The name of a sqlite table, qualified with the attached database holding
+ * it unless schema is NULL.
+ */
+char *
+quote_sqliteTable(char const *schema, char const *table)
+{
+	if (schema)
+		return psprintf("%s.%s", quote_identifier(schema),
+						quote_identifier(table));
+	return pstrdup(quote_identifier(table));
 }
 
 /*
@@ -1301,6 +1615,12 @@ deparseExpr(Expr *node, deparse_expr_cxt *context)
 {
 	if (node == NULL)
 		return;
+
+	if (is_locallyEvaluable__((Node *) node))
+	{
+		deparseAsParam__(node, context);
+		return;
+	}
     
 	switch (nodeTag(node))
 	{
@@ -1319,6 +1639,9 @@ deparseExpr(Expr *node, deparse_expr_cxt *context)
 		case T_FuncExpr:
 			deparseFuncExpr((FuncExpr *) node, context);
 			break;
+		case T_CoalesceExpr:
+			deparseCoalesceExpr((CoalesceExpr *) node, context);
+			break;
 		case T_OpExpr:
 			deparseOpExpr((OpExpr *) node, context);
 			break;
@@ -1387,31 +1710,7 @@ deparseVar(Var *node, deparse_expr_cxt *context)
 	else
 	{
 		/* Treat like a Param */
-		if (context->params_list)
-		{
-			int			pindex = 0;
-			ListCell   *lc;
-
-			/* find its index in params_list */
-			foreach(lc, *context->params_list)
-			{
-				pindex++;
-				if (equal(node, (Node *) lfirst(lc)))
-					break;
-			}
-			if (lc == NULL)
-			{
-				/* not in list, so add it */
-				pindex++;
-				*context->params_list = lappend(*context->params_list, node);
-			}
-
-			printRemoteParam(pindex, node->vartype, node->vartypmod, context);
-		}
-		else
-		{
-			printRemotePlaceholder(node->vartype, node->vartypmod, context);
-		}
+		deparseAsParam__((Expr *) node, context);
 	}
 }
 
@@ -1494,6 +1793,18 @@ deparseConst(Const *node, deparse_expr_cxt *context, int showtype)
 		case VARBITOID:
 			appendStringInfo(buf, "x'%s'", extval);
 			break;
+		case BYTEAOID:	// a blob, which is what sqlite compares a blob to
+			{
+				bytea	   *data = DatumGetByteaPP(node->constvalue);
+				char const *bytes = VARDATA_ANY(data);
+				int			i;
+
+				appendStringInfoString(buf, "x'");
+				for (i = 0; i < VARSIZE_ANY_EXHDR(data); i++)
+					appendStringInfo(buf, "%02x", (unsigned char) bytes[i]);
+				appendStringInfoChar(buf, '\'');
+			}
+			break;
 		case BOOLOID: // booleans should be ints for sqlite
 			if (strcmp(extval, "t") == 0)
 				appendStringInfoString(buf, "1");
@@ -1590,6 +1901,17 @@ deparseConstArray(Const *arraynode, deparse_expr_cxt *context)
  */
 static void
 deparseParam(Param *node, deparse_expr_cxt *context)
+{
+	deparseAsParam__((Expr *) node, context);
+}
+
+/*
+ * Emit a parameter standing for an expression the executor computes
+ * before the query runs.  The expression goes into context->params_list
+ * unless an equal one is there already.
+ */
+static void
+deparseAsParam__(Expr *node, deparse_expr_cxt *context)
 {
 	if (context->params_list)
 	{
@@ -1610,12 +1932,97 @@ deparseParam(Param *node, deparse_expr_cxt *context)
 			*context->params_list = lappend(*context->params_list, node);
 		}
 
-		printRemoteParam(pindex, node->paramtype, node->paramtypmod, context);
+		printRemoteParam(pindex, exprType((Node *) node),
+						 exprTypmod((Node *) node), context);
 	}
 	else
 	{
-		printRemotePlaceholder(node->paramtype, node->paramtypmod, context);
+		printRemotePlaceholder(exprType((Node *) node),
+							   exprTypmod((Node *) node), context);
+	}
+}
+
+/*
+ * True for an expression that references no column, aggregate or subplan
+ * and calls no volatile function, such as now() - interval '90 days'.
+ * sqlite could evaluate few of those the way PostgreSQL does, but they
+ * need no evaluating per row: the executor computes them once when the
+ * scan starts and they are sent as parameters.  Constants and Params are
+ * handled by the usual code.
+ */
+static bool
+is_locallyEvaluable__(Node *node)
+{
+	if (node == NULL)
+		return false;
+
+	switch (nodeTag(node))
+	{
+		case T_FuncExpr:
+		case T_OpExpr:
+		case T_SQLValueFunction:
+		case T_CoerceViaIO:
+		case T_RelabelType:
+		case T_CaseExpr:
+		case T_CoalesceExpr:
+		case T_MinMaxExpr:
+		case T_NullIfExpr:
+			break;
+		default:
+			return false;
+	}
+
+	return !contain_var_clause(node) &&
+		   !contain_agg_clause(node) &&
+		   !contain_subplans(node) &&
+		   !contain_volatile_functions(node);
+}
+
+/*
+ * True for the array of "x = ANY(array)" that is to be bound as a single
+ * parameter, for sqlite to read back with json_tree(): a parameter or other
+ * column-free expression, or a constant too long to spell out.  This keeps
+ * the statement text short and the same for every array, so its prepared
+ * statement is cached.  The array goes as JSON, which only keeps values as
+ * sqlite would see them bound one by one for integers, booleans and strings
+ * (JSON lacks blobs, rounds floats to their text form and writes dates and
+ * times its own way), so only arrays of those qualify, and of numeric.
+ * A whole numeric is bound as an integer, as json_tree reads it back.  Any
+ * other is bound as text but read back as a real: the two compare alike
+ * against a column of numeric or real affinity, which turns the text into
+ * the same real, but not against a text column, where 1.5 does not match
+ * '1.5' as the scalar would.
+ */
+static bool
+is_jsonArrayParam__(Node *arraynode)
+{
+	switch (get_element_type(exprType(arraynode)))
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case NUMERICOID:
+		case BOOLOID:
+		case TEXTOID:
+		case VARCHAROID:
+		case BPCHAROID:
+			break;
+		default:
+			return false;
+	}
+
+	if (IsA(arraynode, Const))
+	{
+		Const	   *c = (Const *) arraynode;
+		ArrayType  *array;
+
+		if (c->constisnull)
+			return false;
+		array = DatumGetArrayTypeP(c->constvalue);
+		return ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array)) >
+			INLINE_ARRAY_MAX;
 	}
+	return IsA(arraynode, Param) || is_locallyEvaluable__(arraynode);
 }
 
 /*
@@ -1665,67 +2072,123 @@ deparseArrayRef(ArrayRef *node, deparse_expr_cxt *context)
 }
 
 /*
- * Deparse a function call.
+ * Deparse a function call, as the sqlite expression it translates to (see
+ * shippable.c), with $n replaced by argument n and @n by argument n made a
+ * date or time value: sqlite's date functions would read an integer as a
+ * julian day, where we take it for seconds since the unix epoch.  Casts
+ * are function calls too.
  */
 static void
 deparseFuncExpr(FuncExpr *node, deparse_expr_cxt *context)
 {
 	StringInfo	buf = context->buf;
-	bool		use_variadic;
-	bool		first;
-	ListCell   *arg;
-	
-	/*
-	 * If the function call came from an implicit coercion, then just show the
-	 * first argument.
-	 */
-	if (node->funcformat == COERCE_IMPLICIT_CAST)
-	{
-		deparseExpr((Expr *) linitial(node->args), context);
-		return;
-	}
+	SqliteFuncTranslation const *t = get_sqliteFuncTranslation(node);
+	char const *p;
 
-	/*
-	 * If the function call came from a cast, then show the first argument
-	 * plus an explicit cast operation.
-	 */
-	if (node->funcformat == COERCE_EXPLICIT_CAST)
+	if (!t)
+		elog(ERROR, "no sqlite translation for function %u", node->funcid);
+
+	appendStringInfoChar(buf, '(');
+	for (p = t->sqlite; *p; p++)
 	{
-		Oid			rettype = node->funcresulttype;
-		int32		coercedTypmod;
+		Expr	   *arg;
 
-		/* Get the typmod if this is a length-coercion function */
-		(void) exprIsLengthCoercion((Node *) node, &coercedTypmod);
+		if ((*p != '$' && *p != '@') || p[1] < '1' || p[1] > '9')
+		{
+			appendStringInfoChar(buf, *p);
+			continue;
+		}
 
-		deparseExpr((Expr *) linitial(node->args), context);
-		appendStringInfo(buf, "::%s",
-						 deparse_type_name(rettype, coercedTypmod));
-		return;
+		arg = (Expr *) list_nth(node->args, p[1] - '1');
+		if (*p == '$')
+			deparseExpr(arg, context);
+		else
+		{
+			appendStringInfoString(buf, "CASE typeof(");
+			deparseExpr(arg, context);
+			appendStringInfoString(buf, ") WHEN 'integer' THEN datetime(");
+			deparseExpr(arg, context);
+			appendStringInfoString(buf, ", 'unixepoch') ELSE ");
+			deparseExpr(arg, context);
+			appendStringInfoString(buf, " END");
+		}
+		p++;
 	}
+	appendStringInfoChar(buf, ')');
+}
 
-	/* Check if need to print VARIADIC (cf. ruleutils.c) */
-	use_variadic = node->funcvariadic;
+/*
+ * Deparse COALESCE, of which sqlite wants two arguments at least.
+ */
+static void
+deparseCoalesceExpr(CoalesceExpr *node, deparse_expr_cxt *context)
+{
+	StringInfo	buf = context->buf;
+	ListCell   *arg;
+	bool		first = true;
 
-	/*
-	 * Normal function: display as proname(args).
-	 */
-	appendFunctionName(node->funcid, context);
-	appendStringInfoChar(buf, '(');
+	if (list_length(node->args) == 1)
+	{
+		deparseExpr((Expr *) linitial(node->args), context);
+		return;
+	}
 
-	/* ... and all the arguments */
-	first = true;
+	appendStringInfoString(buf, "coalesce(");
 	foreach(arg, node->args)
 	{
 		if (!first)
 			appendStringInfoString(buf, ", ");
-		if (use_variadic && lnext(arg) == NULL)
-			appendStringInfoString(buf, "VARIADIC ");
 		deparseExpr((Expr *) lfirst(arg), context);
 		first = false;
 	}
 	appendStringInfoChar(buf, ')');
 }
 
+/*
+ * For "text_column LIKE 'abc%'", the prefix 'abc'; NULL for other clauses.
+ *
+ * Our like() is opaque to sqlite, so it cannot use an index for it the way
+ * it does for its own LIKE.  A range on the prefix can, and it is the same
+ * condition when sqlite's BINARY collation is a byte comparison, as under
+ * the C collation.  The like() stays in place after the range, so where
+ * the column has another collation the range only has to let through all
+ * the strings that match, which NOCASE and RTRIM do too.  Numbers sort
+ * before all text in sqlite, so the range would drop a number a pattern
+ * like '12%' matches once turned into text: patterns that a number's text
+ * could start with are left alone.
+ */
+static char *
+get_likePrefix__(OpExpr *node, Form_pg_operator form)
+{
+	Node	   *left;
+	Const	   *right;
+	char	   *pattern;
+	size_t		len;
+
+	if (strcmp(NameStr(form->oprname), "~~") != 0 ||
+		list_length(node->args) != 2 ||
+		!lc_collate_is_c(DEFAULT_COLLATION_OID))
+		return NULL;
+
+	left = (Node *) linitial(node->args);
+	right = (Const *) lsecond(node->args);
+	if (!IsA(left, Var) || exprType(left) != TEXTOID ||
+		!IsA(right, Const) || right->constisnull ||
+		right->consttype != TEXTOID)
+		return NULL;
+
+	pattern = TextDatumGetCString(right->constvalue);
+	len = strlen(pattern);
+	if (len < 2 || pattern[len - 1] != '%' ||
+		strcspn(pattern, "%_\\") != len - 1 ||
+		strchr("0123456789+-.I", pattern[0]) ||
+		(unsigned char) pattern[len - 2] >= 0x7F)
+		return NULL;
+
+	pattern[len - 1] = '\0';
+	return pattern;
+}
+
 /*
  * Deparse given operator expression.   To avoid problems around
  * priority of operations, we always parenthesize the arguments.
@@ -1738,6 +2201,7 @@ deparseOpExpr(OpExpr *node, deparse_expr_cxt *context)
 	Form_pg_operator form;
 	char		oprkind;
 	ListCell   *arg;
+	char	   *prefix;
 
 	/* Retrieve information about the operator from system catalog. */
 	tuple = SearchSysCache1(OPEROID, ObjectIdGetDatum(node->opno));
@@ -1754,6 +2218,23 @@ deparseOpExpr(OpExpr *node, deparse_expr_cxt *context)
 	/* Always parenthesize the expression. */
 	appendStringInfoChar(buf, '(');
 
+	/* Put the range of a prefix LIKE first, see get_likePrefix__ */
+	prefix = get_likePrefix__(node, form);
+	if (prefix)
+	{
+		size_t		len = strlen(prefix);
+
+		deparseExpr(linitial(node->args), context);
+		appendStringInfoString(buf, " >= ");
+		deparseStringLiteral(buf, prefix);
+		appendStringInfoString(buf, " AND ");
+		deparseExpr(linitial(node->args), context);
+		appendStringInfoString(buf, " < ");
+		prefix[len - 1]++;
+		deparseStringLiteral(buf, prefix);
+		appendStringInfoString(buf, " AND ");
+	}
+
 	/* Deparse left operand. */
 	if (oprkind == 'r' || oprkind == 'b')
 	{
@@ -1763,7 +2244,7 @@ deparseOpExpr(OpExpr *node, deparse_expr_cxt *context)
 	}
 
 	/* Deparse operator name. */
-	deparseOperatorName(buf, form);
+	deparseOperatorName(buf, node->opno, form);
 
 	/* Deparse right operand. */
 	if (oprkind == 'l' || oprkind == 'b')
@@ -1779,27 +2260,14 @@ deparseOpExpr(OpExpr *node, deparse_expr_cxt *context)
 }
 
 
-static char const *
-translate_opname__(char *opname)
-{
-    if (strcmp(opname, "~~") == 0)
-        return "like";
-    else if (strcmp(opname, "!~~") == 0)
-        return "not like";
-    if (strcmp(opname, "~") == 0)
-        return "regexp";
-    else if (strcmp(opname, "!~") == 0)
-        return "not regexp";
-    else
-        return opname;
-}
-
 /*
- * Print the name of an operator.
+ * Print the name of an operator, the way sqlite spells it (see
+ * shippable.c) if it is one we send.
  */
 static void
-deparseOperatorName(StringInfo buf, Form_pg_operator opform)
+deparseOperatorName(StringInfo buf, Oid opno, Form_pg_operator opform)
 {
+	SqliteOpTranslation const *t = get_sqliteOpTranslation(opno);
 	char	   *opname;
 
 	/* opname is not a SQL identifier, so we should not quote it. */
@@ -1818,7 +2286,7 @@ deparseOperatorName(StringInfo buf, Form_pg_operator opform)
 	else
 	{
 		/* Just print operator name. */
-		appendStringInfoString(buf, translate_opname__(opname));
+		appendStringInfoString(buf, t ? t->sqlite : opname);
 	}
 }
 
@@ -1859,14 +2327,32 @@ deparseScalarArrayOpExpr(ScalarArrayOpExpr *node, deparse_expr_cxt *context)
 		// elog(ERROR, "cache lookup failed for operator %u", node->opno);
 	// form = (Form_pg_operator) GETSTRUCT(tuple);
 
+	Expr	   *json = NULL;
+
 	/* Sanity check. */
 	Assert(list_length(node->args) == 2);
+	arg1 = linitial(node->args);
+	arg2 = lsecond(node->args);
 
 	/* Always parenthesize the expression. */
 	appendStringInfoChar(buf, '(');
 
+	/*
+	 * A null array makes the comparison null, where json_tree would read no
+	 * element at all from it.  Null elements are taken care of by IN.
+	 */
+	if (is_jsonArrayParam__((Node *) arg2))
+	{
+		json = (Expr *) makeFuncExpr(F_ARRAY_TO_JSON, JSONOID,
+									 list_make1(arg2),
+									 InvalidOid, InvalidOid,
+									 COERCE_EXPLICIT_CALL);
+		appendStringInfoString(buf, "CASE WHEN ");
+		deparseAsParam__(json, context);
+		appendStringInfoString(buf, " IS NULL THEN NULL ELSE ");
+	}
+
 	/* Deparse left operand. */
-	arg1 = linitial(node->args);
 	deparseExpr(arg1, context);
 	appendStringInfoChar(buf, ' ');
 
@@ -1874,10 +2360,22 @@ deparseScalarArrayOpExpr(ScalarArrayOpExpr *node, deparse_expr_cxt *context)
 	appendStringInfo(buf, " IN (");
 
 	/* Deparse right operand. */
-	arg2 = lsecond(node->args);
-	deparseConstArray((Const *)arg2, context);
+	if (json)
+	{
+		/*
+		 * json_tree rather than json_each, since = ANY looks at all the
+		 * elements of a multidimensional array as well.
+		 */
+		appendStringInfoString(buf, "SELECT value FROM json_tree(");
+		deparseAsParam__(json, context);
+		appendStringInfoString(buf, ") WHERE type <> 'array'");
+	}
+	else
+		deparseConstArray((Const *)arg2, context);
 
 	appendStringInfoChar(buf, ')');
+	if (json)
+		appendStringInfoString(buf, " END");
 
 	/* Always parenthesize the expression. */
 	appendStringInfoChar(buf, ')');
@@ -2130,7 +2628,7 @@ appendAggOrderBy(List *orderList, List *targetList, deparse_expr_cxt *context)
 			if (!HeapTupleIsValid(opertup))
 				elog(ERROR, "cache lookup failed for operator %u", srt->sortop);
 			operform = (Form_pg_operator) GETSTRUCT(opertup);
-			deparseOperatorName(buf, operform);
+			deparseOperatorName(buf, srt->sortop, operform);
 			ReleaseSysCache(opertup);
 		}
 
@@ -2154,7 +2652,7 @@ printRemoteParam(int paramindex, Oid paramtype, int32 paramtypmod,
 				 deparse_expr_cxt *context)
 {
 	StringInfo	buf = context->buf;
-	appendStringInfo(buf, "$%d", paramindex);
+	appendStringInfo(buf, "?%d", paramindex);
 }
 
 /*
@@ -2219,10 +2717,12 @@ appendGroupByClause(List *tlist, deparse_expr_cxt *context)
 /*
  * Deparse ORDER BY clause according to the given pathkeys for given base
  * relation. From given pathkeys expressions belonging entirely to the given
- * base relation are obtained and deparsed.
+ * base relation are obtained and deparsed.  For the final sort of an upper
+ * relation the expressions are taken from its output instead.
  */
 static void
-appendOrderByClause(List *pathkeys, deparse_expr_cxt *context)
+appendOrderByClause(List *pathkeys, bool has_final_sort,
+					deparse_expr_cxt *context)
 {
 	ListCell   *lcell;
 	int			nestlevel;
@@ -2237,34 +2737,68 @@ appendOrderByClause(List *pathkeys, deparse_expr_cxt *context)
 	foreach(lcell, pathkeys)
 	{
 		PathKey    *pathkey = lfirst(lcell);
+		bool		ascending = pathkey->pk_strategy == BTLessStrategyNumber;
 		Expr	   *em_expr;
 
-		em_expr = find_em_expr_for_rel(pathkey->pk_eclass, baserel);
-		Assert(em_expr != NULL);
+		if (has_final_sort)
+			em_expr = find_em_expr_for_input_target(context->root,
+													pathkey->pk_eclass,
+								context->root->upper_targets[UPPERREL_GROUP_AGG]);
+		else
+			em_expr = find_em_expr_for_rel(pathkey->pk_eclass, baserel);
+		if (em_expr == NULL)
+			elog(ERROR, "could not find pathkey item to sort");
 
 		appendStringInfoString(buf, delim);
-        appendStringInfoString(buf, " case ");
-        deparseExpr(em_expr, context);
-        appendStringInfoString(buf, " when null then 0 else 1 end ");
-        appendStringInfoString(buf, pathkey->pk_nulls_first ?
-                                    "ASC, " :
-                                    "DESC, ");
-		deparseExpr(em_expr, context);
-		if (pathkey->pk_strategy == BTLessStrategyNumber)
-			appendStringInfoString(buf, " ASC");
-		else
-			appendStringInfoString(buf, " DESC");
 
-		// if (pathkey->pk_nulls_first)
-		// 	appendStringInfoString(buf, " NULLS FIRST");
-		// else
-		// 	appendStringInfoString(buf, " NULLS LAST");
+		/*
+		 * sqlite sorts NULLs before everything else and has no NULLS
+		 * FIRST/LAST, so the other placement takes an extra sort key.
+		 * Leaving it out where the expression cannot be NULL keeps the
+		 * order one that a sqlite index can deliver.
+		 */
+		if (pathkey->pk_nulls_first != ascending &&
+			!is_sqliteNotNull(context->root, baserel, em_expr))
+		{
+			appendStringInfoChar(buf, '(');
+			deparseExpr(em_expr, context);
+			appendStringInfoString(buf, pathkey->pk_nulls_first ?
+										" IS NULL) DESC, " :
+										" IS NULL) ASC, ");
+		}
+
+		deparseExpr(em_expr, context);
+		appendStringInfoString(buf, ascending ? " ASC" : " DESC");
 
 		delim = ", ";
 	}
 	reset_transmission_modes(nestlevel);
 }
 
+/*
+ * Deparse LIMIT/OFFSET clause.  Only constants are pushed down (see
+ * add_foreignFinalPaths); a NULL one means there is no limit.  sqlite does
+ * not take an OFFSET without a LIMIT, so that gets LIMIT -1.
+ */
+static void
+appendLimitClause(deparse_expr_cxt *context)
+{
+	Query	   *parse = context->root->parse;
+	StringInfo	buf = context->buf;
+	Const	   *count = (Const *) parse->limitCount;
+	Const	   *offset = (Const *) parse->limitOffset;
+
+	if (count && !count->constisnull)
+		appendStringInfo(buf, " LIMIT " INT64_FORMAT,
+						 DatumGetInt64(count->constvalue));
+	else
+		appendStringInfoString(buf, " LIMIT -1");
+
+	if (offset && !offset->constisnull)
+		appendStringInfo(buf, " OFFSET " INT64_FORMAT,
+						 DatumGetInt64(offset->constvalue));
+}
+
 /*
  * appendFunctionName
  *		Deparses function name from given function oid.
@@ -1,30 +1,48 @@
 #include <postgres.h>
+#include <catalog/pg_attribute.h>
 #include <catalog/pg_collation.h>
 #include <miscadmin.h>
+#include <nodes/makefuncs.h>
 #include <nodes/parsenodes.h>
 #include <nodes/relation.h>
 #include <nodes/execnodes.h>
 #include <nodes/nodeFuncs.h>
 #include <lib/stringinfo.h>
+#include <mb/pg_wchar.h>
+#include <regex/regex.h>
 #include <utils/builtins.h>
+#include <utils/date.h>
+#include <utils/datetime.h>
+#include <utils/fmgroids.h>
 #include <utils/formatting.h>
 #include <foreign/foreign.h>
 #include <commands/defrem.h>
 #include <utils/lsyscache.h>
 #include <utils/syscache.h>
+#include <utils/timestamp.h>
+#include <utils/tuplestore.h>
 #include <utils/selfuncs.h>
 #include <utils/varlena.h>
 #include <utils/guc.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+#include <utils/pg_locale.h>
+#include <utils/sampling.h>
 #include <catalog/pg_type.h>
 #include <access/htup_details.h>
+#include <commands/vacuum.h>
 #include <optimizer/clauses.h>
 #include <optimizer/cost.h>
 #include <optimizer/tlist.h>
 #include <optimizer/pathnode.h>
+#include <optimizer/paths.h>
+#include <optimizer/var.h>
+#include <parser/parsetree.h>
 #include <parser/parse_oper.h>
 #include <parser/parse_type.h>
 #include <executor/executor.h>
 
+#include <math.h>
 #include <sys/stat.h>
 #include <sqlite3.h>
 #include <signal.h>
@@ -65,35 +83,250 @@ compare_text(void * tmp, int len1, const void * str1,
 }
 
 
-// convenience function to make a text datum (which is varlen) from string
-static Datum
-string_to_textDatum__(unsigned char const * str)
+/*
+ * What we know about the pattern argument of like() or regexp().  sqlite
+ * keeps it with the argument for as long as that stays the same, which for
+ * a constant pattern is the whole statement, so each pattern is looked at
+ * (or compiled) once rather than on every row.
+ */
+typedef enum
 {
-    size_t len = strlen((char *)str);
-    void * blob = palloc0(len + VARHDRSZ);
-    memcpy((char *)blob + VARHDRSZ, str, len);
-    SET_VARSIZE(blob, len + VARHDRSZ);
-    return PointerGetDatum(blob);
-}
+    PATTERN_EXACT,              /* LIKE 'abc' */
+    PATTERN_PREFIX,             /* LIKE 'abc%' */
+    PATTERN_SUFFIX,             /* LIKE '%abc' */
+    PATTERN_INFIX,              /* LIKE '%abc%' */
+    PATTERN_LIKE,               /* any other LIKE, left to textlike */
+    PATTERN_REGEXP              /* a compiled regular expression */
+} PatternKind;
+
+typedef struct
+{
+    PatternKind kind;
+    char       *literal;        /* the fixed text of the fast paths,
+                                 * pointing into pattern */
+    int         literal_len;
+    text       *pattern;        /* the pattern, for textlike */
+    regex_t     re;             /* the pattern, for PATTERN_REGEXP */
+    text       *str;            /* buffer for the subject, for textlike */
+    int         str_size;
+    pg_wchar   *wstr;           /* buffer for the subject, for pg_regexec */
+    int         wstr_size;
+} PatternState;
 
 
-typedef Datum (*PatternMatchFunc)(FunctionCallInfo);
+static void
+free_patternState__(void *p)
+{
+    PatternState *state = (PatternState *) p;
+
+    if (state->kind == PATTERN_REGEXP)
+        pg_regfree(&state->re);
+    if (state->pattern)
+        pfree(state->pattern);
+    if (state->str)
+        pfree(state->str);
+    if (state->wstr)
+        pfree(state->wstr);
+    pfree(state);
+}
+
 
+/*
+ * The LIKE pattern as one of the fast paths if it is a fixed text with at
+ * most a '%' at either end.  Matching the end or the middle of a string
+ * bytewise is only right where no character's bytes can pass for the end
+ * of another's, so those two need a single-byte encoding or UTF8.
+ */
 static void
-invoke_pattern_match__(sqlite3_context *cxt, sqlite3_value **argv, 
-                       PatternMatchFunc pattern_match)
+classify_likePattern__(PatternState *state, char *pattern, int len)
+{
+    bool lead = false;
+    bool trail = false;
+    int i;
+
+    if (len > 0 && pattern[0] == '%')
+    {
+        lead = true;
+        pattern++;
+        len--;
+    }
+    if (len > 0 && pattern[len - 1] == '%')
+    {
+        trail = true;
+        len--;
+    }
+    for (i = 0; i < len; i++)
+    {
+        if (pattern[i] == '%' || pattern[i] == '_' || pattern[i] == '\\')
+            return;
+    }
+    if (lead && pg_database_encoding_max_length() > 1 &&
+        GetDatabaseEncoding() != PG_UTF8)
+        return;
+
+    state->kind = lead ? (trail ? PATTERN_INFIX : PATTERN_SUFFIX)
+                       : (trail ? PATTERN_PREFIX : PATTERN_EXACT);
+    state->literal = pattern;
+    state->literal_len = len;
+}
+
+
+static PatternState *
+make_patternState__(sqlite3_context *cxt, sqlite3_value *arg, bool regexp)
+{
+    char const *pattern = (char const *) sqlite3_value_text(arg);
+    int len = sqlite3_value_bytes(arg);
+    PatternState *state;
+
+    state = MemoryContextAllocZero(TopMemoryContext, sizeof(PatternState));
+    state->pattern = MemoryContextAlloc(TopMemoryContext, len + VARHDRSZ);
+    SET_VARSIZE(state->pattern, len + VARHDRSZ);
+    memcpy(VARDATA(state->pattern), pattern, len);
+
+    if (regexp)
+    {
+        pg_wchar *wpattern = palloc((len + 1) * sizeof(pg_wchar));
+        int wlen = pg_mb2wchar_with_len(pattern, wpattern, len);
+        int rc = pg_regcomp(&state->re, wpattern, wlen, REG_ADVANCED,
+                            DEFAULT_COLLATION_OID);
+
+        pfree(wpattern);
+        if (rc != REG_OKAY)
+        {
+            char msg[256];
+
+            pg_regerror(rc, &state->re, msg, sizeof(msg));
+            free_patternState__(state);
+            sqlite3_result_error(cxt, msg, -1);
+            return NULL;
+        }
+        state->kind = PATTERN_REGEXP;
+    }
+    else
+    {
+        state->kind = PATTERN_LIKE;
+        classify_likePattern__(state, VARDATA(state->pattern), len);
+    }
+    return state;
+}
+
+
+static bool
+find_literal__(char const *str, int len, char const *literal, int literal_len)
+{
+    char const *end = str + len - literal_len;
+    char const *p;
+
+    if (literal_len == 0)
+        return true;
+    for (p = str; p <= end; p++)
+    {
+        p = memchr(p, literal[0], end - p + 1);
+        if (!p)
+            return false;
+        if (memcmp(p, literal, literal_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+
+/*
+ * 1 if str matches, 0 if not, -1 after reporting an error to sqlite.
+ */
+static int
+match_pattern__(sqlite3_context *cxt, PatternState *state, char const *str,
+                int len)
 {
-    const unsigned char *pattern = sqlite3_value_text(argv[0]);
-    const unsigned char *str = sqlite3_value_text(argv[1]);
     FunctionCallInfoData fcinfo;
-    
-    fcinfo.arg[0] = string_to_textDatum__(str);
-    fcinfo.arg[1] = string_to_textDatum__(pattern);
-    fcinfo.fncollation = DEFAULT_COLLATION_OID;
-    
-    sqlite3_result_int(cxt, DatumGetBool(pattern_match(&fcinfo)));
-    pfree(DatumGetPointer(fcinfo.arg[0]));
-    pfree(DatumGetPointer(fcinfo.arg[1]));
+    int n = state->literal_len;
+    int rc;
+
+    switch (state->kind)
+    {
+        case PATTERN_EXACT:
+            return len == n && memcmp(str, state->literal, n) == 0;
+        case PATTERN_PREFIX:
+            return len >= n && memcmp(str, state->literal, n) == 0;
+        case PATTERN_SUFFIX:
+            return len >= n && memcmp(str + len - n, state->literal, n) == 0;
+        case PATTERN_INFIX:
+            return find_literal__(str, len, state->literal, n);
+        case PATTERN_LIKE:
+            if (state->str_size < len + VARHDRSZ)
+            {
+                if (state->str)
+                    pfree(state->str);
+                state->str_size = Max(len + VARHDRSZ, 2 * state->str_size);
+                state->str = MemoryContextAlloc(TopMemoryContext,
+                                                state->str_size);
+            }
+            SET_VARSIZE(state->str, len + VARHDRSZ);
+            memcpy(VARDATA(state->str), str, len);
+
+            InitFunctionCallInfoData(fcinfo, NULL, 2, DEFAULT_COLLATION_OID,
+                                     NULL, NULL);
+            fcinfo.arg[0] = PointerGetDatum(state->str);
+            fcinfo.arg[1] = PointerGetDatum(state->pattern);
+            fcinfo.argnull[0] = false;
+            fcinfo.argnull[1] = false;
+            return DatumGetBool(textlike(&fcinfo));
+        case PATTERN_REGEXP:
+            if (state->wstr_size < len + 1)
+            {
+                if (state->wstr)
+                    pfree(state->wstr);
+                state->wstr_size = Max(len + 1, 2 * state->wstr_size);
+                state->wstr = MemoryContextAlloc(TopMemoryContext,
+                                        state->wstr_size * sizeof(pg_wchar));
+            }
+            n = pg_mb2wchar_with_len(str, state->wstr, len);
+            rc = pg_regexec(&state->re, state->wstr, n, 0, NULL, 0, NULL, 0);
+            if (rc != REG_OKAY && rc != REG_NOMATCH)
+            {
+                char msg[256];
+
+                pg_regerror(rc, &state->re, msg, sizeof(msg));
+                sqlite3_result_error(cxt, msg, -1);
+                return -1;
+            }
+            return rc == REG_OKAY;
+    }
+    return 0;
+}
+
+
+static void
+invoke_pattern_match__(sqlite3_context *cxt, sqlite3_value **argv,
+                       bool regexp)
+{
+    PatternState *state;
+    char const *str;
+    int result;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+        sqlite3_value_type(argv[1]) == SQLITE_NULL)
+    {
+        sqlite3_result_null(cxt);
+        return;
+    }
+
+    state = (PatternState *) sqlite3_get_auxdata(cxt, 0);
+    if (!state)
+    {
+        state = make_patternState__(cxt, argv[0], regexp);
+        if (!state)
+            return;
+    }
+
+    str = (char const *) sqlite3_value_text(argv[1]);
+    result = match_pattern__(cxt, state, str, sqlite3_value_bytes(argv[1]));
+    if (result >= 0)
+        sqlite3_result_int(cxt, result);
+
+    /* this may well free state at once, if the pattern is not a constant */
+    if (sqlite3_get_auxdata(cxt, 0) != state)
+        sqlite3_set_auxdata(cxt, 0, state, free_patternState__);
 }
 
 
@@ -101,7 +334,7 @@ invoke_pattern_match__(sqlite3_context *cxt, sqlite3_value **argv,
 static void
 invoke_like(sqlite3_context *cxt, int argc, sqlite3_value **argv)
 {
-    invoke_pattern_match__(cxt, argv, textlike);
+    invoke_pattern_match__(cxt, argv, false);
 }
 
     
@@ -109,17 +342,104 @@ invoke_like(sqlite3_context *cxt, int argc, sqlite3_value **argv)
 static void
 invoke_regexp(sqlite3_context *cxt, int argc, sqlite3_value **argv)
 {
-    invoke_pattern_match__(cxt, argv, textregexeq);
+    invoke_pattern_match__(cxt, argv, true);
+}
+
+
+static int
+hex_digit__(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
 }
 
 
+/*
+ * Shipped to sqlite as sqlite_fdw_bytea, the bytes a value of a bytea
+ * column stands for: a blob as it is, anything else read in the hex or
+ * escape format, as byteain would, only with sqlite's memory and an sqlite
+ * error rather than an ereport on bad input.
+ */
+static void
+invoke_bytea(sqlite3_context *cxt, int argc, sqlite3_value **argv)
+{
+    unsigned char const *str;
+    int len;
+    unsigned char *bytes;
+    int n = 0;
+    int i;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    {
+        sqlite3_result_null(cxt);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) == SQLITE_BLOB)
+    {
+        sqlite3_result_value(cxt, argv[0]);
+        return;
+    }
+
+    str = sqlite3_value_text(argv[0]);
+    len = sqlite3_value_bytes(argv[0]);
+    bytes = sqlite3_malloc(Max(len, 1));
+    if (!str || !bytes)
+    {
+        sqlite3_free(bytes);
+        sqlite3_result_error_nomem(cxt);
+        return;
+    }
+
+    if (len >= 2 && str[0] == '\\' && str[1] == 'x')
+    {
+        for (i = 2; i < len; i++)
+        {
+            int hi;
+            int lo;
+
+            if (str[i] == ' ' || str[i] == '\n' || str[i] == '\t' ||
+                str[i] == '\r')
+                continue;
+            hi = hex_digit__(str[i]);
+            lo = i + 1 < len ? hex_digit__(str[++i]) : -1;
+            if (hi < 0 || lo < 0)
+                goto invalid;
+            bytes[n++] = (hi << 4) | lo;
+        }
+    }
+    else
+    {
+        for (i = 0; i < len; i++)
+        {
+            if (str[i] != '\\')
+                bytes[n++] = str[i];
+            else if (i + 1 < len && str[i + 1] == '\\')
+                bytes[n++] = str[++i];
+            else if (i + 3 < len &&
+                     str[i + 1] >= '0' && str[i + 1] <= '3' &&
+                     str[i + 2] >= '0' && str[i + 2] <= '7' &&
+                     str[i + 3] >= '0' && str[i + 3] <= '7')
+            {
+                bytes[n++] = ((str[i + 1] - '0') << 6) |
+                             ((str[i + 2] - '0') << 3) | (str[i + 3] - '0');
+                i += 3;
+            }
+            else
+                goto invalid;
+        }
+    }
+    sqlite3_result_blob(cxt, bytes, n, sqlite3_free);
+    return;
 
-static Datum make_datumFloat__(sqlite3_stmt *stmt, int col,
-                               PgTypeInputTraits *traits);
-static Datum make_datumInt__(sqlite3_stmt *stmt, int col,
-                             PgTypeInputTraits *traits);
-static Datum make_datumViaCString__(sqlite3_stmt *stmt, int col,
-                                    PgTypeInputTraits *traits);
+invalid:
+    sqlite3_free(bytes);
+    sqlite3_result_error(cxt, "invalid input syntax for type bytea", -1);
+}
 
 
 
@@ -176,6 +496,10 @@ translate_sqliteType__(char const *type)
     int32 typmod_p = 0;
     
     type = asc_tolower(type, strlen(type) + 1);
+
+    /* a column declared without a type has the Blob affinity */
+    if ( *type == '\0' )
+        return "bytea";
     affinity = get_affinity__(type);
     
     if ( strcmp(affinity, "Text") == 0 )
@@ -190,8 +514,10 @@ translate_sqliteType__(char const *type)
     // Now we have the Numeric affinity
     // and we will see if we have timestamp, date, boolean
     if ( strcmp(type, "timestamp") == 0 ||
-         strcmp(type, "date") )
+         strcmp(type, "date") == 0 )
         return type;
+    if ( strcmp(type, "datetime") == 0 )
+        return "timestamp";
 
     if ( strncmp(type, "bool", 4) == 0 )
         return "boolean";
@@ -235,25 +561,141 @@ get_affinity__(char const *type)
 }
 
 
+/*
+ * The URI of filename with the immutable=1 flag, which tells sqlite that
+ * nobody changes the file: it takes no locks on it and never checks it for
+ * changes.
+ */
+static char *
+immutable_uri__(char const *filename)
+{
+    StringInfoData uri;
+    char const *p;
+
+    initStringInfo(&uri);
+    appendStringInfoString(&uri, "file:");
+    for (p = filename; *p; p++)
+    {
+        if (*p == '%' || *p == '?' || *p == '#')
+            appendStringInfo(&uri, "%%%02X", (unsigned char) *p);
+        else
+            appendStringInfoChar(&uri, *p);
+    }
+    appendStringInfoString(&uri, "?immutable=1");
+    return uri.data;
+}
+
+
+static char *
+trim_spaces__(char *s)
+{
+    char *end;
+
+    while (*s == ' ' || *s == '\t')
+        s++;
+    end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t'))
+        *--end = '\0';
+    return s;
+}
+
+
+/*
+ * The files of the attach server option, "alias=path, ...", as a list of
+ * DefElems naming each path by its alias.
+ */
+List *
+parse_sqliteAttachOption(char const *value)
+{
+    char *item = pstrdup(value);
+    List *result = NIL;
+
+    while (item)
+    {
+        char *next = strchr(item, ',');
+        char *eq;
+        char *alias;
+        char *path;
+        ListCell *lc;
+
+        if (next)
+            *next++ = '\0';
+        eq = strchr(item, '=');
+        if (eq)
+            *eq = '\0';
+        alias = trim_spaces__(item);
+        path = eq ? trim_spaces__(eq + 1) : "";
+        if (*alias == '\0' || *path == '\0' ||
+            pg_strcasecmp(alias, "main") == 0 ||
+            pg_strcasecmp(alias, "temp") == 0)
+            ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("invalid value for option \"attach\": \"%s\"", value),
+                errhint("The value is a list of alias=path entries separated "
+                        "by commas; \"main\" and \"temp\" are taken.")
+                ));
+        foreach(lc, result)
+        {
+            if (pg_strcasecmp(((DefElem *) lfirst(lc))->defname, alias) == 0)
+                ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("alias \"%s\" is attached twice", alias)
+                    ));
+        }
+
+        result = lappend(result, makeDefElem(alias, (Node *) makeString(path),
+                                             -1));
+        item = next;
+    }
+    return result;
+}
+
+
+/*
+ * Open a new handle on a sqlite database and install our collation and
+ * functions on it.  An immutable database is opened read-only too.  With
+ * binary_collation sqlite's own BINARY collation is kept regardless of the
+ * database's collation.  Callers normally go through get_sqliteDbHandle,
+ * which caches the result.
+ */
 sqlite3 *
-get_sqliteDbHandle(char const *filename)
+open_sqliteDb(char const *filename, bool readonly, bool immutable,
+              bool binary_collation)
 {
     sqlite3 *db = NULL;
+    char const *name = filename;
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
     int rc = 0;
-	if (sqlite3_open(filename, &db) != SQLITE_OK) 
+
+    if (readonly || immutable)
+        flags = SQLITE_OPEN_READONLY;
+    if (immutable)
+    {
+        name = immutable_uri__(filename);
+        flags |= SQLITE_OPEN_URI;
+    }
+	if (sqlite3_open_v2(name, &db, flags, NULL) != SQLITE_OK) 
+    {
+        char *msg = pstrdup(sqlite3_errmsg(db));
+        sqlite3_close(db);
 		ereport(ERROR,
 			(errcode(ERRCODE_FDW_ERROR),
 			errmsg("Can't open sqlite database %s: %s", 
                     filename, 
-                    sqlite3_errmsg(db))
+                    msg)
 			));
+    }
     
     /*
      *  Remap the BINARY collation of sqlite3 to use the comparison 
-     *  operator provided by postgres (DEFAULT_COLLATION_OID)
+     *  operator provided by postgres (DEFAULT_COLLATION_OID).  Under the
+     *  C collation that is a memcmp, which is just what sqlite's own
+     *  BINARY does, only without calling back into us for every
+     *  comparison.
      */
-    rc = sqlite3_create_collation_v2(db, "BINARY", SQLITE_UTF8, 
-                                     NULL, compare_text, NULL);
+    if (!binary_collation && !lc_collate_is_c(DEFAULT_COLLATION_OID))
+        rc = sqlite3_create_collation_v2(db, "BINARY", SQLITE_UTF8, 
+                                         NULL, compare_text, NULL);
     if ( rc != SQLITE_OK )
 		ereport(ERROR,
 			(errcode(ERRCODE_FDW_ERROR),
@@ -294,11 +736,49 @@ get_sqliteDbHandle(char const *filename)
                     filename, 
                     sqlite3_errmsg(db))
 			));
+
+    /* for the lengths and substrings of bytea, see shippable.c */
+    rc = sqlite3_create_function_v2(db, "sqlite_fdw_bytea", 1,
+            SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            NULL,
+            invoke_bytea,
+            NULL, NULL, NULL);
+    if ( rc != SQLITE_OK )
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			errmsg("Could not ship the sqlite_fdw_bytea function for %s: %s", 
+                    filename, 
+                    sqlite3_errmsg(db))
+			));
     
     return db;
 }
 
 
+/*
+ * ATTACH filename to db under alias, as immutable like the main file if
+ * need be.  Returns false, with the error left on db, if sqlite cannot.
+ */
+bool
+attach_sqliteDb(sqlite3 *db, char const *alias, char const *filename,
+                bool immutable)
+{
+    char const *name = immutable ? immutable_uri__(filename) : filename;
+    sqlite3_stmt *stmt = NULL;
+    int rc;
+
+    rc = sqlite3_prepare_v2(db, "ATTACH DATABASE ?1 AS ?2", -1, &stmt, NULL);
+    if (rc == SQLITE_OK)
+    {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, alias, -1, SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE;
+}
+
+
 sqlite3_stmt *
 prepare_sqliteQuery(sqlite3 *db, char *query, const char **pzTail)
 {
@@ -315,37 +795,6 @@ prepare_sqliteQuery(sqlite3 *db, char *query, const char **pzTail)
 }
 
 
-bool
-is_sqliteTableRequired(ImportForeignSchemaStmt *stmt, 
-                       char const * tablename)
-{
-	ListCell   *lc;
-
-    switch ( stmt->list_type )
-    {
-        case FDW_IMPORT_SCHEMA_LIMIT_TO:
-            foreach(lc, stmt->table_list)
-            {
-                RangeVar *rv = (RangeVar *) lfirst(lc);
-                if ( strcmp(tablename, rv->relname) == 0 )
-                    return true;
-            }
-            return false;
-
-        case FDW_IMPORT_SCHEMA_EXCEPT:
-            foreach(lc, stmt->table_list)
-            {
-                RangeVar *rv = (RangeVar *) lfirst(lc);
-                if ( strcmp(tablename, rv->relname) == 0 )
-                    return false;
-            }
-
-        default:
-            return true;
-    }
-}
-
-
 char *
 get_tableDropSql(char const *local_schema, char const *tablename)
 {
@@ -362,55 +811,134 @@ get_tableDropSql(char const *local_schema, char const *tablename)
 }
 
 
-char * 
+/*
+ * Close the CREATE FOREIGN TABLE command for tablename in cftsql with the
+ * table's options.
+ */
+static char *
+finish_foreignTableCreationSql__(StringInfo cftsql,
+                                 ImportForeignSchemaStmt *stmt,
+                                 char const *tablename, bool estimates)
+{
+    appendStringInfo(cftsql, "\n) SERVER %s\n"
+            "OPTIONS (table %s",
+            quote_identifier(stmt->server_name),
+            quote_literal_cstr(tablename));
+    if (strcmp(stmt->remote_schema, "main") != 0)
+        appendStringInfo(cftsql, ", schema %s",
+                         quote_literal_cstr(stmt->remote_schema));
+    if (estimates)
+        appendStringInfoString(cftsql, ", use_remote_estimate 'true'");
+    appendStringInfoChar(cftsql, ')');
+    return cftsql->data;
+}
+
+
+/*
+ * The CREATE FOREIGN TABLE commands for the tables and views that stmt
+ * imports, from a single query joining sqlite_master to the columns of
+ * each table, which also leaves out those LIMIT TO or EXCEPT exclude.  The
+ * columns of a table's primary key become the key to update and delete
+ * rows by, which WITHOUT ROWID tables need; an INTEGER PRIMARY KEY of a
+ * rowid table is its rowid, so finding rows by it costs no more.  Virtual
+ * tables, whose modules we may not have, are left out.  The tables of an
+ * attached file are read from its own sqlite_master and get its alias as
+ * their schema option.
+ */
+List *
 get_foreignTableCreationSql(ImportForeignSchemaStmt *stmt,
-                            sqlite3 * db,
-                            char const * tablename,
+                            sqlite3 *db,
                             SqliteTableImportOptions importOptions)
 {
-    StringInfoData	cftsql;
-    char  *columns_q = palloc0(strlen(tablename) + 32);
-    sqlite3_stmt * volatile  columns;
-    int volatile counter = 0;
+    StringInfoData query;
+    StringInfoData cftsql;
+    sqlite3_stmt * volatile columns = NULL;
+    List *commands = NIL;
+    char *tablename = NULL;
+    bool is_table = false;
+    int counter = 0;
+    int rc;
+
+    initStringInfo(&query);
+    appendStringInfo(&query,
+        "SELECT p.cid, p.name, p.type, p.\"notnull\", p.dflt_value, p.pk, "
+        "m.name, m.type, "
+        "p.pk > 0 AND m.type = 'table' "
+        "FROM %s.sqlite_master AS m, pragma_table_info(m.name, ",
+        quote_identifier(stmt->remote_schema));
+    deparseStringLiteral(&query, stmt->remote_schema);
+    appendStringInfoString(&query, ") AS p "
+        "WHERE m.type IN ('table', 'view') "
+        "AND substr(m.name, 1, 7) <> 'sqlite_' "
+        "AND upper(substr(m.sql, 1, 14)) <> 'CREATE VIRTUAL'");
+    if (stmt->list_type != FDW_IMPORT_SCHEMA_ALL)
+    {
+        ListCell *lc;
 
-    if ( !is_sqliteTableRequired(stmt, tablename) )
-        return NULL;
+        appendStringInfoString(&query,
+            stmt->list_type == FDW_IMPORT_SCHEMA_EXCEPT
+                ? " AND m.name NOT IN (" : " AND m.name IN (");
+        foreach(lc, stmt->table_list)
+        {
+            if (lc != list_head(stmt->table_list))
+                appendStringInfoString(&query, ", ");
+            deparseStringLiteral(&query, ((RangeVar *) lfirst(lc))->relname);
+        }
+        appendStringInfoChar(&query, ')');
+    }
+    appendStringInfoString(&query, " ORDER BY m.rowid, p.cid");
 
     PG_TRY();
     {
-        cftsql.data = NULL;
-        
-        initStringInfo(&cftsql);
-        appendStringInfo(&cftsql, 
-            "CREATE FOREIGN TABLE %s.%s (",
-            stmt->local_schema, 
-            quote_identifier(tablename));
-        
-        sprintf(columns_q, "PRAGMA table_info(%s)", tablename);
-        columns = prepare_sqliteQuery(db, columns_q, NULL);
-        while (sqlite3_step(columns) == SQLITE_ROW)
-            add_columnDefinition__(&cftsql, counter++, 
+        columns = prepare_sqliteQuery(db, query.data, NULL);
+        while ((rc = sqlite3_step(columns)) == SQLITE_ROW)
+        {
+            char const *name = (char const *) sqlite3_column_text(columns, 6);
+
+            if (!tablename || strcmp(tablename, name) != 0)
+            {
+                if (tablename)
+                    commands = lappend(commands,
+                        finish_foreignTableCreationSql__(
+                            &cftsql, stmt, tablename,
+                            is_table && importOptions.import_estimates));
+
+                tablename = pstrdup(name);
+                is_table = strcmp((char const *) sqlite3_column_text(columns, 7),
+                                  "table") == 0;
+                counter = 0;
+                initStringInfo(&cftsql);
+                appendStringInfo(&cftsql,
+                    "CREATE FOREIGN TABLE %s.%s (",
+                    quote_identifier(stmt->local_schema),
+                    quote_identifier(tablename));
+            }
+            add_columnDefinition__(&cftsql, counter++,
                                    importOptions, columns);
+        }
+        if (rc != SQLITE_DONE)
+		    ereport(ERROR,
+			    (errcode(ERRCODE_FDW_ERROR),
+			    errmsg("sqlite failed to list the tables to import: %s",
+                       sqlite3_errmsg(db))
+			    ));
     }
     PG_CATCH();
     {
-        if ( cftsql.data )
-            pfree(cftsql.data);
-        pfree(columns_q);
         dispose_sqlite(NULL, (sqlite3_stmt **)&columns);
         PG_RE_THROW();
     }
     PG_END_TRY();
-    
-    dispose_sqlite(NULL, (sqlite3_stmt **)&columns);
-    pfree(columns_q);
-    
-    appendStringInfo(&cftsql, "\n) SERVER %s\n"
-            "OPTIONS (table '%s')",
-            quote_identifier(stmt->server_name),
-            quote_identifier(tablename));
 
-    return cftsql.data;
+    dispose_sqlite(NULL, (sqlite3_stmt **)&columns);
+    pfree(query.data);
+
+    if (tablename)
+        commands = lappend(commands,
+            finish_foreignTableCreationSql__(
+                &cftsql, stmt, tablename,
+                is_table && importOptions.import_estimates));
+    return commands;
 }
 
 
@@ -421,17 +949,23 @@ get_tableSource(Oid foreigntableid)
 	ForeignServer  *f_server;
 	List           *options;
 	ListCell       *lc;
-    SqliteTableSource opt;
+    SqliteTableSource opt = {0};
 	
 	/*
 	 * Extract options from FDW objects.
 	 */
 	f_table = GetForeignTable(foreigntableid);
 	f_server = GetForeignServer(f_table->serverid);
+    opt.serverid = f_server->serverid;
 
+    opt.fetch_size = DEFAULT_FETCH_SIZE;
+    opt.batch_size = DEFAULT_BATCH_SIZE;
+    opt.analyze_sampling = SQLITE_ANALYZE_AUTO;
+
+	/* Table options come last so that they override the server's */
 	options = NIL;
-	options = list_concat(options, f_table->options);
-	options = list_concat(options, f_server->options);
+	options = list_concat(options, list_copy(f_server->options));
+	options = list_concat(options, list_copy(f_table->options));
 
 	/* Loop through the options */
 	foreach(lc, options)
@@ -443,13 +977,53 @@ get_tableSource(Oid foreigntableid)
 
 		if (strcmp(def->defname, "table") == 0)
 			opt.table = defGetString(def);
+
+		if (strcmp(def->defname, "schema") == 0)
+			opt.schema = defGetString(def);
+
+		if (strcmp(def->defname, "fetch_size") == 0)
+			opt.fetch_size = atoi(defGetString(def));
+
+		if (strcmp(def->defname, "batch_size") == 0)
+			opt.batch_size = atoi(defGetString(def));
+
+		if (strcmp(def->defname, "commit_size") == 0)
+			opt.commit_size = atoi(defGetString(def));
+
+		if (strcmp(def->defname, "use_remote_estimate") == 0)
+			opt.use_remote_estimate = defGetBoolean(def);
+
+		if (strcmp(def->defname, "shard_column") == 0)
+			opt.shard_column = defGetString(def);
+
+		if (strcmp(def->defname, "cache") == 0)
+			opt.cache = defGetBoolean(def);
+
+		if (strcmp(def->defname, "analyze_sampling") == 0)
+			opt.analyze_sampling = 
+                strcmp(defGetString(def), "full") == 0 ? SQLITE_ANALYZE_FULL
+                                                       : SQLITE_ANALYZE_AUTO;
 	}
 
 	if (!opt.table)
 		opt.table = get_rel_name(foreigntableid);
 
+	/* A pattern stands for many files, see shards.c */
+	if (opt.database && has_sqliteShards(f_server->options))
+	{
+		opt.shard_pattern = opt.database;
+		opt.database = NULL;
+		opt.use_remote_estimate = false;	/* no one file speaks for all */
+		if (opt.cache)
+			ereport(ERROR,
+				(errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+				errmsg("the cache option cannot be used with a table spread "
+					   "over many files: \"%s\"", opt.shard_pattern)
+				));
+	}
+
 	/* Check we have the options we need to proceed */
-	if (!opt.database || !opt.table)
+	if ((!opt.database && !opt.shard_pattern) || !opt.table)
 		ereport(ERROR,
 			(errcode(ERRCODE_SYNTAX_ERROR),
 			errmsg("a database and a table must be specified")
@@ -458,6 +1032,35 @@ get_tableSource(Oid foreigntableid)
 }
 
 
+/*
+ * Attribute numbers of the columns declared with the key column option.
+ * Rows of a table without any are identified by their rowid.
+ */
+List *
+get_keyAttrs(Relation rel)
+{
+    TupleDesc desc = RelationGetDescr(rel);
+    List *keys = NIL;
+    int i;
+
+    for (i = 1; i <= desc->natts; i++)
+    {
+        ListCell *lc;
+
+        if (desc->attrs[i - 1]->attisdropped)
+            continue;
+        foreach(lc, GetForeignColumnOptions(RelationGetRelid(rel), i))
+        {
+            DefElem *def = (DefElem *) lfirst(lc);
+
+            if (strcmp(def->defname, "key") == 0 && defGetBoolean(def))
+                keys = lappend_int(keys, i);
+        }
+    }
+    return keys;
+}
+
+
 static void 
 add_columnDefinition__(StringInfoData *cftsql,
                        int counter,
@@ -476,6 +1079,10 @@ add_columnDefinition__(StringInfoData *cftsql,
         
     appendStringInfo(cftsql, "%s ", quote_identifier(colname));
     appendStringInfo(cftsql, "%s ", pgtypename);
+
+    // the ninth column, from get_foreignTableCreationSql, says it is a key
+    if ( sqlite3_column_int(columns, 8) == 1 )
+        appendStringInfo(cftsql, "OPTIONS (key 'true') ");
     
     // the third column is 1 if column is not null in sqlite schema
     if ( importOpts.import_notnull )
@@ -494,7 +1101,7 @@ SqliteTableImportOptions
 get_sqliteTableImportOptions(ImportForeignSchemaStmt *stmt)
 {
     ListCell *lc;
-    SqliteTableImportOptions ret;
+    SqliteTableImportOptions ret = {0};
 
 	foreach(lc, stmt->options)
 	{
@@ -504,6 +1111,8 @@ get_sqliteTableImportOptions(ImportForeignSchemaStmt *stmt)
 			ret.import_default = defGetBoolean(def);
 		else if (strcmp(def->defname, "import_not_null") == 0)
 			ret.import_notnull = defGetBoolean(def);
+		else if (strcmp(def->defname, "import_estimates") == 0)
+			ret.import_estimates = defGetBoolean(def);
 		else
 			ereport(ERROR,
 					(errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
@@ -514,110 +1123,21 @@ get_sqliteTableImportOptions(ImportForeignSchemaStmt *stmt)
 }
 
 
-static Datum
-make_datumViaCString__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
+/*
+ * Assess whether the join between inner and outer relations can be pushed down
+ * to the foreign server. As a side effect, save information we obtain in this
+ * function to SqliteFdwRelationInfo passed in.
+ */
+bool
+foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
+				RelOptInfo *outerrel, RelOptInfo *innerrel,
+				JoinPathExtraData *extra)
 {
-    return OidFunctionCall3(
-                traits->typeinput, 
-                CStringGetDatum((char*) sqlite3_column_text(stmt, col)),
-                ObjectIdGetDatum(InvalidOid), 
-                Int32GetDatum(traits->typmod));
-}
-
-
-static Datum
-make_datumInt__(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits)
-{
-    switch ( traits->pgtyp )
-    {
-        case BOOLOID:
-            return BoolGetDatum(sqlite3_column_int(stmt, col) > 0);
-        
-        case INT8OID:
-            return Int64GetDatum(sqlite3_column_int64(stmt, col));
-
-        case INT4OID:
-            return Int32GetDatum(sqlite3_column_int(stmt, col));
-
-        case INT2OID:
-            return Int16GetDatum(sqlite3_column_int(stmt, col));
-
-        case CHAROID:
-            return CharGetDatum((char) sqlite3_column_int(stmt, col));
-
-        default:
-            return make_datumViaCString__(stmt, col, traits);
-    }
-}
-
-
-static Datum
-make_datumFloat__(sqlite3_stmt *stmt, int col,
-                  PgTypeInputTraits *traits)
-{
-    switch ( traits->pgtyp )
-    {
-        case FLOAT4OID:
-            return Float4GetDatum((float) sqlite3_column_double(stmt, col));
-        
-        case FLOAT8OID:
-            return Float8GetDatum(sqlite3_column_double(stmt, col));
-        
-        default:
-            return make_datumViaCString__(stmt, col, traits);
-    }
-}
-
-
-
-
-Datum
-make_datum(sqlite3_stmt *stmt, int col, PgTypeInputTraits *traits, bool *isnull)
-{
-    if (!traits->valid)
-        return (Datum) 0;
-	
-    *isnull = false;
-    switch ( sqlite3_column_type(stmt, col) )
-    {
-        case SQLITE_INTEGER:
-            return make_datumInt__(stmt, col, traits);
-        case SQLITE_FLOAT:
-            return make_datumFloat__(stmt, col, traits);
-        case SQLITE_TEXT:
-            return make_datumViaCString__(stmt, col, traits);
-        case SQLITE_BLOB:
-        {
-            void * blob = palloc(sqlite3_column_bytes(stmt, col) + VARHDRSZ);
-            memcpy((char *)blob + VARHDRSZ, 
-                    sqlite3_column_blob(stmt, col), 
-                    sqlite3_column_bytes(stmt, col));
-			SET_VARSIZE(blob, sqlite3_column_bytes(stmt, col) + VARHDRSZ);
-			return PointerGetDatum(blob);
-        }
-        case SQLITE_NULL:
-        default:
-            *isnull = true;
-            return (Datum) 0;
-    }
-}
-
-
-/*
- * Assess whether the join between inner and outer relations can be pushed down
- * to the foreign server. As a side effect, save information we obtain in this
- * function to SqliteFdwRelationInfo passed in.
- */
-bool
-foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
-				RelOptInfo *outerrel, RelOptInfo *innerrel,
-				JoinPathExtraData *extra)
-{
-	SqliteFdwRelationInfo *fpinfo;
-	SqliteFdwRelationInfo *fpinfo_o;
-	SqliteFdwRelationInfo *fpinfo_i;
-	ListCell   *lc;
-	List	   *joinclauses;
+	SqliteFdwRelationInfo *fpinfo;
+	SqliteFdwRelationInfo *fpinfo_o;
+	SqliteFdwRelationInfo *fpinfo_i;
+	ListCell   *lc;
+	List	   *joinclauses;
 
 	/*
 	 * We support pushing down INNER, LEFT, RIGHT and FULL OUTER joins.
@@ -653,7 +1173,7 @@ foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 	 * know which quals can be evaluated on the foreign server, which might
 	 * depend on shippable_extensions.
 	 */
-	fpinfo->src.database = fpinfo_o->src.database;
+	fpinfo->src = fpinfo_o->src;
 	// merge_fdw_options(fpinfo, fpinfo_o, fpinfo_i);
 
 	/*
@@ -874,6 +1394,63 @@ classifyConditions(PlannerInfo *root,
 	}
 }
 
+/*
+ * True if sqlite, on the server of rel, compares text byte by byte where
+ * PostgreSQL does not: with the binary_collation option under a database
+ * collation other than C.  Text is then neither to be sorted nor compared
+ * for order there.
+ */
+bool
+is_sqliteTextByteOrdered(RelOptInfo *rel)
+{
+	ListCell   *lc;
+
+	if (lc_collate_is_c(DEFAULT_COLLATION_OID) || !OidIsValid(rel->serverid))
+		return false;
+
+	foreach(lc, GetForeignServer(rel->serverid)->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "binary_collation") == 0)
+			return defGetBoolean(def);
+	}
+	return false;
+}
+
+
+/*
+ * True if node compares collatable values for order, or takes the min or
+ * max of them.
+ */
+static bool
+has_textOrdering__(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, OpExpr) && OidIsValid(((OpExpr *) node)->inputcollid))
+	{
+		char	   *opname = get_opname(((OpExpr *) node)->opno);
+
+		if (opname && (strcmp(opname, "<") == 0 ||
+					   strcmp(opname, "<=") == 0 ||
+					   strcmp(opname, ">") == 0 ||
+					   strcmp(opname, ">=") == 0))
+			return true;
+	}
+	if (IsA(node, Aggref) && OidIsValid(((Aggref *) node)->inputcollid))
+	{
+		char	   *aggname = get_func_name(((Aggref *) node)->aggfnoid);
+
+		if (aggname && (strcmp(aggname, "min") == 0 ||
+						strcmp(aggname, "max") == 0))
+			return true;
+	}
+	return expression_tree_walker(node, has_textOrdering__, context);
+}
+
+
 /*
  * Returns true if given expr is safe to evaluate on the foreign server.
  */
@@ -882,17 +1459,17 @@ is_foreign_expr(PlannerInfo *root, RelOptInfo *baserel, Expr *expr)
 {
 	Oid collation = InvalidOid;
 
-	if (!foreign_expr_walker((Node *) expr, &collation, NULL))
-		return false;
-    
 	/*
-	 * An expression which includes any mutable functions can't be sent over
-	 * because its result is not stable.  For example, sending now() remote
-	 * side could cause confusion from clock offsets.  Future versions might
-	 * be able to make this choice with more granularity.  (We check this last
-	 * because it requires a lot of expensive catalog lookups.)
+	 * The walker only lets through immutable operators and functions, apart
+	 * from column-free subexpressions such as now(), which are evaluated
+	 * locally and sent as parameters.  Volatile functions never pass.
 	 */
-	if (contain_mutable_functions((Node *) expr))
+	if (!foreign_expr_walker((Node *) expr, &collation, NULL))
+		return false;
+
+	/* text that sqlite would put in another order, see binary_collation */
+	if (is_sqliteTextByteOrdered(baserel) &&
+		has_textOrdering__((Node *) expr, NULL))
 		return false;
 
 	/* OK to evaluate on the remote server */
@@ -900,8 +1477,15 @@ is_foreign_expr(PlannerInfo *root, RelOptInfo *baserel, Expr *expr)
 }
 
     
+/*
+ * Bind a value to parameter index of stmt.  Strings and blobs are bound in
+ * place, without a copy, so the caller has to keep pval until the statement
+ * has run or has its parameters bound again.  Dates and times are written
+ * in ISO style whatever the DateStyle, as the decoder expects them, and an
+ * integral numeric goes as an integer.
+ */
 void
-sqlite_bind_param_value(SqliteFdwExecutionState *festate,
+sqlite_bind_param_value(sqlite3_stmt *stmt,
                         int index, 
                         Oid ptype, 
                         Datum pval, 
@@ -910,7 +1494,6 @@ sqlite_bind_param_value(SqliteFdwExecutionState *festate,
     int rc;
 	Oid   typoutput;
 	bool  typIsVarlena;
-    sqlite3_stmt *stmt = festate->stmt;
     
     if ( isNull ) 
         rc = sqlite3_bind_null(stmt, index);
@@ -942,11 +1525,92 @@ sqlite_bind_param_value(SqliteFdwExecutionState *festate,
                 break;
 
             case BYTEAOID:
+            {
+                bytea *data = DatumGetByteaPP(pval);
+
                 rc = sqlite3_bind_blob(
                         stmt, index, 
-                        VARDATA(DatumGetPointer(pval)),
-                        VARSIZE(DatumGetPointer(pval)), SQLITE_TRANSIENT);
+                        VARDATA_ANY(data),
+                        VARSIZE_ANY_EXHDR(data), SQLITE_STATIC);
+                break;
+            }
+
+            /* their output functions only copy the string out */
+            case TEXTOID:
+            case VARCHAROID:
+            case BPCHAROID:
+            case JSONOID:
+            {
+                text *data = DatumGetTextPP(pval);
+
+                rc = sqlite3_bind_text(
+                        stmt, index, 
+                        VARDATA_ANY(data),
+                        VARSIZE_ANY_EXHDR(data), SQLITE_STATIC);
+                break;
+            }
+
+            case NUMERICOID:
+            {
+                char *str = DatumGetCString(
+                                DirectFunctionCall1(numeric_out, pval));
+                char *end;
+                int64 n;
+
+                errno = 0;
+                n = strtoll(str, &end, 10);
+                if (errno == 0 && end != str && *end == '\0')
+                    rc = sqlite3_bind_int64(stmt, index, n);
+                else
+                    rc = sqlite3_bind_text(stmt, index, str, -1,
+                                           SQLITE_TRANSIENT);
+                pfree(str);
+                break;
+            }
+
+            case DATEOID:
+            {
+                DateADT date = DatumGetDateADT(pval);
+                struct pg_tm tm;
+                char buf[MAXDATELEN + 1];
+
+                if (DATE_NOT_FINITE(date))
+                    EncodeSpecialDate(date, buf);
+                else
+                {
+                    j2date(date + POSTGRES_EPOCH_JDATE,
+                           &tm.tm_year, &tm.tm_mon, &tm.tm_mday);
+                    EncodeDateOnly(&tm, USE_ISO_DATES, buf);
+                }
+                rc = sqlite3_bind_text(stmt, index, buf, -1, SQLITE_TRANSIENT);
+                break;
+            }
+
+            case TIMESTAMPOID:
+            case TIMESTAMPTZOID:
+            {
+                Timestamp ts = DatumGetTimestamp(pval);
+                bool with_tz = ptype == TIMESTAMPTZOID;
+                struct pg_tm tm;
+                fsec_t fsec;
+                int tz = 0;
+                const char *tzn = NULL;
+                char buf[MAXDATELEN + 1];
+
+                if (TIMESTAMP_NOT_FINITE(ts))
+                    EncodeSpecialTimestamp(ts, buf);
+                else if (timestamp2tm(ts, with_tz ? &tz : NULL, &tm, &fsec,
+                                      with_tz ? &tzn : NULL, NULL) == 0)
+                    EncodeDateTime(&tm, fsec, with_tz, tz, tzn,
+                                   USE_ISO_DATES, buf);
+                else
+                    ereport(ERROR,
+                        (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+                        errmsg("timestamp out of range")
+                        ));
+                rc = sqlite3_bind_text(stmt, index, buf, -1, SQLITE_TRANSIENT);
                 break;
+            }
 
             default:
 	            getTypeOutputInfo(ptype, &typoutput, &typIsVarlena);
@@ -961,12 +1625,210 @@ sqlite_bind_param_value(SqliteFdwExecutionState *festate,
         ereport(ERROR,
             (errcode(ERRCODE_FDW_ERROR),
             errmsg("error while trying to bind param \"%s\"", 
-                        sqlite3_errmsg(festate->db))
+                        sqlite3_errmsg(sqlite3_db_handle(stmt)))
             ));
     }
 }
 
     
+/*
+ * sqlite name of a column of a foreign table: its column_name option, or
+ * else the attribute name.
+ */
+static char *
+get_columnName__(Oid relid, AttrNumber attnum)
+{
+	ListCell   *lc;
+
+	foreach(lc, GetForeignColumnOptions(relid, attnum))
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "column_name") == 0)
+			return defGetString(def);
+	}
+	return get_relid_attribute_name(relid, attnum);
+}
+
+
+/*
+ * A clause among clauses comparing the named column of baserel for
+ * equality with something that does not depend on baserel, i.e. one
+ * sqlite can look up in an index on that column.
+ */
+static RestrictInfo *
+find_equalityClause__(PlannerInfo *root, RelOptInfo *baserel,
+                      List *clauses, char const *column)
+{
+	Oid			relid = planner_rt_fetch(baserel->relid, root)->relid;
+	ListCell   *lc;
+
+	foreach(lc, clauses)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		OpExpr	   *op = (OpExpr *) rinfo->clause;
+		int			i;
+
+		if (!IsA(op, OpExpr) || list_length(op->args) != 2 ||
+			get_oprrest(op->opno) != F_EQSEL)
+			continue;
+
+		for (i = 0; i < 2; i++)
+		{
+			Node	   *arg = (Node *) list_nth(op->args, i);
+			Node	   *other = (Node *) list_nth(op->args, 1 - i);
+			Var		   *var;
+
+			while (IsA(arg, RelabelType))
+				arg = (Node *) ((RelabelType *) arg)->arg;
+			if (!IsA(arg, Var))
+				continue;
+
+			var = (Var *) arg;
+			if (var->varno == baserel->relid && var->varlevelsup == 0 &&
+				var->varattno > 0 &&
+				!bms_is_member(baserel->relid, pull_varnos(other)) &&
+				pg_strcasecmp(get_columnName__(relid, var->varattno),
+							  column) == 0)
+				return rinfo;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Number of rows sqlite reads to apply clauses when it uses the best of
+ * its indexes for them, judging by the index columns they compare for
+ * equality; -1 if no index helps.  The clauses the index accounts for are
+ * returned in *indexed.
+ */
+static double
+estimate_indexRows__(PlannerInfo *root, RelOptInfo *baserel,
+                     SqliteTableInfo *info, List *clauses, List **indexed)
+{
+	double		best = -1;
+	ListCell   *lc;
+
+	*indexed = NIL;
+	foreach(lc, info->indexes)
+	{
+		SqliteIndexInfo *index = (SqliteIndexInfo *) lfirst(lc);
+		List	   *matched = NIL;
+		double		rows;
+		int			k;
+
+		/* only a prefix of the index columns can be used */
+		for (k = 0; k < index->ncols && index->columns[k]; k++)
+		{
+			RestrictInfo *rinfo = find_equalityClause__(root, baserel, clauses,
+														index->columns[k]);
+
+			if (!rinfo)
+				break;
+			matched = lappend(matched, rinfo);
+		}
+		if (k == 0)
+			continue;
+
+		if (index->unique && k == index->ncols)
+			rows = 1;
+		else if (index->rows_per_key)
+			rows = index->rows_per_key[k - 1];
+		else
+			rows = baserel->tuples *
+				clauselist_selectivity(root, matched, baserel->relid,
+									   JOIN_INNER, NULL);
+
+		if (best < 0 || rows < best)
+		{
+			best = rows;
+			*indexed = matched;
+		}
+	}
+	return best;
+}
+
+
+static double
+estimate_remoteIndexRows__(PlannerInfo *root, RelOptInfo *baserel,
+                           List *clauses, List **indexed)
+{
+	SqliteFdwRelationInfo *fpinfo = FDW_RELINFO(baserel->fdw_private);
+    sqlite3 *db = get_sqliteDbHandle(fpinfo->src.serverid, 
+                                     fpinfo->src.database);
+    double rows;
+
+    PG_TRY();
+    {
+        rows = estimate_indexRows__(root, baserel, 
+                                    get_sqliteTableInfo(db, fpinfo->src.schema,
+                                                        fpinfo->src.table),
+                                    clauses, indexed);
+    }
+    PG_CATCH();
+    {
+        release_sqliteDbHandle(db);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    release_sqliteDbHandle(db);
+
+    return rows;
+}
+
+
+/*
+ * With use_remote_estimate, replace the local guesses at the size of a
+ * base relation by what sqlite knows (see metadata.c): the number of rows
+ * in the table and, when sqlite can use an index for the remote_conds,
+ * the number of rows that index leads to.  The conditions no index
+ * accounts for are estimated by clauselist_selectivity as before.
+ */
+void
+apply_remoteEstimates(PlannerInfo *root, RelOptInfo *baserel)
+{
+	SqliteFdwRelationInfo *fpinfo = FDW_RELINFO(baserel->fdw_private);
+    sqlite3 *db = get_sqliteDbHandle(fpinfo->src.serverid, 
+                                     fpinfo->src.database);
+    List *indexed = NIL;
+    double tablerows = -1;
+    Selectivity sel;
+
+    PG_TRY();
+    {
+        SqliteTableInfo *info = get_sqliteTableInfo(db, fpinfo->src.schema,
+                                                    fpinfo->src.table);
+
+        tablerows = info->rows;
+        if (tablerows >= 0)
+            baserel->tuples = tablerows;
+        fpinfo->index_rows = estimate_indexRows__(root, baserel, info,
+                                                  fpinfo->remote_conds,
+                                                  &indexed);
+    }
+    PG_CATCH();
+    {
+        release_sqliteDbHandle(db);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    release_sqliteDbHandle(db);
+
+    if (tablerows < 0 && fpinfo->index_rows < 0)
+        return;     /* nothing better than the local statistics */
+
+    sel = clauselist_selectivity(root,
+                                 list_difference_ptr(fpinfo->remote_conds,
+                                                     indexed),
+                                 baserel->relid, JOIN_INNER, NULL);
+    baserel->rows = clamp_row_est(
+                (fpinfo->index_rows >= 0 ? fpinfo->index_rows 
+                                         : baserel->tuples) *
+                sel * fpinfo->costsize.local_conds_sel);
+}
+
+
 static void
 estimate_join_rel_cost(PlannerInfo *root, RelOptInfo *foreignrel)
 {
@@ -1088,6 +1950,106 @@ estimate_base_rel_cost(PlannerInfo *root,
     store->startup_cost = DEFAULT_FDW_STARTUP_COST;
     store->rows = foreignrel->rows;
     store->run_cost =  cpu_per_tuple * foreignrel->tuples;
+
+    /* but with an index sqlite only visits the rows it leads to */
+    if (fpinfo->index_rows >= 0)
+        store->run_cost = cpu_operator_cost * log2(Max(foreignrel->tuples, 2.0)) +
+                          cpu_per_tuple * fpinfo->index_rows;
+
+    /* a copy of the table in memory costs no more than reading its rows */
+    if (fpinfo->cached)
+    {
+        store->startup_cost = 0;
+        store->run_cost = cpu_per_tuple * foreignrel->tuples;
+    }
+}
+
+
+/*
+ * Cost one execution of a parameterized scan of a base relation.  After
+ * the first execution a rescan is only a sqlite3_reset of the cached
+ * statement and a rebind of the outer values, so the fixed per-query
+ * startup cost is not charged again.  When the table's metadata shows an
+ * index that serves one of the join clauses, sqlite looks the rows up
+ * through it, paying about log2(tuples) comparisons per probe plus the
+ * cost of the rows it returns; otherwise every probe reads the whole
+ * table.
+ */
+void
+estimate_param_path_cost(PlannerInfo *root, RelOptInfo *baserel,
+                         ParamPathInfo *param_info,
+                         SqliteRelationCostSize *store)
+{
+	SqliteFdwRelationInfo *fpinfo = FDW_RELINFO(baserel->fdw_private);
+	Cost	cpu_per_tuple = cpu_tuple_cost + 
+                            baserel->baserestrictcost.per_tuple;
+    QualCost join_cost;
+    double retrieved_rows;
+    List *clauses;
+    List *indexed = NIL;
+    double index_rows = -1;
+
+    cost_qual_eval(&join_cost, param_info->ppi_clauses, root);
+
+    *store = fpinfo->costsize;
+    store->rows = get_parameterized_baserel_size(root, baserel,
+                                                 param_info->ppi_clauses);
+    if ( store->local_conds_sel > 0 )
+        retrieved_rows = clamp_row_est(store->rows / store->local_conds_sel);
+    else
+        retrieved_rows = clamp_row_est(store->rows);
+
+    /*
+     * A copy of the table is probed through a hash of the joined column
+     * (see tablecache.c), and every condition is checked on the rows of the
+     * probed bucket.
+     */
+    if (fpinfo->cached)
+    {
+        store->startup_cost = 0;
+        store->run_cost = cpu_operator_cost +
+                          retrieved_rows * (cpu_per_tuple + join_cost.per_tuple);
+        store->total_cost = store->run_cost + cpu_tuple_cost * store->rows;
+        return;
+    }
+
+    /*
+     * See whether an index serves the join clauses; the files of a sharded
+     * table have no one index to speak for all of them.
+     */
+    clauses = list_concat(list_copy(param_info->ppi_clauses),
+                          list_copy(fpinfo->remote_conds));
+    if (!fpinfo->src.shard_pattern)
+        index_rows = estimate_remoteIndexRows__(root, baserel, clauses,
+                                                &indexed);
+    store->startup_cost = DEFAULT_FDW_RESCAN_STARTUP_COST;
+    if (index_rows < 0 ||
+        !list_intersection(indexed, param_info->ppi_clauses))
+    {
+        store->run_cost = fpinfo->costsize.run_cost +
+                          baserel->tuples * join_cost.per_tuple;
+        store->total_cost = store->startup_cost + store->run_cost +
+                            cpu_tuple_cost * retrieved_rows;
+        return;
+    }
+
+    /* With remote estimates, the index also tells how many rows it finds */
+    if (fpinfo->src.use_remote_estimate)
+    {
+        retrieved_rows = clamp_row_est(index_rows *
+                clauselist_selectivity(root,
+                                       list_difference_ptr(clauses, indexed),
+                                       baserel->relid, JOIN_INNER, NULL));
+        store->rows = clamp_row_est(retrieved_rows * store->local_conds_sel);
+    }
+    else
+        index_rows = -1;
+
+    store->run_cost = cpu_operator_cost * log2(Max(baserel->tuples, 2.0)) +
+                      Max(index_rows, retrieved_rows) *
+                        (cpu_per_tuple + join_cost.per_tuple);
+    store->total_cost = store->startup_cost + store->run_cost +
+                        cpu_tuple_cost * retrieved_rows;
 }
 
 
@@ -1149,10 +2111,13 @@ sqlite_bind_param_values(ForeignScanState *node)
 	SqliteFdwExecutionState   *festate = (SqliteFdwExecutionState *) 
                                           node->fdw_state;
     List * fdw_exprs = ((ForeignScan *) node->ss.ps.plan)->fdw_exprs;
-    MemoryContext oldcontext = MemoryContextSwitchTo(
-                    node->ss.ps.ps_ExprContext->ecxt_per_tuple_memory);
+    MemoryContext oldcontext;
 	ListCell   *lc, *lcf;
     int i = 0;
+
+    /* the values stay bound, uncopied, for as long as the scan runs */
+    MemoryContextReset(festate->param_cxt);
+    oldcontext = MemoryContextSwitchTo(festate->param_cxt);
     
     forboth(lc, festate->param_exprs, lcf, fdw_exprs)
 	{
@@ -1164,7 +2129,8 @@ sqlite_bind_param_values(ForeignScanState *node)
 		/* Evaluate the parameter expression */
 		expr_value = ExecEvalExpr(expr_state, node->ss.ps.ps_ExprContext, 
                                   &isNull);
-        sqlite_bind_param_value(festate, i+1, ptype, expr_value, isNull);
+        sqlite_bind_param_value(festate->stmt, i+1, ptype, expr_value, 
+                                isNull);
         i++;
     }
     MemoryContextSwitchTo(oldcontext);
@@ -1172,55 +2138,835 @@ sqlite_bind_param_values(ForeignScanState *node)
 }
 
 
+/*
+ * Set up the batch buffer of a scan.  The retrieved attribute numbers are
+ * flattened into an array so the fetch loop does not walk a List.
+ */
 void
-cleanup_(SqliteFdwExecutionState *festate)
+init_fetchBuffer(SqliteFdwExecutionState *festate, int fetch_size,
+                 MemoryContext parent)
 {
-    dispose_sqlite(&festate->db, &festate->stmt);
-    pfree(festate->traits);
-    festate->traits = NULL;
-}
-
+    ListCell *lc;
+    int i = 0;
 
-void
-add_pathsWithPathKeysForRel(PlannerInfo *root, 
-                            RelOptInfo *rel,
-                            Path *epq_path)
-{
-	ListCell   *lc;
-    SqliteRelationCostSize *costs = &(FDW_RELINFO(rel)->costsize);
+    festate->nattnums = list_length(festate->retrieved_attrs);
+    festate->attnums = palloc0(Max(festate->nattnums, 1) * sizeof(int));
+    festate->ctid_col = -1;
+    foreach(lc, festate->retrieved_attrs)
+    {
+        if (lfirst_int(lc) == SelfItemPointerAttributeNumber)
+            festate->ctid_col = i;
+        festate->attnums[i++] = lfirst_int(lc);
+    }
 
-	/* Create one path for each set of pathkeys we find*/
-	foreach(lc, get_useful_pathkeys_for_relation(root, rel))
-	{
-		add_path(rel, (Path *)
-				 create_foreignscan_path(root, rel,
-                             NULL,
-                             costs->rows,
-                             costs->startup_cost * DEFAULT_FDW_SORT_MULTIPLIER,
-                             costs->total_cost * DEFAULT_FDW_SORT_MULTIPLIER,
-                             lfirst(lc),
-                             NULL,
-                             epq_path,
-                             NIL));
-	}
+    festate->fetch_size = Max(fetch_size, 1);
+    festate->values = palloc0(Max(festate->nattnums, 1) *
+                              festate->fetch_size * sizeof(Datum));
+    festate->nulls = palloc0(Max(festate->nattnums, 1) *
+                             festate->fetch_size * sizeof(bool));
+    festate->nrows = 0;
+    festate->next_row = 0;
+    festate->eof = false;
+    festate->batch_cxt = AllocSetContextCreate(parent,
+                                               "sqlite_fdw tuple data",
+                                               ALLOCSET_DEFAULT_SIZES);
+    festate->param_cxt = AllocSetContextCreate(parent,
+                                               "sqlite_fdw parameters",
+                                               ALLOCSET_SMALL_SIZES);
 }
 
 
-
 /*
- * get_useful_pathkeys_for_relation
- *		Determine which orderings of a relation might be useful.
- *
- * Getting data in sorted order can be useful either because the requested
- * order matches the final output ordering for the overall query we're
- * planning, or because it enables an efficient merge join.  Here, we try
- * to figure out which pathkeys to consider.
+ * Step the statement up to fetch_size times, decoding every row into the
+ * buffer.  Whatever the previous batch handed out is no longer referenced
+ * by the executor once we are asked for the next row, so its memory can
+ * go.
  */
-List *
-get_useful_pathkeys_for_relation(PlannerInfo *root, RelOptInfo *rel)
+static void
+step_batch__(SqliteFdwExecutionState *festate)
 {
-	List	   *useful_pathkeys_list = NIL;
-	ListCell   *lc;
+    sqlite3_stmt *stmt = festate->stmt;
+    int const ncols = festate->nattnums;
+    int const *attnums = festate->attnums;
+    int const fetch_size = festate->fetch_size;
+    Datum *values = festate->values;
+    bool *nulls = festate->nulls;
+    PgTypeInputTraits *traits = festate->traits;
+    SqliteScanStats *stats = festate->stats;
+    MemoryContext oldcontext;
+    instr_time start;
+    instr_time end;
+    int row;
+    int rc;
+
+    if (festate->timing)
+        INSTR_TIME_SET_CURRENT(start);
+    MemoryContextReset(festate->batch_cxt);
+    oldcontext = MemoryContextSwitchTo(festate->batch_cxt);
+
+    for (row = 0; row < fetch_size; row++)
+    {
+        int col;
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_ROW)
+        {
+            festate->eof = true;
+            if (rc != SQLITE_DONE)
+            {
+                char *msg = pstrdup(sqlite3_errmsg(festate->db));
+
+                sqlite3_reset(stmt);
+                check_sqliteInterrupt(rc);
+                ereport(ERROR,
+                    (errcode(ERRCODE_FDW_ERROR),
+                    errmsg("sqlite failed to execute \"%s\": %s",
+                           festate->query, msg)
+                    ));
+            }
+            break;
+        }
+
+        for (col = 0; col < ncols; col++)
+        {
+            int cell = col * fetch_size + row;
+
+            nulls[cell] = true;
+            values[cell] = (Datum) 0;
+            if (attnums[col] > 0)
+                values[cell] = make_datum(stmt, col,
+                                          traits + attnums[col] - 1,
+                                          nulls + cell);
+            else if (attnums[col] == SelfItemPointerAttributeNumber &&
+                     sqlite3_column_type(stmt, col) != SQLITE_NULL)
+            {
+                /* the rowid, turned into a ctid by store_bufferedRow */
+                values[cell] = Int64GetDatum(sqlite3_column_int64(stmt, col));
+                nulls[cell] = false;
+            }
+            if (stats)
+                stats->bytes += sqlite3_column_bytes(stmt, col);
+        }
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+    festate->nrows = row;
+    festate->next_row = 0;
+
+    if (stats)
+        stats->rows += row;
+    if (festate->timing)
+    {
+        INSTR_TIME_SET_CURRENT(end);
+        INSTR_TIME_ACCUM_DIFF(stats->step_time, end, start);
+    }
+}
+
+
+/*
+ * Run the statement to completion, keeping its rows in festate->spool, a
+ * tuplestore that holds up to work_mem of them in memory and writes the
+ * rest to a temporary file.  The rowid goes in an int8 column.
+ */
+static void
+spool_result__(SqliteFdwExecutionState *festate)
+{
+    MemoryContext cxt = GetMemoryChunkContext(festate->values);
+    MemoryContext oldcontext = MemoryContextSwitchTo(cxt);
+    int const ncols = festate->nattnums;
+    int const fetch_size = festate->fetch_size;
+    TupleDesc desc = CreateTemplateTupleDesc(ncols, false);
+    Datum *values = palloc(Max(ncols, 1) * sizeof(Datum));
+    bool *nulls = palloc(Max(ncols, 1) * sizeof(bool));
+    int col;
+
+    for (col = 0; col < ncols; col++)
+    {
+        int attnum = festate->attnums[col];
+
+        if (attnum > 0)
+            TupleDescInitEntry(desc, col + 1, NULL,
+                               festate->traits[attnum - 1].pgtyp,
+                               festate->traits[attnum - 1].typmod, 0);
+        else
+            TupleDescInitEntry(desc, col + 1, NULL, INT8OID, -1, 0);
+    }
+    festate->spool = tuplestore_begin_heap(false, false, work_mem);
+    festate->spool_slot = MakeSingleTupleTableSlot(desc);
+    MemoryContextSwitchTo(oldcontext);
+
+    while (!festate->eof)
+    {
+        int row;
+
+        step_batch__(festate);
+        for (row = 0; row < festate->nrows; row++)
+        {
+            for (col = 0; col < ncols; col++)
+            {
+                values[col] = festate->values[col * fetch_size + row];
+                nulls[col] = festate->nulls[col * fetch_size + row];
+            }
+            tuplestore_putvalues(festate->spool, desc, values, nulls);
+        }
+    }
+    MemoryContextReset(festate->batch_cxt);
+    pfree(values);
+    pfree(nulls);
+}
+
+
+/*
+ * Put the next row of the spool in the buffer, as a batch of one.  It
+ * stays valid until the next call, like any batch.
+ */
+static void
+read_spooledRow__(SqliteFdwExecutionState *festate)
+{
+    TupleTableSlot *slot = festate->spool_slot;
+    int const fetch_size = festate->fetch_size;
+    int col;
+
+    festate->nrows = 0;
+    festate->next_row = 0;
+    if (!tuplestore_gettupleslot(festate->spool, true, false, slot))
+    {
+        festate->eof = true;
+        return;
+    }
+    slot_getallattrs(slot);
+    for (col = 0; col < festate->nattnums; col++)
+    {
+        festate->values[col * fetch_size] = slot->tts_values[col];
+        festate->nulls[col * fetch_size] = slot->tts_isnull[col];
+    }
+    festate->nrows = 1;
+}
+
+
+/*
+ * Fill the buffer with the next batch of rows.
+ *
+ * With fetch_all set the statement is first stepped to completion into a
+ * tuplestore, from which the rows are then handed out.  A scan feeding an
+ * UPDATE of the same table does this so that rows it has already updated
+ * cannot show up again under the running statement (sqlite makes no
+ * promise either way about changes made on the connection while a
+ * statement is stepping).
+ */
+void
+fetch_batch(SqliteFdwExecutionState *festate)
+{
+    if (!festate->fetch_all)
+    {
+        step_batch__(festate);
+        return;
+    }
+
+    if (!festate->spool)
+    {
+        spool_result__(festate);
+        festate->eof = false;
+    }
+    read_spooledRow__(festate);
+}
+
+
+/*
+ * Forget the spooled result of a fetch_all scan, unless rewind is set and
+ * it can just be read again from its start.
+ */
+void
+reset_fetchSpool(SqliteFdwExecutionState *festate, bool rewind)
+{
+    if (!festate->spool)
+        return;
+    if (rewind)
+    {
+        tuplestore_rescan(festate->spool);
+        return;
+    }
+    ExecDropSingleTupleTableSlot(festate->spool_slot);
+    festate->spool_slot = NULL;
+    tuplestore_end(festate->spool);
+    festate->spool = NULL;
+}
+
+
+/*
+ * Move a parallel-aware scan on to a chunk of rowids that no other
+ * participant has claimed: rewind the statement and bind the chunk's
+ * bounds after the query's own parameters.  Returns false once all of
+ * them are taken.  Without shared state the one chunk is the whole range
+ * of rowids.
+ *
+ * Rewinding the statement would end sqlite's implicit read transaction, so
+ * a participant reads all its chunks in one transaction, begun before the
+ * first of them and committed by cleanup_.  Rows written by others while
+ * it runs are then seen by none of its chunks rather than by some.  The
+ * participants still read the file as of their own first chunk, since
+ * sqlite cannot share a snapshot between connections.
+ */
+bool
+claim_rowidChunk(SqliteFdwExecutionState *festate)
+{
+    SqliteParallelScanState *pstate = festate->pstate;
+    int64 lo = PG_INT64_MIN;
+    int64 hi = PG_INT64_MAX;
+
+    if (!pstate)
+    {
+        if (festate->chunk_done)
+            return false;
+        festate->chunk_done = true;
+    }
+    else
+    {
+        uint64 span = (uint64) pstate->max_rowid - (uint64) pstate->min_rowid;
+        uint64 nchunks = span / (uint64) pstate->chunk_size + 1;
+        uint64 chunk;
+
+        if (pstate->max_rowid < pstate->min_rowid)
+            return false;
+        if (!festate->read_xact)
+        {
+            begin_sqliteReadTransaction(festate->db);
+            festate->read_xact = true;
+        }
+        chunk = pg_atomic_fetch_add_u64(&pstate->next_chunk, 1);
+        if (chunk >= nchunks)
+            return false;
+
+        lo = (int64) ((uint64) pstate->min_rowid +
+                      chunk * (uint64) pstate->chunk_size);
+        hi = chunk == nchunks - 1 ? pstate->max_rowid :
+             lo + (pstate->chunk_size - 1);
+    }
+
+    sqlite3_reset(festate->stmt);
+    sqlite3_bind_int64(festate->stmt, festate->chunk_param, lo);
+    sqlite3_bind_int64(festate->stmt, festate->chunk_param + 1, hi);
+    festate->nrows = 0;
+    festate->next_row = 0;
+    festate->eof = false;
+    return true;
+}
+
+
+/*
+ * Store the next buffered row in the slot.  If the scan retrieves the
+ * rowid (because the table is the target of an UPDATE or DELETE) the row
+ * has to be a physical tuple to carry it as its ctid; otherwise a virtual
+ * tuple will do.
+ */
+void
+store_bufferedRow(SqliteFdwExecutionState *festate, TupleTableSlot *slot)
+{
+    int const natts = slot->tts_tupleDescriptor->natts;
+    int const fetch_size = festate->fetch_size;
+    int const row = festate->next_row++;
+    int col;
+
+    memset(slot->tts_values, 0, sizeof(Datum) * natts);
+    memset(slot->tts_isnull, true, sizeof(bool) * natts);
+    for (col = 0; col < festate->nattnums; col++)
+    {
+        int target = festate->attnums[col] - 1;
+
+        if (target < 0)
+            continue;
+        slot->tts_values[target] = festate->values[col * fetch_size + row];
+        slot->tts_isnull[target] = festate->nulls[col * fetch_size + row];
+    }
+
+    if (festate->ctid_col >= 0)
+    {
+        int cell = festate->ctid_col * fetch_size + row;
+        HeapTuple tuple = heap_form_tuple(slot->tts_tupleDescriptor,
+                                          slot->tts_values,
+                                          slot->tts_isnull);
+
+        if (!festate->nulls[cell])
+            rowid_to_itemPointer(DatumGetInt64(festate->values[cell]),
+                                 &tuple->t_self);
+        tuple->t_data->t_ctid = tuple->t_self;
+        HeapTupleHeaderSetXmax(tuple->t_data, InvalidTransactionId);
+        HeapTupleHeaderSetXmin(tuple->t_data, InvalidTransactionId);
+        HeapTupleHeaderSetCmin(tuple->t_data, InvalidTransactionId);
+        ExecStoreTuple(tuple, slot, InvalidBuffer, false);
+    }
+    else
+        ExecStoreVirtualTuple(slot);
+}
+
+
+void
+cleanup_(SqliteFdwExecutionState *festate)
+{
+    release_sqliteStatement(festate->db, festate->stmt);
+    festate->stmt = NULL;
+    if (festate->read_xact)
+    {
+        festate->read_xact = false;
+        commit_sqliteTransaction(festate->db);
+    }
+    if (festate->sharded)
+        close_sqliteDbHandle(festate->db);
+    else
+        release_sqliteDbHandle(festate->db);
+    festate->db = NULL;
+    reset_fetchSpool(festate, false);
+    pfree(festate->traits);
+    festate->traits = NULL;
+    if (festate->batch_cxt)
+    {
+        MemoryContextDelete(festate->batch_cxt);
+        festate->batch_cxt = NULL;
+    }
+    if (festate->param_cxt)
+    {
+        MemoryContextDelete(festate->param_cxt);
+        festate->param_cxt = NULL;
+    }
+}
+
+
+/*
+ * True if expr, as sent to sqlite in a scan of scanrel, can never be NULL:
+ * a column that the foreign table or sqlite declares NOT NULL (which takes
+ * in the INTEGER PRIMARY KEY).  Columns of joins are not looked at, since
+ * an outer join can make them NULL anyway.
+ */
+bool
+is_sqliteNotNull(PlannerInfo *root, RelOptInfo *scanrel, Expr *expr)
+{
+	SqliteFdwRelationInfo *fpinfo;
+	RangeTblEntry *rte;
+	HeapTuple	tuple;
+	Var		   *var;
+	bool		notnull = false;
+	sqlite3    *db;
+
+	while (IsA(expr, RelabelType))
+		expr = ((RelabelType *) expr)->arg;
+
+	if (!IS_SIMPLE_REL(scanrel) || !IsA(expr, Var))
+		return false;
+	var = (Var *) expr;
+	if (var->varno != scanrel->relid || var->varlevelsup != 0 ||
+		var->varattno <= 0)
+		return false;
+
+	rte = planner_rt_fetch(scanrel->relid, root);
+	tuple = SearchSysCache2(ATTNUM, ObjectIdGetDatum(rte->relid),
+							Int16GetDatum(var->varattno));
+	if (HeapTupleIsValid(tuple))
+	{
+		notnull = ((Form_pg_attribute) GETSTRUCT(tuple))->attnotnull;
+		ReleaseSysCache(tuple);
+	}
+	if (notnull)
+		return true;
+
+	fpinfo = FDW_RELINFO(scanrel->fdw_private);
+	if (!fpinfo->src.database)
+		return false;
+	db = get_sqliteDbHandle(fpinfo->src.serverid, fpinfo->src.database);
+	PG_TRY();
+	{
+		notnull = is_sqliteNotNullColumn(
+						get_sqliteTableInfo(db, fpinfo->src.schema,
+											fpinfo->src.table),
+						get_columnName__(rte->relid, var->varattno));
+	}
+	PG_CATCH();
+	{
+		release_sqliteDbHandle(db);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	release_sqliteDbHandle(db);
+
+	return notnull;
+}
+
+
+/*
+ * True if sqlite can produce the rows of a base relation in the order of
+ * pathkeys by walking index, forwards or backwards, rather than sorting:
+ * the pathkeys name a prefix of the index columns, in the index's
+ * direction (or all reversed).  sqlite puts NULLs before anything else,
+ * so a pathkey wanting them the other way round needs a column that
+ * cannot be NULL; see appendOrderByClause.
+ *
+ * An index keeps text in the order of its collation as it was when the
+ * rows went in, which for BINARY is byte order, whatever open_sqliteDb
+ * makes BINARY compare like now.  So the index only gives the order of a
+ * text pathkey under the C collation, and only if it is a BINARY index.
+ */
+static bool
+is_indexOrdered__(PlannerInfo *root, RelOptInfo *baserel,
+                  SqliteIndexInfo *index, List *pathkeys)
+{
+	Oid			relid = planner_rt_fetch(baserel->relid, root)->relid;
+	bool		reverse = false;
+	ListCell   *lc;
+	int			k = 0;
+
+	if (list_length(pathkeys) > index->ncols)
+		return false;
+
+	foreach(lc, pathkeys)
+	{
+		PathKey    *pathkey = (PathKey *) lfirst(lc);
+		Expr	   *em_expr = find_em_expr_for_rel(pathkey->pk_eclass, baserel);
+		bool		descending = pathkey->pk_strategy != BTLessStrategyNumber;
+		Var		   *var;
+
+		while (em_expr && IsA(em_expr, RelabelType))
+			em_expr = ((RelabelType *) em_expr)->arg;
+		if (!em_expr || !IsA(em_expr, Var) || !index->columns[k])
+			return false;
+		var = (Var *) em_expr;
+		if (var->varno != baserel->relid || var->varattno <= 0 ||
+			pg_strcasecmp(get_columnName__(relid, var->varattno),
+						  index->columns[k]) != 0)
+			return false;
+		if (OidIsValid(pathkey->pk_eclass->ec_collation) &&
+			!(lc_collate_is_c(pathkey->pk_eclass->ec_collation) &&
+			  index->collations[k] &&
+			  pg_strcasecmp(index->collations[k], "BINARY") == 0))
+			return false;
+
+		if (k == 0)
+			reverse = descending != index->descending[0];
+		else if ((descending != index->descending[k]) != reverse)
+			return false;
+
+		/* NULLs come first in ascending order */
+		if (pathkey->pk_nulls_first != !descending &&
+			!is_sqliteNotNull(root, baserel, em_expr))
+			return false;
+		k++;
+	}
+	return true;
+}
+
+
+/*
+ * Cost of a scan of rel that returns its rows in the order of pathkeys.
+ * For a base relation sqlite may get that order from an index: walking
+ * the table's own b-tree (INTEGER PRIMARY KEY) is free, walking another
+ * index costs a lookup of every row.  Otherwise sqlite sorts, which we
+ * cost like a local sort of the rows it retrieves.
+ */
+static void
+estimate_orderedPathCost__(PlannerInfo *root, RelOptInfo *rel,
+                           List *pathkeys, Cost *startup_cost,
+                           Cost *total_cost)
+{
+	SqliteFdwRelationInfo *fpinfo = FDW_RELINFO(rel->fdw_private);
+    SqliteRelationCostSize *costs = &fpinfo->costsize;
+    double retrieved_rows = costs->rows;
+    Path sort_path;
+
+    if ( costs->local_conds_sel > 0 )
+        retrieved_rows = clamp_row_est(costs->rows / costs->local_conds_sel);
+
+    if (IS_SIMPLE_REL(rel))
+    {
+        sqlite3 *db = get_sqliteDbHandle(fpinfo->src.serverid, 
+                                         fpinfo->src.database);
+        SqliteIndexInfo *found = NULL;
+
+        PG_TRY();
+        {
+            SqliteTableInfo *info = get_sqliteTableInfo(db,
+                                                        fpinfo->src.schema,
+                                                        fpinfo->src.table);
+            ListCell *lc;
+
+            foreach(lc, info->indexes)
+            {
+                SqliteIndexInfo *index = (SqliteIndexInfo *) lfirst(lc);
+
+                if (is_indexOrdered__(root, rel, index, pathkeys))
+                {
+                    /* prefer the table itself over a secondary index */
+                    found = index;
+                    if (!index->name)
+                        break;
+                }
+            }
+        }
+        PG_CATCH();
+        {
+            release_sqliteDbHandle(db);
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+        release_sqliteDbHandle(db);
+
+        if (found)
+        {
+            *startup_cost = costs->startup_cost;
+            *total_cost = costs->total_cost;
+            if (found->name)
+                *total_cost += retrieved_rows * cpu_operator_cost *
+                               log2(Max(rel->tuples, 2.0));
+            return;
+        }
+    }
+
+    cost_sort(&sort_path, root, pathkeys, costs->total_cost, retrieved_rows,
+              costs->width, 0.0, work_mem, -1.0);
+    *startup_cost = sort_path.startup_cost;
+    *total_cost = sort_path.total_cost;
+}
+
+
+void
+add_pathsWithPathKeysForRel(PlannerInfo *root, 
+                            RelOptInfo *rel,
+                            Path *epq_path)
+{
+	ListCell   *lc;
+    SqliteRelationCostSize *costs = &(FDW_RELINFO(rel->fdw_private)->costsize);
+
+	/* Create one path for each set of pathkeys we find*/
+	foreach(lc, get_useful_pathkeys_for_relation(root, rel))
+	{
+        List *pathkeys = (List *) lfirst(lc);
+        Cost startup_cost;
+        Cost total_cost;
+
+        estimate_orderedPathCost__(root, rel, pathkeys, 
+                                   &startup_cost, &total_cost);
+		add_path(rel, (Path *)
+				 create_foreignscan_path(root, rel,
+                             NULL,
+                             costs->rows,
+                             startup_cost,
+                             total_cost,
+                             pathkeys,
+                             NULL,
+                             epq_path,
+                             NIL));
+	}
+}
+
+
+/*
+ * The share of a parallel scan's rows each participant handles, as the
+ * core planner reckons it: the leader helps less the more workers it has
+ * to look after.
+ */
+static double
+parallel_divisor__(int parallel_workers)
+{
+    double divisor = parallel_workers;
+    double leader_contribution = 1.0 - (0.3 * parallel_workers);
+
+    if (leader_contribution > 0)
+        divisor += leader_contribution;
+    return divisor;
+}
+
+
+/*
+ * True if the table of a base relation has rowids to split a scan by.
+ */
+static bool
+has_rowids__(SqliteFdwRelationInfo *fpinfo)
+{
+    sqlite3 *db = get_sqliteDbHandle(fpinfo->src.serverid,
+                                     fpinfo->src.database);
+    volatile bool has_rowid = false;
+
+    PG_TRY();
+    {
+        has_rowid = get_sqliteTableInfo(db, fpinfo->src.schema,
+                                        fpinfo->src.table)->has_rowid;
+    }
+    PG_CATCH();
+    {
+        release_sqliteDbHandle(db);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    release_sqliteDbHandle(db);
+
+    return has_rowid;
+}
+
+
+/*
+ * Add a partial path over a base relation, whose participants scan it in
+ * chunks of rowids (see claim_rowidChunk).  Only a table with rowids can
+ * be split so, and only a large one is worth it, as judged by
+ * compute_parallel_worker from the size of the rows to read.  For a table
+ * spread over many files, the participants take whole files instead, so
+ * there is no point in more of them than files.
+ */
+void
+add_partialPathForRel(PlannerInfo *root, RelOptInfo *baserel)
+{
+	SqliteFdwRelationInfo *fpinfo = FDW_RELINFO(baserel->fdw_private);
+    SqliteRelationCostSize *costs = &fpinfo->costsize;
+    double pages;
+    int parallel_workers;
+    double divisor;
+    ForeignPath *path;
+
+    if (!baserel->consider_parallel || baserel->lateral_relids)
+        return;
+
+    pages = Max((double) baserel->pages,
+                ceil(baserel->tuples * (costs->width + SizeofHeapTupleHeader) /
+                     BLCKSZ));
+    parallel_workers = compute_parallel_worker(baserel, pages, -1);
+    if (fpinfo->src.shard_pattern)
+        parallel_workers = Min(parallel_workers,
+                               list_length(fpinfo->shards) - 1);
+    if (parallel_workers <= 0)
+        return;
+    if (!fpinfo->src.shard_pattern && !has_rowids__(fpinfo))
+        return;
+
+    divisor = parallel_divisor__(parallel_workers);
+    path = create_foreignscan_path(root, baserel,
+                                   NULL,
+                                   clamp_row_est(costs->rows / divisor),
+                                   costs->startup_cost,
+                                   costs->startup_cost +
+                                   (costs->total_cost - costs->startup_cost) /
+                                   divisor,
+                                   NIL,
+                                   NULL,
+                                   NULL,
+                                   NIL);
+    path->path.parallel_aware = true;
+    path->path.parallel_workers = parallel_workers;
+    add_partial_path(baserel, (Path *) path);
+}
+
+
+/*
+ * Equivalence classes of a base relation that could make a merge join
+ * against it, from the EC join clauses as well as the other mergejoinable
+ * join clauses.
+ */
+static List *
+get_useful_ecs_for_relation__(PlannerInfo *root, RelOptInfo *rel)
+{
+	List	   *useful_eclass_list = NIL;
+	ListCell   *lc;
+
+	if (rel->has_eclass_joins)
+	{
+		foreach(lc, root->eq_classes)
+		{
+			EquivalenceClass *cur_ec = (EquivalenceClass *) lfirst(lc);
+
+			if (eclass_useful_for_merging(root, cur_ec, rel))
+				useful_eclass_list = lappend(useful_eclass_list, cur_ec);
+		}
+	}
+
+	foreach(lc, rel->joininfo)
+	{
+		RestrictInfo *restrictinfo = (RestrictInfo *) lfirst(lc);
+
+		/* Consider only mergejoinable clauses */
+		if (restrictinfo->mergeopfamilies == NIL)
+			continue;
+
+		/* Make sure we've got canonical ECs. */
+		update_mergeclause_eclasses(root, restrictinfo);
+
+		if (bms_overlap(rel->relids, restrictinfo->right_ec->ec_relids))
+			useful_eclass_list = list_append_unique_ptr(useful_eclass_list,
+														restrictinfo->right_ec);
+		else if (bms_overlap(rel->relids, restrictinfo->left_ec->ec_relids))
+			useful_eclass_list = list_append_unique_ptr(useful_eclass_list,
+														restrictinfo->left_ec);
+	}
+
+	return useful_eclass_list;
+}
+
+
+/*
+ * An ascending pathkey on an equivalence class of a base relation, for a
+ * merge join, if sqlite has an index that yields that order; else NULL.
+ * A sort for the sake of a merge join is better left to the local side,
+ * where the planner can see what it costs against a hash join.
+ */
+static PathKey *
+get_indexMergePathKey__(PlannerInfo *root, RelOptInfo *baserel,
+                        EquivalenceClass *ec)
+{
+	SqliteFdwRelationInfo *fpinfo = FDW_RELINFO(baserel->fdw_private);
+	PathKey    *pathkey;
+	Expr	   *em_expr;
+	sqlite3    *db;
+	bool		ordered = false;
+
+	if (ec->ec_has_volatile ||
+		(OidIsValid(ec->ec_collation) && is_sqliteTextByteOrdered(baserel)) ||
+		!(em_expr = find_em_expr_for_rel(ec, baserel)) ||
+		!is_foreign_expr(root, baserel, em_expr))
+		return NULL;
+
+	pathkey = make_canonical_pathkey(root, ec,
+									 linitial_oid(ec->ec_opfamilies),
+									 BTLessStrategyNumber,
+									 false);
+
+	db = get_sqliteDbHandle(fpinfo->src.serverid, fpinfo->src.database);
+	PG_TRY();
+	{
+		SqliteTableInfo *info = get_sqliteTableInfo(db, fpinfo->src.schema,
+													fpinfo->src.table);
+		ListCell   *lc;
+
+		foreach(lc, info->indexes)
+		{
+			if (is_indexOrdered__(root, baserel, (SqliteIndexInfo *) lfirst(lc),
+								  list_make1(pathkey)))
+			{
+				ordered = true;
+				break;
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		release_sqliteDbHandle(db);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	release_sqliteDbHandle(db);
+
+	return ordered ? pathkey : NULL;
+}
+
+
+/*
+ * get_useful_pathkeys_for_relation
+ *		Determine which orderings of a relation might be useful.
+ *
+ * Getting data in sorted order can be useful either because the requested
+ * order matches the final output ordering for the overall query we're
+ * planning, or because it enables an efficient merge join.  Here, we try
+ * to figure out which pathkeys to consider.
+ */
+List *
+get_useful_pathkeys_for_relation(PlannerInfo *root, RelOptInfo *rel)
+{
+	List	   *useful_pathkeys_list = NIL;
+	EquivalenceClass *query_ec = NULL;
+	ListCell   *lc;
 
 	/*
 	 * Pushing the query_pathkeys to the remote server is always worth
@@ -1247,6 +2993,8 @@ get_useful_pathkeys_for_relation(PlannerInfo *root, RelOptInfo *rel)
 			 * checking ec_has_volatile here saves some cycles.
 			 */
 			if (pathkey_ec->ec_has_volatile ||
+				(OidIsValid(pathkey_ec->ec_collation) &&
+				 is_sqliteTextByteOrdered(rel)) ||
 				!(em_expr = find_em_expr_for_rel(pathkey_ec, rel)) ||
 				!is_foreign_expr(root, rel, em_expr))
 			{
@@ -1259,6 +3007,32 @@ get_useful_pathkeys_for_relation(PlannerInfo *root, RelOptInfo *rel)
 			useful_pathkeys_list = list_make1(list_copy(root->query_pathkeys));
 	}
 
+	/*
+	 * Orderings of a base relation that are good for a merge join, as long
+	 * as an index of the table produces them.  As in postgres_fdw we only
+	 * try pathkeys of length one, each being a copy of the whole scan.
+	 */
+	if (!IS_SIMPLE_REL(rel))
+		return useful_pathkeys_list;
+
+	if (list_length(root->query_pathkeys) == 1)
+		query_ec = ((PathKey *) linitial(root->query_pathkeys))->pk_eclass;
+
+	foreach(lc, get_useful_ecs_for_relation__(root, rel))
+	{
+		EquivalenceClass *cur_ec = (EquivalenceClass *) lfirst(lc);
+		PathKey    *pathkey;
+
+		/* If redundant with what we did above, skip it. */
+		if (cur_ec == query_ec)
+			continue;
+
+		pathkey = get_indexMergePathKey__(root, rel, cur_ec);
+		if (pathkey)
+			useful_pathkeys_list = lappend(useful_pathkeys_list,
+										   list_make1(pathkey));
+	}
+
     return useful_pathkeys_list;
 }
 
@@ -1376,36 +3150,142 @@ find_em_expr_for_rel(EquivalenceClass *ec, RelOptInfo *rel)
 }
 
 
-int8
-get_rowCount(char const *database, char const *table)
+/*
+ * Find the expression of target that the query's ORDER BY sorts on and
+ * that is a member of the given equivalence class, or NULL.
+ */
+Expr *
+find_em_expr_for_input_target(PlannerInfo *root, EquivalenceClass *ec,
+							  PathTarget *target)
 {
-    sqlite3 *db = get_sqliteDbHandle(database);
-    char *query = palloc0(strlen(table) + 32);
-    sqlite3_stmt *volatile stmt;
-    int8 rowcount = 0;
+	ListCell   *lc1;
+	int			i = 0;
+
+	foreach(lc1, target->exprs)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc1);
+		Index		sgref = get_pathtarget_sortgroupref(target, i);
+		ListCell   *lc2;
+
+		i++;
+
+		/* Ignore non-sort expressions */
+		if (sgref == 0 ||
+			get_sortgroupref_clause_noerr(sgref,
+										  root->parse->sortClause) == NULL)
+			continue;
+
+		/* We ignore binary-compatible relabeling on both ends */
+		while (expr && IsA(expr, RelabelType))
+			expr = ((RelabelType *) expr)->arg;
+
+		/* Locate an EquivalenceClass member matching this expr, if any */
+		foreach(lc2, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lc2);
+			Expr	   *em_expr;
+
+			/* Don't match constants or child members */
+			if (em->em_is_const || em->em_is_child)
+				continue;
+
+			/* Match if same expression (after stripping relabel) */
+			em_expr = em->em_expr;
+			while (em_expr && IsA(em_expr, RelabelType))
+				em_expr = ((RelabelType *) em_expr)->arg;
+
+			if (equal(em_expr, expr))
+				return em->em_expr;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Give back a handle on a file of src, closing it if the table is spread
+ * over many files.
+ */
+static void
+release_shardDbHandle__(SqliteTableSource *src, sqlite3 *db)
+{
+    if (src->shard_pattern)
+        close_sqliteDbHandle(db);
+    else
+        release_sqliteDbHandle(db);
+}
+
+
+/*
+ * Number of rows in the table of src in the file database, as far as
+ * possible without reading it: taken from sqlite_stat1 if sqlite has
+ * analyzed the table, otherwise from the span of its rowids.  Only a table
+ * that has neither is counted.
+ */
+static int64
+count_rows__(SqliteTableSource *src, char const *database)
+{
+    char const *table = src->table;
+    sqlite3 *db = get_sqliteDbHandle(src->serverid, database);
+    char *query = NULL;
+    sqlite3_stmt *volatile stmt = NULL;
+    int64 rowcount = -1;
+    int rc;
 
-    sprintf(query, "select count(*) from %s", quote_identifier(table));
     PG_TRY();
     {
-        stmt = prepare_sqliteQuery(db, query, NULL);
-        if (sqlite3_step(stmt) == SQLITE_OK)
-            rowcount = sqlite3_column_int64(stmt, 0);
+        double rows = get_sqliteTableInfo(db, src->schema, table)->rows;
+
+        if (rows >= 0)
+            rowcount = (int64) rows;
+        else
+        {
+            query = psprintf("select count(*) from %s",
+                             quote_sqliteTable(src->schema, table));
+            stmt = prepare_sqliteQuery(db, query, NULL);
+            rowcount = 0;
+            rc = sqlite3_step(stmt);
+            check_sqliteInterrupt(rc);
+            if (rc == SQLITE_ROW)
+                rowcount = sqlite3_column_int64(stmt, 0);
+        }
     }
     PG_CATCH();
     {
-        dispose_sqlite(&db, (sqlite3_stmt **)&stmt);
-        pfree(query);
+        dispose_sqlite(NULL, (sqlite3_stmt **)&stmt);
+        release_shardDbHandle__(src, db);
         PG_RE_THROW();
     }
     PG_END_TRY();
 
-    dispose_sqlite(&db, (sqlite3_stmt **)&stmt);
-    pfree(query);
+    dispose_sqlite(NULL, (sqlite3_stmt **)&stmt);
+    release_shardDbHandle__(src, db);
+    if (query)
+        pfree(query);
     
     return rowcount;
 }
 
 
+/*
+ * Number of rows in the table, summed over all its files if it has many.
+ */
+int64
+get_rowCount(SqliteTableSource *src)
+{
+    int64 rowcount = 0;
+    ListCell *lc;
+
+    if (!src->shard_pattern)
+        return count_rows__(src, src->database);
+
+    foreach(lc, get_sqliteShards(src->shard_pattern))
+        rowcount += count_rows__(src, (char const *) lfirst(lc));
+    return rowcount;
+}
+
+
 /* 
  * Guess the size of a row
  * Caveats:
@@ -1452,49 +3332,271 @@ get_numPages(Relation relation)
 }
 
 
+/*
+ * Decode the current row of stmt into a tuple and store it at rows[pos].
+ * The decoding garbage goes into tmp_cxt, which is reset for every row.
+ */
 static void
-collect_foreignSample__(SqliteAnalyzeState *state, sqlite3_stmt *stmt)
+collect_foreignSample__(SqliteAnalyzeState *state, sqlite3_stmt *stmt,
+                        int pos)
 {
     TupleTableSlot *slot = state->slot;
+    MemoryContext oldcontext = MemoryContextSwitchTo(state->tmp_cxt);
     HeapTuple tuple;
 
     populate_tupleTableSlot(stmt, slot, state->retrieved_attrs, 
                             state->traits);
+    MemoryContextSwitchTo(oldcontext);
     tuple = heap_form_tuple(slot->tts_tupleDescriptor, 
                             slot->tts_values, 
                             slot->tts_isnull);
 	HeapTupleHeaderSetXmax(tuple->t_data, InvalidTransactionId);
 	HeapTupleHeaderSetXmin(tuple->t_data, InvalidTransactionId);
 	HeapTupleHeaderSetCmin(tuple->t_data, InvalidTransactionId);
+    MemoryContextReset(state->tmp_cxt);
 
-    state->rows[state->numsamples] = tuple;
-    state->numsamples++;
+    state->rows[pos] = tuple;
 }
 
 
-void
-collect_foreignSamples(SqliteAnalyzeState *state, StringInfoData sql)
+static int
+cmp_rowid__(const void *a, const void *b)
 {
-    sqlite3 *db = get_sqliteDbHandle(state->src.database);
-    sqlite3_stmt *volatile stmt;
-    
+    int64 x = *(const int64 *) a;
+    int64 y = *(const int64 *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Sample by looking up random rowids between min_rowid and max_rowid, each
+ * lookup being one descent of the table's b-tree, so the work depends on
+ * the sample size rather than the table size.  The probes of each batch
+ * are made in ascending rowid order, which keeps the reads local.  A
+ * rowid is probed once at most, so no row is sampled twice and every
+ * probe counts towards the hit ratio.  Rowids that do not exist (deleted
+ * rows) are misses; the hit ratio, and with it the number of rows in the
+ * table, is estimated as we go.
+ *
+ * Returns false, having kept nothing, if the rowids are so sparse that
+ * the sample cannot be filled with a reasonable number of probes.
+ */
+static bool
+collect_rowidSamples__(SqliteAnalyzeState *state, sqlite3 *db,
+                       StringInfoData sql, int64 min_rowid, int64 max_rowid)
+{
+    double const span = (double) max_rowid - (double) min_rowid + 1;
+    int const targrows = state->targrows;
+    double const max_probes = (double) targrows * SQLITE_ANALYZE_MAX_SPARSENESS;
+    SamplerRandomStateData randstate;
+    int64 *probes = palloc(targrows * sizeof(int64));
+    double nprobes = 0;
+    double nhits = 0;
+    char *query = psprintf("%s WHERE rowid = ?1", sql.data);
+    sqlite3_stmt *volatile stmt = NULL;
+    HTAB *probed;
+    HASHCTL ctl;
+    int i;
+
+    sampler_random_init_state(random(), randstate);
+
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(int64);
+    ctl.entrysize = sizeof(int64);
+    ctl.hcxt = CurrentMemoryContext;
+    probed = hash_create("sqlite_fdw analyze probes", targrows, &ctl,
+                         HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    PG_TRY();
+    {
+        stmt = prepare_sqliteQuery(db, query, NULL);
+        while (state->numsamples < targrows && nprobes < max_probes &&
+               nprobes < span)
+        {
+            /* enough probes to fill the sample at the hit ratio so far */
+            double density = nprobes > 0 ? Max(nhits / nprobes, 0.01) : 1.0;
+            int n = (int) Min((targrows - state->numsamples) / density + 1,
+                              targrows);
+
+            for (i = 0; i < n; i++)
+                probes[i] = min_rowid +
+                            (int64) (sampler_random_fract(randstate) * span);
+            qsort(probes, n, sizeof(int64), cmp_rowid__);
+
+            for (i = 0; i < n && state->numsamples < targrows; i++)
+            {
+                bool found;
+
+                hash_search(probed, &probes[i], HASH_ENTER, &found);
+                if (found)
+                    continue;
+                vacuum_delay_point();
+
+                nprobes++;
+                sqlite3_bind_int64(stmt, 1, probes[i]);
+                if (sqlite3_step(stmt) == SQLITE_ROW)
+                {
+                    collect_foreignSample__(state, stmt, state->numsamples);
+                    state->numsamples++;
+                    nhits++;
+                }
+                sqlite3_reset(stmt);
+            }
+        }
+    }
+    PG_CATCH();
+    {
+        dispose_sqlite(NULL, (sqlite3_stmt **)&stmt);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    dispose_sqlite(NULL, (sqlite3_stmt **)&stmt);
+    hash_destroy(probed);
+    pfree(query);
+    pfree(probes);
+
+    if (state->numsamples < targrows)
+    {
+        elog(DEBUG1, "sqlite_fdw: rowids of %s too sparse to sample, "
+                     "reading the whole table", state->src.table);
+        for (i = 0; i < state->numsamples; i++)
+            heap_freetuple(state->rows[i]);
+        state->numsamples = 0;
+        return false;
+    }
+
+    state->count = rint(span * nhits / nprobes);
+    return true;
+}
+
+
+/*
+ * Sample by reading the whole table, keeping a uniform sample of its rows
+ * with the reservoir algorithm ANALYZE itself uses.  The reservoir, and
+ * state->count, carry on from one call to the next, so the files of a
+ * sharded table can be read one after another.  Every row joins the
+ * sample independently of the others, so the skip ahead can be drawn
+ * afresh for each file.
+ */
+static void
+collect_allSamples__(SqliteAnalyzeState *state, sqlite3 *db,
+                     StringInfoData sql, ReservoirState rstate)
+{
+    int const targrows = state->targrows;
+    double rowstoskip = -1;
+    sqlite3_stmt *volatile stmt = NULL;
+    int rc;
+
     PG_TRY();
     {
         stmt = prepare_sqliteQuery(db, sql.data, NULL);
-        while ( sqlite3_step(stmt) == SQLITE_ROW ) {
-            if (state->count % state->toskip == 0)
-                if (state->numsamples < state->targrows)
-                    collect_foreignSample__(state, stmt);
+        while ( (rc = sqlite3_step(stmt)) == SQLITE_ROW ) {
+            vacuum_delay_point();
+
+            if (state->numsamples < targrows)
+            {
+                collect_foreignSample__(state, stmt, state->numsamples);
+                state->numsamples++;
+            }
+            else
+            {
+                /*
+                 * The first targrows rows are all kept; after that a row
+                 * replaces a random earlier one with falling probability.
+                 */
+                if (rowstoskip < 0)
+                    rowstoskip = reservoir_get_next_S(rstate, state->count,
+                                                      targrows);
+                if (rowstoskip <= 0)
+                {
+                    int pos = (int) (targrows *
+                                     sampler_random_fract(rstate->randstate));
+
+                    heap_freetuple(state->rows[pos]);
+                    collect_foreignSample__(state, stmt, pos);
+                }
+                rowstoskip -= 1;
+            }
             state->count++;
         }
+        check_sqliteInterrupt(rc);
+    }
+    PG_CATCH();
+    {
+        dispose_sqlite(NULL, (sqlite3_stmt **)&stmt);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    dispose_sqlite(NULL, (sqlite3_stmt **)&stmt);
+}
+
+
+/*
+ * Sample the table in the file database.  Unless analyze_sampling is
+ * 'full' or this is one of many files, tables with rowids that are not
+ * small are sampled by rowid; the rest are read in full.
+ */
+static void
+collect_fileSamples__(SqliteAnalyzeState *state, char const *database,
+                      StringInfoData sql, ReservoirState rstate)
+{
+    sqlite3 *db = get_sqliteDbHandle(state->src.serverid, database);
+    int64 min_rowid;
+    int64 max_rowid;
+
+    PG_TRY();
+    {
+        bool sampled = false;
+
+        if (state->targrows > 0 && !state->src.shard_pattern &&
+            state->src.analyze_sampling == SQLITE_ANALYZE_AUTO &&
+            get_sqliteRowidRange(db, state->src.schema, state->src.table,
+                                 &min_rowid, &max_rowid) &&
+            (double) max_rowid - (double) min_rowid + 1 >
+                (double) state->targrows * SQLITE_ANALYZE_FULL_SCAN_RATIO)
+            sampled = collect_rowidSamples__(state, db, sql,
+                                             min_rowid, max_rowid);
+        if (!sampled)
+            collect_allSamples__(state, db, sql, rstate);
     }
     PG_CATCH();
     {
-        dispose_sqlite(&db, (sqlite3_stmt **)&stmt);
+        release_shardDbHandle__(&state->src, db);
         PG_RE_THROW();
     }
     PG_END_TRY();
-    dispose_sqlite(&db, (sqlite3_stmt **)&stmt);
+    release_shardDbHandle__(&state->src, db);
+}
+
+
+/*
+ * Fill state->rows with a sample of the table; of all its files in turn
+ * if it is sharded.
+ */
+void
+collect_foreignSamples(SqliteAnalyzeState *state, StringInfoData sql)
+{
+    ReservoirStateData rstate;
+    ListCell *lc;
+
+    state->tmp_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                           "sqlite_fdw analyze",
+                                           ALLOCSET_SMALL_SIZES);
+    reservoir_init_selection_state(&rstate, state->targrows);
+    state->count = 0;
+
+    if (!state->src.shard_pattern)
+        collect_fileSamples__(state, state->src.database, sql, &rstate);
+    else
+    {
+        foreach(lc, get_sqliteShards(state->src.shard_pattern))
+            collect_fileSamples__(state, (char const *) lfirst(lc), sql,
+                                  &rstate);
+    }
+
+    MemoryContextDelete(state->tmp_cxt);
+    state->tmp_cxt = NULL;
 }
 
 
@@ -1520,41 +3622,3 @@ populate_tupleTableSlot(sqlite3_stmt *stmt,
     }
     ExecStoreVirtualTuple(slot);
 }
-
-    
-static PgTypeInputTraits
-get_pgTypeInputTraits__(Oid pgtyp)
-{
-    PgTypeInputTraits traits = {0};
-	HeapTuple tuple;
-    Form_pg_type typeform;
-	
-    traits.pgtyp = pgtyp;
-    tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(pgtyp));
-	if (!HeapTupleIsValid(tuple))
-    {
-		elog(ERROR, "cache lookup failed for type %u", pgtyp);
-        traits.valid = false;
-    }
-    else
-    {
-        typeform = ((Form_pg_type)GETSTRUCT(tuple));
-        traits.typeinput = typeform->typinput;
-	    traits.typmod  = typeform->typtypmod;
-        traits.valid = true;
-    }
-	
-	ReleaseSysCache(tuple);
-    return traits;
-}
-
-
-PgTypeInputTraits *
-get_pgTypeInputTraits(TupleDesc desc)
-{
-    PgTypeInputTraits *vec = palloc0(desc->natts * sizeof(PgTypeInputTraits));
-    int i;
-    for ( i = 0; i < desc->natts; i++)
-        vec[i] = get_pgTypeInputTraits__(desc->attrs[i]->atttypid);
-    return vec;
-}
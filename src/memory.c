@@ -0,0 +1,226 @@
+/*-------------------------------------------------------------------------
+ *
+ * memory.c
+ *	  sqlite's memory, taken from a PostgreSQL memory context.
+ *
+ * sqlite's page caches, sorters and temporary b-trees all allocate through
+ * the allocator set up here, which takes the memory from the "sqlite_fdw
+ * sqlite heap" context, so a memory context dump shows what sqlite holds.
+ * sqlite_fdw.soft_heap_limit asks sqlite to give back cache memory to stay
+ * under a size, and sqlite_fdw.hard_heap_limit makes its allocations fail
+ * beyond one.  Both count all the connections of the backend together.
+ * sqlite_fdw_memory_usage() shows how much sqlite uses.
+ *
+ * The allocator has to be in place before sqlite is first used, so it is
+ * set up when the library is loaded.  If sqlite was already in use by then
+ * (another library of the backend using it too), sqlite keeps its own
+ * malloc, but the limits still apply.
+ *
+ * The page caches of each connection are sized by work_mem, see
+ * connection.c, which bounds sqlite's sorts as well: a sorter spills to
+ * temporary files beyond the page cache's size.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <postgres.h>
+#include <access/htup_details.h>
+#include <funcapi.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+
+#include <sqlite3.h>
+
+#include "sqlite_private.h"
+
+
+/* Each allocation is preceded by its size, which sqlite asks for */
+#define SQLITE_MEM_HEADER MAXALIGN(sizeof(int64))
+
+
+static MemoryContext sqlite_cxt = NULL;
+static int soft_heap_limit = 0;     // kB, 0 for none
+static int hard_heap_limit = 0;
+
+
+/*
+ * The allocator sqlite calls.  It must not throw, so it reports failure
+ * with NULL and lets sqlite turn that into SQLITE_NOMEM.
+ */
+static void *
+mem_malloc__(int size)
+{
+    char *chunk = MemoryContextAllocExtended(sqlite_cxt,
+                                             SQLITE_MEM_HEADER + size,
+                                             MCXT_ALLOC_HUGE |
+                                             MCXT_ALLOC_NO_OOM);
+
+    if (!chunk)
+        return NULL;
+    *(int64 *) chunk = size;
+    return chunk + SQLITE_MEM_HEADER;
+}
+
+
+static void
+mem_free__(void *ptr)
+{
+    if (ptr)
+        pfree((char *) ptr - SQLITE_MEM_HEADER);
+}
+
+
+static int
+mem_size__(void *ptr)
+{
+    return ptr ? (int) *(int64 *) ((char *) ptr - SQLITE_MEM_HEADER) : 0;
+}
+
+
+/* repalloc throws when it runs out of memory, so we move the data over */
+static void *
+mem_realloc__(void *ptr, int size)
+{
+    void *moved = mem_malloc__(size);
+
+    if (moved)
+    {
+        memcpy(moved, ptr, Min(size, mem_size__(ptr)));
+        mem_free__(ptr);
+    }
+    return moved;
+}
+
+
+static int
+mem_roundup__(int size)
+{
+    return MAXALIGN(size);
+}
+
+
+static int
+mem_init__(void *arg)
+{
+    return SQLITE_OK;
+}
+
+
+static void
+mem_shutdown__(void *arg)
+{
+}
+
+
+static void
+assign_softHeapLimit__(int newval, void *extra)
+{
+    sqlite3_soft_heap_limit64((sqlite3_int64) newval * 1024);
+}
+
+
+static void
+assign_hardHeapLimit__(int newval, void *extra)
+{
+#if SQLITE_VERSION_NUMBER >= 3031000
+    sqlite3_hard_heap_limit64((sqlite3_int64) newval * 1024);
+#endif
+}
+
+
+/*
+ * Give sqlite our allocator, and define the settings of its heap.
+ */
+void
+init_sqliteMemory(void)
+{
+    static sqlite3_mem_methods const methods = {
+        mem_malloc__,
+        mem_free__,
+        mem_realloc__,
+        mem_size__,
+        mem_roundup__,
+        mem_init__,
+        mem_shutdown__,
+        NULL
+    };
+
+    sqlite_cxt = AllocSetContextCreate(TopMemoryContext,
+                                       "sqlite_fdw sqlite heap",
+                                       ALLOCSET_DEFAULT_SIZES);
+    if (sqlite3_config(SQLITE_CONFIG_MALLOC, &methods) != SQLITE_OK)
+    {
+        elog(DEBUG1, "sqlite_fdw: sqlite is in use already, "
+                     "it keeps its own allocator");
+        MemoryContextDelete(sqlite_cxt);
+        sqlite_cxt = NULL;
+    }
+
+    /* these call sqlite3_initialize, so come after sqlite3_config */
+    DefineCustomIntVariable("sqlite_fdw.soft_heap_limit",
+                            "Sets the memory sqlite tries to stay under in "
+                            "this backend.",
+                            "sqlite gives back cache memory to stay under it. "
+                            "Zero means no limit.",
+                            &soft_heap_limit,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_KB,
+                            NULL,
+                            assign_softHeapLimit__,
+                            NULL);
+    DefineCustomIntVariable("sqlite_fdw.hard_heap_limit",
+                            "Sets the most memory sqlite may allocate in this "
+                            "backend.",
+                            "sqlite's allocations beyond it fail, and so do "
+                            "the queries that need them. Zero means no limit.",
+                            &hard_heap_limit,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_SUSET,
+                            GUC_UNIT_KB,
+                            NULL,
+                            assign_hardHeapLimit__,
+                            NULL);
+}
+
+
+/*
+ * SQL functions
+ */
+PG_FUNCTION_INFO_V1(sqlite_fdw_memory_usage);
+
+#define SQLITE_FDW_MEMORY_USAGE_COLS 4
+
+/*
+ * The bytes sqlite has allocated in this backend, the most it has had
+ * allocated (since the last reset, which the argument asks for), and its
+ * heap limits.
+ */
+Datum
+sqlite_fdw_memory_usage(PG_FUNCTION_ARGS)
+{
+    bool reset = PG_GETARG_BOOL(0);
+    TupleDesc tupdesc;
+    Datum values[SQLITE_FDW_MEMORY_USAGE_COLS];
+    bool nulls[SQLITE_FDW_MEMORY_USAGE_COLS];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+    MemSet(nulls, 0, sizeof(nulls));
+    values[0] = Int64GetDatum(sqlite3_memory_used());
+    values[1] = Int64GetDatum(sqlite3_memory_highwater(reset));
+    values[2] = Int64GetDatum(sqlite3_soft_heap_limit64(-1));
+#if SQLITE_VERSION_NUMBER >= 3031000
+    values[3] = Int64GetDatum(sqlite3_hard_heap_limit64(-1));
+#else
+    nulls[3] = true;
+#endif
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(
+        heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
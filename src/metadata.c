@@ -0,0 +1,333 @@
+/*-------------------------------------------------------------------------
+ *
+ * metadata.c
+ *	  What sqlite itself knows about a table, for the planner.
+ *
+ * With use_remote_estimate, the size of a foreign table and the
+ * selectivity of the conditions sent to sqlite are judged from sqlite's
+ * own bookkeeping rather than from local statistics, which a freshly
+ * attached database file does not have:
+ *
+ *	- the number of rows, from sqlite_stat1 if sqlite has analyzed the
+ *	  table, or else from the span of its rowids;
+ *	- the table's indexes and their columns, from PRAGMA index_list and
+ *	  index_xinfo, plus the INTEGER PRIMARY KEY, which is the rowid;
+ *	- the columns declared NOT NULL, from PRAGMA table_info;
+ *	- the average number of rows per distinct value of each prefix of an
+ *	  index's columns, again from sqlite_stat1.
+ *
+ * None of this reads the table itself.  The result is cached with the
+ * connection (see get_sqliteTableInfo), so it is loaded once per backend
+ * and database file.  A table with the schema option is looked up in that
+ * attached database only, and so are its indexes and sqlite_stat1.
+ * Nothing in here throws on a sqlite error: whatever cannot be found out
+ * is left unknown.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <postgres.h>
+#include <utils/builtins.h>
+
+#include <sqlite3.h>
+
+#include "sqlite_private.h"
+
+
+/*
+ * Parse a sqlite_stat1 stat string, "N a b c ...": N rows in all, a rows
+ * per distinct value of the first index column, b per distinct pair of the
+ * first two, and so on.  Returns the number of values parsed.
+ */
+static int
+parse_stat1__(char const *stat, double *values, int nvalues)
+{
+    int n = 0;
+
+    while (n < nvalues)
+    {
+        char *end;
+        double v = strtod(stat, &end);
+
+        if (end == stat)
+            break;
+        values[n++] = v;
+        stat = end;
+    }
+    return n;
+}
+
+
+/*
+ * PRAGMA name(arg), run on the database of the table.
+ */
+static char *
+pragma_query__(SqliteTableInfo *info, char const *name, char const *arg)
+{
+    if (info->schema)
+        return psprintf("PRAGMA %s.%s(%s)", quote_identifier(info->schema),
+                        name, quote_identifier(arg));
+    return psprintf("PRAGMA %s(%s)", name, quote_identifier(arg));
+}
+
+
+static SqliteIndexInfo *
+find_index__(SqliteTableInfo *info, char const *name)
+{
+    ListCell *lc;
+
+    foreach(lc, info->indexes)
+    {
+        SqliteIndexInfo *index = (SqliteIndexInfo *) lfirst(lc);
+
+        if (index->name && strcmp(index->name, name) == 0)
+            return index;
+    }
+    return NULL;
+}
+
+
+/*
+ * The NOT NULL columns of the table, and its INTEGER PRIMARY KEY column if
+ * it has one.  That column is the rowid, so sqlite does not list an index
+ * for it, and it cannot be NULL either.
+ */
+static void
+load_columns__(sqlite3 *db, SqliteTableInfo *info)
+{
+    char *query = pragma_query__(info, "table_info", info->table);
+    sqlite3_stmt *stmt = NULL;
+    char *pk_column = NULL;
+    int npk = 0;
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+    {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            char const *name = (char const *) sqlite3_column_text(stmt, 1);
+            char const *type = (char const *) sqlite3_column_text(stmt, 2);
+
+            if (sqlite3_column_int(stmt, 3) != 0)
+                info->notnull = lappend(info->notnull, pstrdup(name));
+            if (sqlite3_column_int(stmt, 5) == 0)
+                continue;
+            npk++;
+            if (type && pg_strcasecmp(type, "integer") == 0)
+                pk_column = pstrdup(name);
+        }
+    }
+    sqlite3_finalize(stmt);
+    pfree(query);
+
+    if (npk == 1 && pk_column)
+    {
+        SqliteIndexInfo *index = palloc0(sizeof(SqliteIndexInfo));
+
+        index->unique = true;
+        index->ncols = 1;
+        index->columns = palloc(sizeof(char *));
+        index->columns[0] = pk_column;
+        index->descending = palloc0(sizeof(bool));
+        index->collations = palloc0(sizeof(char *));
+        info->indexes = lappend(info->indexes, index);
+        info->notnull = lappend(info->notnull, pk_column);
+    }
+}
+
+
+static void
+load_indexColumns__(sqlite3 *db, SqliteTableInfo *info, SqliteIndexInfo *index)
+{
+    char *query = pragma_query__(info, "index_xinfo", index->name);
+    sqlite3_stmt *stmt = NULL;
+    int size = 4;
+
+    index->columns = palloc0(size * sizeof(char *));
+    index->descending = palloc0(size * sizeof(bool));
+    index->collations = palloc0(size * sizeof(char *));
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+    {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            /* the rowid and other auxiliary columns come after the keys */
+            if (sqlite3_column_int(stmt, 5) == 0)
+                break;
+
+            if (index->ncols == size)
+            {
+                size *= 2;
+                index->columns = repalloc(index->columns,
+                                          size * sizeof(char *));
+                index->descending = repalloc(index->descending,
+                                             size * sizeof(bool));
+                index->collations = repalloc(index->collations,
+                                             size * sizeof(char *));
+            }
+
+            /* an expression (cid -2) has no column name */
+            index->columns[index->ncols] =
+                sqlite3_column_type(stmt, 2) == SQLITE_NULL ? NULL :
+                pstrdup((char const *) sqlite3_column_text(stmt, 2));
+            index->descending[index->ncols] = sqlite3_column_int(stmt, 3) != 0;
+            index->collations[index->ncols] =
+                sqlite3_column_type(stmt, 4) == SQLITE_NULL ? NULL :
+                pstrdup((char const *) sqlite3_column_text(stmt, 4));
+            index->ncols++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    pfree(query);
+}
+
+
+/*
+ * Indexes that can serve any query.  Partial indexes are left out, since
+ * we do not know when their predicate holds.
+ */
+static void
+load_indexes__(sqlite3 *db, SqliteTableInfo *info)
+{
+    char *query = pragma_query__(info, "index_list", info->table);
+    sqlite3_stmt *stmt = NULL;
+    ListCell *lc;
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+    {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            SqliteIndexInfo *index;
+
+            if (sqlite3_column_int(stmt, 4) != 0)
+                continue;
+            index = palloc0(sizeof(SqliteIndexInfo));
+            index->name = pstrdup((char const *) sqlite3_column_text(stmt, 1));
+            index->unique = sqlite3_column_int(stmt, 2) != 0;
+            info->indexes = lappend(info->indexes, index);
+        }
+    }
+    sqlite3_finalize(stmt);
+    pfree(query);
+
+    foreach(lc, info->indexes)
+        load_indexColumns__(db, info, (SqliteIndexInfo *) lfirst(lc));
+}
+
+
+/*
+ * Row count of the table and rows per key of its indexes, where sqlite's
+ * ANALYZE has recorded them.  There is no sqlite_stat1 table at all until
+ * sqlite has been asked to ANALYZE for the first time.
+ */
+static void
+load_stat1__(sqlite3 *db, SqliteTableInfo *info)
+{
+    char *query = psprintf("SELECT idx, stat FROM %s WHERE tbl = ?1",
+                           quote_sqliteTable(info->schema, "sqlite_stat1"));
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK)
+    {
+        sqlite3_bind_text(stmt, 1, info->table, -1, SQLITE_STATIC);
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            char const *stat = (char const *) sqlite3_column_text(stmt, 1);
+            SqliteIndexInfo *index = NULL;
+            double *values;
+            int nvalues;
+            int n;
+
+            if (!stat)
+                continue;
+            if (sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+                index = find_index__(info,
+                            (char const *) sqlite3_column_text(stmt, 0));
+
+            nvalues = (index ? index->ncols : 0) + 1;
+            values = palloc(nvalues * sizeof(double));
+            n = parse_stat1__(stat, values, nvalues);
+            if (n > 0 && values[0] >= 0)
+                info->rows = values[0];
+            if (index && n == index->ncols + 1)
+                index->rows_per_key = values + 1;
+        }
+    }
+    sqlite3_finalize(stmt);
+    pfree(query);
+}
+
+
+/*
+ * True if sqlite declares the named column of the table NOT NULL.
+ */
+bool
+is_sqliteNotNullColumn(SqliteTableInfo *info, char const *column)
+{
+    ListCell *lc;
+
+    foreach(lc, info->notnull)
+    {
+        if (pg_strcasecmp((char const *) lfirst(lc), column) == 0)
+            return true;
+    }
+    return false;
+}
+
+
+/*
+ * Smallest and largest rowid of a table, each found with one descent of
+ * its b-tree.  An empty table gives an empty range.  Returns false for a
+ * table without rowids.
+ */
+bool
+get_sqliteRowidRange(sqlite3 *db, char const *schema, char const *table,
+                     int64 *min_rowid, int64 *max_rowid)
+{
+    char *query = psprintf("SELECT min(rowid), max(rowid) FROM %s",
+                           quote_sqliteTable(schema, table));
+    sqlite3_stmt *stmt = NULL;
+    bool result = false;
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        result = true;
+        *min_rowid = 0;
+        *max_rowid = -1;
+        if (sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+        {
+            *min_rowid = sqlite3_column_int64(stmt, 0);
+            *max_rowid = sqlite3_column_int64(stmt, 1);
+        }
+    }
+    sqlite3_finalize(stmt);
+    pfree(query);
+    return result;
+}
+
+
+/*
+ * Gather the planner metadata of a table in CurrentMemoryContext.  Use
+ * get_sqliteTableInfo for the cached copy.
+ */
+SqliteTableInfo *
+load_sqliteTableInfo(sqlite3 *db, char const *schema, char const *table)
+{
+    SqliteTableInfo *info = palloc0(sizeof(SqliteTableInfo));
+    int64 min_rowid;
+    int64 max_rowid;
+
+    info->schema = schema ? pstrdup(schema) : NULL;
+    info->table = pstrdup(table);
+    info->rows = -1;
+
+    load_indexes__(db, info);
+    load_columns__(db, info);
+    load_stat1__(db, info);
+
+    info->has_rowid = get_sqliteRowidRange(db, schema, table,
+                                           &min_rowid, &max_rowid);
+    if (info->rows < 0 && info->has_rowid)
+        info->rows = (double) max_rowid - (double) min_rowid + 1;
+
+    return info;
+}
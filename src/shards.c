@@ -0,0 +1,434 @@
+/*-------------------------------------------------------------------------
+ *
+ * shards.c
+ *	  Foreign tables spread over many sqlite files.
+ *
+ * A server with the shards option, whose database option is then a glob
+ * pattern such as '/data/events_*.db', serves every file the pattern
+ * matches, all of them holding the same tables.  The option has to be
+ * asked for, as "*", "?" and "[" may well be part of a file name.  A
+ * scan of one of its foreign tables reads the files in turn.
+ *
+ * With the table's shard_column option, the part of a file name that the
+ * pattern's '*' matches is the file's key, read as a value of the named
+ * column.  The files, ordered by key, are taken to hold the rows whose
+ * shard column lies from the file's key up to (not including) the next
+ * file's key; the first file also takes anything below its key.  So one
+ * file per day fits a date column holding the day as well as a timestamp
+ * column.  From conditions comparing the column with a constant, such as
+ * "day >= '2024-03-01'" or "day = $1", each scan works out which files
+ * can hold matching rows and leaves the others out.  The files are listed
+ * when the scan starts rather than when it is planned, so a prepared
+ * statement also reads the files added since.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <postgres.h>
+#include <access/stratnum.h>
+#include <commands/defrem.h>
+#include <executor/executor.h>
+#include <nodes/relation.h>
+#include <parser/parsetree.h>
+#include <utils/lsyscache.h>
+#include <utils/typcache.h>
+
+#include <glob.h>
+
+#include "sqlite_private.h"
+
+
+typedef struct
+{
+    char   *path;
+    Datum   key;
+} ShardKey;
+
+
+typedef struct
+{
+    FmgrInfo   *cmp;
+    Oid         collation;
+} ShardKeyCmpContext;
+
+
+/*
+ * True if the server with these options has its database option name many
+ * files rather than one.
+ */
+bool
+has_sqliteShards(List *options)
+{
+    ListCell *lc;
+
+    foreach(lc, options)
+    {
+        DefElem *def = (DefElem *) lfirst(lc);
+
+        if (strcmp(def->defname, "shards") == 0)
+            return defGetBoolean(def);
+    }
+    return false;
+}
+
+
+/*
+ * The files matching pattern, in the order of their names.
+ */
+List *
+get_sqliteShards(char const *pattern)
+{
+    glob_t      found;
+    List       *shards = NIL;
+    int         rc;
+    size_t      i;
+
+    rc = glob(pattern, 0, NULL, &found);
+    if (rc != 0 && rc != GLOB_NOMATCH)
+    {
+        globfree(&found);
+        ereport(ERROR,
+            (errcode(ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+            errmsg("could not list the sqlite files matching \"%s\"",
+                   pattern)
+            ));
+    }
+
+    for (i = 0; rc == 0 && i < found.gl_pathc; i++)
+        shards = lappend(shards, pstrdup(found.gl_pathv[i]));
+    globfree(&found);
+    return shards;
+}
+
+
+static int
+cmp_shardKey__(const void *a, const void *b, void *arg)
+{
+    ShardKeyCmpContext *cxt = (ShardKeyCmpContext *) arg;
+
+    return DatumGetInt32(FunctionCall2Coll(cxt->cmp, cxt->collation,
+                                           ((ShardKey const *) a)->key,
+                                           ((ShardKey const *) b)->key));
+}
+
+
+/*
+ * Number of keys, of nkeys sorted ones, below value, or with or_equal at
+ * most value.
+ */
+static int
+count_keysBelow__(ShardKey *keys, int nkeys, Datum value, bool or_equal,
+                  ShardKeyCmpContext *cxt)
+{
+    int n = 0;
+
+    while (n < nkeys)
+    {
+        int c = DatumGetInt32(FunctionCall2Coll(cxt->cmp, cxt->collation,
+                                                keys[n].key, value));
+
+        if (c > 0 || (c == 0 && !or_equal))
+            break;
+        n++;
+    }
+    return n;
+}
+
+
+/*
+ * The btree strategy of clause, "shard column <op> value" once turned
+ * round if need be, with the value, a constant or a query parameter, in
+ * *value.  Returns 0 for any other clause.
+ */
+static int
+get_shardCondition__(Expr *clause, Index relid, AttrNumber attnum,
+                     TypeCacheEntry *tce, Oid collation, Expr **value)
+{
+    OpExpr *op;
+    Node   *left;
+    Node   *right;
+    Var    *var;
+    int     strategy;
+    bool    commuted = false;
+
+    if (!IsA(clause, OpExpr) || list_length(((OpExpr *) clause)->args) != 2)
+        return 0;
+    op = (OpExpr *) clause;
+    left = linitial(op->args);
+    right = lsecond(op->args);
+    while (IsA(left, RelabelType))
+        left = (Node *) ((RelabelType *) left)->arg;
+    while (IsA(right, RelabelType))
+        right = (Node *) ((RelabelType *) right)->arg;
+
+    if (IsA(right, Var) && !IsA(left, Var))
+    {
+        Node *tmp = left;
+
+        left = right;
+        right = tmp;
+        commuted = true;
+    }
+    if (!IsA(left, Var))
+        return 0;
+    if (!(IsA(right, Const) && !((Const *) right)->constisnull &&
+          ((Const *) right)->consttype == tce->type_id) &&
+        !(IsA(right, Param) && ((Param *) right)->paramkind == PARAM_EXTERN &&
+          ((Param *) right)->paramtype == tce->type_id))
+        return 0;
+
+    var = (Var *) left;
+    if (var->varno != relid || var->varattno != attnum ||
+        var->varlevelsup != 0 || op->inputcollid != collation)
+        return 0;
+
+    strategy = get_op_opfamily_strategy(op->opno, tce->btree_opf);
+    if (commuted)
+    {
+        if (strategy == BTLessStrategyNumber)
+            strategy = BTGreaterStrategyNumber;
+        else if (strategy == BTLessEqualStrategyNumber)
+            strategy = BTGreaterEqualStrategyNumber;
+        else if (strategy == BTGreaterStrategyNumber)
+            strategy = BTLessStrategyNumber;
+        else if (strategy == BTGreaterEqualStrategyNumber)
+            strategy = BTLessEqualStrategyNumber;
+    }
+    *value = (Expr *) right;
+    return strategy;
+}
+
+
+/*
+ * The shard column of foreign table relid named column, with its type's
+ * btree support in *tce and its collation in *collation.  Returns
+ * InvalidAttrNumber if the type has no btree ordering.
+ */
+static AttrNumber
+get_shardColumn__(Oid relid, char const *pattern, char const *column,
+                  TypeCacheEntry **tce, int32 *typmod, Oid *collation)
+{
+    char const *star = strchr(pattern, '*');
+    AttrNumber  attnum;
+    Oid         typid;
+
+    if (!star || strchr(star + 1, '*') || strpbrk(pattern, "?["))
+        ereport(ERROR,
+            (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+            errmsg("shard_column needs a database pattern with a single "
+                   "\"*\" wildcard and no other: \"%s\"", pattern)
+            ));
+
+    attnum = get_attnum(relid, column);
+    if (attnum == InvalidAttrNumber)
+        ereport(ERROR,
+            (errcode(ERRCODE_FDW_COLUMN_NAME_NOT_FOUND),
+            errmsg("shard_column \"%s\" is not a column of foreign table "
+                   "\"%s\"", column, get_rel_name(relid))
+            ));
+
+    get_atttypetypmodcoll(relid, attnum, &typid, typmod, collation);
+    *tce = lookup_type_cache(typid, TYPECACHE_BTREE_OPFAMILY |
+                                    TYPECACHE_CMP_PROC_FINFO);
+    if (!OidIsValid((*tce)->btree_opf) ||
+        !OidIsValid((*tce)->cmp_proc_finfo.fn_oid))
+        return InvalidAttrNumber;
+    return attnum;
+}
+
+
+/*
+ * The restriction clauses of a base relation that bound its shard column,
+ * as a list alternating the btree strategy of each (an Integer) with the
+ * value the column is compared with, a Const or a Param.  The files are
+ * only listed and pruned when the scan starts, see prune_sqliteShards, so
+ * that a plan kept for later sees the files added meanwhile.
+ */
+List *
+get_sqliteShardBounds(PlannerInfo *root, RelOptInfo *baserel)
+{
+    SqliteFdwRelationInfo *fpinfo = FDW_RELINFO(baserel->fdw_private);
+    RangeTblEntry *rte = planner_rt_fetch(baserel->relid, root);
+    TypeCacheEntry *tce;
+    AttrNumber  attnum;
+    int32       typmod;
+    Oid         collation;
+    List       *bounds = NIL;
+    ListCell   *lc;
+
+    if (!fpinfo->src.shard_column)
+        return NIL;
+    attnum = get_shardColumn__(rte->relid, fpinfo->src.shard_pattern,
+                               fpinfo->src.shard_column, &tce, &typmod,
+                               &collation);
+    if (attnum == InvalidAttrNumber)
+        return NIL;
+
+    foreach(lc, baserel->baserestrictinfo)
+    {
+        RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+        Expr   *value;
+        int     strategy;
+
+        if (rinfo->pseudoconstant)
+            continue;
+        strategy = get_shardCondition__(rinfo->clause, baserel->relid,
+                                        attnum, tce, collation, &value);
+        if (strategy != 0)
+            bounds = lappend(lappend(bounds, makeInteger(strategy)),
+                             copyObject(value));
+    }
+    return bounds;
+}
+
+
+/*
+ * Read the key of the file at path, the text key, into *value.  Returns
+ * false, with a message at elevel, if the type does not take that text.
+ * An input function that rejects its text has had nothing to clean up,
+ * so its error can be caught without a subtransaction; any other error is
+ * thrown on.
+ */
+static bool
+read_shardKey__(char const *path, char *key, Oid typinput, Oid typioparam,
+                int32 typmod, int elevel, Datum *value)
+{
+    MemoryContext cxt = CurrentMemoryContext;
+    volatile bool ok = true;
+
+    PG_TRY();
+    {
+        *value = OidInputFunctionCall(typinput, key, typioparam, typmod);
+    }
+    PG_CATCH();
+    {
+        ErrorData  *edata;
+
+        MemoryContextSwitchTo(cxt);
+        edata = CopyErrorData();
+        if (ERRCODE_TO_CATEGORY(edata->sqlerrcode) != ERRCODE_DATA_EXCEPTION)
+            PG_RE_THROW();
+        FlushErrorState();
+
+        ereport(elevel,
+            (errcode(edata->sqlerrcode),
+            errmsg("skipping sqlite file \"%s\", whose name holds no key",
+                   path),
+            errdetail_internal("%s", edata->message)
+            ));
+        FreeErrorData(edata);
+        ok = false;
+    }
+    PG_END_TRY();
+    return ok;
+}
+
+
+/*
+ * The files of pattern, the shards of foreign table relid, that the bounds
+ * from get_sqliteShardBounds leave in play, ordered by key.  Without a
+ * shard column all of them are.  A file whose name does not hold a value
+ * of the shard column's type is left out, with a warning when the scan
+ * starts.  The parameters among the bounds are evaluated in the
+ * expression context of ps, or ignored without one.
+ */
+List *
+prune_sqliteShards(Oid relid, char const *pattern, char const *column,
+                   List *shards, List *bounds, PlanState *ps)
+{
+    char const *star = strchr(pattern, '*');
+    int         nkeys = list_length(shards);
+    ShardKeyCmpContext cxt;
+    TypeCacheEntry *tce;
+    ShardKey   *keys;
+    Oid         typinput;
+    Oid         typioparam;
+    int32       typmod;
+    size_t      prefix_len;
+    size_t      suffix_len;
+    List       *result = NIL;
+    ListCell   *lc;
+    int         lo = 0;
+    int         hi;
+    int         i;
+
+    if (!column || nkeys == 0 ||
+        get_shardColumn__(relid, pattern, column, &tce, &typmod,
+                          &cxt.collation) == InvalidAttrNumber)
+        return shards;
+    cxt.cmp = &tce->cmp_proc_finfo;
+
+    /* Read the key of every file, and put them in order */
+    getTypeInputInfo(tce->type_id, &typinput, &typioparam);
+    prefix_len = star - pattern;
+    suffix_len = strlen(star + 1);
+    keys = palloc(nkeys * sizeof(ShardKey));
+    i = 0;
+    foreach(lc, shards)
+    {
+        char *path = (char *) lfirst(lc);
+        char *key = pnstrdup(path + prefix_len,
+                             strlen(path) - prefix_len - suffix_len);
+
+        keys[i].path = path;
+        if (read_shardKey__(path, key, typinput, typioparam, typmod,
+                            ps ? WARNING : DEBUG1, &keys[i].key))
+            i++;
+    }
+    nkeys = i;
+    if (nkeys == 0)
+        return NIL;
+    qsort_arg(keys, nkeys, sizeof(ShardKey), cmp_shardKey__, &cxt);
+    hi = nkeys - 1;
+
+    /*
+     * Narrow down the run of files lo..hi.  An upper bound drops the files
+     * whose key is beyond it; a lower bound drops the files before the
+     * last one whose key is below it (or, with equal keys, the first of
+     * those), as all their rows are below their successor's key.
+     */
+    lc = list_head(bounds);
+    while (lc)
+    {
+        int     strategy = intVal(lfirst(lc));
+        Expr   *expr = (Expr *) lfirst(lnext(lc));
+        Datum   value;
+        bool    isnull;
+        int     n;
+
+        lc = lnext(lnext(lc));
+        if (IsA(expr, Const))
+        {
+            value = ((Const *) expr)->constvalue;
+            isnull = ((Const *) expr)->constisnull;
+        }
+        else if (ps)
+            value = ExecEvalExprSwitchContext(ExecInitExpr(expr, ps),
+                                              ps->ps_ExprContext, &isnull);
+        else
+            continue;
+        if (isnull)
+            continue;
+
+        if (strategy == BTLessStrategyNumber ||
+            strategy == BTLessEqualStrategyNumber ||
+            strategy == BTEqualStrategyNumber)
+        {
+            n = count_keysBelow__(keys, nkeys, value,
+                                  strategy != BTLessStrategyNumber, &cxt);
+            hi = Min(hi, Max(n - 1, 0));
+        }
+        if (strategy == BTGreaterStrategyNumber ||
+            strategy == BTGreaterEqualStrategyNumber ||
+            strategy == BTEqualStrategyNumber)
+        {
+            n = count_keysBelow__(keys, nkeys, value, true, &cxt);
+            if (n > 0)
+                lo = Max(lo, count_keysBelow__(keys, nkeys, keys[n - 1].key,
+                                               false, &cxt));
+        }
+    }
+
+    for (i = lo; i <= hi; i++)
+        result = lappend(result, keys[i].path);
+    return result;
+}
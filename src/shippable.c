@@ -26,10 +26,16 @@
 #include "access/transam.h"
 #include "access/htup_details.h"
 #include "catalog/dependency.h"
+#include "catalog/pg_operator.h"
 #include "catalog/pg_proc.h"
 #include "catalog/pg_namespace.h"
+#include "catalog/pg_type.h"
+#include "nodes/nodeFuncs.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
 #include "utils/hsearch.h"
 #include "utils/inval.h"
+#include "utils/pg_locale.h"
 #include "utils/syscache.h"
 #include "nodes/relation.h"
 #include "nodes/execnodes.h"
@@ -262,11 +268,311 @@ is_shippable_agg(Oid funcid)
                            sizeof(allowed_names) / sizeof(allowed_names[0]));
 }
 
-    
-bool
-is_shippable_func(Oid funcid)
+
+/*
+ * The functions of pg_catalog that sqlite can compute, each with the
+ * sqlite expression that gives PostgreSQL's answer for the argument types
+ * listed; see deparseFuncExpr for how it is written out.  Any other
+ * function, or these with other arguments, is computed locally.  Among
+ * those left out on purpose: round(float8), which rounds half to even;
+ * interval arithmetic, which sqlite does on months differently; and the
+ * casts to numeric, after which sqlite would still divide integers.
+ *
+ * Dates and timestamps go to sqlite's date functions as @n, which reads an
+ * integer as seconds since the unix epoch rather than a julian day, the
+ * way decode.c does.  Those functions make text in the form sqlite_fdw
+ * binds timestamps in, see sqlite_bind_param_value.
+ *
+ * The lengths and substrings of text and bytea let sqlite work on a large
+ * value without sending it over.  sqlite counts the characters of UTF-8
+ * text, so the text ones need a UTF8 database.  A bytea value that is not
+ * a blob for sqlite goes through sqlite_fdw_bytea, which reads it the way
+ * byteain does, see funcs.c; the length of a blob is known without reading
+ * it.
+ */
+#define SQLITE_FUNC_C_CTYPE  0x01   // only right when the call's LC_CTYPE is C
+#define SQLITE_FUNC_UTF8     0x02   // only right for a UTF8 database
+#define SQLITE_FUNC_LENGTH   0x04   // only for a constant length >= 0
+
+#define SQLITE_TEXT_ARG   "CAST($1 AS TEXT)"
+#define SQLITE_BYTEA_ARG  \
+    "CASE typeof($1) WHEN 'blob' THEN $1 ELSE sqlite_fdw_bytea($1) END"
+
+/* sqlite's substr counts from the end for a start below 1 */
+#define SQLITE_SUBSTR(arg) \
+    "substr(" arg ", max($2, 1), max($2 + $3 - max($2, 1), 0))"
+#define SQLITE_SUBSTR_TAIL(arg) \
+    "substr(" arg ", max($2, 1))"
+
+static SqliteFuncTranslation const func_translations[] =
 {
-    char const *allowed_names[] = {"abs", "coalesce"};
-    return is_allowed_name(funcid, allowed_names, 
-                           sizeof(allowed_names) / sizeof(allowed_names[0]));
+    { "abs",    1, { INT2OID },    NULL, 0, "abs($1)" },
+    { "abs",    1, { INT4OID },    NULL, 0, "abs($1)" },
+    { "abs",    1, { INT8OID },    NULL, 0, "abs($1)" },
+    { "abs",    1, { FLOAT4OID },  NULL, 0, "abs($1)" },
+    { "abs",    1, { FLOAT8OID },  NULL, 0, "abs($1)" },
+    { "abs",    1, { NUMERICOID }, NULL, 0, "abs($1)" },
+
+    /* both round half away from zero, but sqlite's round makes a real */
+    { "round",  1, { NUMERICOID }, NULL, 0,
+      "CASE typeof($1) WHEN 'integer' THEN $1 ELSE round($1) END" },
+
+    /* sqlite only changes the case of ASCII letters */
+    { "lower",  1, { TEXTOID },    NULL, SQLITE_FUNC_C_CTYPE, "lower($1)" },
+    { "upper",  1, { TEXTOID },    NULL, SQLITE_FUNC_C_CTYPE, "upper($1)" },
+
+    { "length", 1, { TEXTOID },    NULL, SQLITE_FUNC_UTF8,
+      "length(" SQLITE_TEXT_ARG ")" },
+    { "char_length", 1, { TEXTOID }, NULL, SQLITE_FUNC_UTF8,
+      "length(" SQLITE_TEXT_ARG ")" },
+    { "character_length", 1, { TEXTOID }, NULL, SQLITE_FUNC_UTF8,
+      "length(" SQLITE_TEXT_ARG ")" },
+    { "octet_length", 1, { TEXTOID }, NULL, SQLITE_FUNC_UTF8,
+      "length(CAST($1 AS BLOB))" },
+    { "substr", 3, { TEXTOID, INT4OID, INT4OID }, NULL,
+      SQLITE_FUNC_UTF8 | SQLITE_FUNC_LENGTH, SQLITE_SUBSTR(SQLITE_TEXT_ARG) },
+    { "substring", 3, { TEXTOID, INT4OID, INT4OID }, NULL,
+      SQLITE_FUNC_UTF8 | SQLITE_FUNC_LENGTH, SQLITE_SUBSTR(SQLITE_TEXT_ARG) },
+    { "substr", 2, { TEXTOID, INT4OID }, NULL, SQLITE_FUNC_UTF8,
+      SQLITE_SUBSTR_TAIL(SQLITE_TEXT_ARG) },
+    { "substring", 2, { TEXTOID, INT4OID }, NULL, SQLITE_FUNC_UTF8,
+      SQLITE_SUBSTR_TAIL(SQLITE_TEXT_ARG) },
+
+    { "length", 1, { BYTEAOID },   NULL, 0,
+      "CASE typeof($1) WHEN 'blob' THEN length($1) "
+      "ELSE length(sqlite_fdw_bytea($1)) END" },
+    { "octet_length", 1, { BYTEAOID }, NULL, 0,
+      "CASE typeof($1) WHEN 'blob' THEN length($1) "
+      "ELSE length(sqlite_fdw_bytea($1)) END" },
+    { "substr", 3, { BYTEAOID, INT4OID, INT4OID }, NULL,
+      SQLITE_FUNC_LENGTH, SQLITE_SUBSTR(SQLITE_BYTEA_ARG) },
+    { "substring", 3, { BYTEAOID, INT4OID, INT4OID }, NULL,
+      SQLITE_FUNC_LENGTH, SQLITE_SUBSTR(SQLITE_BYTEA_ARG) },
+    { "substr", 2, { BYTEAOID, INT4OID }, NULL, 0,
+      SQLITE_SUBSTR_TAIL(SQLITE_BYTEA_ARG) },
+    { "substring", 2, { BYTEAOID, INT4OID }, NULL, 0,
+      SQLITE_SUBSTR_TAIL(SQLITE_BYTEA_ARG) },
+
+    /* casts, which sqlite's values need none of but for division */
+    { "int4",   1, { INT2OID },    NULL, 0, "$1" },
+    { "int8",   1, { INT2OID },    NULL, 0, "$1" },
+    { "int8",   1, { INT4OID },    NULL, 0, "$1" },
+    { "float8", 1, { INT2OID },    NULL, 0, "CAST($1 AS REAL)" },
+    { "float8", 1, { INT4OID },    NULL, 0, "CAST($1 AS REAL)" },
+    { "float8", 1, { INT8OID },    NULL, 0, "CAST($1 AS REAL)" },
+    { "float8", 1, { FLOAT4OID },  NULL, 0, "$1" },
+    { "date",   1, { TIMESTAMPOID }, NULL, 0, "date(@1)" },
+    { "timestamp", 1, { DATEOID }, NULL, 0, "datetime(@1)" },
+
+    { "date_trunc", 2, { TEXTOID, TIMESTAMPOID }, "year", 0,
+      "strftime('%Y-01-01 00:00:00', @2)" },
+    { "date_trunc", 2, { TEXTOID, TIMESTAMPOID }, "month", 0,
+      "strftime('%Y-%m-01 00:00:00', @2)" },
+    { "date_trunc", 2, { TEXTOID, TIMESTAMPOID }, "week", 0,
+      "strftime('%Y-%m-%d 00:00:00', @2, '-6 days', 'weekday 1')" },
+    { "date_trunc", 2, { TEXTOID, TIMESTAMPOID }, "day", 0,
+      "strftime('%Y-%m-%d 00:00:00', @2)" },
+    { "date_trunc", 2, { TEXTOID, TIMESTAMPOID }, "hour", 0,
+      "strftime('%Y-%m-%d %H:00:00', @2)" },
+    { "date_trunc", 2, { TEXTOID, TIMESTAMPOID }, "minute", 0,
+      "strftime('%Y-%m-%d %H:%M:00', @2)" },
+    { "date_trunc", 2, { TEXTOID, TIMESTAMPOID }, "second", 0,
+      "strftime('%Y-%m-%d %H:%M:%S', @2)" },
+
+    /* EXTRACT, of the fields without fractions */
+    { "date_part", 2, { TEXTOID, TIMESTAMPOID }, "year", 0,
+      "CAST(strftime('%Y', @2) AS INTEGER)" },
+    { "date_part", 2, { TEXTOID, TIMESTAMPOID }, "month", 0,
+      "CAST(strftime('%m', @2) AS INTEGER)" },
+    { "date_part", 2, { TEXTOID, TIMESTAMPOID }, "day", 0,
+      "CAST(strftime('%d', @2) AS INTEGER)" },
+    { "date_part", 2, { TEXTOID, TIMESTAMPOID }, "hour", 0,
+      "CAST(strftime('%H', @2) AS INTEGER)" },
+    { "date_part", 2, { TEXTOID, TIMESTAMPOID }, "minute", 0,
+      "CAST(strftime('%M', @2) AS INTEGER)" },
+    { "date_part", 2, { TEXTOID, TIMESTAMPOID }, "dow", 0,
+      "CAST(strftime('%w', @2) AS INTEGER)" },
+    { "date_part", 2, { TEXTOID, TIMESTAMPOID }, "doy", 0,
+      "CAST(strftime('%j', @2) AS INTEGER)" },
+
+    { NULL }
+};
+
+
+/*
+ * The translation of fe for sqlite, or NULL if it has none.  A field the
+ * translation is for must be given as a constant.
+ */
+SqliteFuncTranslation const *
+get_sqliteFuncTranslation(FuncExpr *fe)
+{
+    HeapTuple proctup = SearchSysCache1(PROCOID, ObjectIdGetDatum(fe->funcid));
+    Form_pg_proc procform;
+    SqliteFuncTranslation const *t;
+    SqliteFuncTranslation const *found = NULL;
+    char *field = NULL;
+
+    if (!HeapTupleIsValid(proctup))
+        elog(ERROR, "cache lookup failed for function %u from %s", 
+                fe->funcid, __func__);
+    procform = (Form_pg_proc) GETSTRUCT(proctup);
+
+    if (procform->pronamespace == PG_CATALOG_NAMESPACE &&
+        fe->args && IsA(linitial(fe->args), Const) &&
+        exprType((Node *) linitial(fe->args)) == TEXTOID &&
+        !((Const *) linitial(fe->args))->constisnull)
+        field = TextDatumGetCString(((Const *) linitial(fe->args))->constvalue);
+
+    for (t = func_translations;
+         t->name && procform->pronamespace == PG_CATALOG_NAMESPACE; t++)
+    {
+        int i;
+
+        if (strcmp(t->name, NameStr(procform->proname)) != 0 ||
+            t->nargs != procform->pronargs ||
+            t->nargs != list_length(fe->args))
+            continue;
+        for (i = 0; i < t->nargs; i++)
+            if (t->argtypes[i] != procform->proargtypes.values[i])
+                break;
+        if (i < t->nargs)
+            continue;
+        if (t->field && (!field || pg_strcasecmp(t->field, field) != 0))
+            continue;
+        if ((t->flags & SQLITE_FUNC_C_CTYPE) &&
+            !lc_ctype_is_c(fe->inputcollid))
+            continue;
+        if ((t->flags & SQLITE_FUNC_UTF8) && GetDatabaseEncoding() != PG_UTF8)
+            continue;
+        /* PostgreSQL complains of a negative length, sqlite would not */
+        if ((t->flags & SQLITE_FUNC_LENGTH) &&
+            !(IsA(lthird(fe->args), Const) &&
+              !((Const *) lthird(fe->args))->constisnull &&
+              DatumGetInt32(((Const *) lthird(fe->args))->constvalue) >= 0))
+            continue;
+        found = t;
+        break;
+    }
+
+    ReleaseSysCache(proctup);
+    return found;
+}
+
+
+/*
+ * The operators of pg_catalog that are sent to sqlite, spelled the sqlite
+ * way, for the types of operands sqlite computes them right for:
+ * 'i' for integers, 'n' for integers and floating point numbers, 't' for
+ * text and 'a' for any type.  numeric is no 'n' type, as sqlite would
+ * compute it in doubles.  Where sqlite gives NULL for a division by zero,
+ * PostgreSQL raises an error, so integer division is only sent with a
+ * divisor known not to be zero.  Other operators are applied locally.
+ */
+#define SQLITE_OP_DIVISOR    0x01   // only for a constant right operand != 0
+
+static SqliteOpTranslation const op_translations[] =
+{
+    { "=",   'b', 'a', 0, "=" },
+    { "<>",  'b', 'a', 0, "<>" },
+    { "<",   'b', 'a', 0, "<" },
+    { "<=",  'b', 'a', 0, "<=" },
+    { ">",   'b', 'a', 0, ">" },
+    { ">=",  'b', 'a', 0, ">=" },
+    { "+",   'b', 'n', 0, "+" },
+    { "-",   'b', 'n', 0, "-" },
+    { "*",   'b', 'n', 0, "*" },
+    { "-",   'l', 'n', 0, "-" },
+    { "/",   'b', 'i', SQLITE_OP_DIVISOR, "/" },
+    { "%",   'b', 'i', SQLITE_OP_DIVISOR, "%" },
+    { "&",   'b', 'i', 0, "&" },
+    { "|",   'b', 'i', 0, "|" },
+    { "~",   'l', 'i', 0, "~" },
+    { "||",  'b', 't', 0, "||" },
+    { "~~",  'b', 't', 0, "like" },
+    { "!~~", 'b', 't', 0, "not like" },
+    { "~",   'b', 't', 0, "regexp" },
+    { "!~",  'b', 't', 0, "not regexp" },
+    { NULL }
+};
+
+
+static bool
+is_operandOfClass__(Oid type, char operands)
+{
+    switch (operands)
+    {
+        case 'a':
+            return true;
+        case 't':
+            return type == TEXTOID || type == VARCHAROID;
+        case 'n':
+            if (type == FLOAT4OID || type == FLOAT8OID)
+                return true;
+            /* fall through */
+        case 'i':
+            return type == INT2OID || type == INT4OID || type == INT8OID;
+    }
+    return false;
+}
+
+
+/*
+ * The translation of operator opno for sqlite, or NULL if it has none.
+ */
+SqliteOpTranslation const *
+get_sqliteOpTranslation(Oid opno)
+{
+    HeapTuple tuple = SearchSysCache1(OPEROID, ObjectIdGetDatum(opno));
+    Form_pg_operator form;
+    SqliteOpTranslation const *t;
+    SqliteOpTranslation const *found = NULL;
+
+    if (!HeapTupleIsValid(tuple))
+        elog(ERROR, "cache lookup failed for operator %u", opno);
+    form = (Form_pg_operator) GETSTRUCT(tuple);
+
+    for (t = op_translations;
+         t->name && form->oprnamespace == PG_CATALOG_NAMESPACE; t++)
+    {
+        if (strcmp(t->name, NameStr(form->oprname)) != 0 ||
+            t->kind != form->oprkind ||
+            (form->oprkind == 'b' &&
+             !is_operandOfClass__(form->oprleft, t->operands)) ||
+            !is_operandOfClass__(form->oprright, t->operands))
+            continue;
+        found = t;
+        break;
+    }
+
+    ReleaseSysCache(tuple);
+    return found;
+}
+
+
+/*
+ * The translation of operator expression oe for sqlite, or NULL if sqlite
+ * could give a different answer for it.
+ */
+SqliteOpTranslation const *
+get_sqliteOpExprTranslation(OpExpr *oe)
+{
+    SqliteOpTranslation const *t = get_sqliteOpTranslation(oe->opno);
+    Const *divisor;
+
+    if (!t || !(t->flags & SQLITE_OP_DIVISOR))
+        return t;
+
+    divisor = (Const *) lsecond(oe->args);
+    if (!IsA(divisor, Const) || divisor->constisnull)
+        return NULL;
+    switch (divisor->consttype)
+    {
+        case INT2OID:
+            return DatumGetInt16(divisor->constvalue) != 0 ? t : NULL;
+        case INT4OID:
+            return DatumGetInt32(divisor->constvalue) != 0 ? t : NULL;
+        case INT8OID:
+            return DatumGetInt64(divisor->constvalue) != 0 ? t : NULL;
+    }
+    return NULL;
 }
@@ -2,14 +2,24 @@
 #include <access/reloptions.h>
 #include <commands/defrem.h>
 #include <foreign/fdwapi.h>
+#include <catalog/pg_attribute.h>
 #include <catalog/pg_foreign_server.h>
 #include <catalog/pg_foreign_table.h>
+#include <utils/int8.h>
+
+#include <limits.h>
 
 #include "callbacks.h"
 extern bool file_exists(const char *name);
+extern bool has_sqliteShards(List *options);
+extern List *parse_sqliteAttachOption(char const *value);
+extern void init_sqliteMemory(void);
+extern void init_sqliteStats(void);
 
 PG_MODULE_MAGIC;
 
+void _PG_init(void);
+
 /*
  * SQL functions
  */
@@ -34,15 +44,51 @@ static struct SQLiteFdwOption valid_options[] =
 
 	/* Connection options */
 	{ "database",  ForeignServerRelationId },
+	{ "statement_cache_size", ForeignServerRelationId },
+	{ "fetch_size", ForeignServerRelationId },
+	{ "batch_size", ForeignServerRelationId },
+	{ "commit_size", ForeignServerRelationId },
+	{ "analyze_sampling", ForeignServerRelationId },
+	{ "use_remote_estimate", ForeignServerRelationId },
+	{ "readonly", ForeignServerRelationId },
+	{ "immutable", ForeignServerRelationId },
+	{ "binary_collation", ForeignServerRelationId },
+	{ "cache_size", ForeignServerRelationId },
+	{ "mmap_size", ForeignServerRelationId },
+	{ "temp_store", ForeignServerRelationId },
+	{ "journal_mode", ForeignServerRelationId },
+	{ "synchronous", ForeignServerRelationId },
+	{ "attach", ForeignServerRelationId },
+	{ "shards", ForeignServerRelationId },
 
 	/* Table options */
 	{ "table",     ForeignTableRelationId },
+	{ "schema",    ForeignTableRelationId },
+	{ "fetch_size", ForeignTableRelationId },
+	{ "batch_size", ForeignTableRelationId },
+	{ "commit_size", ForeignTableRelationId },
+	{ "analyze_sampling", ForeignTableRelationId },
+	{ "use_remote_estimate", ForeignTableRelationId },
+	{ "shard_column", ForeignTableRelationId },
+	{ "cache", ForeignTableRelationId },
+
+	/* Column options */
+	{ "key",       AttributeRelationId },
 
 	/* Sentinel */
 	{ NULL,			InvalidOid }
 };
 
 
+void
+_PG_init(void)
+{
+	init_sqliteMemory();
+	/* only does something when preloaded, see stats.c */
+	init_sqliteStats();
+}
+
+
 Datum
 sqlite_fdw_handler(PG_FUNCTION_ARGS)
 {
@@ -64,10 +110,96 @@ sqlite_fdw_handler(PG_FUNCTION_ARGS)
 	routine->GetForeignJoinPaths = get_foreignJoinPaths;
 	routine->GetForeignUpperPaths = get_foreignUpperPaths;
 
+	/* writes */
+	routine->AddForeignUpdateTargets = add_foreignUpdateTargets;
+	routine->PlanForeignModify = plan_foreignModify;
+	routine->BeginForeignModify = begin_foreignModify;
+	routine->ExecForeignInsert = exec_foreignInsert;
+	routine->ExecForeignUpdate = exec_foreignUpdate;
+	routine->ExecForeignDelete = exec_foreignDelete;
+	routine->EndForeignModify = end_foreignModify;
+	routine->ExplainForeignModify = explain_foreignModify;
+	routine->PlanDirectModify = plan_directModify;
+	routine->BeginDirectModify = begin_directModify;
+	routine->IterateDirectModify = iterate_directModify;
+	routine->EndDirectModify = end_directModify;
+	routine->ExplainDirectModify = explain_directModify;
+
+	/* parallel scans */
+	routine->IsForeignScanParallelSafe = is_foreignScanParallelSafe;
+	routine->EstimateDSMForeignScan = estimate_foreignScanDSM;
+	routine->InitializeDSMForeignScan = initialize_foreignScanDSM;
+	routine->ReInitializeDSMForeignScan = reinitialize_foreignScanDSM;
+	routine->InitializeWorkerForeignScan = initialize_foreignScanWorker;
+
 	PG_RETURN_POINTER(routine);
 }
 
 
+/*
+ * Complain unless the option's value is an integer >= min.
+ */
+static void
+check_intOption__(DefElem *def, int min)
+{
+	char	   *value = defGetString(def);
+	char	   *end;
+	long		n;
+
+	errno = 0;
+	n = strtol(value, &end, 10);
+	if (errno != 0 || end == value || *end != '\0' || n < min || n > INT_MAX)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			errmsg("%s requires an integer value of at least %d",
+                   def->defname, min)
+			));
+}
+
+
+/*
+ * Complain unless the option's value is a 64-bit integer >= min.
+ */
+static void
+check_int64Option__(DefElem *def, int64 min)
+{
+	int64		n;
+
+	if (!scanint8(defGetString(def), true, &n) || n < min)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			errmsg("%s requires an integer value of at least " INT64_FORMAT,
+                   def->defname, min)
+			));
+}
+
+
+/*
+ * Complain unless the option's value is one of the NULL-terminated values,
+ * ignoring case.  These go into PRAGMAs as they are.
+ */
+static void
+check_wordOption__(DefElem *def, char const *const *values)
+{
+	char const *value = defGetString(def);
+	char const *const *v;
+	StringInfoData buf;
+
+	for (v = values; *v; v++)
+		if (pg_strcasecmp(value, *v) == 0)
+			return;
+
+	initStringInfo(&buf);
+	for (v = values; *v; v++)
+		appendStringInfo(&buf, "%s\"%s\"", buf.len ? ", " : "", *v);
+	ereport(ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		errmsg("invalid value for option \"%s\": \"%s\"", def->defname, value),
+		errhint("Valid values are %s.", buf.data)
+		));
+}
+
+
 /*
  * Check if the provided option is one of the valid options.
  * context is the Oid of the catalog holding the object the option is for.
@@ -94,8 +226,13 @@ sqlite_fdw_validator(PG_FUNCTION_ARGS)
 	Oid       catalog = PG_GETARG_OID(1);
 	char      *svr_database = NULL;
 	char      *svr_table = NULL;
+	bool      shards = false;
 	ListCell  *cell;
 
+	/* the database of a server with the shards option is a pattern */
+	if (catalog == ForeignServerRelationId)
+		shards = has_sqliteShards(options_list);
+
 	/*
 	 * Check that only options supported by sqlite_fdw,
 	 * and allowed for the current object type, are given.
@@ -136,7 +273,8 @@ sqlite_fdw_validator(PG_FUNCTION_ARGS)
 					(errcode(ERRCODE_SYNTAX_ERROR),
 					errmsg("redundant options: database (%s)", defGetString(def))
 					));
-			if (!file_exists(defGetString(def)))
+			/* the files of a pattern may well come later */
+			if (!shards && !file_exists(defGetString(def)))
 				ereport(ERROR,
 					(errcode_for_file_access(),
 					errmsg("could not access file \"%s\"", defGetString(def))
@@ -154,6 +292,73 @@ sqlite_fdw_validator(PG_FUNCTION_ARGS)
 
 			svr_table = defGetString(def);
 		}
+		else if (strcmp(def->defname, "statement_cache_size") == 0)
+			check_intOption__(def, 0);
+		else if (strcmp(def->defname, "fetch_size") == 0 ||
+				 strcmp(def->defname, "batch_size") == 0)
+			check_intOption__(def, 1);
+		else if (strcmp(def->defname, "commit_size") == 0)
+			check_intOption__(def, 0);
+		else if (strcmp(def->defname, "analyze_sampling") == 0)
+		{
+			char const *value = defGetString(def);
+
+			if (strcmp(value, "auto") != 0 && strcmp(value, "full") != 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					errmsg("invalid value for option \"analyze_sampling\": \"%s\"", value),
+					errhint("Valid values are \"auto\" and \"full\".")
+					));
+		}
+		else if (strcmp(def->defname, "use_remote_estimate") == 0 ||
+				 strcmp(def->defname, "readonly") == 0 ||
+				 strcmp(def->defname, "immutable") == 0 ||
+				 strcmp(def->defname, "binary_collation") == 0 ||
+				 strcmp(def->defname, "shards") == 0 ||
+				 strcmp(def->defname, "cache") == 0)
+			(void) defGetBoolean(def);
+		else if (strcmp(def->defname, "cache_size") == 0)
+			check_intOption__(def, INT_MIN);   /* < 0 means KiB, not pages */
+		else if (strcmp(def->defname, "mmap_size") == 0)
+			check_int64Option__(def, 0);	/* bytes, may well pass 2GB */
+		else if (strcmp(def->defname, "temp_store") == 0)
+		{
+			static char const *const values[] =
+				{ "default", "file", "memory", NULL };
+
+			check_wordOption__(def, values);
+		}
+		else if (strcmp(def->defname, "attach") == 0)
+		{
+			ListCell   *lc;
+
+			foreach(lc, parse_sqliteAttachOption(defGetString(def)))
+			{
+				char const *path = defGetString((DefElem *) lfirst(lc));
+
+				if (!file_exists(path))
+					ereport(ERROR,
+						(errcode_for_file_access(),
+						errmsg("could not access file \"%s\"", path)
+						));
+			}
+		}
+		else if (strcmp(def->defname, "journal_mode") == 0)
+		{
+			static char const *const values[] =
+				{ "delete", "truncate", "persist", "memory", "wal", "off", NULL };
+
+			check_wordOption__(def, values);
+		}
+		else if (strcmp(def->defname, "synchronous") == 0)
+		{
+			static char const *const values[] =
+				{ "off", "normal", "full", "extra", NULL };
+
+			check_wordOption__(def, values);
+		}
+		else if (strcmp(def->defname, "key") == 0)
+			(void) defGetBoolean(def);   /* complain unless a boolean */
 	}
 
 	/* Check we have the options we need to proceed */
@@ -2,25 +2,86 @@
 #define SQLITE_FDW_PRIVATE_H
 #pragma GCC visibility push(hidden)
 
+#include <access/htup.h>
+#include <lib/stringinfo.h>
+#include <nodes/execnodes.h>
+#include <nodes/parsenodes.h>
+#include <nodes/relation.h>
+#include <port/atomics.h>
+#include <portability/instr_time.h>
+#include <utils/relcache.h>
+
 #define SQLITE_FDW_LOG_LEVEL WARNING
-#define DEFAULT_FDW_SORT_MULTIPLIER 1.2
 #define DEFAULT_FDW_STARTUP_COST 100.0
+#define DEFAULT_FDW_RESCAN_STARTUP_COST 1.0
 #define DEFAULT_ATTR_LEN 8
+#define DEFAULT_STATEMENT_CACHE_SIZE 32
+#define DEFAULT_FETCH_SIZE 100
+#define DEFAULT_BATCH_SIZE 100    // rows per INSERT statement sent to sqlite
+#define DEFAULT_BUSY_TIMEOUT 5000   // ms to wait for another connection's lock
+#define SQLITE_PROGRESS_OPS 1000    // VM steps between checks for a cancel
+#define SQLITE_ANALYZE_FULL_SCAN_RATIO 4   // rowid span per sample row below which ANALYZE reads everything
+#define SQLITE_ANALYZE_MAX_SPARSENESS 10    // rowid probes per sample row before giving up on sampling
+#define SQLITE_PARALLEL_CHUNK_SIZE 16384    // rowids claimed at a time by a parallel scan
 
 typedef struct 
 {
     bool import_notnull;
     bool import_default;
+    bool import_estimates;  // set use_remote_estimate on the tables
 } SqliteTableImportOptions;
 
 
 typedef struct 
 {
-    char   *database;
+    Oid     serverid;
+    char   *database;       // NULL for a table spread over many files
+    char   *shard_pattern;  // the glob naming those files, see shards.c
+    char   *shard_column;   // column keyed by the part of the name '*' matches
     char   *table;
+    char   *schema;         // attached database holding table, NULL to let
+                            // sqlite look for it in all of them
+    int     fetch_size;     // rows decoded per batch by a scan
+    int     batch_size;     // rows written per INSERT statement
+    int     commit_size;    // rows an INSERT commits after, 0 for at its end
+    enum
+    {
+        SQLITE_ANALYZE_AUTO,    // sample by rowid when the table allows it
+        SQLITE_ANALYZE_FULL     // always read the whole table
+    }       analyze_sampling;
+    bool    use_remote_estimate;    // size scans from sqlite's metadata
+    bool    cache;          // keep a copy of the rows, see tablecache.c
 } SqliteTableSource;
 
 
+/*
+ * An index of a sqlite table (see metadata.c).  An INTEGER PRIMARY KEY,
+ * which is the rowid, is listed as a unique index without a name.
+ */
+typedef struct
+{
+    char    *name;
+    bool     unique;
+    int      ncols;
+    char   **columns;       // column names, NULL for an expression
+    bool    *descending;
+    char   **collations;    // collation names, NULL if not known
+    double  *rows_per_key;  // rows per distinct prefix of 1..ncols columns,
+                            // from sqlite_stat1, or NULL
+} SqliteIndexInfo;
+
+
+typedef struct
+{
+    char    *schema;    // attached database holding it, or NULL
+    char    *table;
+    double   rows;      // -1 unless sqlite could tell without counting
+    List    *indexes;   // of SqliteIndexInfo
+    List    *notnull;   // names of the columns that cannot be NULL
+    bool     has_rowid; // false for a WITHOUT ROWID table or a view
+} SqliteTableInfo;
+
+
 typedef struct 
 {
 	/* Cost and selectivity of local_conds. */
@@ -73,16 +134,26 @@ typedef struct
     // Filename (i.e. sqlite database ) and tablename
     SqliteTableSource src;
     struct sqlite3 *db;
+    List      *shards;      // files of a sharded table, as planned
+    List      *shard_bounds; // see get_sqliteShardBounds
     
     /* baserestrictinfo clauses, broken down into safe/unsafe */
 	List	   *remote_conds;
 	List	   *local_conds;
+
+    /* read from the backend's copy of the table, see tablecache.c */
+    bool       cached;
+
+	/* Actual remote restriction clauses for scan (sans RestrictInfos) */
+	List	   *final_remote_exprs;
 	
     /* Bitmap of attr numbers to fetch from the remote server. */
 	Bitmapset  *attrs_used;
     bool       pushdown_safe;
 
     SqliteRelationCostSize costsize;
+    double                 index_rows;  // rows sqlite reads through an index
+                                        // to apply remote_conds, -1 if none
     SqliteJoinSpec         joinspec;
     SqliteSubquerySpec     subqspec;
 	
@@ -107,15 +178,51 @@ typedef struct
 } SqliteFdwRelationInfo;
 
 
-typedef struct
+#define SQLITE_NUM_STORAGE_CLASSES 4   // integer, float, text, blob
+
+struct PgTypeInputTraits;
+typedef Datum (*SqliteDecodeFunc)(struct sqlite3_stmt *stmt, int col,
+                                  struct PgTypeInputTraits *traits);
+
+typedef struct PgTypeInputTraits
 {
     regproc   typeinput;
     int       typmod;
     bool      valid;
     Oid       pgtyp;
+    Oid       typioparam;
+    FmgrInfo  input_fn;
+    // decoder for each sqlite storage class, see decode.c
+    SqliteDecodeFunc decode[SQLITE_NUM_STORAGE_CLASSES];
 } PgTypeInputTraits;
 
 
+/*
+ * A function of PostgreSQL that sqlite can compute, see shippable.c.  In
+ * the sqlite expression $n stands for argument n, and @n for argument n
+ * as a date or time value for sqlite's date functions.
+ */
+typedef struct
+{
+    char const *name;       // of the function, in pg_catalog
+    int         nargs;
+    Oid         argtypes[3];
+    char const *field;      // the constant first argument, if any
+    int         flags;
+    char const *sqlite;
+} SqliteFuncTranslation;
+
+
+typedef struct
+{
+    char const *name;       // of the operator, in pg_catalog
+    char        kind;       // 'b' for infix, 'l' for prefix
+    char        operands;   // the types it is for, see shippable.c
+    int         flags;
+    char const *sqlite;
+} SqliteOpTranslation;
+
+
 /* Callback argument for ec_member_matches_foreign */
 typedef struct
 {
@@ -124,6 +231,109 @@ typedef struct
 } ec_member_foreign_arg;
 
 
+/*
+ * Items of the fdw_private list of a scan's ForeignScan plan node.  They
+ * are all Nodes, so that the plan can be copied and handed to parallel
+ * workers.
+ */
+enum FdwScanPrivateIndex
+{
+    FdwScanPrivateSelectSql,        // String: the query
+    FdwScanPrivateRetrievedAttrs,   // Integer list of the attnums it returns
+    FdwScanPrivateFetchAll,         // Integer: buffer the whole result
+    FdwScanPrivateServerId,         // Integer: Oid of the server
+    FdwScanPrivateDatabase,         // String: the sqlite file
+    FdwScanPrivateFetchSize,        // Integer
+    FdwScanPrivateTable,            // String: the scanned table, or NULL
+    FdwScanPrivateSchema,           // String: its schema option, or NULL
+    FdwScanPrivateChunkSql,         // String: the query restricted to a
+                                    // range of rowids, or NULL
+    FdwScanPrivateShards,           // the pattern (String), shard_column
+                                    // (String or NULL) and bounds (see
+                                    // get_sqliteShardBounds) of a sharded
+                                    // table, whose Database is NULL; NIL
+                                    // for any other
+    FdwScanPrivateCache             // Integer list of the column a scan of
+                                    // the copy of a table looks rows up by
+                                    // (0 for none) and its collation, or NIL
+                                    // when the scan reads from sqlite
+};
+
+
+/*
+ * Shared state of a parallel scan, in dynamic shared memory.  The leader
+ * looks up the table's rowid range, and every participant then claims
+ * chunk_size rowids of it at a time from next_chunk.  The participants in
+ * a scan of a sharded table claim its files from next_chunk instead, all
+ * going by the list of files the leader found.
+ */
+typedef struct
+{
+    int64             min_rowid;
+    int64             max_rowid;   // below min_rowid for an empty table
+    int64             chunk_size;
+    pg_atomic_uint64  next_chunk;
+    int               nshards;
+    char              shards[FLEXIBLE_ARRAY_MEMBER];  // their names, each
+                                                      // ending in a NUL
+} SqliteParallelScanState;
+
+
+/*
+ * What a scan has cost, for EXPLAIN ANALYZE.  The sqlite3_stmt_status
+ * counters of statements given back before the end of the scan (those of
+ * earlier shards) are added up here.
+ */
+typedef struct
+{
+    instr_time  prepare_time;   // getting connections and statements
+    instr_time  step_time;      // running the statement and decoding rows
+    int64       rows;           // rows sqlite returned
+    int64       bytes;          // bytes of column data decoded
+    int         opens;          // connections and statements acquired
+    int         db_hits;        // connections that were open already
+    int         stmt_hits;      // statements that were prepared already
+    int64       fullscan_steps; // SQLITE_STMTSTATUS_FULLSCAN_STEP
+    int64       sorts;          // SQLITE_STMTSTATUS_SORT
+    int64       autoindexes;    // SQLITE_STMTSTATUS_AUTOINDEX
+    int64       vm_steps;       // SQLITE_STMTSTATUS_VM_STEP
+} SqliteScanStats;
+
+
+/* Operations whose pushdown to sqlite stats.c keeps count of */
+typedef enum
+{
+    SQLITE_PUSHDOWN_JOIN,
+    SQLITE_PUSHDOWN_AGGREGATE,
+    SQLITE_PUSHDOWN_SORT
+} SqlitePushdownKind;
+
+#define SQLITE_NUM_PUSHDOWN_KINDS 3
+
+
+/*
+ * A backend's copy of all rows of a foreign table with the cache option
+ * (see tablecache.c), in a memory context of its own.
+ */
+typedef struct
+{
+    Oid         relid;
+    MemoryContext cxt;
+    TupleDesc   desc;
+    Oid         serverid;       // where the rows were read from
+    char       *database;
+    int64       epoch;          // of the data read, see get_sqliteDataVersion
+    int         data_version;
+    int         nrows;
+    HeapTuple  *rows;
+    List       *indexes;        // hashes of the rows by a column, built on
+                                // first use
+    int         nusers;         // scans reading the copy
+    long        too_large;      // if not 0, the rows took more than this
+                                // many bytes and were not kept
+} SqliteTableCache;
+
+
 typedef struct
 {
 	struct sqlite3 *db;
@@ -133,21 +343,115 @@ typedef struct
     List   *param_exprs;
     bool   params_bound;
     PgTypeInputTraits *traits;
+
+    /*
+     * Rows are stepped and decoded fetch_size at a time into a column-major
+     * buffer (values[col * fetch_size + row]) and handed out from there.
+     * The decoded data lives in batch_cxt, which is reset for every batch.
+     */
+    int    *attnums;       /* retrieved_attrs as an array */
+    int    nattnums;
+    int    fetch_size;
+    Datum  *values;
+    bool   *nulls;
+    int    nrows;          /* rows in the buffer */
+    int    next_row;       /* next row to hand out */
+    bool   eof;            /* sqlite3_step has run out of rows */
+    bool   fetch_all;      /* read the whole result into spool first */
+    int    ctid_col;       /* column holding the rowid, or -1 */
+    MemoryContext batch_cxt;
+    struct Tuplestorestate *spool;  /* the result, once read, of fetch_all */
+    TupleTableSlot *spool_slot;
+    MemoryContext param_cxt;   /* values bound to stmt, reset on rebinding */
+
+    /*
+     * A parallel-aware scan of a single file (parallel set) runs the query
+     * once per chunk of rowids, whose bounds are bound to parameters
+     * chunk_param and chunk_param + 1.  Without shared state (pstate NULL)
+     * a single chunk covers the table.
+     */
+    bool   parallel;
+    int    chunk_param;
+    bool   chunk_done;     /* the single chunk has been run */
+    bool   read_xact;      /* the chunks are read in one sqlite transaction,
+                            * see claim_rowidChunk */
+    SqliteParallelScanState *pstate;
+
+    SqliteScanStats *stats;    /* NULL unless instrumented or counted */
+    bool   timing;             /* measure times into stats */
+    List   *stat_relids;       /* Oids of the foreign tables whose shared
+                                * statistics the scan counts for, or NIL */
+    bool   checked_locally;    /* the plan has conditions of its own */
+
+    /*
+     * A scan of a sharded table runs the query on each of its files in
+     * turn, on the file's own connection.
+     */
+    Oid    serverid;
+    bool   sharded;
+    List   *shards;        /* String list of the files */
+    int    next_shard;
+
+    /*
+     * A scan of a table with the cache option reads the backend's copy of
+     * it (see tablecache.c): all its rows, or, unless cache_attnum is 0,
+     * those whose column cache_attnum equals the scan's only parameter.
+     */
+    bool   cached;
+    SqliteTableCache *cache;   /* NULL under EXPLAIN without ANALYZE */
+    AttrNumber cache_attnum;
+    Oid    cache_collation;
+    Datum  cache_value;        /* the parameter, when params_bound */
+    bool   cache_isnull;
+    int    cache_row;          /* row last handed out, -1 before the first */
 } SqliteFdwExecutionState;
 
 
+typedef struct
+{
+    struct sqlite3 *db;
+    struct sqlite3_stmt *stmt;   /* INSERT, UPDATE or DELETE, reused per row */
+    char   *query;
+    List   *target_attrs;        /* columns bound from the new tuple */
+    List   *key_attrs;           /* key columns, NIL when keyed by rowid */
+    AttrNumber  ctid_attno;      /* junk ctid in the subplan's output */
+    AttrNumber *key_attnos;      /* junk key columns in the subplan's output */
+    MemoryContext temp_cxt;      /* reset after each row */
+    TupleDesc   desc;
+    struct sqlite3_stmt *batch_stmt;    /* INSERT of batch_rows rows, or NULL */
+    int     batch_rows;          /* rows buffered before they are written */
+    int     nbuffered;
+    Datum  *values;              /* the buffered rows, target_attrs of each */
+    bool   *nulls;
+    MemoryContext batch_cxt;     /* holds their data, reset after each batch */
+    int     commit_size;         /* commit after so many rows, 0 for never */
+    int     uncommitted;         /* rows inserted since the last commit */
+} SqliteFdwModifyState;
+
+
+typedef struct
+{
+    struct sqlite3 *db;
+    struct sqlite3_stmt *stmt;   /* the whole UPDATE or DELETE */
+    char   *query;
+    List   *param_exprs;
+    bool   set_processed;        /* count the rows in es_processed */
+    int    num_changed;          /* rows changed, -1 before execution */
+} SqliteFdwDirectModifyState;
+
+
 typedef struct
 {
     Relation    relation;
     List        *retrieved_attrs;
     HeapTuple   *rows;    // space to store the sampled rows
-    int8        toskip;   // skip these many before storing a row
-    int8        targrows; // number of rows we want to collect
-    int8        numsamples; // how many rows did we actually collect
+    int         targrows; // number of rows we want to collect
+    int         numsamples; // how many rows did we actually collect
     SqliteTableSource src;
-    int8              count;   // total number of rows in table
+    double            count;   // total number of rows in table, maybe estimated
     PgTypeInputTraits *traits; // Oids of input functions.
     TupleTableSlot    *slot;   // working space to gather data from row.
+    MemoryContext     tmp_cxt; // decoding garbage, reset per row
 } SqliteAnalyzeState;
 
 
@@ -189,7 +493,76 @@ typedef struct
 bool is_builtin(Oid objectId);
 bool is_shippable(Oid objectId, Oid classId, SqliteFdwRelationInfo *fpinfo);
 bool is_shippable_agg(Oid funcid);
-bool is_shippable_func(Oid funcid);
+SqliteFuncTranslation const *get_sqliteFuncTranslation(FuncExpr *fe);
+SqliteOpTranslation const *get_sqliteOpTranslation(Oid opno);
+SqliteOpTranslation const *get_sqliteOpExprTranslation(OpExpr *oe);
+
+
+// from connection.c
+struct sqlite3 * get_sqliteDbHandle(Oid serverid, char const *database);
+void release_sqliteDbHandle(struct sqlite3 *db);
+void close_sqliteDbHandle(struct sqlite3 *db);
+struct sqlite3_stmt * acquire_sqliteStatement(struct sqlite3 *db,
+                                              char const *query);
+void release_sqliteStatement(struct sqlite3 *db, struct sqlite3_stmt *stmt);
+void get_sqliteCacheHits(struct sqlite3 *db, bool *db_hit, bool *stmt_hit);
+void check_sqliteInterrupt(int rc);
+void begin_sqliteTransaction(struct sqlite3 *db);
+void begin_sqliteReadTransaction(struct sqlite3 *db);
+void commit_sqliteTransaction(struct sqlite3 *db);
+SqliteTableInfo *get_sqliteTableInfo(struct sqlite3 *db, char const *schema,
+                                     char const *table);
+void get_sqliteDataVersion(struct sqlite3 *db, int64 *epoch,
+                           int *data_version);
+
+
+// from shards.c
+bool has_sqliteShards(List *options);
+List *get_sqliteShards(char const *pattern);
+List *get_sqliteShardBounds(PlannerInfo *root, RelOptInfo *baserel);
+List *prune_sqliteShards(Oid relid, char const *pattern, char const *column,
+                         List *shards, List *bounds, PlanState *ps);
+
+
+// from tablecache.c
+SqliteTableCache *acquire_sqliteTableCache(Relation rel, Oid serverid,
+                                           char const *database,
+                                           char const *query,
+                                           List *retrieved_attrs);
+void release_sqliteTableCache(SqliteTableCache *cache);
+int next_sqliteCachedRow(SqliteTableCache *cache, AttrNumber attnum,
+                         Oid collation, Datum value, int row);
+
+
+// from memory.c
+void init_sqliteMemory(void);
+
+
+// from stats.c
+void init_sqliteStats(void);
+bool is_sqliteStatsEnabled(void);
+void count_sqlitePushdown(PlannerInfo *root, Relids relids,
+                          SqlitePushdownKind kind, bool pushed);
+void count_sqliteScan(List *relids, SqliteScanStats const *stats,
+                      bool checked_locally);
+void count_sqliteAnalyze(Oid relid, double msec);
+
+
+// from metadata.c
+SqliteTableInfo *load_sqliteTableInfo(struct sqlite3 *db, char const *schema,
+                                      char const *table);
+bool get_sqliteRowidRange(struct sqlite3 *db, char const *schema,
+                          char const *table, int64 *min_rowid,
+                          int64 *max_rowid);
+bool is_sqliteNotNullColumn(SqliteTableInfo *info, char const *column);
+
+
+// from decode.c
+Datum make_datum(struct sqlite3_stmt *stmt, int col, PgTypeInputTraits *,
+                 bool *isnull);
+PgTypeInputTraits *get_pgTypeInputTraits(TupleDesc desc);
+void rowid_to_itemPointer(int64 rowid, ItemPointer tid);
+int64 itemPointer_to_rowid(ItemPointer tid);
 
 
 // from deparse.c
@@ -197,12 +570,29 @@ List * build_tlist_to_deparse(RelOptInfo *foreignrel);
 const char * get_jointype_name(JoinType jointype);
 void deparseAnalyzeSizeSql(StringInfo buf, Relation rel);
 void deparseStringLiteral(StringInfo buf, const char *val);
+char *quote_sqliteTable(char const *schema, char const *table);
 void deparseAnalyzeSql(StringInfo buf, Relation rel, List **retrieved_attrs);
 void deparseSelectStmtForRel(StringInfo buf, PlannerInfo *root, RelOptInfo *rel,
 						List *tlist, List *remote_conds, List *pathkeys,
+						bool has_final_sort, bool has_limit,
 						bool is_subquery, List **retrieved_attrs,
 						List **params_list);
+void appendRowidRangeCondition(StringInfo buf, bool has_where, int first);
 bool foreign_expr_walker(Node *node, Oid *expr_collid, Oid *expected_collid);
+void deparseInsertSql(StringInfo buf, PlannerInfo *root, Index rtindex,
+                      Relation rel, List *targetAttrs, bool doNothing);
+void deparseInsertBatchSql(StringInfo buf, char const *query, int nparams,
+                           int nrows);
+void deparseUpdateSql(StringInfo buf, PlannerInfo *root, Index rtindex,
+                      Relation rel, List *targetAttrs, List *keyAttrs);
+void deparseDeleteSql(StringInfo buf, PlannerInfo *root, Index rtindex,
+                      Relation rel, List *keyAttrs);
+void deparseDirectUpdateSql(StringInfo buf, PlannerInfo *root, Index rtindex,
+                            Relation rel, List *targetlist, List *targetAttrs,
+                            List *remote_conds, List **params_list);
+void deparseDirectDeleteSql(StringInfo buf, PlannerInfo *root, Index rtindex,
+                            Relation rel, List *remote_conds,
+                            List **params_list);
 StringInfoData construct_foreignSamplesQuery(SqliteAnalyzeState *);
 
 
@@ -210,7 +600,20 @@ StringInfoData construct_foreignSamplesQuery(SqliteAnalyzeState *);
 void add_pathsWithPathKeysForRel(PlannerInfo *root, RelOptInfo *rel,
                                      Path *epq_path);
 void estimate_path_cost_size(PlannerInfo *root, RelOptInfo *baserel);
+void apply_remoteEstimates(PlannerInfo *root, RelOptInfo *baserel);
+bool is_sqliteNotNull(PlannerInfo *root, RelOptInfo *scanrel, Expr *expr);
+void estimate_param_path_cost(PlannerInfo *root, RelOptInfo *baserel,
+                              ParamPathInfo *param_info,
+                              SqliteRelationCostSize *store);
 void sqlite_bind_param_values(ForeignScanState * node);
+void init_fetchBuffer(SqliteFdwExecutionState *festate, int fetch_size,
+                      MemoryContext parent);
+void fetch_batch(SqliteFdwExecutionState *festate);
+void reset_fetchSpool(SqliteFdwExecutionState *festate, bool rewind);
+bool claim_rowidChunk(SqliteFdwExecutionState *festate);
+void add_partialPathForRel(PlannerInfo *root, RelOptInfo *baserel);
+void store_bufferedRow(SqliteFdwExecutionState *festate,
+                       TupleTableSlot *slot);
 void cleanup_(SqliteFdwExecutionState *);
 SqliteTableSource get_tableSource(Oid foreigntableid);
 struct sqlite3_stmt * prepare_sqliteQuery(struct sqlite3 *db, char *query, 
@@ -219,23 +622,24 @@ bool foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 				RelOptInfo *outerrel, RelOptInfo *innerrel,
 				JoinPathExtraData *extra);
 bool is_foreign_expr(PlannerInfo *root, RelOptInfo *baserel, Expr *expr);
+bool is_sqliteTextByteOrdered(RelOptInfo *rel);
 void classifyConditions(PlannerInfo *root, RelOptInfo *baserel,
 				        List *input_conds,
 				        List **remote_conds, List **local_conds);
-Datum make_datum(struct sqlite3_stmt *stmt, int col, PgTypeInputTraits *,
-                 bool *isnull);
-struct sqlite3 * get_sqliteDbHandle(char const *filename);
-bool is_sqliteTableRequired(ImportForeignSchemaStmt *stmt, 
-                            char const * tablename);
-char *get_foreignTableCreationSql(ImportForeignSchemaStmt *stmt, 
+struct sqlite3 * open_sqliteDb(char const *filename, bool readonly,
+                               bool immutable, bool binary_collation);
+List *parse_sqliteAttachOption(char const *value);
+bool attach_sqliteDb(struct sqlite3 *db, char const *alias,
+                     char const *filename, bool immutable);
+List *get_foreignTableCreationSql(ImportForeignSchemaStmt *stmt,
                                   struct sqlite3 *db,
-                                  char const * tablename,
                                   SqliteTableImportOptions options);
 char *get_tableDropSql(char const *local_schema, char const * tablename);
 SqliteTableImportOptions get_sqliteTableImportOptions(
         ImportForeignSchemaStmt *stmt);
-void sqlite_bind_param_value(SqliteFdwExecutionState *festate,
+void sqlite_bind_param_value(struct sqlite3_stmt *stmt,
                         int index, Oid ptype, Datum pval, bool isNull);
+List * get_keyAttrs(Relation rel);
 bool file_exists(const char *name);
 void cleanup_(SqliteFdwExecutionState *festate);
 void add_pathsWithPathKeysForRel(PlannerInfo *root, RelOptInfo *rel,
@@ -246,16 +650,17 @@ bool ec_member_matches_foreign(PlannerInfo *root, RelOptInfo *rel,
 						       void *arg);
 int set_transmission_modes(void);
 Expr * find_em_expr_for_rel(EquivalenceClass *ec, RelOptInfo *rel);
+Expr * find_em_expr_for_input_target(PlannerInfo *root, EquivalenceClass *ec,
+                                     PathTarget *target);
 void reset_transmission_modes(int nestlevel);
 int get_rowSize(Relation relation);
 int get_numPages(Relation relation);
-int8 get_rowCount(char const *database, char const *table);
+int64 get_rowCount(SqliteTableSource *src);
 void collect_foreignSamples(SqliteAnalyzeState *, StringInfoData sql);
 void populate_tupleTableSlot(struct sqlite3_stmt *stmt, TupleTableSlot *slot,
                              List *retrieved_attrs,
                              PgTypeInputTraits *traits);
 void dispose_sqlite(struct sqlite3 **db, struct sqlite3_stmt **stmt);
-PgTypeInputTraits *get_pgTypeInputTraits(TupleDesc desc);
 
 #define FDW_RELINFO(X)  ((SqliteFdwRelationInfo *)X)
 
@@ -0,0 +1,434 @@
+/*-------------------------------------------------------------------------
+ *
+ * stats.c
+ *	  Cumulative statistics of the foreign tables, in shared memory.
+ *
+ * With sqlite_fdw in shared_preload_libraries, every backend adds what its
+ * scans, ANALYZEs and plans of a foreign table came to into one shared
+ * entry per table, which the sqlite_fdw_stat_tables view shows:
+ *
+ *	- scans begun, rows sqlite returned to them, and how many of those rows
+ *	  PostgreSQL still had to check against conditions sqlite was not sent;
+ *	- the time spent stepping statements and decoding their rows;
+ *	- statements prepared, statements found in the cache, and connections
+ *	  opened for them;
+ *	- the number and total duration of ANALYZEs;
+ *	- how often the planner could push a join, an aggregation or a final
+ *	  sort of the table down to sqlite, and how often it had to do it
+ *	  locally.
+ *
+ * A scan of a pushed-down join or aggregation counts for each of its
+ * tables.  The planner's figures count plans, so a query planned once and
+ * run many times counts once.  An entry also records the database option
+ * (a file, or the pattern of a sharded table) the table had when the entry
+ * was made.  Entries are per table, not per file: the files of a sharded
+ * table all count towards its one entry.
+ *
+ * The number of tables tracked is limited by sqlite_fdw.stat_max; those
+ * beyond it are not tracked until sqlite_fdw_stat_reset() makes room.
+ * Nothing is kept across a restart of the server.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <postgres.h>
+#include <access/parallel.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <parser/parsetree.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <storage/spin.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/hsearch.h>
+#include <utils/tuplestore.h>
+
+#include "sqlite_private.h"
+
+
+#define SQLITE_STAT_TRANCHE "sqlite_fdw"
+
+
+typedef struct
+{
+    Oid     dbid;
+    Oid     relid;
+} SqliteStatKey;
+
+
+typedef struct
+{
+    int64   scans;
+    int64   rows;
+    int64   rows_checked_locally;
+    double  step_time;          // ms
+    int64   prepares;
+    int64   cached_statements;
+    int64   connection_opens;
+    int64   analyzes;
+    double  analyze_time;       // ms
+    int64   pushed[SQLITE_NUM_PUSHDOWN_KINDS];
+    int64   local[SQLITE_NUM_PUSHDOWN_KINDS];
+} SqliteStatCounters;
+
+
+typedef struct
+{
+    SqliteStatKey       key;
+    slock_t             mutex;      // guards counters
+    char                database[MAXPGPATH];
+    SqliteStatCounters  counters;
+} SqliteStatEntry;
+
+
+typedef struct
+{
+    LWLock     *lock;       // guards the hash table, not the counters
+} SqliteStatShared;
+
+
+static int stat_max = 1000;
+static SqliteStatShared *stat_shared = NULL;
+static HTAB *stat_hash = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static Size
+stat_memsize__(void)
+{
+    return add_size(MAXALIGN(sizeof(SqliteStatShared)),
+                    hash_estimate_size(stat_max, sizeof(SqliteStatEntry)));
+}
+
+
+static void
+startup_sqliteStats__(void)
+{
+    HASHCTL info;
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    stat_shared = ShmemInitStruct("sqlite_fdw stats",
+                                  sizeof(SqliteStatShared), &found);
+    if (!found)
+        stat_shared->lock = &(GetNamedLWLockTranche(SQLITE_STAT_TRANCHE))->lock;
+
+    memset(&info, 0, sizeof(info));
+    info.keysize = sizeof(SqliteStatKey);
+    info.entrysize = sizeof(SqliteStatEntry);
+    stat_hash = ShmemInitHash("sqlite_fdw stats hash", stat_max, stat_max,
+                              &info, HASH_ELEM | HASH_BLOBS);
+    LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * Set up the shared statistics, if we are being preloaded; loaded any
+ * later, the library collects none.
+ */
+void
+init_sqliteStats(void)
+{
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+    DefineCustomIntVariable("sqlite_fdw.stat_max",
+                            "Sets the number of foreign tables whose "
+                            "statistics sqlite_fdw keeps.",
+                            NULL,
+                            &stat_max,
+                            1000,
+                            100,
+                            INT_MAX / 2,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    EmitWarningsOnPlaceholders("sqlite_fdw");
+
+    RequestAddinShmemSpace(stat_memsize__());
+    RequestNamedLWLockTranche(SQLITE_STAT_TRANCHE, 1);
+
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = startup_sqliteStats__;
+}
+
+
+bool
+is_sqliteStatsEnabled(void)
+{
+    return stat_hash != NULL;
+}
+
+
+static void
+check_statsEnabled__(void)
+{
+    if (!stat_hash)
+        ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+            errmsg("sqlite_fdw statistics are not being collected"),
+            errhint("Add sqlite_fdw to shared_preload_libraries.")
+            ));
+}
+
+
+/*
+ * Add delta to the counters of the foreign table, making its entry if it
+ * has none and there is room for it.
+ */
+static void
+add_counters__(Oid relid, SqliteStatCounters const *delta)
+{
+    SqliteStatKey key;
+    SqliteStatEntry *entry;
+    SqliteStatCounters *c;
+    char *database = NULL;
+    bool found;
+    int i;
+
+    memset(&key, 0, sizeof(key));
+    key.dbid = MyDatabaseId;
+    key.relid = relid;
+
+    LWLockAcquire(stat_shared->lock, LW_SHARED);
+    entry = (SqliteStatEntry *) hash_search(stat_hash, &key, HASH_FIND, NULL);
+    if (!entry)
+    {
+        /* look the table up before we hold everyone else up */
+        SqliteTableSource src;
+
+        LWLockRelease(stat_shared->lock);
+        src = get_tableSource(relid);
+        database = src.database ? src.database : src.shard_pattern;
+
+        LWLockAcquire(stat_shared->lock, LW_EXCLUSIVE);
+        entry = (SqliteStatEntry *)
+            hash_search(stat_hash, &key, HASH_FIND, NULL);
+        if (!entry && hash_get_num_entries(stat_hash) < stat_max)
+        {
+            entry = (SqliteStatEntry *)
+                hash_search(stat_hash, &key, HASH_ENTER_NULL, &found);
+            if (entry && !found)
+            {
+                SpinLockInit(&entry->mutex);
+                strlcpy(entry->database, database, MAXPGPATH);
+                memset(&entry->counters, 0, sizeof(SqliteStatCounters));
+            }
+        }
+        if (!entry)
+        {
+            LWLockRelease(stat_shared->lock);
+            return;
+        }
+    }
+
+    SpinLockAcquire(&entry->mutex);
+    c = &entry->counters;
+    c->scans += delta->scans;
+    c->rows += delta->rows;
+    c->rows_checked_locally += delta->rows_checked_locally;
+    c->step_time += delta->step_time;
+    c->prepares += delta->prepares;
+    c->cached_statements += delta->cached_statements;
+    c->connection_opens += delta->connection_opens;
+    c->analyzes += delta->analyzes;
+    c->analyze_time += delta->analyze_time;
+    for (i = 0; i < SQLITE_NUM_PUSHDOWN_KINDS; i++)
+    {
+        c->pushed[i] += delta->pushed[i];
+        c->local[i] += delta->local[i];
+    }
+    SpinLockRelease(&entry->mutex);
+
+    LWLockRelease(stat_shared->lock);
+}
+
+
+/*
+ * Count whether the planner pushed an operation on the base relations
+ * relids down to sqlite.
+ */
+void
+count_sqlitePushdown(PlannerInfo *root, Relids relids,
+                     SqlitePushdownKind kind, bool pushed)
+{
+    SqliteStatCounters delta;
+    int rti = -1;
+
+    if (!stat_hash)
+        return;
+
+    memset(&delta, 0, sizeof(delta));
+    if (pushed)
+        delta.pushed[kind] = 1;
+    else
+        delta.local[kind] = 1;
+
+    while ((rti = bms_next_member(relids, rti)) >= 0)
+    {
+        RangeTblEntry *rte = planner_rt_fetch(rti, root);
+
+        if (rte->rtekind == RTE_RELATION)
+            add_counters__(rte->relid, &delta);
+    }
+}
+
+
+/*
+ * Add the figures of a finished scan to each of its foreign tables, relids.
+ * In a parallel query each process adds its own rows; the scan itself is
+ * counted by the leader.
+ */
+void
+count_sqliteScan(List *relids, SqliteScanStats const *stats,
+                 bool checked_locally)
+{
+    SqliteStatCounters delta;
+    ListCell *lc;
+
+    if (!stat_hash)
+        return;
+
+    memset(&delta, 0, sizeof(delta));
+    delta.scans = IsParallelWorker() ? 0 : 1;
+    delta.rows = stats->rows;
+    delta.rows_checked_locally = checked_locally ? stats->rows : 0;
+    delta.step_time = INSTR_TIME_GET_MILLISEC(stats->step_time);
+    delta.prepares = stats->opens - stats->stmt_hits;
+    delta.cached_statements = stats->stmt_hits;
+    delta.connection_opens = stats->opens - stats->db_hits;
+
+    foreach(lc, relids)
+        add_counters__(lfirst_oid(lc), &delta);
+}
+
+
+/*
+ * Count an ANALYZE of the foreign table that took msec milliseconds.
+ */
+void
+count_sqliteAnalyze(Oid relid, double msec)
+{
+    SqliteStatCounters delta;
+
+    if (!stat_hash)
+        return;
+
+    memset(&delta, 0, sizeof(delta));
+    delta.analyzes = 1;
+    delta.analyze_time = msec;
+    add_counters__(relid, &delta);
+}
+
+
+/*
+ * SQL functions
+ */
+PG_FUNCTION_INFO_V1(sqlite_fdw_stat_tables);
+PG_FUNCTION_INFO_V1(sqlite_fdw_stat_reset);
+
+#define SQLITE_FDW_STAT_TABLES_COLS 18
+
+/*
+ * List the statistics of the foreign tables, of all databases.
+ */
+Datum
+sqlite_fdw_stat_tables(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS scan;
+	SqliteStatEntry *entry;
+
+    check_statsEnabled__();
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+    LWLockAcquire(stat_shared->lock, LW_SHARED);
+    hash_seq_init(&scan, stat_hash);
+    while ((entry = (SqliteStatEntry *) hash_seq_search(&scan)) != NULL)
+    {
+        Datum values[SQLITE_FDW_STAT_TABLES_COLS];
+        bool nulls[SQLITE_FDW_STAT_TABLES_COLS];
+        SqliteStatCounters c;
+        int i = 0;
+        int k;
+
+        SpinLockAcquire(&entry->mutex);
+        c = entry->counters;
+        SpinLockRelease(&entry->mutex);
+
+        MemSet(nulls, 0, sizeof(nulls));
+        values[i++] = ObjectIdGetDatum(entry->key.dbid);
+        values[i++] = ObjectIdGetDatum(entry->key.relid);
+        values[i++] = CStringGetTextDatum(entry->database);
+        values[i++] = Int64GetDatum(c.scans);
+        values[i++] = Int64GetDatum(c.rows);
+        values[i++] = Int64GetDatum(c.rows_checked_locally);
+        values[i++] = Float8GetDatum(c.step_time);
+        values[i++] = Int64GetDatum(c.prepares);
+        values[i++] = Int64GetDatum(c.cached_statements);
+        values[i++] = Int64GetDatum(c.connection_opens);
+        values[i++] = Int64GetDatum(c.analyzes);
+        values[i++] = Float8GetDatum(c.analyze_time);
+        for (k = 0; k < SQLITE_NUM_PUSHDOWN_KINDS; k++)
+        {
+            values[i++] = Int64GetDatum(c.pushed[k]);
+            values[i++] = Int64GetDatum(c.local[k]);
+        }
+        Assert(i == SQLITE_FDW_STAT_TABLES_COLS);
+
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+    LWLockRelease(stat_shared->lock);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+
+/*
+ * Forget the statistics of all foreign tables.
+ */
+Datum
+sqlite_fdw_stat_reset(PG_FUNCTION_ARGS)
+{
+    HASH_SEQ_STATUS scan;
+    SqliteStatEntry *entry;
+
+    check_statsEnabled__();
+    LWLockAcquire(stat_shared->lock, LW_EXCLUSIVE);
+    hash_seq_init(&scan, stat_hash);
+    while ((entry = (SqliteStatEntry *) hash_seq_search(&scan)) != NULL)
+        hash_search(stat_hash, &entry->key, HASH_REMOVE, NULL);
+    LWLockRelease(stat_shared->lock);
+
+    PG_RETURN_VOID();
+}
@@ -0,0 +1,438 @@
+/*-------------------------------------------------------------------------
+ *
+ * tablecache.c
+ *	  Backend-local copies of small foreign tables.
+ *
+ * A foreign table with the cache option is read whole into memory the
+ * first time a scan needs it, as the tuples PostgreSQL would have decoded
+ * from sqlite anyway, and later scans are served from there without
+ * asking sqlite for any rows.  Dimension tables joined in almost every
+ * query are what this is for.  Conditions on the table are then all
+ * checked locally, except that a scan looking rows up by the value of a
+ * column ("col = $1", or the inner side of a nested-loop join on col)
+ * goes straight to them through a hash of that column, built on first
+ * use.
+ *
+ * Each scan checks, once at its start, that the copy is still that of
+ * the data in the file; see get_sqliteDataVersion.  The copy is also
+ * dropped when the foreign table is altered.  A scan holds on to the copy
+ * it started with even if that is dropped meanwhile.
+ *
+ * The rows of a copy may take up to work_mem.  A table outgrowing that is
+ * read from sqlite like any other, and only loaded again once its data
+ * has changed or work_mem has been raised.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <postgres.h>
+#include <access/htup_details.h>
+#include <access/xact.h>
+#include <executor/tuptable.h>
+#include <miscadmin.h>
+#include <utils/hsearch.h>
+#include <utils/inval.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+#include <utils/typcache.h>
+
+#include <sqlite3.h>
+
+#include "sqlite_private.h"
+
+
+/*
+ * A hash of the rows of a copy by one of its columns, chaining the rows
+ * of each bucket through next.
+ */
+typedef struct
+{
+    AttrNumber  attnum;
+    Oid         collation;
+    FmgrInfo    hash_fn;
+    FmgrInfo    eq_fn;
+    uint32      mask;       // number of buckets - 1, a power of 2 less one
+    int        *buckets;    // first row of each bucket, or -1
+    int        *next;       // next row of the same bucket, or -1
+} SqliteCacheIndex;
+
+
+typedef struct
+{
+    Oid         relid;      // hash key
+    SqliteTableCache *cache;
+} SqliteTableCacheEntry;
+
+
+static HTAB *TableCacheHash = NULL;
+static List *dropped_caches = NIL;  // still in use when dropped
+
+
+static void
+free_cache__(SqliteTableCache *cache)
+{
+    MemoryContextDelete(cache->cxt);
+}
+
+
+/*
+ * Drop the copy of a table; the scans still using it keep it until they
+ * are done.
+ */
+static void
+drop_cache__(SqliteTableCacheEntry *entry)
+{
+    SqliteTableCache *cache = entry->cache;
+    MemoryContext oldcontext;
+
+    hash_search(TableCacheHash, &entry->relid, HASH_REMOVE, NULL);
+    if (cache->nusers == 0)
+    {
+        free_cache__(cache);
+        return;
+    }
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    dropped_caches = lappend(dropped_caches, cache);
+    MemoryContextSwitchTo(oldcontext);
+}
+
+
+static void
+invalidate_tableCache__(Datum arg, Oid relid)
+{
+    HASH_SEQ_STATUS scan;
+    SqliteTableCacheEntry *entry;
+
+    hash_seq_init(&scan, TableCacheHash);
+    while ((entry = (SqliteTableCacheEntry *) hash_seq_search(&scan)) != NULL)
+    {
+        if (relid == InvalidOid || entry->relid == relid)
+            drop_cache__(entry);
+    }
+}
+
+
+/*
+ * Scans that errored out never gave their copies back.
+ */
+static void
+xact_callback__(XactEvent event, void *arg)
+{
+    HASH_SEQ_STATUS scan;
+    SqliteTableCacheEntry *entry;
+    ListCell *lc;
+
+    if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_PARALLEL_COMMIT &&
+        event != XACT_EVENT_ABORT && event != XACT_EVENT_PARALLEL_ABORT &&
+        event != XACT_EVENT_PREPARE)
+        return;
+
+    hash_seq_init(&scan, TableCacheHash);
+    while ((entry = (SqliteTableCacheEntry *) hash_seq_search(&scan)) != NULL)
+        entry->cache->nusers = 0;
+
+    foreach(lc, dropped_caches)
+        free_cache__((SqliteTableCache *) lfirst(lc));
+    list_free(dropped_caches);
+    dropped_caches = NIL;
+}
+
+
+static void
+initialize_tableCache__(void)
+{
+    HASHCTL ctl;
+
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(Oid);
+    ctl.entrysize = sizeof(SqliteTableCacheEntry);
+    TableCacheHash = hash_create("sqlite_fdw table cache", 8, &ctl,
+                                 HASH_ELEM | HASH_BLOBS);
+
+    CacheRegisterRelcacheCallback(invalidate_tableCache__, (Datum) 0);
+    RegisterXactCallback(xact_callback__, NULL);
+}
+
+
+/*
+ * Read all rows of query, which selects retrieved_attrs of rel, into a new
+ * copy of the table.  If they take more than max_bytes, the copy returned
+ * has no rows and says so in too_large.
+ */
+static SqliteTableCache *
+load_cache__(Relation rel, sqlite3 *db, char const *query,
+             List *retrieved_attrs, long max_bytes)
+{
+    TupleDesc desc = RelationGetDescr(rel);
+    MemoryContext cxt = AllocSetContextCreate(TopMemoryContext,
+                                              "sqlite_fdw cached table",
+                                              ALLOCSET_DEFAULT_SIZES);
+    MemoryContext tmp_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                                  "sqlite_fdw cache load",
+                                                  ALLOCSET_DEFAULT_SIZES);
+    PgTypeInputTraits *traits = get_pgTypeInputTraits(desc);
+    TupleTableSlot *slot = MakeSingleTupleTableSlot(desc);
+    MemoryContext caller_cxt = MemoryContextSwitchTo(cxt);
+    SqliteTableCache *cache;
+    sqlite3_stmt *volatile stmt = NULL;
+    long used = 0;
+    int size = 64;
+    int rc;
+
+    cache = palloc0(sizeof(SqliteTableCache));
+    cache->relid = RelationGetRelid(rel);
+    cache->cxt = cxt;
+    cache->desc = CreateTupleDescCopy(desc);
+    cache->rows = palloc(size * sizeof(HeapTuple));
+    MemoryContextSwitchTo(caller_cxt);
+
+    PG_TRY();
+    {
+        stmt = prepare_sqliteQuery(db, (char *) query, NULL);
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            MemoryContext oldcontext = MemoryContextSwitchTo(tmp_cxt);
+
+            populate_tupleTableSlot(stmt, slot, retrieved_attrs, traits);
+            MemoryContextSwitchTo(cxt);
+            if (cache->nrows == size)
+            {
+                size *= 2;
+                cache->rows = repalloc(cache->rows, size * sizeof(HeapTuple));
+            }
+            cache->rows[cache->nrows] =
+                heap_form_tuple(cache->desc, slot->tts_values,
+                                slot->tts_isnull);
+            used += HEAPTUPLESIZE + cache->rows[cache->nrows]->t_len +
+                    2 * sizeof(HeapTuple);
+            cache->nrows++;
+            MemoryContextSwitchTo(oldcontext);
+            MemoryContextReset(tmp_cxt);
+            if (used > max_bytes)
+                break;
+        }
+        if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+        {
+            char *msg = pstrdup(sqlite3_errmsg(db));
+
+            check_sqliteInterrupt(rc);
+            ereport(ERROR,
+                (errcode(ERRCODE_FDW_ERROR),
+                errmsg("sqlite failed to execute \"%s\": %s", query, msg)
+                ));
+        }
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(caller_cxt);
+        dispose_sqlite(NULL, (sqlite3_stmt **)&stmt);
+        MemoryContextDelete(cxt);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    dispose_sqlite(NULL, (sqlite3_stmt **)&stmt);
+
+    ExecDropSingleTupleTableSlot(slot);
+    MemoryContextDelete(tmp_cxt);
+    pfree(traits);
+
+    /* keep only the note that the table is too large */
+    if (used > max_bytes)
+    {
+        MemoryContextDelete(cxt);
+        cxt = AllocSetContextCreate(TopMemoryContext,
+                                    "sqlite_fdw cached table",
+                                    ALLOCSET_SMALL_SIZES);
+        cache = MemoryContextAllocZero(cxt, sizeof(SqliteTableCache));
+        cache->relid = RelationGetRelid(rel);
+        cache->cxt = cxt;
+        cache->too_large = max_bytes;
+    }
+    return cache;
+}
+
+
+/*
+ * The copy of the foreign table rel, whose rows query (selecting
+ * retrieved_attrs) reads from database of the server, loading it anew
+ * unless the one we have is of the data in the file now.  Must be paired
+ * with a call to release_sqliteTableCache.  NULL if the table is too
+ * large to copy, in which case the caller reads it from sqlite.
+ */
+SqliteTableCache *
+acquire_sqliteTableCache(Relation rel, Oid serverid, char const *database,
+                         char const *query, List *retrieved_attrs)
+{
+    Oid relid = RelationGetRelid(rel);
+    long max_bytes = work_mem * 1024L;
+    SqliteTableCacheEntry *entry;
+    SqliteTableCache *cache = NULL;
+    sqlite3 *db;
+    int64 epoch;
+    int data_version;
+    bool found;
+
+    if (!TableCacheHash)
+        initialize_tableCache__();
+
+    db = get_sqliteDbHandle(serverid, database);
+    PG_TRY();
+    {
+        get_sqliteDataVersion(db, &epoch, &data_version);
+
+        entry = (SqliteTableCacheEntry *)
+            hash_search(TableCacheHash, &relid, HASH_FIND, NULL);
+        if (entry && entry->cache->serverid == serverid &&
+            strcmp(entry->cache->database, database) == 0 &&
+            epoch >= 0 && entry->cache->epoch == epoch &&
+            entry->cache->data_version == data_version &&
+            (entry->cache->too_large == 0 ||
+             entry->cache->too_large >= max_bytes))
+            cache = entry->cache;
+        else
+        {
+            if (entry)
+                drop_cache__(entry);
+            cache = load_cache__(rel, db, query, retrieved_attrs,
+                                 max_bytes);
+            cache->serverid = serverid;
+            cache->database = MemoryContextStrdup(cache->cxt, database);
+            cache->epoch = epoch;
+            cache->data_version = data_version;
+
+            entry = (SqliteTableCacheEntry *)
+                hash_search(TableCacheHash, &relid, HASH_ENTER, &found);
+            entry->cache = cache;
+        }
+    }
+    PG_CATCH();
+    {
+        release_sqliteDbHandle(db);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    release_sqliteDbHandle(db);
+
+    if (cache->too_large)
+        return NULL;
+    cache->nusers++;
+    return cache;
+}
+
+
+void
+release_sqliteTableCache(SqliteTableCache *cache)
+{
+    ListCell *lc;
+
+    if (!cache || cache->nusers == 0 || --cache->nusers > 0)
+        return;
+
+    foreach(lc, dropped_caches)
+    {
+        if (lfirst(lc) == cache)
+        {
+            dropped_caches = list_delete_ptr(dropped_caches, cache);
+            free_cache__(cache);
+            return;
+        }
+    }
+}
+
+
+static uint32
+hash_value__(SqliteCacheIndex *index, Datum value)
+{
+    return DatumGetUInt32(FunctionCall1Coll(&index->hash_fn, index->collation,
+                                            value));
+}
+
+
+/*
+ * The hash of cache's rows by column attnum, compared under collation,
+ * built if need be.
+ */
+static SqliteCacheIndex *
+get_cacheIndex__(SqliteTableCache *cache, AttrNumber attnum, Oid collation)
+{
+    Form_pg_attribute attr = cache->desc->attrs[attnum - 1];
+    TypeCacheEntry *tce;
+    SqliteCacheIndex *index;
+    MemoryContext oldcontext;
+    uint32 nbuckets = 16;
+    ListCell *lc;
+    int row;
+
+    foreach(lc, cache->indexes)
+    {
+        index = (SqliteCacheIndex *) lfirst(lc);
+        if (index->attnum == attnum && index->collation == collation)
+            return index;
+    }
+
+    tce = lookup_type_cache(attr->atttypid, TYPECACHE_EQ_OPR_FINFO |
+                                            TYPECACHE_HASH_PROC_FINFO);
+    if (!OidIsValid(tce->eq_opr_finfo.fn_oid) ||
+        !OidIsValid(tce->hash_proc_finfo.fn_oid))
+        elog(ERROR, "could not find hash support for type %u",
+             attr->atttypid);
+
+    oldcontext = MemoryContextSwitchTo(cache->cxt);
+    while (nbuckets < (uint32) cache->nrows && nbuckets < PG_INT32_MAX / 2)
+        nbuckets *= 2;
+    index = palloc(sizeof(SqliteCacheIndex));
+    index->attnum = attnum;
+    index->collation = collation;
+    fmgr_info_copy(&index->hash_fn, &tce->hash_proc_finfo, cache->cxt);
+    fmgr_info_copy(&index->eq_fn, &tce->eq_opr_finfo, cache->cxt);
+    index->mask = nbuckets - 1;
+    index->buckets = palloc(nbuckets * sizeof(int));
+    memset(index->buckets, -1, nbuckets * sizeof(int));
+    index->next = palloc(Max(cache->nrows, 1) * sizeof(int));
+
+    /* chain in reverse, so that each bucket lists its rows in order */
+    for (row = cache->nrows - 1; row >= 0; row--)
+    {
+        bool isnull;
+        Datum value = heap_getattr(cache->rows[row], attnum, cache->desc,
+                                   &isnull);
+        uint32 bucket;
+
+        index->next[row] = -1;
+        if (isnull)
+            continue;
+        bucket = hash_value__(index, value) & index->mask;
+        index->next[row] = index->buckets[bucket];
+        index->buckets[bucket] = row;
+    }
+    cache->indexes = lappend(cache->indexes, index);
+    MemoryContextSwitchTo(oldcontext);
+
+    return index;
+}
+
+
+/*
+ * The first row of cache after row (-1 to start) whose column attnum
+ * equals value under collation, or -1 if there is none.  Start over with
+ * the same value to get the next.
+ */
+int
+next_sqliteCachedRow(SqliteTableCache *cache, AttrNumber attnum,
+                     Oid collation, Datum value, int row)
+{
+    SqliteCacheIndex *index = get_cacheIndex__(cache, attnum, collation);
+
+    row = row < 0 ? index->buckets[hash_value__(index, value) & index->mask]
+                  : index->next[row];
+    for (; row >= 0; row = index->next[row])
+    {
+        bool isnull;
+        Datum other = heap_getattr(cache->rows[row], attnum, cache->desc,
+                                   &isnull);
+
+        if (DatumGetBool(FunctionCall2Coll(&index->eq_fn, collation,
+                                           other, value)))
+            return row;
+    }
+    return -1;
+}
@@ -0,0 +1,7 @@
+-- A table of 5000 rows, too large for a cache within the least work_mem.
+
+CREATE TABLE big AS
+    WITH RECURSIVE n(i) AS (
+        SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 5000
+    )
+    SELECT i AS id, printf('%040d', i) AS pad FROM n;
@@ -0,0 +1,39 @@
+-- The sqlite database most regression tests start from, made afresh by
+-- each of them with "sqlite3 FILE < test/data/init.sql".
+
+CREATE TABLE items (
+    id integer PRIMARY KEY,
+    name text NOT NULL,
+    qty integer NOT NULL DEFAULT 0,
+    price real,
+    added datetime
+);
+INSERT INTO items VALUES
+    (1, 'apple', 3, 0.5, '2024-01-15 10:30:00'),
+    (2, 'Avocado', 7, 1.25, '2024-02-01 08:00:00'),
+    (3, 'banana', 12, 0.25, '2024-02-29 23:59:59'),
+    (4, 'cherry', 0, 4.0, '2024-03-10 12:00:00'),
+    (5, 'date', 5, NULL, NULL),
+    (6, 'elderberry', 9, 2.75, '2023-12-31 00:00:00');
+CREATE INDEX items_name ON items (name);
+
+CREATE TABLE codes (
+    code text PRIMARY KEY,
+    label text NOT NULL
+) WITHOUT ROWID;
+INSERT INTO codes VALUES ('fr', 'fruit'), ('nu', 'nut'), ('ve', 'vegetable');
+
+CREATE TABLE item_codes (
+    item_id integer NOT NULL,
+    code text NOT NULL,
+    PRIMARY KEY (item_id, code)
+);
+INSERT INTO item_codes VALUES
+    (1, 'fr'), (2, 'fr'), (2, 've'), (3, 'fr'), (4, 'fr'), (6, 'fr');
+
+CREATE TABLE loads (
+    id integer PRIMARY KEY,
+    val text NOT NULL
+);
+
+CREATE VIEW cheap_items AS SELECT id, name FROM items WHERE price < 1;
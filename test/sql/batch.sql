@@ -0,0 +1,63 @@
+--
+-- INSERT into a foreign table, batch_size rows to a statement
+--
+\! rm -f /tmp/sqlite_fdw_batch.db
+\! sqlite3 /tmp/sqlite_fdw_batch.db < test/data/init.sql
+CREATE SERVER batch_server FOREIGN DATA WRAPPER sqlite_fdw
+    OPTIONS (database '/tmp/sqlite_fdw_batch.db');
+CREATE FOREIGN TABLE loads (id integer OPTIONS (key 'true'), val text)
+    SERVER batch_server OPTIONS (batch_size '4');
+
+-- the sizes are checked
+ALTER FOREIGN TABLE loads OPTIONS (SET batch_size '0');
+ALTER SERVER batch_server OPTIONS (ADD batch_size 'many');
+ALTER FOREIGN TABLE loads OPTIONS (ADD commit_size '-1');
+SELECT * FROM explain_lines(
+    'EXPLAIN (VERBOSE, COSTS OFF) INSERT INTO loads VALUES (1, ''one'')',
+    'sqlite batch size');
+-- ON CONFLICT DO NOTHING sends the rows one at a time
+SELECT * FROM explain_lines(
+    'EXPLAIN (VERBOSE, COSTS OFF) INSERT INTO loads VALUES (1, ''one'')
+     ON CONFLICT DO NOTHING',
+    'sqlite batch size');
+
+-- two full batches, then the two rows left over
+INSERT INTO loads SELECT i, 'row ' || i FROM generate_series(1, 10) i;
+SELECT count(*), min(id), max(id) FROM loads;
+SELECT * FROM loads WHERE id IN (1, 4, 5, 8, 9, 10) ORDER BY id;
+
+-- a failed batch undoes the whole statement
+DO $$
+BEGIN
+    INSERT INTO loads SELECT i, 'again ' || i FROM generate_series(8, 12) i;
+EXCEPTION WHEN unique_violation THEN
+    RAISE NOTICE 'unique violation';
+END
+$$;
+DO $$
+BEGIN
+    INSERT INTO loads VALUES (11, 'eleven'), (12, NULL);
+EXCEPTION WHEN not_null_violation THEN
+    RAISE NOTICE 'not null violation';
+END
+$$;
+SELECT count(*) FROM loads;
+INSERT INTO loads VALUES (10, 'ten'), (11, 'eleven') ON CONFLICT DO NOTHING;
+SELECT * FROM loads WHERE id >= 10 ORDER BY id;
+
+-- with commit_size, the rows committed before a failure stay
+ALTER FOREIGN TABLE loads OPTIONS (ADD commit_size '4');
+DO $$
+BEGIN
+    INSERT INTO loads
+        SELECT i, 'row ' || i FROM generate_series(21, 28) i
+        UNION ALL SELECT 1, 'duplicate';
+EXCEPTION WHEN unique_violation THEN
+    RAISE NOTICE 'unique violation';
+END
+$$;
+SELECT count(*), max(id) FROM loads;
+
+DROP FOREIGN TABLE loads;
+DROP SERVER batch_server;
+\! rm -f /tmp/sqlite_fdw_batch.db
@@ -0,0 +1,30 @@
+--
+-- length and substr of bytea, computed by sqlite
+--
+\! rm -f /tmp/sqlite_fdw_blobs.db
+\! sqlite3 /tmp/sqlite_fdw_blobs.db "CREATE TABLE docs (id integer PRIMARY KEY, body blob); INSERT INTO docs VALUES (1, X'89504e470d0a'), (2, X'ffd8ffe0'), (3, '\\x6869'), (4, NULL)"
+CREATE SERVER blobs_server FOREIGN DATA WRAPPER sqlite_fdw
+    OPTIONS (database '/tmp/sqlite_fdw_blobs.db');
+CREATE FOREIGN TABLE docs (id integer, body bytea) SERVER blobs_server;
+
+SELECT id, body, length(body) FROM docs ORDER BY id;
+
+-- row 3 is text in sqlite, read the way byteain would read it
+SELECT pushed('docs', $$length(body) > 3$$);
+SELECT id, body FROM docs WHERE length(body) > 3 ORDER BY id;
+SELECT pushed('docs', $$octet_length(body) = 2$$);
+SELECT id, body FROM docs WHERE octet_length(body) = 2 ORDER BY id;
+SELECT pushed('docs', $$substr(body, 1, 2) = '\x8950'$$);
+SELECT id, body FROM docs WHERE substr(body, 1, 2) = '\x8950' ORDER BY id;
+SELECT pushed('docs', $$substring(body, 2) = '\x69'$$);
+SELECT id, body FROM docs WHERE substring(body, 2) = '\x69' ORDER BY id;
+SELECT pushed('docs', $$substr(body, 0, 3) = '\xffd8'$$);
+SELECT id, body FROM docs WHERE substr(body, 0, 3) = '\xffd8' ORDER BY id;
+-- a length that is not a constant, and may be negative, is left to
+-- PostgreSQL
+SELECT pushed('docs', $$substr(body, 1, id) = '\x89'$$);
+SELECT id, body FROM docs WHERE substr(body, 1, id) = '\x89' ORDER BY id;
+
+DROP FOREIGN TABLE docs;
+DROP SERVER blobs_server;
+\! rm -f /tmp/sqlite_fdw_blobs.db
@@ -0,0 +1,58 @@
+--
+-- foreign tables with the cache option, read from a copy of their rows
+--
+\! rm -f /tmp/sqlite_fdw_cache.db
+\! sqlite3 /tmp/sqlite_fdw_cache.db < test/data/init.sql
+CREATE SERVER cache_server FOREIGN DATA WRAPPER sqlite_fdw
+    OPTIONS (database '/tmp/sqlite_fdw_cache.db');
+CREATE FOREIGN TABLE codes (code text OPTIONS (key 'true'), label text)
+    SERVER cache_server OPTIONS (cache 'true');
+
+SELECT * FROM explain_lines(
+    'EXPLAIN (COSTS OFF) SELECT * FROM codes',
+    'sqlite cache');
+SELECT * FROM explain_lines(
+    'EXPLAIN (COSTS OFF) SELECT * FROM codes WHERE code = ''nu''',
+    'sqlite cache');
+SELECT * FROM explain_lines(
+    'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF) SELECT * FROM codes',
+    'sqlite cached rows');
+SELECT * FROM codes ORDER BY code;
+SELECT label FROM codes WHERE code = 've';
+
+-- the copy follows the changes made through other connections
+\! sqlite3 /tmp/sqlite_fdw_cache.db "INSERT INTO codes VALUES ('gr', 'grain')"
+SELECT * FROM codes ORDER BY code;
+SELECT label FROM codes WHERE code = 'gr';
+-- and those made through this one
+UPDATE codes SET label = 'nuts' WHERE code = 'nu';
+SELECT label FROM codes WHERE code = 'nu';
+SELECT * FROM explain_lines(
+    'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF) SELECT * FROM codes',
+    'sqlite cached rows');
+
+-- a table larger than work_mem is read from sqlite instead
+\! sqlite3 /tmp/sqlite_fdw_cache.db < test/data/big.sql
+CREATE FOREIGN TABLE big (id integer, pad text)
+    SERVER cache_server OPTIONS (cache 'true');
+SET work_mem = '64kB';
+SELECT * FROM explain_lines(
+    'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF) SELECT * FROM big',
+    'sqlite cache');
+SELECT count(*) FROM big WHERE id % 1000 = 0;
+RESET work_mem;
+SELECT * FROM explain_lines(
+    'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF) SELECT * FROM big',
+    'sqlite cached rows');
+SELECT count(*) FROM big WHERE id % 1000 = 0;
+
+-- without the option, the table is read from sqlite again
+ALTER FOREIGN TABLE codes OPTIONS (SET cache 'false');
+SELECT * FROM explain_lines(
+    'EXPLAIN (COSTS OFF) SELECT * FROM codes',
+    'sqlite cache');
+SELECT count(*) FROM codes;
+
+DROP FOREIGN TABLE codes, big;
+DROP SERVER cache_server;
+\! rm -f /tmp/sqlite_fdw_cache.db
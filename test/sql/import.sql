@@ -0,0 +1,61 @@
+--
+-- IMPORT FOREIGN SCHEMA
+--
+\! rm -f /tmp/sqlite_fdw_import.db
+\! sqlite3 /tmp/sqlite_fdw_import.db < test/data/init.sql
+\! rm -f /tmp/sqlite_fdw_import_extra.db
+\! sqlite3 /tmp/sqlite_fdw_import_extra.db "CREATE TABLE notes (id integer PRIMARY KEY, body text); INSERT INTO notes VALUES (1, 'first')"
+CREATE SERVER import_server FOREIGN DATA WRAPPER sqlite_fdw
+    OPTIONS (database '/tmp/sqlite_fdw_import.db',
+             attach 'extra=/tmp/sqlite_fdw_import_extra.db');
+CREATE SCHEMA import_all;
+CREATE SCHEMA import_some;
+CREATE SCHEMA import_extra;
+
+-- the tables and views of the file, without its indexes
+IMPORT FOREIGN SCHEMA main FROM SERVER import_server INTO import_all;
+SELECT c.relname, t.ftoptions
+    FROM pg_foreign_table t JOIN pg_class c ON c.oid = t.ftrelid
+    WHERE c.relnamespace = 'import_all'::regnamespace
+    ORDER BY c.relname;
+-- the columns of a primary key are the key of a table
+SELECT c.relname, a.attname, format_type(a.atttypid, a.atttypmod),
+       a.attnotnull, a.attfdwoptions
+    FROM pg_attribute a JOIN pg_class c ON c.oid = a.attrelid
+    WHERE c.relnamespace = 'import_all'::regnamespace AND a.attnum > 0
+    ORDER BY c.relname, a.attnum;
+SELECT * FROM import_all.codes ORDER BY code;
+SELECT * FROM import_all.cheap_items ORDER BY id;
+
+-- some of the tables, with their NOT NULL constraints and estimates
+IMPORT FOREIGN SCHEMA main LIMIT TO (items, codes)
+    FROM SERVER import_server INTO import_some
+    OPTIONS (import_not_null 'true', import_estimates 'true');
+SELECT c.relname, t.ftoptions
+    FROM pg_foreign_table t JOIN pg_class c ON c.oid = t.ftrelid
+    WHERE c.relnamespace = 'import_some'::regnamespace
+    ORDER BY c.relname;
+SELECT c.relname, a.attname, format_type(a.atttypid, a.atttypmod),
+       a.attnotnull, a.attfdwoptions
+    FROM pg_attribute a JOIN pg_class c ON c.oid = a.attrelid
+    WHERE c.relnamespace = 'import_some'::regnamespace AND a.attnum > 0
+    ORDER BY c.relname, a.attnum;
+
+-- the tables of an attached file
+IMPORT FOREIGN SCHEMA extra FROM SERVER import_server INTO import_extra;
+SELECT c.relname, t.ftoptions
+    FROM pg_foreign_table t JOIN pg_class c ON c.oid = t.ftrelid
+    WHERE c.relnamespace = 'import_extra'::regnamespace
+    ORDER BY c.relname;
+SELECT * FROM import_extra.notes;
+
+-- errors
+IMPORT FOREIGN SCHEMA other FROM SERVER import_server INTO import_extra;
+IMPORT FOREIGN SCHEMA main FROM SERVER import_server INTO import_extra
+    OPTIONS (import_keys 'true');
+
+SET client_min_messages TO warning;
+DROP SCHEMA import_all, import_some, import_extra CASCADE;
+RESET client_min_messages;
+DROP SERVER import_server;
+\! rm -f /tmp/sqlite_fdw_import.db /tmp/sqlite_fdw_import_extra.db
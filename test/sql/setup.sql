@@ -0,0 +1,24 @@
+--
+-- helpers for the other tests, which pg_regress runs after this one
+--
+-- the lines of an EXPLAIN output with the given label, such as 'Filter'
+CREATE FUNCTION explain_lines(command text, label text) RETURNS SETOF text
+LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE command LOOP
+        line := ltrim(line);
+        IF split_part(line, ':', 1) = label THEN
+            RETURN NEXT line;
+        END IF;
+    END LOOP;
+END
+$$;
+-- whether sqlite checks all of the condition on the rows of rel
+CREATE FUNCTION pushed(rel text, cond text) RETURNS boolean
+LANGUAGE sql AS $$
+    SELECT NOT EXISTS (SELECT FROM explain_lines(
+        'EXPLAIN (COSTS OFF) SELECT * FROM ' || rel || ' WHERE ' || cond,
+        'Filter'))
+$$;
@@ -0,0 +1,65 @@
+--
+-- a foreign table spread over many sqlite files, one per day
+--
+\! rm -f /tmp/sqlite_fdw_shard_*.db
+\! for d in 1 2 3; do sqlite3 /tmp/sqlite_fdw_shard_$d.db "CREATE TABLE events (day integer, n integer); INSERT INTO events VALUES ($d, 1), ($d, 2)"; done
+-- a pattern has to be asked for
+CREATE SERVER shard_server FOREIGN DATA WRAPPER sqlite_fdw
+    OPTIONS (database '/tmp/sqlite_fdw_shard_*.db');
+CREATE SERVER shard_server FOREIGN DATA WRAPPER sqlite_fdw
+    OPTIONS (database '/tmp/sqlite_fdw_shard_*.db', shards 'true');
+CREATE FOREIGN TABLE events (day integer, n integer)
+    SERVER shard_server OPTIONS (shard_column 'day');
+
+SELECT day, sum(n) FROM events GROUP BY day ORDER BY day;
+
+-- the files that cannot hold matching rows are left out
+SELECT * FROM explain_lines(
+    'EXPLAIN (COSTS OFF) SELECT * FROM events',
+    'sqlite files');
+SELECT * FROM explain_lines(
+    'EXPLAIN (COSTS OFF) SELECT * FROM events WHERE day = 2',
+    'sqlite files');
+SELECT * FROM explain_lines(
+    'EXPLAIN (COSTS OFF) SELECT * FROM events WHERE day >= 2',
+    'sqlite files');
+SELECT * FROM explain_lines(
+    'EXPLAIN (COSTS OFF) SELECT * FROM events WHERE day < 2',
+    'sqlite files');
+SELECT * FROM explain_lines(
+    'EXPLAIN (COSTS OFF) SELECT * FROM events WHERE day > 5',
+    'sqlite files');
+SELECT * FROM explain_lines(
+    'EXPLAIN (COSTS OFF) SELECT * FROM events WHERE 2 >= day',
+    'sqlite files');
+SELECT * FROM events WHERE day >= 2 AND day < 3 ORDER BY n;
+SELECT count(*) FROM events WHERE day > 5;
+
+-- the files are listed when a scan starts
+PREPARE day_count(integer) AS SELECT count(*) FROM events WHERE day >= $1;
+EXECUTE day_count(2);
+\! sqlite3 /tmp/sqlite_fdw_shard_4.db "CREATE TABLE events (day integer, n integer); INSERT INTO events VALUES (4, 1), (4, 2)"
+EXECUTE day_count(2);
+SELECT * FROM explain_lines(
+    'EXPLAIN (COSTS OFF) SELECT * FROM events',
+    'sqlite files');
+DEALLOCATE day_count;
+
+-- a file whose name holds no day is skipped
+\! sqlite3 /tmp/sqlite_fdw_shard_old.db "CREATE TABLE events (day integer, n integer); INSERT INTO events VALUES (0, 1)"
+SELECT count(*) FROM events;
+\! rm -f /tmp/sqlite_fdw_shard_old.db
+
+-- such a table can be neither written nor cached
+INSERT INTO events VALUES (5, 1);
+CREATE FOREIGN TABLE cached_events (day integer, n integer)
+    SERVER shard_server OPTIONS (table 'events', cache 'true');
+SELECT * FROM cached_events;
+-- and the shard column has to be one of its columns
+CREATE FOREIGN TABLE bad_events (day integer, n integer)
+    SERVER shard_server OPTIONS (table 'events', shard_column 'month');
+SELECT * FROM bad_events;
+
+DROP FOREIGN TABLE events, cached_events, bad_events;
+DROP SERVER shard_server;
+\! rm -f /tmp/sqlite_fdw_shard_*.db
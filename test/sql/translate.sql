@@ -0,0 +1,70 @@
+--
+-- the functions and operators computed by sqlite
+--
+\! rm -f /tmp/sqlite_fdw_translate.db
+\! sqlite3 /tmp/sqlite_fdw_translate.db < test/data/init.sql
+CREATE SERVER translate_server FOREIGN DATA WRAPPER sqlite_fdw
+    OPTIONS (database '/tmp/sqlite_fdw_translate.db');
+CREATE FOREIGN TABLE items (
+    id integer,
+    name text,
+    qty integer,
+    price double precision,
+    added timestamp
+) SERVER translate_server;
+
+-- arithmetic
+SELECT pushed('items', $$abs(qty - 5) = 2$$);
+SELECT id, qty FROM items WHERE abs(qty - 5) = 2 ORDER BY id;
+SELECT pushed('items', $$id % 2 = 0 AND qty * 2 + 1 > 15$$);
+SELECT id, qty FROM items WHERE id % 2 = 0 AND qty * 2 + 1 > 15 ORDER BY id;
+SELECT pushed('items', $$qty / 2 = 3 OR -qty < -10$$);
+SELECT id, qty FROM items WHERE qty / 2 = 3 OR -qty < -10 ORDER BY id;
+SELECT pushed('items', $$price * 2 >= 5.5$$);
+SELECT id, price FROM items WHERE price * 2 >= 5.5 ORDER BY id;
+
+-- text
+SELECT pushed('items', $$name LIKE 'a%'$$);
+SELECT id, name FROM items WHERE name LIKE 'a%' ORDER BY id;
+SELECT pushed('items', $$name NOT LIKE '%e%'$$);
+SELECT id, name FROM items WHERE name NOT LIKE '%e%' ORDER BY id;
+SELECT pushed('items', $$name ~ '^[a-c]'$$);
+SELECT id, name FROM items WHERE name ~ '^[a-c]' ORDER BY id;
+SELECT pushed('items', $$name !~ 'e'$$);
+SELECT id, name FROM items WHERE name !~ 'e' ORDER BY id;
+SELECT pushed('items', $$name || '!' = 'date!'$$);
+SELECT id, name FROM items WHERE name || '!' = 'date!' ORDER BY id;
+-- ILIKE is left to PostgreSQL
+SELECT pushed('items', $$name ILIKE 'a%'$$);
+SELECT id, name FROM items WHERE name ILIKE 'a%' ORDER BY id;
+
+-- numeric rounds half away from zero, as sqlite does
+CREATE FOREIGN TABLE prices (id integer, price numeric)
+    SERVER translate_server OPTIONS (table 'items');
+SELECT pushed('prices', $$round(price) = 1$$);
+SELECT id, price, round(price) AS rounded FROM prices WHERE round(price) = 1
+    ORDER BY id;
+
+-- dates and times
+SELECT pushed('items', $$EXTRACT(year FROM added) = 2024$$);
+SELECT id, name FROM items WHERE EXTRACT(year FROM added) = 2024 ORDER BY id;
+SELECT pushed('items', $$EXTRACT(dow FROM added) = 0$$);
+SELECT id, name FROM items WHERE EXTRACT(dow FROM added) = 0 ORDER BY id;
+SELECT pushed('items', $$EXTRACT(doy FROM added) = 60$$);
+SELECT id, name FROM items WHERE EXTRACT(doy FROM added) = 60 ORDER BY id;
+SELECT pushed('items', $$date_trunc('month', added) = '2024-02-01'$$);
+SELECT id, name FROM items WHERE date_trunc('month', added) = '2024-02-01'
+    ORDER BY id;
+SELECT pushed('items', $$date_trunc('week', added) = '2024-02-26'$$);
+SELECT id, name FROM items WHERE date_trunc('week', added) = '2024-02-26'
+    ORDER BY id;
+SELECT pushed('items', $$added::date = '2024-03-10'$$);
+SELECT id, name FROM items WHERE added::date = '2024-03-10' ORDER BY id;
+-- date_trunc to a quarter is computed locally
+SELECT pushed('items', $$date_trunc('quarter', added) = '2024-01-01'$$);
+SELECT id, name FROM items WHERE date_trunc('quarter', added) = '2024-01-01'
+    ORDER BY id;
+
+DROP FOREIGN TABLE items, prices;
+DROP SERVER translate_server;
+\! rm -f /tmp/sqlite_fdw_translate.db